@@ -0,0 +1,422 @@
+#include "channel_expression.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <vector>
+
+#include "cpu_features.h"
+#include "str_util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CYCLING_X86 1
+#endif
+
+namespace cycling {
+
+struct ChannelExpression::Node {
+  enum Op {
+    CHANNEL,
+    CONSTANT,
+    ADD,
+    SUBTRACT,
+    MULTIPLY,
+    DIVIDE,
+    POWER,
+  };
+
+  Op op;
+  // Only for CHANNEL.
+  Measurement::Type type = Measurement::NO_TYPE;
+  // Only for CONSTANT.
+  double constant = 0;
+  // Only for POWER.
+  int exp = 0;
+  // The operands. POWER only has lhs.
+  std::shared_ptr<const Node> lhs;
+  std::shared_ptr<const Node> rhs;
+
+  SiUnit unit;
+  Status status;
+  std::string text;
+};
+
+namespace {
+
+using Node = ChannelExpression::Node;
+
+// The number of samples evaluated at a time. Each level of the expression
+// needs a block of doubles, which should all stay in L1.
+const size_t kBlockSize = 256;
+
+std::string ChannelName(const Measurement::Type type) {
+  switch (type) {
+    case Measurement::NO_TYPE:
+      return "NO_TYPE";
+    case Measurement::DEGREES_LATITUDE:
+      return "DEGREES_LATITUDE";
+    case Measurement::DEGREES_LONGITUDE:
+      return "DEGREES_LONGITUDE";
+    case Measurement::ALTITUDE:
+      return "ALTITUDE";
+    case Measurement::HEART_RATE:
+      return "HEART_RATE";
+    case Measurement::HRV:
+      return "HRV";
+    case Measurement::SPEED:
+      return "SPEED";
+    case Measurement::CADENCE:
+      return "CADENCE";
+    case Measurement::POWER:
+      return "POWER";
+    case Measurement::GEAR:
+      return "GEAR";
+    case Measurement::INCREMENTAL_DISTANCE:
+      return "INCREMENTAL_DISTANCE";
+    case Measurement::TOTAL_DISTANCE:
+      return "TOTAL_DISTANCE";
+    case Measurement::TOTAL_JOULES:
+      return "TOTAL_JOULES";
+    case Measurement::W_PRIME_BALANCE:
+      return "W_PRIME_BALANCE";
+    case Measurement::GRADE:
+      return "GRADE";
+    case Measurement::NUM_MEASUREMENTS:
+      break;
+  }
+  assert(false);
+  return "";
+}
+
+// Unlike SiVar::ToString(), keeps every digit, since the text of an
+// expression is also its cache key.
+std::string ConstantText(const double value, const SiUnit& unit) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.17g", value);
+  const std::string units = unit.ToString();
+  return units.empty() ? buf : StrCat(buf, " ", units);
+}
+
+const char* OperatorText(const Node::Op op) {
+  switch (op) {
+    case Node::ADD:
+      return " + ";
+    case Node::SUBTRACT:
+      return " - ";
+    case Node::MULTIPLY:
+      return " * ";
+    case Node::DIVIDE:
+      return " / ";
+    default:
+      assert(false);
+      return "";
+  }
+}
+
+std::shared_ptr<const Node> MakeBinary(const Node::Op op,
+                                       const std::shared_ptr<const Node>& lhs,
+                                       const std::shared_ptr<const Node>& rhs) {
+  auto node = std::make_shared<Node>();
+  node->op = op;
+  node->lhs = lhs;
+  node->rhs = rhs;
+  node->text = StrCat("(", lhs->text, OperatorText(op), rhs->text, ")");
+  if (!lhs->status.ok()) {
+    node->status = lhs->status;
+  } else if (!rhs->status.ok()) {
+    node->status = rhs->status;
+  }
+  switch (op) {
+    case Node::ADD:
+    case Node::SUBTRACT:
+      node->unit = lhs->unit;
+      if (node->status.ok() && lhs->unit != rhs->unit) {
+        node->status = Status::FailureStatus(
+            StrCat("Incompatible units in ", node->text, ": ",
+                   lhs->unit.ToString(), " and ", rhs->unit.ToString()));
+      }
+      break;
+    case Node::MULTIPLY:
+      node->unit = lhs->unit * rhs->unit;
+      break;
+    case Node::DIVIDE:
+      node->unit = lhs->unit / rhs->unit;
+      break;
+    default:
+      assert(false);
+  }
+  return node;
+}
+
+// One step of the postfix program that Evaluate() runs for each block.
+struct Instruction {
+  Node::Op op;
+  // CHANNEL: the column to read.
+  const double* column;
+  // CONSTANT: the index of the constant's block.
+  int constant_index;
+  // POWER: the exponent.
+  int exp;
+};
+
+struct Program {
+  std::vector<Instruction> instructions;
+  // Keeps the columns read by CHANNEL instructions alive.
+  std::vector<TimeSeries::ColumnPtr> columns;
+  std::vector<double> constants;
+  // The most operands on the stack at any one time.
+  int max_depth = 0;
+};
+
+// Appends node to program in postfix order. depth is the number of operands on
+// the stack before node runs.
+void Compile(const Node& node, const TimeSeries& series, const int depth,
+             Program* program) {
+  program->max_depth = std::max(program->max_depth, depth + 1);
+  Instruction instruction = {node.op, nullptr, -1, 0};
+  switch (node.op) {
+    case Node::CHANNEL:
+      program->columns.push_back(series.Values(node.type));
+      instruction.column = program->columns.back()->data();
+      break;
+    case Node::CONSTANT:
+      instruction.constant_index = static_cast<int>(program->constants.size());
+      program->constants.push_back(node.constant);
+      break;
+    case Node::POWER:
+      Compile(*node.lhs, series, depth, program);
+      instruction.exp = node.exp;
+      break;
+    default:
+      Compile(*node.lhs, series, depth, program);
+      Compile(*node.rhs, series, depth + 1, program);
+  }
+  program->instructions.push_back(instruction);
+}
+
+// out[i] = a[i] op b[i] for i in [0,n), or a[i]^exp for POWER. out may be the
+// same as a.
+void ApplyScalar(const Node::Op op, const double* a, const double* b,
+                 const int exp, double* out, const size_t n) {
+  switch (op) {
+    case Node::ADD:
+      for (size_t i = 0; i < n; ++i) out[i] = a[i] + b[i];
+      break;
+    case Node::SUBTRACT:
+      for (size_t i = 0; i < n; ++i) out[i] = a[i] - b[i];
+      break;
+    case Node::MULTIPLY:
+      for (size_t i = 0; i < n; ++i) out[i] = a[i] * b[i];
+      break;
+    case Node::DIVIDE:
+      for (size_t i = 0; i < n; ++i) out[i] = a[i] / b[i];
+      break;
+    case Node::POWER:
+      for (size_t i = 0; i < n; ++i) {
+        double r = a[i];
+        for (int k = 1; k < std::abs(exp); ++k) r *= a[i];
+        out[i] = exp < 0 ? 1 / r : r;
+      }
+      break;
+    default:
+      assert(false);
+  }
+}
+
+#ifdef CYCLING_X86
+
+__attribute__((target("avx2"))) void ApplyAvx2(const Node::Op op,
+                                               const double* a,
+                                               const double* b, const int exp,
+                                               double* out, const size_t n) {
+  const size_t vector_end = n - n % 4;
+  switch (op) {
+    case Node::ADD:
+      for (size_t i = 0; i < vector_end; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i),
+                                                _mm256_loadu_pd(b + i)));
+      }
+      break;
+    case Node::SUBTRACT:
+      for (size_t i = 0; i < vector_end; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_sub_pd(_mm256_loadu_pd(a + i),
+                                                _mm256_loadu_pd(b + i)));
+      }
+      break;
+    case Node::MULTIPLY:
+      for (size_t i = 0; i < vector_end; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                                _mm256_loadu_pd(b + i)));
+      }
+      break;
+    case Node::DIVIDE:
+      for (size_t i = 0; i < vector_end; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_div_pd(_mm256_loadu_pd(a + i),
+                                                _mm256_loadu_pd(b + i)));
+      }
+      break;
+    case Node::POWER: {
+      const __m256d one = _mm256_set1_pd(1);
+      for (size_t i = 0; i < vector_end; i += 4) {
+        const __m256d x = _mm256_loadu_pd(a + i);
+        __m256d r = x;
+        for (int k = 1; k < std::abs(exp); ++k) r = _mm256_mul_pd(r, x);
+        _mm256_storeu_pd(out + i, exp < 0 ? _mm256_div_pd(one, r) : r);
+      }
+      break;
+    }
+    default:
+      assert(false);
+  }
+  ApplyScalar(op, a + vector_end, b ? b + vector_end : nullptr, exp,
+              out + vector_end, n - vector_end);
+}
+
+#endif  // CYCLING_X86
+
+using ApplyFunction = void (*)(const Node::Op, const double*, const double*,
+                               const int, double*, const size_t);
+
+ApplyFunction ChooseApply() {
+#ifdef CYCLING_X86
+  if (HasAvx2()) return ApplyAvx2;
+#endif
+  return ApplyScalar;
+}
+
+// Runs program over the first n samples. For each block of samples, every
+// instruction reads its operands from, and writes its result to, a block-sized
+// slot per stack level, so nothing the size of the series is allocated besides
+// the result.
+TimeSeries::Column Run(const Program& program, const size_t n) {
+  const ApplyFunction apply = ChooseApply();
+  std::vector<double> constants(program.constants.size() * kBlockSize);
+  for (size_t i = 0; i < program.constants.size(); ++i) {
+    std::fill_n(constants.begin() + i * kBlockSize, kBlockSize,
+                program.constants[i]);
+  }
+  std::vector<double> slots(program.max_depth * kBlockSize);
+  std::vector<const double*> stack(program.max_depth);
+  TimeSeries::Column result(n);
+  for (size_t begin = 0; begin < n; begin += kBlockSize) {
+    const size_t size = std::min(kBlockSize, n - begin);
+    double* const out = result.data() + begin;
+    int top = 0;
+    for (size_t i = 0; i < program.instructions.size(); ++i) {
+      const Instruction& instruction = program.instructions[i];
+      const bool last = i + 1 == program.instructions.size();
+      switch (instruction.op) {
+        case Node::CHANNEL:
+          stack[top++] = instruction.column + begin;
+          break;
+        case Node::CONSTANT:
+          stack[top++] =
+              constants.data() + instruction.constant_index * kBlockSize;
+          break;
+        case Node::POWER: {
+          double* slot = last ? out : slots.data() + (top - 1) * kBlockSize;
+          apply(instruction.op, stack[top - 1], nullptr, instruction.exp, slot,
+                size);
+          stack[top - 1] = slot;
+          break;
+        }
+        default: {
+          double* slot = last ? out : slots.data() + (top - 2) * kBlockSize;
+          apply(instruction.op, stack[top - 2], stack[top - 1], 0, slot, size);
+          stack[top - 2] = slot;
+          --top;
+        }
+      }
+    }
+    assert(top == 1);
+    if (stack[0] != out) std::copy(stack[0], stack[0] + size, out);
+  }
+  return result;
+}
+
+}  // namespace
+
+ChannelExpression::ChannelExpression(std::shared_ptr<const Node> node)
+    : node_(std::move(node)) {}
+
+ChannelExpression ChannelExpression::Channel(const Measurement::Type type) {
+  auto node = std::make_shared<Node>();
+  node->op = Node::CHANNEL;
+  node->type = type;
+  node->unit = Measurement(type, 0).value().unit();
+  node->text = ChannelName(type);
+  return ChannelExpression(std::move(node));
+}
+
+ChannelExpression ChannelExpression::Constant(const SiVar& value) {
+  auto node = std::make_shared<Node>();
+  node->op = Node::CONSTANT;
+  node->constant = value.coef();
+  node->unit = value.unit();
+  node->text = ConstantText(value.coef(), value.unit());
+  return ChannelExpression(std::move(node));
+}
+
+ChannelExpression ChannelExpression::operator+(
+    const ChannelExpression& rhs) const {
+  return ChannelExpression(MakeBinary(Node::ADD, node_, rhs.node_));
+}
+
+ChannelExpression ChannelExpression::operator-(
+    const ChannelExpression& rhs) const {
+  return ChannelExpression(MakeBinary(Node::SUBTRACT, node_, rhs.node_));
+}
+
+ChannelExpression ChannelExpression::operator*(
+    const ChannelExpression& rhs) const {
+  return ChannelExpression(MakeBinary(Node::MULTIPLY, node_, rhs.node_));
+}
+
+ChannelExpression ChannelExpression::operator/(
+    const ChannelExpression& rhs) const {
+  return ChannelExpression(MakeBinary(Node::DIVIDE, node_, rhs.node_));
+}
+
+ChannelExpression ChannelExpression::Power(const int exp) const {
+  auto node = std::make_shared<Node>();
+  node->op = Node::POWER;
+  node->exp = exp;
+  node->lhs = node_;
+  node->unit = node_->unit.Power(exp);
+  node->status = node_->status;
+  node->text = StrCat("(", node_->text, " ^ ", exp, ")");
+  if (node->status.ok() && exp == 0) {
+    node->status = Status::FailureStatus(
+        StrCat("Zero exponent in ", node->text));
+  }
+  return ChannelExpression(std::move(node));
+}
+
+const Status& ChannelExpression::status() const { return node_->status; }
+
+const SiUnit& ChannelExpression::unit() const { return node_->unit; }
+
+std::string ChannelExpression::ToString() const { return node_->text; }
+
+Status ChannelExpression::Evaluate(const TimeSeries& series,
+                                   TimeSeries::ColumnPtr* values) const {
+  if (!status().ok()) return status();
+  *values = series.CachedColumn(
+      StrCat("ChannelExpression ", node_->text), [this, &series]() {
+        size_t n = series.num_samples();
+        Program program;
+        Compile(*node_, series, 0, &program);
+        // Samples may have been added since n was read; only evaluate as many
+        // as every column has.
+        for (const TimeSeries::ColumnPtr& column : program.columns) {
+          n = std::min(n, column->size());
+        }
+        return Run(program, n);
+      });
+  return Status::OkStatus();
+}
+
+}  // namespace cycling
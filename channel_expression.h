@@ -0,0 +1,79 @@
+#ifndef __CHANNEL_EXPRESSION_H__
+#define __CHANNEL_EXPRESSION_H__
+
+#include <memory>
+#include <string>
+
+#include "measurement.h"
+#include "si_unit.h"
+#include "si_var.h"
+#include "status.h"
+#include "time_series.h"
+
+namespace cycling {
+
+// An arithmetic expression over the channels of a TimeSeries and SiVar
+// constants, used to define derived channels such as power-to-weight:
+//
+//   const ChannelExpression w_per_kg =
+//       ChannelExpression::Channel(Measurement::POWER) /
+//       ChannelExpression::Constant(75 * SiVar::Kilogram());
+//   TimeSeries::ColumnPtr values;
+//   RETURN_IF_ERROR(w_per_kg.Evaluate(series, &values));
+//
+// Units are worked out once, as the expression is built; adding or subtracting
+// operands of different units makes the expression invalid (see status()).
+// Evaluate() then runs the whole expression over the series in a single pass,
+// one block of samples at a time with SIMD arithmetic, so no SiVar or
+// full-length temporary is created per sample or per operator.
+//
+// Expressions are immutable and cheap to copy; subexpressions are shared.
+class ChannelExpression {
+ public:
+  // A node of the expression tree. Defined in channel_expression.cc.
+  struct Node;
+
+  // The values of type, in its base unit (see Measurement). Samples that lack
+  // the channel evaluate to NaN, as does anything computed from them.
+  static ChannelExpression Channel(const Measurement::Type type);
+  static ChannelExpression Constant(const SiVar& value);
+
+  ChannelExpression(const ChannelExpression&) = default;
+  ChannelExpression(ChannelExpression&&) = default;
+  ChannelExpression& operator=(const ChannelExpression&) = default;
+  ChannelExpression& operator=(ChannelExpression&&) = default;
+  ~ChannelExpression() = default;
+
+  ChannelExpression operator+(const ChannelExpression& rhs) const;
+  ChannelExpression operator-(const ChannelExpression& rhs) const;
+  ChannelExpression operator*(const ChannelExpression& rhs) const;
+  // Follows IEEE arithmetic: dividing by a zero value yields +-inf or NaN.
+  ChannelExpression operator/(const ChannelExpression& rhs) const;
+  // Raises the expression to a non-zero integer power.
+  ChannelExpression Power(const int exp) const;
+
+  // OK unless the expression, or any subexpression, combines incompatible
+  // units.
+  const Status& status() const;
+  // The unit of the values the expression evaluates to.
+  const SiUnit& unit() const;
+  // A fully parenthesized rendering of the expression, e.g.
+  // "(POWER / 75 kg)". Equal expressions have equal strings.
+  std::string ToString() const;
+
+  // Sets *values to the value of the expression for every sample of series.
+  // The result is cached on series under ToString() until the next
+  // TimeSeries::Add(), so evaluating the same expression again is free.
+  // Returns status() if the expression is invalid.
+  Status Evaluate(const TimeSeries& series,
+                  TimeSeries::ColumnPtr* values) const;
+
+ private:
+  explicit ChannelExpression(std::shared_ptr<const Node> node);
+
+  std::shared_ptr<const Node> node_;
+};
+
+}  // namespace cycling
+
+#endif  // __CHANNEL_EXPRESSION_H__
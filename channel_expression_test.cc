@@ -0,0 +1,173 @@
+#include "channel_expression.h"
+
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace cycling {
+namespace {
+
+using ::testing::DoubleEq;
+using ::testing::ElementsAre;
+using ::testing::NanSensitiveDoubleEq;
+
+using TimePoint = TimeSeries::TimePoint;
+
+const double kNaN = std::numeric_limits<double>::quiet_NaN();
+
+::testing::Matcher<double> IsNan() { return NanSensitiveDoubleEq(kNaN); }
+
+ChannelExpression Channel(const Measurement::Type type) {
+  return ChannelExpression::Channel(type);
+}
+
+ChannelExpression Constant(const SiVar& value) {
+  return ChannelExpression::Constant(value);
+}
+
+TimePoint At(const int seconds) {
+  return TimePoint() + std::chrono::hours(24 * 365 * 40) +
+         std::chrono::seconds(seconds);
+}
+
+// Adds one sample per second with the given power and heart rate. NaN leaves
+// the measurement out.
+void AddSamples(const std::vector<double>& watts,
+                const std::vector<double>& bpm, TimeSeries* series) {
+  for (size_t i = 0; i < watts.size(); ++i) {
+    TimeSample sample(At(series->num_samples()));
+    if (!std::isnan(watts[i])) {
+      sample.Add(Measurement(Measurement::POWER, watts[i]));
+    }
+    if (!std::isnan(bpm[i])) {
+      sample.Add(Measurement(Measurement::HEART_RATE, bpm[i]));
+    }
+    series->Add(sample);
+  }
+}
+
+TEST(ChannelExpressionTest, PowerToWeight) {
+  TimeSeries series;
+  AddSamples({150, 300, kNaN, 0}, {100, 120, 130, 140}, &series);
+  const ChannelExpression w_per_kg =
+      Channel(Measurement::POWER) / Constant(75 * SiVar::Kilogram());
+  ASSERT_TRUE(w_per_kg.status().ok());
+  EXPECT_EQ(w_per_kg.unit(), SiUnit::Watt() / SiUnit::Kilogram());
+
+  TimeSeries::ColumnPtr values;
+  ASSERT_TRUE(w_per_kg.Evaluate(series, &values).ok());
+  EXPECT_THAT(*values, ElementsAre(DoubleEq(2), DoubleEq(4), IsNan(), 0));
+}
+
+TEST(ChannelExpressionTest, EfficiencyFactor) {
+  TimeSeries series;
+  AddSamples({150, 300, 200}, {100, kNaN, 160}, &series);
+  const ChannelExpression ef =
+      Channel(Measurement::POWER) / Channel(Measurement::HEART_RATE);
+  EXPECT_EQ(ef.unit(), SiUnit::Watt());
+  TimeSeries::ColumnPtr values;
+  ASSERT_TRUE(ef.Evaluate(series, &values).ok());
+  EXPECT_THAT(*values, ElementsAre(DoubleEq(1.5), IsNan(), DoubleEq(1.25)));
+}
+
+// Checks every sample, across several blocks and a partial last block, against
+// the same formula computed with SiVars.
+TEST(ChannelExpressionTest, AeroPowerMatchesSiVarArithmetic) {
+  const SiVar air_density = 1.226 * SiVar::Kilogram() / SiVar::Meter().Power(3);
+  const SiVar frontal_area = 0.3 * SiVar::Meter().Power(2);
+  const double drag_coef = 0.63;
+
+  TimeSeries series;
+  for (int i = 0; i < 1003; ++i) {
+    series.Add(TimeSample(
+        At(i), Measurement(Measurement::SPEED, 5 + (i % 37) * 0.25)));
+  }
+  const ChannelExpression aero =
+      Constant(0.5 * drag_coef * air_density * frontal_area) *
+      Channel(Measurement::SPEED).Power(3);
+  ASSERT_TRUE(aero.status().ok());
+  EXPECT_EQ(aero.unit(), SiUnit::Watt());
+
+  TimeSeries::ColumnPtr values;
+  ASSERT_TRUE(aero.Evaluate(series, &values).ok());
+  ASSERT_EQ(values->size(), 1003);
+  for (int i = 0; i < 1003; ++i) {
+    const SiVar speed = (5 + (i % 37) * 0.25) * SiVar::MetersPerSecond();
+    const SiVar expected =
+        0.5 * drag_coef * air_density * frontal_area * speed * speed * speed;
+    ASSERT_EQ(expected.unit(), SiUnit::Watt());
+    ASSERT_NEAR((*values)[i], expected.coef(), 1e-9 * expected.coef()) << i;
+  }
+}
+
+TEST(ChannelExpressionTest, AddSubtractAndNegativePower) {
+  TimeSeries series;
+  AddSamples({100, 200}, {50, 100}, &series);
+  const ChannelExpression expression =
+      (Channel(Measurement::POWER) - Constant(50 * SiVar::Watt()) +
+       Channel(Measurement::POWER))
+          .Power(-1) *
+      Channel(Measurement::HEART_RATE);
+  EXPECT_EQ(expression.unit(), SiUnit::Watt().Invert());
+  TimeSeries::ColumnPtr values;
+  ASSERT_TRUE(expression.Evaluate(series, &values).ok());
+  EXPECT_THAT(*values,
+              ElementsAre(DoubleEq(50 / 150.0), DoubleEq(100 / 350.0)));
+}
+
+TEST(ChannelExpressionTest, IncompatibleUnits) {
+  const ChannelExpression bad =
+      Channel(Measurement::POWER) + Channel(Measurement::SPEED);
+  EXPECT_FALSE(bad.status().ok());
+  // Errors propagate to every expression built on top.
+  const ChannelExpression worse = bad * Constant(2);
+  EXPECT_FALSE(worse.status().ok());
+  EXPECT_FALSE(Channel(Measurement::POWER).Power(0).status().ok());
+
+  TimeSeries series;
+  AddSamples({100}, {100}, &series);
+  TimeSeries::ColumnPtr values;
+  EXPECT_FALSE(worse.Evaluate(series, &values).ok());
+  EXPECT_EQ(values, nullptr);
+}
+
+TEST(ChannelExpressionTest, ToString) {
+  EXPECT_EQ((Channel(Measurement::POWER) / Constant(75 * SiVar::Kilogram()))
+                .ToString(),
+            "(POWER / 75 kg)");
+  EXPECT_EQ((Channel(Measurement::SPEED).Power(2) * Constant(0.5)).ToString(),
+            "((SPEED ^ 2) * 0.5)");
+}
+
+TEST(ChannelExpressionTest, CachedUntilAdd) {
+  TimeSeries series;
+  AddSamples({100, 200}, {50, 100}, &series);
+  const ChannelExpression ef =
+      Channel(Measurement::POWER) / Channel(Measurement::HEART_RATE);
+  TimeSeries::ColumnPtr first, second;
+  ASSERT_TRUE(ef.Evaluate(series, &first).ok());
+  // An equal expression built separately shares the cached column.
+  ASSERT_TRUE((Channel(Measurement::POWER) / Channel(Measurement::HEART_RATE))
+                  .Evaluate(series, &second)
+                  .ok());
+  EXPECT_EQ(first, second);
+
+  AddSamples({300}, {150}, &series);
+  ASSERT_TRUE(ef.Evaluate(series, &second).ok());
+  EXPECT_NE(first, second);
+  EXPECT_THAT(*first, ElementsAre(2, 2));
+  EXPECT_THAT(*second, ElementsAre(2, 2, 2));
+}
+
+TEST(ChannelExpressionTest, EmptySeries) {
+  TimeSeries series;
+  TimeSeries::ColumnPtr values;
+  ASSERT_TRUE(Channel(Measurement::POWER).Evaluate(series, &values).ok());
+  EXPECT_TRUE(values->empty());
+}
+
+}  // namespace
+}  // namespace cycling
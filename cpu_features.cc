@@ -0,0 +1,15 @@
+#include "cpu_features.h"
+
+namespace cycling {
+
+bool HasAvx2() {
+#if defined(__x86_64__) || defined(__i386__)
+  static const bool has_avx2 =
+      __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  return has_avx2;
+#else
+  return false;
+#endif
+}
+
+}  // namespace cycling
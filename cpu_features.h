@@ -0,0 +1,13 @@
+#ifndef __CPU_FEATURES_H__
+#define __CPU_FEATURES_H__
+
+namespace cycling {
+
+// Returns true if the CPU running this process supports AVX2 and FMA. Kernels
+// with an AVX2 path compile it with __attribute__((target("avx2,fma"))) and
+// only call it when this returns true, so the binary still runs everywhere.
+bool HasAvx2();
+
+}  // namespace cycling
+
+#endif  // __CPU_FEATURES_H__
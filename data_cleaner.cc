@@ -0,0 +1,281 @@
+#include "data_cleaner.h"
+
+#include <cmath>
+#include <cstdint>
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "cpu_features.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CYCLING_X86 1
+#endif
+
+namespace cycling {
+
+namespace {
+
+const double kNaN = std::numeric_limits<double>::quiet_NaN();
+
+// Turns a median absolute deviation into an estimate of the standard deviation
+// of normally distributed noise.
+const double kMadToSigma = 1.4826;
+
+// The outlier test needs at least this many values in the window.
+const int kMinWindowValues = 3;
+
+// Returns the median of values[0, n), reordering them.
+double Median(double* values, const int n) {
+  double* mid = values + n / 2;
+  std::nth_element(values, mid, values + n);
+  if (n % 2 == 1) return *mid;
+  return (*std::max_element(values, mid) + *mid) / 2;
+}
+
+// A value can only be further than `deviation` from the median of its window
+// if at least half of the values in the window lie beyond that distance on
+// one side. Counting is far cheaper than finding the median, and almost every
+// value fails it, so only the values that pass are suspects for the full
+// test.
+//
+// Sets suspects[i] for i in [begin, end) to whether the value of sample i is a
+// suspect. The window of sample i is padded[i, i + window), and its value is
+// padded[i + window / 2]. NaN marks samples without a value. counts[i] is the
+// number of values in padded[0, i).
+void FindSuspectsScalar(const double* padded, const int32_t* counts,
+                        const int begin, const int end, const int window,
+                        const double deviation, uint8_t* suspects) {
+  for (int i = begin; i < end; ++i) {
+    const double value = padded[i + window / 2];
+    const double low = value - deviation;
+    const double high = value + deviation;
+    const int num_values = counts[i + window] - counts[i];
+    int num_below = 0;
+    int num_above = 0;
+    for (int k = i; k < i + window; ++k) {
+      num_below += padded[k] < low;
+      num_above += padded[k] > high;
+    }
+    const int half = (num_values + 1) / 2;
+    suspects[i] = num_values >= kMinWindowValues &&
+                  (num_below >= half || num_above >= half);
+  }
+}
+
+#ifdef CYCLING_X86
+
+// Same as FindSuspectsScalar, for eight samples at a time, on narrow, the
+// values of padded rounded to floats. Rounding never reorders two values, so
+// counting the floats <= the rounded low end (and >= the rounded high end)
+// counts at least the doubles beyond it: a few more samples may be suspects,
+// but none are missed, and the full test is done in doubles.
+__attribute__((target("avx2"))) void FindSuspectsAvx2(
+    const double* padded, const float* narrow, const int32_t* counts,
+    const int begin, const int end, const int window, const double deviation,
+    uint8_t* suspects) {
+  const __m256d deviation4 = _mm256_set1_pd(deviation);
+  const int half = window / 2;
+  int i = begin;
+  for (; i + 8 <= end; i += 8) {
+    const __m256d value0 = _mm256_loadu_pd(padded + i + half);
+    const __m256d value1 = _mm256_loadu_pd(padded + i + half + 4);
+    const __m256 low = _mm256_set_m128(
+        _mm256_cvtpd_ps(_mm256_sub_pd(value1, deviation4)),
+        _mm256_cvtpd_ps(_mm256_sub_pd(value0, deviation4)));
+    const __m256 high = _mm256_set_m128(
+        _mm256_cvtpd_ps(_mm256_add_pd(value1, deviation4)),
+        _mm256_cvtpd_ps(_mm256_add_pd(value0, deviation4)));
+    // Comparisons are all ones, i.e. -1, in the lanes where they hold.
+    __m256i num_below = _mm256_setzero_si256();
+    __m256i num_above = _mm256_setzero_si256();
+    for (int k = 0; k < window; ++k) {
+      const __m256 v = _mm256_loadu_ps(narrow + i + k);
+      num_below = _mm256_sub_epi32(
+          num_below, _mm256_castps_si256(_mm256_cmp_ps(v, low, _CMP_LE_OQ)));
+      num_above = _mm256_sub_epi32(
+          num_above, _mm256_castps_si256(_mm256_cmp_ps(v, high, _CMP_GE_OQ)));
+    }
+    const __m256i num_values = _mm256_sub_epi32(
+        _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(counts + i + window)),
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(counts + i)));
+    // half = (num_values + 1) / 2, and a suspect has num_below or num_above
+    // >= half, i.e. > half - 1.
+    const __m256i half_minus_one = _mm256_srai_epi32(
+        _mm256_sub_epi32(num_values, _mm256_set1_epi32(1)), 1);
+    const __m256i outside = _mm256_or_si256(
+        _mm256_cmpgt_epi32(num_below, half_minus_one),
+        _mm256_cmpgt_epi32(num_above, half_minus_one));
+    const __m256i enough = _mm256_cmpgt_epi32(
+        num_values, _mm256_set1_epi32(kMinWindowValues - 1));
+    const int mask = _mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_and_si256(outside, enough)));
+    for (int lane = 0; lane < 8; ++lane) suspects[i + lane] = mask >> lane & 1;
+  }
+  FindSuspectsScalar(padded, counts, i, end, window, deviation, suspects);
+}
+
+#endif  // CYCLING_X86
+
+void FindSuspects(const double* padded, const float* narrow,
+                  const int32_t* counts, const int n, const int window,
+                  const double deviation, uint8_t* suspects) {
+#ifdef CYCLING_X86
+  static const bool has_avx2 = HasAvx2();
+  if (has_avx2) {
+    FindSuspectsAvx2(padded, narrow, counts, 0, n, window, deviation,
+                     suspects);
+    return;
+  }
+#endif
+  FindSuspectsScalar(padded, counts, 0, n, window, deviation, suspects);
+}
+
+}  // namespace
+
+// The channel being cleaned. Kept from channel to channel and call to call,
+// with its buffers, so that cleaning doesn't allocate once they are big
+// enough.
+struct DataCleaner::Channel {
+  // Sets up the channel to clean raw, the values of a series, with windows of
+  // `window` samples, and counts the values into stats.
+  void Reset(const ChannelLimits& channel_limits, const TimeSeries::Column& raw,
+             const int window, ChannelCleaningStats* stats) {
+    limits = channel_limits;
+    const int n = static_cast<int>(raw.size());
+    const int half = window / 2;
+    padded.resize(n + 2 * half);
+    narrow.resize(n + 2 * half);
+    counts.resize(n + 2 * half + 1);
+    suspects.resize(n);
+    scratch.resize(window);
+    std::fill(padded.begin(), padded.begin() + half, kNaN);
+    std::fill(padded.end() - half, padded.end(), kNaN);
+    std::fill(narrow.begin(), narrow.begin() + half, kNaN);
+    std::fill(narrow.end() - half, narrow.end(), kNaN);
+    // Locals, since the stores could otherwise alias the limits.
+    const double min = limits.min;
+    const double max = limits.max;
+    int num_values = 0;
+    for (int i = 0; i < n; ++i) {
+      const double value = raw[i];
+      const double kept = value >= min && value <= max ? value : kNaN;
+      num_values += !std::isnan(value);
+      padded[half + i] = kept;
+      narrow[half + i] = static_cast<float>(kept);
+    }
+    // Counted in a pass of its own, which leaves the loop above with no
+    // running dependency.
+    std::fill(counts.begin(), counts.begin() + half + 1, 0);
+    int num_in_bounds = 0;
+    for (int i = half; i < n + 2 * half; ++i) {
+      num_in_bounds += !std::isnan(padded[i]);
+      counts[i + 1] = num_in_bounds;
+    }
+    cleaned.assign(padded.begin() + half, padded.end() - half);
+    stats->num_values = num_values;
+    stats->num_out_of_bounds = num_values - num_in_bounds;
+    FindSuspects(padded.data(), narrow.data(), counts.data(), n, window,
+                 limits.min_outlier_deviation, suspects.data());
+  }
+
+  // Removes the outliers from cleaned and fills the gaps of up to max_gap
+  // samples, counting both into stats. The window of each sample holds raw
+  // values, so a removed outlier still counts towards its neighbors' medians,
+  // as in a Hampel filter. A sample that keeps a value closes the gap since
+  // the last sample that did.
+  void Clean(const int window, const double threshold, const int max_gap,
+             ChannelCleaningStats* stats) {
+    const int n = static_cast<int>(cleaned.size());
+    int last_valid = -1;
+    for (int i = 0; i < n; ++i) {
+      if (std::isnan(cleaned[i])) continue;
+      if (IsOutlier(i, window, threshold)) {
+        cleaned[i] = kNaN;
+        ++stats->num_outliers;
+        continue;
+      }
+      const int gap = i - last_valid - 1;
+      if (last_valid >= 0 && gap > 0 && gap <= max_gap) {
+        const double start = cleaned[last_valid];
+        const double step = (cleaned[i] - start) / (gap + 1);
+        for (int k = 1; k <= gap; ++k) {
+          cleaned[last_valid + k] = start + step * k;
+        }
+        stats->num_interpolated += gap;
+      }
+      last_valid = i;
+    }
+  }
+
+  // Returns true if the value of sample i is an outlier among the values in
+  // its window.
+  bool IsOutlier(const int i, const int window, const double threshold) {
+    if (!suspects[i]) return false;
+    const double value = cleaned[i];
+    int n = 0;
+    for (int k = i; k < i + window; ++k) {
+      if (!std::isnan(padded[k])) scratch[n++] = padded[k];
+    }
+    const double median = Median(scratch.data(), n);
+    const double deviation = std::abs(value - median);
+    if (deviation <= limits.min_outlier_deviation) return false;
+    for (int k = 0; k < n; ++k) scratch[k] = std::abs(scratch[k] - median);
+    return deviation > threshold * kMadToSigma * Median(scratch.data(), n);
+  }
+
+  ChannelLimits limits;
+  // The in-bounds raw values, NaN elsewhere, with window / 2 NaNs on either
+  // side so that the window of sample i is always padded[i, i + window).
+  TimeSeries::Column padded;
+  // padded rounded to floats, which screen twice as many samples at a time.
+  std::vector<float> narrow;
+  // counts[i] is the number of values in padded[0, i).
+  std::vector<int32_t> counts;
+  TimeSeries::Column cleaned;
+  std::vector<uint8_t> suspects;
+  std::vector<double> scratch;
+};
+
+DataCleaner::DataCleaner(const CleaningOptions& options)
+    : options_(options), channel_(new Channel) {}
+
+DataCleaner::~DataCleaner() {}
+
+CleaningReport DataCleaner::Clean(TimeSeries* series) {
+  const int half = std::max(0, options_.window / 2);
+  const int window = 2 * half + 1;
+
+  CleaningReport report;
+  std::vector<Measurement::Type> types;
+  std::vector<const ChannelLimits*> limits;
+  for (const ChannelLimits& channel : options_.channels) {
+    if (TimeSeries::IsDerived(channel.type)) continue;
+    ChannelCleaningStats stats;
+    stats.type = channel.type;
+    report.channels.push_back(stats);
+    types.push_back(channel.type);
+    limits.push_back(&channel);
+  }
+  // Reading the samples costs the most, so only the cleaned channels are
+  // read, once, into columns that are then worked on and written back.
+  series->CopyValues(types, &columns_);
+  for (size_t k = 0; k < types.size(); ++k) {
+    channel_->Reset(*limits[k], columns_[k], window, &report.channels[k]);
+    channel_->Clean(window, options_.outlier_threshold, options_.max_gap,
+                    &report.channels[k]);
+    std::swap(columns_[k], channel_->cleaned);
+  }
+  series->SetValues(types, columns_);
+  return report;
+}
+
+CleaningReport CleanTimeSeries(const CleaningOptions& options,
+                               TimeSeries* series) {
+  return DataCleaner(options).Clean(series);
+}
+
+}  // namespace cycling
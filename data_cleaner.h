@@ -0,0 +1,99 @@
+#ifndef __DATA_CLEANER_H__
+#define __DATA_CLEANER_H__
+
+#include <memory>
+#include <vector>
+
+#include "measurement.h"
+#include "time_series.h"
+
+namespace cycling {
+
+// How one channel is cleaned. Values are in the base unit of type.
+struct ChannelLimits {
+  Measurement::Type type;
+  // Values outside [min,max] can't be real (e.g. a 250 bpm heart rate) and
+  // are always removed.
+  double min;
+  double max;
+  // Values further than this from the sliding median are outliers if they
+  // are also far out in terms of the local spread. Keeps a steady signal,
+  // whose spread is near zero, from turning every small change into an
+  // outlier.
+  double min_outlier_deviation;
+};
+
+struct CleaningOptions {
+  // The channels to clean. Derived channels (see TimeSeries::IsDerived()) are
+  // skipped, since their samples hold no values.
+  std::vector<ChannelLimits> channels = {
+      {Measurement::POWER, 0, 2500, 150},
+      {Measurement::HEART_RATE, 30, 230, 20},
+      {Measurement::CADENCE, 0, 200, 30},
+      // 30 m/s is 108 km/h.
+      {Measurement::SPEED, 0, 30, 5},
+  };
+
+  // The number of samples in the window centered on each sample that the
+  // median and the median absolute deviation (MAD) are taken over.
+  int window = 11;
+  // A value is an outlier if it lies more than this many robust standard
+  // deviations (1.4826 * MAD) from the median of its window. This catches
+  // spikes as well as zero dropouts in the middle of steady riding.
+  double outlier_threshold = 5;
+  // Runs of at most this many samples without a value, between two samples
+  // with one, are filled in by linear interpolation. Longer gaps are left
+  // alone, since they are more likely to be real breaks. 0 disables it.
+  int max_gap = 5;
+};
+
+// What cleaning did to one channel.
+struct ChannelCleaningStats {
+  Measurement::Type type;
+  // The number of samples that had a value before cleaning.
+  int num_values = 0;
+  // The number of values removed for being outside [min,max].
+  int num_out_of_bounds = 0;
+  // The number of values removed by the median/MAD test.
+  int num_outliers = 0;
+  // The number of samples filled in by interpolation, whether their value was
+  // removed or never there.
+  int num_interpolated = 0;
+};
+
+struct CleaningReport {
+  // One entry per cleaned channel, in the order of CleaningOptions::channels.
+  std::vector<ChannelCleaningStats> channels;
+};
+
+// Removes impossible values and outliers from the channels listed in its
+// options, and fills short gaps. The cleaned channels are read out of a series
+// in one pass over its samples, cleaned a channel at a time, and only the
+// samples whose values change are written back. Meant to run right after
+// parsing a file, before anything reads the series.
+//
+// A DataCleaner keeps its buffers from ride to ride, so cleaning one ride
+// after another doesn't allocate once they are big enough. Use one per
+// thread.
+class DataCleaner {
+ public:
+  explicit DataCleaner(const CleaningOptions& options);
+  ~DataCleaner();
+
+  CleaningReport Clean(TimeSeries* series);
+
+ private:
+  struct Channel;
+
+  const CleaningOptions options_;
+  std::vector<TimeSeries::Column> columns_;
+  std::unique_ptr<Channel> channel_;
+};
+
+// Same as DataCleaner(options).Clean(series), for a single ride.
+CleaningReport CleanTimeSeries(const CleaningOptions& options,
+                               TimeSeries* series);
+
+}  // namespace cycling
+
+#endif  // __DATA_CLEANER_H__
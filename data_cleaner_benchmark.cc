@@ -0,0 +1,64 @@
+// Times DataCleaner::Clean() on an hour-long ride with power, heart rate,
+// cadence and speed. On a 2.1 GHz VM the median for 10000 samples is 0.55 to
+// 0.9 ms from one run of the benchmark to the next, about half of it reading
+// the channels out of the samples and writing them back.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "data_cleaner.h"
+
+namespace cycling {
+namespace {
+
+const int kNumSamples = 10000;
+const int kNumRuns = 20;
+
+// A steady ride with noise, and a power spike every 997 samples.
+std::unique_ptr<TimeSeries> MakeRide(std::mt19937* random) {
+  std::normal_distribution<double> noise(0, 15);
+  std::unique_ptr<TimeSeries> series(new TimeSeries);
+  const auto start = TimeSeries::TimePoint() + std::chrono::hours(1000);
+  for (int i = 0; i < kNumSamples; ++i) {
+    TimeSample sample(start + std::chrono::seconds(i));
+    const double power = i % 997 == 0 ? 2000 : 220 + noise(*random);
+    sample.Add(Measurement(Measurement::POWER, power));
+    sample.Add(Measurement(Measurement::HEART_RATE, 150 + noise(*random) / 5));
+    sample.Add(Measurement(Measurement::CADENCE, 90 + noise(*random) / 5));
+    sample.Add(Measurement(Measurement::SPEED, 9 + noise(*random) / 30));
+    series->Add(sample);
+  }
+  return series;
+}
+
+void Run() {
+  std::mt19937 random(1);
+  // The first run sizes the buffers that later runs reuse.
+  DataCleaner cleaner((CleaningOptions()));
+  cleaner.Clean(MakeRide(&random).get());
+  std::vector<double> times;
+  for (int run = 0; run < kNumRuns; ++run) {
+    std::unique_ptr<TimeSeries> series = MakeRide(&random);
+    const auto start = std::chrono::steady_clock::now();
+    cleaner.Clean(series.get());
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    times.push_back(elapsed.count());
+  }
+  std::sort(times.begin(), times.end());
+  printf("DataCleaner::Clean, %d samples, 4 channels: best %.3f ms, "
+         "median %.3f ms over %d runs\n",
+         kNumSamples, times.front(), times[kNumRuns / 2], kNumRuns);
+}
+
+}  // namespace
+}  // namespace cycling
+
+int main() {
+  cycling::Run();
+  return 0;
+}
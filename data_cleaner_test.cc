@@ -0,0 +1,166 @@
+#include "data_cleaner.h"
+
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace cycling {
+namespace {
+
+using ::testing::DoubleEq;
+using ::testing::ElementsAreArray;
+using ::testing::NanSensitiveDoubleEq;
+
+const double kNaN = std::numeric_limits<double>::quiet_NaN();
+
+// Builds a series with one sample per second holding the given values of type.
+// NaN leaves the value out.
+std::unique_ptr<TimeSeries> MakeSeries(const Measurement::Type type,
+                                       const std::vector<double>& values) {
+  std::unique_ptr<TimeSeries> series(new TimeSeries);
+  const auto start = TimeSeries::TimePoint() + std::chrono::hours(1000);
+  for (size_t i = 0; i < values.size(); ++i) {
+    TimeSample sample(start + std::chrono::seconds(i));
+    if (!std::isnan(values[i])) sample.Add(Measurement(type, values[i]));
+    series->Add(sample);
+  }
+  return series;
+}
+
+std::vector<::testing::Matcher<double>> Near(
+    const std::vector<double>& values) {
+  std::vector<::testing::Matcher<double>> matchers;
+  for (const double value : values) {
+    matchers.push_back(NanSensitiveDoubleEq(value));
+  }
+  return matchers;
+}
+
+CleaningReport Clean(TimeSeries* series) {
+  return CleanTimeSeries(CleaningOptions(), series);
+}
+
+std::vector<double> Repeat(const double value, const int count) {
+  return std::vector<double>(count, value);
+}
+
+std::vector<double> Concat(std::initializer_list<std::vector<double>> parts) {
+  std::vector<double> result;
+  for (const auto& part : parts) {
+    result.insert(result.end(), part.begin(), part.end());
+  }
+  return result;
+}
+
+TEST(DataCleanerTest, RemovesSpikesAndFillsThem) {
+  auto series = MakeSeries(
+      Measurement::POWER,
+      Concat({Repeat(200, 10), {2000}, Repeat(200, 10), {210},
+              Repeat(220, 9)}));
+  const CleaningReport report = Clean(series.get());
+  EXPECT_THAT(*series->Values(Measurement::POWER),
+              ElementsAreArray(Near(Concat(
+                  {Repeat(200, 21), {210}, Repeat(220, 9)}))));
+  ASSERT_EQ(report.channels.size(), 4);
+  EXPECT_EQ(report.channels[0].type, Measurement::POWER);
+  EXPECT_EQ(report.channels[0].num_values, 31);
+  EXPECT_EQ(report.channels[0].num_out_of_bounds, 0);
+  EXPECT_EQ(report.channels[0].num_outliers, 1);
+  EXPECT_EQ(report.channels[0].num_interpolated, 1);
+  // Channels without values are reported, and left alone.
+  EXPECT_EQ(report.channels[1].type, Measurement::HEART_RATE);
+  EXPECT_EQ(report.channels[1].num_values, 0);
+  EXPECT_EQ(series->Values(Measurement::HEART_RATE)->size(), 31);
+}
+
+TEST(DataCleanerTest, ZeroDropoutsInSteadyRiding) {
+  auto series = MakeSeries(
+      Measurement::POWER,
+      Concat({Repeat(250, 10), {0, 0}, {280}, Repeat(250, 10)}));
+  const CleaningReport report = Clean(series.get());
+  const auto& power = *series->Values(Measurement::POWER);
+  EXPECT_THAT(power[10], DoubleEq(260));
+  EXPECT_THAT(power[11], DoubleEq(270));
+  EXPECT_EQ(power[12], 280);
+  EXPECT_EQ(report.channels[0].num_outliers, 2);
+  EXPECT_EQ(report.channels[0].num_interpolated, 2);
+}
+
+TEST(DataCleanerTest, KeepsRealChanges) {
+  // A step up into an interval, and a long stretch of coasting.
+  const std::vector<double> watts = Concat(
+      {Repeat(150, 15), Repeat(400, 15), Repeat(0, 20), Repeat(180, 15)});
+  auto series = MakeSeries(Measurement::POWER, watts);
+  const CleaningReport report = Clean(series.get());
+  EXPECT_THAT(*series->Values(Measurement::POWER),
+              ElementsAreArray(Near(watts)));
+  EXPECT_EQ(report.channels[0].num_outliers, 0);
+}
+
+TEST(DataCleanerTest, BoundsAndGaps) {
+  CleaningOptions options;
+  options.max_gap = 2;
+  auto series = MakeSeries(
+      Measurement::HEART_RATE,
+      {140, 142, 250, 146, kNaN, kNaN, kNaN, 150, 150, 0, kNaN, 154, 156});
+  const CleaningReport report = CleanTimeSeries(options, series.get());
+  EXPECT_THAT(*series->Values(Measurement::HEART_RATE),
+              ElementsAreArray(Near({140, 142, 144, 146, kNaN, kNaN, kNaN, 150,
+                                     150, 151.333333333333333,
+                                     152.666666666666667, 154, 156})));
+  const ChannelCleaningStats& stats = report.channels[1];
+  EXPECT_EQ(stats.num_values, 9);
+  EXPECT_EQ(stats.num_out_of_bounds, 2);
+  EXPECT_EQ(stats.num_outliers, 0);
+  EXPECT_EQ(stats.num_interpolated, 3);
+}
+
+TEST(DataCleanerTest, SeveralChannels) {
+  std::unique_ptr<TimeSeries> series(new TimeSeries);
+  const auto start = TimeSeries::TimePoint() + std::chrono::hours(1000);
+  for (int i = 0; i < 30; ++i) {
+    TimeSample sample(start + std::chrono::seconds(i));
+    sample.Add(Measurement(Measurement::POWER, i == 5 ? 1800 : 200));
+    sample.Add(Measurement(Measurement::HEART_RATE, i == 20 ? 240 : 150));
+    sample.Add(Measurement(Measurement::CADENCE, 90));
+    series->Add(sample);
+  }
+  const CleaningReport report = Clean(series.get());
+  EXPECT_THAT(*series->Values(Measurement::POWER),
+              ElementsAreArray(Near(Repeat(200, 30))));
+  EXPECT_THAT(*series->Values(Measurement::HEART_RATE),
+              ElementsAreArray(Near(Repeat(150, 30))));
+  EXPECT_EQ(report.channels[0].num_outliers, 1);
+  EXPECT_EQ(report.channels[1].num_out_of_bounds, 1);
+  EXPECT_EQ(report.channels[2].num_values, 30);
+  EXPECT_EQ(report.channels[2].num_outliers, 0);
+}
+
+TEST(DataCleanerTest, ReusedCleaner) {
+  // Longer rides, then a shorter one, through the same buffers.
+  DataCleaner cleaner((CleaningOptions()));
+  for (const int n : {40, 60, 20}) {
+    std::vector<double> values = Repeat(200, n);
+    values[n / 2] = 1800;
+    auto reused = MakeSeries(Measurement::POWER, values);
+    auto fresh = MakeSeries(Measurement::POWER, values);
+    const CleaningReport report = cleaner.Clean(reused.get());
+    Clean(fresh.get());
+    EXPECT_EQ(report.channels[0].num_outliers, 1) << n;
+    EXPECT_THAT(*reused->Values(Measurement::POWER),
+                ElementsAreArray(Near(*fresh->Values(Measurement::POWER))));
+  }
+}
+
+TEST(DataCleanerTest, EmptySeries) {
+  TimeSeries series;
+  const CleaningReport report = CleanTimeSeries(CleaningOptions(), &series);
+  EXPECT_EQ(report.channels.size(), 4);
+  EXPECT_EQ(series.num_samples(), 0);
+}
+
+}  // namespace
+}  // namespace cycling
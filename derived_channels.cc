@@ -0,0 +1,95 @@
+#include "derived_channels.h"
+
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+namespace cycling {
+namespace derived_channels {
+
+namespace {
+
+const double kNaN = std::numeric_limits<double>::quiet_NaN();
+
+// Grades over less horizontal distance than this are too noisy to report.
+const double kMinGradeMeters = 1.0;
+
+// Computes the running sum of rate * dt, where dt is the time since the
+// previous sample.
+std::vector<double> Integrate(const std::vector<double>& seconds,
+                              const std::vector<double>& rate) {
+  assert(seconds.size() == rate.size());
+  std::vector<double> total(rate.size());
+  double sum = 0;
+  for (size_t i = 0; i < rate.size(); ++i) {
+    if (i > 0 && !std::isnan(rate[i])) {
+      sum += rate[i] * (seconds[i] - seconds[i - 1]);
+    }
+    total[i] = sum;
+  }
+  return total;
+}
+
+}  // namespace
+
+std::vector<double> CumulativeEnergy(const std::vector<double>& seconds,
+                                     const std::vector<double>& watts) {
+  return Integrate(seconds, watts);
+}
+
+std::vector<double> IncrementalDistance(const std::vector<double>& total) {
+  std::vector<double> incremental(total.size(), kNaN);
+  double last = 0;
+  for (size_t i = 0; i < total.size(); ++i) {
+    if (std::isnan(total[i])) continue;
+    incremental[i] = total[i] - last;
+    last = total[i];
+  }
+  return incremental;
+}
+
+std::vector<double> TotalDistanceFromIncrements(
+    const std::vector<double>& incremental) {
+  std::vector<double> total(incremental.size());
+  double sum = 0;
+  for (size_t i = 0; i < incremental.size(); ++i) {
+    if (!std::isnan(incremental[i])) sum += incremental[i];
+    total[i] = sum;
+  }
+  return total;
+}
+
+std::vector<double> TotalDistanceFromSpeed(const std::vector<double>& seconds,
+                                           const std::vector<double>& speed) {
+  return Integrate(seconds, speed);
+}
+
+std::vector<double> Grade(const std::vector<double>& total_distance,
+                          const std::vector<double>& altitude,
+                          const double window_meters) {
+  assert(total_distance.size() == altitude.size());
+  std::vector<double> grade(altitude.size(), kNaN);
+  std::vector<size_t> valid;
+  valid.reserve(altitude.size());
+  for (size_t i = 0; i < altitude.size(); ++i) {
+    if (!std::isnan(altitude[i]) && !std::isnan(total_distance[i])) {
+      valid.push_back(i);
+    }
+  }
+  // lo trails k as the latest valid sample at least window_meters back.
+  size_t lo = 0;
+  for (size_t k = 1; k < valid.size(); ++k) {
+    const size_t i = valid[k];
+    while (lo + 1 < k &&
+           total_distance[i] - total_distance[valid[lo + 1]] >= window_meters) {
+      ++lo;
+    }
+    const double run = total_distance[i] - total_distance[valid[lo]];
+    if (run < kMinGradeMeters) continue;
+    grade[i] = (altitude[i] - altitude[valid[lo]]) / run;
+  }
+  return grade;
+}
+
+}  // namespace derived_channels
+}  // namespace cycling
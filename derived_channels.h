@@ -0,0 +1,41 @@
+#ifndef __DERIVED_CHANNELS_H__
+#define __DERIVED_CHANNELS_H__
+
+#include <vector>
+
+namespace cycling {
+namespace derived_channels {
+
+// Kernels that compute one channel of a TimeSeries from others. Every input
+// and output has one entry per sample, and missing values are NaN. seconds
+// holds the time of each sample relative to the first one.
+
+// The cumulative energy in joules, assuming each power sample was held since
+// the previous sample. Samples without power add nothing.
+std::vector<double> CumulativeEnergy(const std::vector<double>& seconds,
+                                     const std::vector<double>& watts);
+
+// The distance covered since the previous sample with a distance. The first
+// one is measured from 0, so the increments always sum to the last total.
+std::vector<double> IncrementalDistance(const std::vector<double>& total);
+
+// The running sum of the incremental distances.
+std::vector<double> TotalDistanceFromIncrements(
+    const std::vector<double>& incremental);
+
+// The running integral of speed (m/s), assuming each speed sample was held
+// since the previous sample.
+std::vector<double> TotalDistanceFromSpeed(const std::vector<double>& seconds,
+                                           const std::vector<double>& speed);
+
+// Altitude gained over horizontal distance covered (e.g. 0.05 for 5%), over
+// roughly the last window_meters of distance to suppress altitude noise.
+// NaN where a sample lacks either input or too little distance was covered.
+std::vector<double> Grade(const std::vector<double>& total_distance,
+                          const std::vector<double>& altitude,
+                          const double window_meters);
+
+}  // namespace derived_channels
+}  // namespace cycling
+
+#endif  // __DERIVED_CHANNELS_H__
@@ -0,0 +1,53 @@
+#include "derived_channels.h"
+
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace cycling {
+namespace derived_channels {
+namespace {
+
+using ::testing::DoubleEq;
+using ::testing::ElementsAre;
+using ::testing::NanSensitiveDoubleEq;
+
+const double kNaN = std::numeric_limits<double>::quiet_NaN();
+
+::testing::Matcher<double> IsNan() { return NanSensitiveDoubleEq(kNaN); }
+
+TEST(DerivedChannelsTest, CumulativeEnergy) {
+  EXPECT_THAT(CumulativeEnergy({0, 1, 2, 4, 5}, {100, 200, kNaN, 300, 0}),
+              ElementsAre(0, 200, 200, 800, 800));
+  EXPECT_TRUE(CumulativeEnergy({}, {}).empty());
+}
+
+TEST(DerivedChannelsTest, IncrementalDistance) {
+  EXPECT_THAT(IncrementalDistance({5, 12, kNaN, 20, 20}),
+              ElementsAre(5, 7, IsNan(), 8, 0));
+}
+
+TEST(DerivedChannelsTest, TotalDistance) {
+  EXPECT_THAT(TotalDistanceFromIncrements({5, 7, kNaN, 8, 0}),
+              ElementsAre(5, 12, 12, 20, 20));
+  EXPECT_THAT(TotalDistanceFromSpeed({0, 1, 3, 4}, {10, 10, 5, kNaN}),
+              ElementsAre(0, 10, 20, 20));
+}
+
+TEST(DerivedChannelsTest, Grade) {
+  const std::vector<double> distance = {0, 10, 20, 30, 40, 40.5, kNaN, 50};
+  const std::vector<double> altitude = {100, 101, 102, 103, 103, 103, 104, 102};
+  EXPECT_THAT(Grade(distance, altitude, 20),
+              ElementsAre(IsNan(), DoubleEq(0.1), DoubleEq(0.1), DoubleEq(0.1),
+                          DoubleEq(0.05), DoubleEq(1 / 20.5), IsNan(),
+                          DoubleEq(-0.05)));
+  // Samples that have not moved far enough have no grade.
+  EXPECT_THAT(Grade({0, 0.5}, {100, 101}, 20), ElementsAre(IsNan(), IsNan()));
+}
+
+}  // namespace
+}  // namespace derived_channels
+}  // namespace cycling
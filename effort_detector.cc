@@ -0,0 +1,148 @@
+#include "effort_detector.h"
+
+#include <algorithm>
+
+#include "parallel.h"
+
+namespace cycling {
+
+namespace {
+
+using TimePoint = Effort::TimePoint;
+using Duration = EffortOptions::Duration;
+
+struct Point {
+  TimePoint time;
+  double value;
+  double heart_rate;
+};
+
+// Extracts every sample that has a value of the requested type. heart_rate is
+// negative when the sample has none.
+std::vector<Point> ExtractPoints(const TimeSeries& series,
+                                 const Measurement::Type type) {
+  std::vector<Point> points;
+  if (series.num_samples() == 0) return points;
+  points.reserve(series.num_samples());
+  const TimePoint begin = series.BeginTime();
+  const TimePoint end = series.EndTime();
+  series.PrepareVisit();
+  series.Visit(begin, end, [&points, type](const TimeSample& sample) {
+    if (!sample.has_value(type)) return;
+    points.push_back({sample.time(), sample.coef(type),
+                      sample.has_value(Measurement::HEART_RATE)
+                          ? sample.coef(Measurement::HEART_RATE)
+                          : -1});
+  });
+  series.FinishVisit();
+  return points;
+}
+
+// Returns the centered moving average of the points over window, computed
+// with two pointers so that it is linear regardless of the window size.
+std::vector<double> Smooth(const std::vector<Point>& points,
+                           const Duration& window) {
+  const Duration half = window / 2;
+  std::vector<double> smoothed(points.size());
+  size_t lo = 0, hi = 0;
+  double sum = 0;
+  for (size_t i = 0; i < points.size(); ++i) {
+    for (; hi < points.size() && points[hi].time <= points[i].time + half;
+         ++hi) {
+      sum += points[hi].value;
+    }
+    for (; points[lo].time < points[i].time - half; ++lo) {
+      sum -= points[lo].value;
+    }
+    smoothed[i] = sum / (hi - lo);
+  }
+  return smoothed;
+}
+
+double Percentile(std::vector<double> values, const double fraction) {
+  auto nth =
+      values.begin() + static_cast<size_t>(fraction * (values.size() - 1));
+  std::nth_element(values.begin(), nth, values.end());
+  return *nth;
+}
+
+// Summarizes the raw values of points[begin, end].
+Effort Summarize(const std::vector<Point>& points, const size_t begin,
+                 const size_t end) {
+  Effort effort = {points[begin].time, points[end].time,
+                   static_cast<int>(end - begin + 1), 0, points[begin].value,
+                   0};
+  int num_heart_rates = 0;
+  for (size_t i = begin; i <= end; ++i) {
+    effort.average += points[i].value;
+    effort.maximum = std::max(effort.maximum, points[i].value);
+    if (points[i].heart_rate >= 0) {
+      effort.average_heart_rate += points[i].heart_rate;
+      ++num_heart_rates;
+    }
+  }
+  effort.average /= effort.num_samples;
+  if (num_heart_rates > 0) effort.average_heart_rate /= num_heart_rates;
+  return effort;
+}
+
+}  // namespace
+
+std::vector<Effort> DetectEfforts(const TimeSeries& series,
+                                  const EffortOptions& options) {
+  std::vector<Effort> efforts;
+  const std::vector<Point> points = ExtractPoints(series, options.type);
+  if (points.empty()) return efforts;
+  const std::vector<double> smoothed = Smooth(points, options.smoothing_window);
+
+  const double reference = options.reference > 0
+                               ? options.reference
+                               : Percentile(smoothed, 0.9);
+  // A ride of zeros would otherwise be at the threshold all through, and come
+  // back as one effort.
+  if (reference <= 0) return efforts;
+  const double start_threshold = options.start_ratio * reference;
+  const double end_threshold = options.end_ratio * reference;
+  const Duration half_window = options.smoothing_window / 2;
+
+  const size_t n = points.size();
+  size_t i = 0;
+  while (i < n) {
+    for (; i < n && smoothed[i] < start_threshold; ++i) {
+    }
+    if (i == n) break;
+    size_t begin = i;
+    for (; i < n && smoothed[i] >= end_threshold; ++i) {
+    }
+    size_t end = i - 1;
+    // Smoothing blurs the edges of the effort, so move them out to the raw
+    // samples that are still above the end threshold, up to half a window.
+    const TimePoint earliest = points[begin].time - half_window;
+    while (begin > 0 && points[begin - 1].time >= earliest &&
+           points[begin - 1].value >= end_threshold &&
+           (efforts.empty() || points[begin - 1].time > efforts.back().end)) {
+      --begin;
+    }
+    const TimePoint latest = points[end].time + half_window;
+    while (end + 1 < n && points[end + 1].time <= latest &&
+           points[end + 1].value >= end_threshold) {
+      ++end;
+    }
+    i = std::max(i, end + 1);
+    if (points[end].time - points[begin].time < options.min_duration) continue;
+    efforts.push_back(Summarize(points, begin, end));
+  }
+  return efforts;
+}
+
+std::vector<std::vector<Effort>> DetectEfforts(
+    const std::vector<const TimeSeries*>& rides, const EffortOptions& options,
+    const int num_threads) {
+  std::vector<std::vector<Effort>> efforts(rides.size());
+  ParallelFor(rides.size(), num_threads, [&](const int, const size_t i) {
+    efforts[i] = DetectEfforts(*rides[i], options);
+  });
+  return efforts;
+}
+
+}  // namespace cycling
@@ -0,0 +1,69 @@
+#ifndef __EFFORT_DETECTOR_H__
+#define __EFFORT_DETECTOR_H__
+
+#include <chrono>
+#include <vector>
+
+#include "measurement.h"
+#include "time_sample.h"
+#include "time_series.h"
+
+namespace cycling {
+
+// One sustained effort found in a TimeSeries, e.g. a single interval of a
+// structured workout.
+struct Effort {
+  using TimePoint = TimeSample::TimePoint;
+
+  // The times of the first and last samples of the effort.
+  TimePoint begin;
+  TimePoint end;
+  // The number of samples of the detected measurement type in the effort.
+  int num_samples;
+  // The mean and maximum raw (unsmoothed) value of the detected measurement
+  // type, in its base unit (e.g. watts).
+  double average;
+  double maximum;
+  // The mean heart rate over the effort, or 0 if there was no heart rate data.
+  double average_heart_rate;
+};
+
+struct EffortOptions {
+  using Duration = std::chrono::system_clock::duration;
+
+  // The measurement the efforts are detected on, typically POWER or SPEED.
+  Measurement::Type type = Measurement::POWER;
+
+  // The athlete's threshold for type (e.g. FTP in watts). If not positive, it
+  // is estimated as the 90th percentile of the smoothed values of the ride,
+  // and a ride where that isn't positive either, such as one of zeros, has no
+  // efforts.
+  double reference = 0;
+  // An effort starts when the smoothed value rises to start_ratio * reference,
+  // and lasts until it drops below end_ratio * reference. The gap between the
+  // two keeps short dips from splitting an effort.
+  double start_ratio = 0.9;
+  double end_ratio = 0.8;
+
+  // Values are smoothed with a centered moving average this wide before being
+  // compared against the thresholds.
+  Duration smoothing_window = std::chrono::seconds(30);
+  // Efforts shorter than this are dropped.
+  Duration min_duration = std::chrono::seconds(30);
+};
+
+// Finds the efforts in series with a smoothed threshold-plus-hysteresis
+// detector. Runs in O(n) apart from estimating the reference, which is
+// O(n log n) worst case.
+std::vector<Effort> DetectEfforts(const TimeSeries& series,
+                                  const EffortOptions& options);
+
+// Runs DetectEfforts over every series on num_threads threads. The result at
+// index i holds the efforts of rides[i].
+std::vector<std::vector<Effort>> DetectEfforts(
+    const std::vector<const TimeSeries*>& rides, const EffortOptions& options,
+    const int num_threads);
+
+}  // namespace cycling
+
+#endif  // __EFFORT_DETECTOR_H__
@@ -0,0 +1,124 @@
+#include "effort_detector.h"
+
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "measurement.h"
+
+namespace cycling {
+namespace {
+
+using TimePoint = Effort::TimePoint;
+
+const TimePoint kStart = TimePoint() + std::chrono::hours(24 * 365 * 40);
+
+// Builds a 1 Hz ride of a warm up, num_intervals repeats of work_seconds at
+// work_watts and rest_seconds at 120 W, and a cool down. Every sample gets a
+// bit of deterministic noise.
+std::unique_ptr<TimeSeries> MakeWorkout(const int num_intervals,
+                                        const int work_seconds,
+                                        const int rest_seconds,
+                                        const double work_watts) {
+  std::unique_ptr<TimeSeries> series(new TimeSeries);
+  int t = 0;
+  auto add = [&](const int seconds, const double watts, const double bpm) {
+    for (int i = 0; i < seconds; ++i, ++t) {
+      const double noise = 15 * std::sin(t * 1.7);
+      series->Add(TimeSample(kStart + std::chrono::seconds(t))
+                      .Add(Measurement(Measurement::POWER, watts + noise))
+                      .Add(Measurement(Measurement::HEART_RATE, bpm)));
+    }
+  };
+  add(600, 120, 110);
+  for (int i = 0; i < num_intervals; ++i) {
+    add(work_seconds, work_watts, 160);
+    add(rest_seconds, 120, 120);
+  }
+  add(600, 110, 100);
+  return series;
+}
+
+TEST(EffortDetectorTest, FindsIntervals) {
+  std::unique_ptr<TimeSeries> series = MakeWorkout(5, 180, 120, 300);
+  const std::vector<Effort> efforts = DetectEfforts(*series, EffortOptions());
+  ASSERT_EQ(efforts.size(), 5);
+  for (int i = 0; i < 5; ++i) {
+    const TimePoint begin = kStart + std::chrono::seconds(600 + 300 * i);
+    EXPECT_LE(std::abs((efforts[i].begin - begin).count()),
+              std::chrono::system_clock::duration(std::chrono::seconds(3))
+                  .count());
+    EXPECT_NEAR(efforts[i].num_samples, 180, 5);
+    EXPECT_NEAR(efforts[i].average, 300, 5);
+    EXPECT_GE(efforts[i].maximum, 310);
+    EXPECT_NEAR(efforts[i].average_heart_rate, 160, 2);
+  }
+}
+
+TEST(EffortDetectorTest, AbsoluteReference) {
+  std::unique_ptr<TimeSeries> series = MakeWorkout(3, 240, 120, 250);
+  EffortOptions options;
+  // With a 400 W threshold nothing is hard enough.
+  options.reference = 400;
+  EXPECT_TRUE(DetectEfforts(*series, options).empty());
+  options.reference = 260;
+  EXPECT_EQ(DetectEfforts(*series, options).size(), 3);
+}
+
+TEST(EffortDetectorTest, ShortEffortsAreDropped) {
+  std::unique_ptr<TimeSeries> series = MakeWorkout(4, 15, 60, 400);
+  EffortOptions options;
+  options.reference = 300;
+  EXPECT_TRUE(DetectEfforts(*series, options).empty());
+  options.min_duration = std::chrono::seconds(10);
+  options.smoothing_window = std::chrono::seconds(6);
+  EXPECT_EQ(DetectEfforts(*series, options).size(), 4);
+}
+
+TEST(EffortDetectorTest, EmptyAndMissingChannel) {
+  TimeSeries empty;
+  EXPECT_TRUE(DetectEfforts(empty, EffortOptions()).empty());
+  std::unique_ptr<TimeSeries> series = MakeWorkout(2, 180, 120, 300);
+  EffortOptions options;
+  options.type = Measurement::SPEED;
+  EXPECT_TRUE(DetectEfforts(*series, options).empty());
+}
+
+TEST(EffortDetectorTest, ZeroRide) {
+  TimeSeries series;
+  for (int t = 0; t < 1200; ++t) {
+    series.Add(TimeSample(kStart + std::chrono::seconds(t))
+                   .Add(Measurement(Measurement::POWER, 0)));
+  }
+  EXPECT_TRUE(DetectEfforts(series, EffortOptions()).empty());
+}
+
+TEST(EffortDetectorTest, Batch) {
+  std::vector<std::unique_ptr<TimeSeries>> rides;
+  std::vector<const TimeSeries*> pointers;
+  for (int i = 1; i <= 8; ++i) {
+    rides.push_back(MakeWorkout(i, 120 + 10 * i, 90, 280));
+    pointers.push_back(rides.back().get());
+  }
+  const std::vector<std::vector<Effort>> efforts =
+      DetectEfforts(pointers, EffortOptions(), 4);
+  ASSERT_EQ(efforts.size(), rides.size());
+  for (size_t i = 0; i < rides.size(); ++i) {
+    const std::vector<Effort> expected =
+        DetectEfforts(*rides[i], EffortOptions());
+    ASSERT_EQ(efforts[i].size(), i + 1);
+    ASSERT_EQ(efforts[i].size(), expected.size());
+    for (size_t j = 0; j < expected.size(); ++j) {
+      EXPECT_EQ(efforts[i][j].begin, expected[j].begin);
+      EXPECT_EQ(efforts[i][j].end, expected[j].end);
+      EXPECT_EQ(efforts[i][j].average, expected[j].average);
+    }
+  }
+}
+
+}  // namespace
+}  // namespace cycling
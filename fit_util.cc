@@ -0,0 +1,612 @@
+#include "fit_util.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <utility>
+
+#include "mapped_file.h"
+#include "measurement.h"
+#include "str_util.h"
+
+namespace cycling {
+
+namespace {
+
+const char kDataType[] = ".FIT";
+const size_t kMinHeaderSize = 12;
+const size_t kCrcSize = 2;
+// Seconds from the Unix epoch to the FIT one, 1989-12-31T00:00:00Z.
+const int64_t kFitEpoch = 631065600;
+const int kNumLocalMessages = 16;
+
+// Record header bits.
+const uint8_t kCompressedTimestampHeader = 0x80;
+const uint8_t kDefinitionMessage = 0x40;
+const uint8_t kDeveloperData = 0x20;
+const uint8_t kLocalMessageMask = 0x0f;
+
+// The global message numbers that are decoded.
+const uint16_t kSessionMessage = 18;
+const uint16_t kLapMessage = 19;
+const uint16_t kRecordMessage = 20;
+const uint16_t kFieldDescriptionMessage = 206;
+
+// Every message can have a timestamp, which compressed timestamps count from.
+const uint8_t kTimestampField = 253;
+
+// The base types, by their number: the low 5 bits of the base type byte.
+enum BaseType : uint8_t {
+  ENUM = 0,
+  SINT8,
+  UINT8,
+  SINT16,
+  UINT16,
+  SINT32,
+  UINT32,
+  STRING,
+  FLOAT32,
+  FLOAT64,
+  UINT8Z,
+  UINT16Z,
+  UINT32Z,
+  BYTE,
+  SINT64,
+  UINT64,
+  UINT64Z,
+
+  NUM_BASE_TYPES,
+};
+
+const uint8_t kBaseTypeSizes[NUM_BASE_TYPES] = {1, 1, 1, 2, 2, 4, 4, 1, 4,
+                                                8, 1, 2, 4, 1, 8, 8, 8};
+
+// Where the value of a field goes while its message is decoded.
+enum Slot : uint8_t {
+  TIMESTAMP = 0,
+  // record
+  LATITUDE,
+  LONGITUDE,
+  ALTITUDE,
+  ENHANCED_ALTITUDE,
+  HEART_RATE,
+  CADENCE,
+  DISTANCE,
+  SPEED,
+  ENHANCED_SPEED,
+  POWER,
+  // lap and session
+  START_TIME,
+  TOTAL_ELAPSED_TIME,
+  TOTAL_TIMER_TIME,
+  TOTAL_DISTANCE,
+  TOTAL_CALORIES,
+  // field_description
+  DEVELOPER_DATA_INDEX,
+  FIELD_DEFINITION_NUMBER,
+  FIT_BASE_TYPE_ID,
+  SCALE,
+  OFFSET,
+  NATIVE_MESG_NUM,
+  NATIVE_FIELD_NUM,
+
+  NUM_SLOTS,
+};
+
+// A field of a global message that is decoded, and how: the value is
+// raw / scale - offset.
+struct KnownField {
+  uint16_t message;
+  uint8_t number;
+  Slot slot;
+  double scale;
+  double offset;
+};
+
+const double kSemicirclesPerDegree = 2147483648.0 / 180;
+
+const KnownField kKnownFields[] = {
+    {kRecordMessage, 0, LATITUDE, kSemicirclesPerDegree, 0},
+    {kRecordMessage, 1, LONGITUDE, kSemicirclesPerDegree, 0},
+    {kRecordMessage, 2, ALTITUDE, 5, 500},
+    {kRecordMessage, 3, HEART_RATE, 1, 0},
+    {kRecordMessage, 4, CADENCE, 1, 0},
+    {kRecordMessage, 5, DISTANCE, 100, 0},
+    {kRecordMessage, 6, SPEED, 1000, 0},
+    {kRecordMessage, 7, POWER, 1, 0},
+    {kRecordMessage, 73, ENHANCED_SPEED, 1000, 0},
+    {kRecordMessage, 78, ENHANCED_ALTITUDE, 5, 500},
+    {kLapMessage, 2, START_TIME, 1, 0},
+    {kLapMessage, 7, TOTAL_ELAPSED_TIME, 1000, 0},
+    {kLapMessage, 8, TOTAL_TIMER_TIME, 1000, 0},
+    {kLapMessage, 9, TOTAL_DISTANCE, 100, 0},
+    {kLapMessage, 11, TOTAL_CALORIES, 1, 0},
+    {kSessionMessage, 2, START_TIME, 1, 0},
+    {kSessionMessage, 7, TOTAL_ELAPSED_TIME, 1000, 0},
+    {kSessionMessage, 8, TOTAL_TIMER_TIME, 1000, 0},
+    {kSessionMessage, 9, TOTAL_DISTANCE, 100, 0},
+    {kSessionMessage, 11, TOTAL_CALORIES, 1, 0},
+    {kFieldDescriptionMessage, 0, DEVELOPER_DATA_INDEX, 1, 0},
+    {kFieldDescriptionMessage, 1, FIELD_DEFINITION_NUMBER, 1, 0},
+    {kFieldDescriptionMessage, 2, FIT_BASE_TYPE_ID, 1, 0},
+    {kFieldDescriptionMessage, 6, SCALE, 1, 0},
+    {kFieldDescriptionMessage, 7, OFFSET, 1, 0},
+    {kFieldDescriptionMessage, 14, NATIVE_MESG_NUM, 1, 0},
+    {kFieldDescriptionMessage, 15, NATIVE_FIELD_NUM, 1, 0},
+};
+
+// The timestamp field, which is decoded whatever the message, so that
+// compressed timestamps count from the last timestamp of any message.
+const KnownField kTimestamp = {0, kTimestampField, TIMESTAMP, 1, 0};
+
+const KnownField* FindKnownField(const uint16_t message, const uint8_t number) {
+  if (number == kTimestampField) return &kTimestamp;
+  for (const KnownField& field : kKnownFields) {
+    if (field.message == message && field.number == number) return &field;
+  }
+  return nullptr;
+}
+
+// The record fields that go into the series.
+const std::pair<Slot, Measurement::Type> kRecordMeasurements[] = {
+    {LATITUDE, Measurement::DEGREES_LATITUDE},
+    {LONGITUDE, Measurement::DEGREES_LONGITUDE},
+    {ALTITUDE, Measurement::ALTITUDE},
+    {HEART_RATE, Measurement::HEART_RATE},
+    {CADENCE, Measurement::CADENCE},
+    {DISTANCE, Measurement::TOTAL_DISTANCE},
+    {SPEED, Measurement::SPEED},
+    {POWER, Measurement::POWER},
+};
+
+uint16_t Crc(uint16_t crc, const uint8_t* data, const size_t size) {
+  static const uint16_t kTable[16] = {
+      0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+      0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400};
+  for (size_t i = 0; i < size; ++i) {
+    uint16_t tmp = kTable[crc & 0xf];
+    crc = (crc >> 4) & 0x0fff;
+    crc = crc ^ tmp ^ kTable[data[i] & 0xf];
+    tmp = kTable[crc & 0xf];
+    crc = (crc >> 4) & 0x0fff;
+    crc = crc ^ tmp ^ kTable[(data[i] >> 4) & 0xf];
+  }
+  return crc;
+}
+
+uint64_t ReadUnsigned(const uint8_t* p, const int size, const bool big_endian) {
+  uint64_t value = 0;
+  for (int i = 0; i < size; ++i) {
+    value |= static_cast<uint64_t>(p[big_endian ? size - 1 - i : i]) << 8 * i;
+  }
+  return value;
+}
+
+// Reads the field of the given base type at p into value. Returns false if
+// the field holds its type's invalid value, or isn't a number.
+bool ReadValue(const uint8_t* p, const BaseType type, const bool big_endian,
+               double* value) {
+  const uint64_t raw = ReadUnsigned(p, kBaseTypeSizes[type], big_endian);
+  switch (type) {
+    case ENUM:
+    case UINT8:
+    case BYTE:
+      if (raw == 0xff) return false;
+      *value = raw;
+      return true;
+    case SINT8:
+      if (raw == 0x7f) return false;
+      *value = static_cast<int8_t>(raw);
+      return true;
+    case UINT16:
+      if (raw == 0xffff) return false;
+      *value = raw;
+      return true;
+    case SINT16:
+      if (raw == 0x7fff) return false;
+      *value = static_cast<int16_t>(raw);
+      return true;
+    case UINT32:
+      if (raw == 0xffffffff) return false;
+      *value = raw;
+      return true;
+    case SINT32:
+      if (raw == 0x7fffffff) return false;
+      *value = static_cast<int32_t>(raw);
+      return true;
+    case UINT64:
+      if (raw == ~uint64_t(0)) return false;
+      *value = raw;
+      return true;
+    case SINT64:
+      if (raw == std::numeric_limits<int64_t>::max()) return false;
+      *value = static_cast<int64_t>(raw);
+      return true;
+    case UINT8Z:
+    case UINT16Z:
+    case UINT32Z:
+    case UINT64Z:
+      if (raw == 0) return false;
+      *value = raw;
+      return true;
+    case FLOAT32: {
+      if (raw == 0xffffffff) return false;
+      const uint32_t bits = raw;
+      float f;
+      memcpy(&f, &bits, sizeof(f));
+      *value = f;
+      return std::isfinite(*value);
+    }
+    case FLOAT64:
+      if (raw == ~uint64_t(0)) return false;
+      memcpy(value, &raw, sizeof(*value));
+      return std::isfinite(*value);
+    case STRING:
+    case NUM_BASE_TYPES:
+      break;
+  }
+  return false;
+}
+
+TimeSample::TimePoint FitTime(const double timestamp) {
+  return TimeSample::TimePoint(
+      std::chrono::seconds(kFitEpoch + static_cast<int64_t>(timestamp)));
+}
+
+// Decodes one file, or a chain of them, keeping the state the records of a
+// file depend on.
+class FitDecoder {
+ public:
+  explicit FitDecoder(FitActivity* activity) : activity_(activity) {}
+
+  Status Decode(const uint8_t* data, const size_t size);
+
+ private:
+  // A field of a local message that is decoded. Every other field is skipped.
+  struct Field {
+    uint16_t offset;
+    BaseType type;
+    Slot slot;
+    double scale;
+    double offset_value;
+  };
+
+  struct Definition {
+    bool defined = false;
+    bool big_endian = false;
+    uint16_t message = 0;
+    // Of the whole message, fields that are skipped included.
+    size_t size = 0;
+    std::vector<Field> fields;
+  };
+
+  // A developer field, as its field_description message described it.
+  struct DeveloperField {
+    uint8_t developer_data_index;
+    uint8_t number;
+    BaseType type;
+    double scale;
+    double offset;
+    // The record field this field is the same as, or nullptr.
+    const KnownField* native;
+  };
+
+  Status DecodeFile(const uint8_t* file, const size_t size, size_t* used);
+  Status DecodeDefinition(const uint8_t header, const uint8_t* p,
+                          const uint8_t* end, size_t* used);
+  Status DecodeData(const Definition& definition, const uint8_t* p);
+  Status AddRecord();
+  void AddLap(std::vector<FitLap>* laps) const;
+  void AddDeveloperField();
+  void Flush();
+
+  bool has(const Slot slot) const { return (has_ >> slot) & 1; }
+
+  FitActivity* const activity_;
+  Definition definitions_[kNumLocalMessages];
+  std::vector<DeveloperField> developer_fields_;
+  // The last timestamp of any message, that compressed timestamps count from.
+  bool has_timestamp_ = false;
+  uint32_t last_timestamp_ = 0;
+  // The fields of the message being decoded.
+  uint32_t has_ = 0;
+  double values_[NUM_SLOTS];
+  // Records for the same time are merged into one sample.
+  std::vector<TimeSample> samples_;
+};
+
+Status FitDecoder::Decode(const uint8_t* data, const size_t size) {
+  size_t position = 0;
+  do {
+    size_t used = 0;
+    const Status status = DecodeFile(data + position, size - position, &used);
+    if (!status.ok()) {
+      return Status::FailureStatus(
+          StrCat("FIT file at byte ", position, ": ", status.error_message()));
+    }
+    position += used;
+  } while (position < size);
+  Flush();
+  return Status::OkStatus();
+}
+
+Status FitDecoder::DecodeFile(const uint8_t* file, const size_t size,
+                              size_t* used) {
+  if (size < kMinHeaderSize) return Status::FailureStatus("Truncated header.");
+  const size_t header_size = file[0];
+  if (header_size < kMinHeaderSize || header_size > size) {
+    return Status::FailureStatus("Bad header size.");
+  }
+  if (memcmp(file + 8, kDataType, 4) != 0) {
+    return Status::FailureStatus("Not a FIT file.");
+  }
+  if (header_size >= kMinHeaderSize + kCrcSize) {
+    const uint16_t header_crc = ReadUnsigned(file + 12, 2, false);
+    if (header_crc != 0 && header_crc != Crc(0, file, 12)) {
+      return Status::FailureStatus("Bad header CRC.");
+    }
+  }
+  const size_t data_size = ReadUnsigned(file + 4, 4, false);
+  if (data_size + kCrcSize > size - header_size) {
+    return Status::FailureStatus("Truncated file.");
+  }
+  const uint8_t* p = file + header_size;
+  const uint8_t* const end = p + data_size;
+  if (ReadUnsigned(end, 2, false) != Crc(0, file, end - file)) {
+    return Status::FailureStatus("Bad CRC.");
+  }
+  *used = end + kCrcSize - file;
+
+  // Local message types only hold within a file.
+  for (Definition& definition : definitions_) definition.defined = false;
+  const uint8_t* first_record = nullptr;
+  size_t first_sample = 0;
+  while (p < end) {
+    const uint8_t header = *p;
+    size_t record_size = 0;
+    if (!(header & kCompressedTimestampHeader) &&
+        (header & kDefinitionMessage)) {
+      RETURN_IF_ERROR(DecodeDefinition(header, p + 1, end, &record_size));
+    } else {
+      const bool compressed = header & kCompressedTimestampHeader;
+      const Definition& definition =
+          definitions_[compressed ? (header >> 5) & 0x3
+                                  : header & kLocalMessageMask];
+      if (!definition.defined) {
+        return Status::FailureStatus(
+            StrCat("Undefined local message at byte ", p - file, "."));
+      }
+      if (definition.size > static_cast<size_t>(end - p - 1)) {
+        return Status::FailureStatus("Truncated message.");
+      }
+      RETURN_IF_ERROR(DecodeData(definition, p + 1));
+      if (compressed) {
+        if (!has_timestamp_) {
+          return Status::FailureStatus(
+              "Compressed timestamp before any timestamp.");
+        }
+        const uint32_t offset = header & 0x1f;
+        last_timestamp_ += (offset - last_timestamp_) & 0x1f;
+        values_[TIMESTAMP] = last_timestamp_;
+        has_ |= 1 << TIMESTAMP;
+      }
+      switch (definition.message) {
+        case kRecordMessage:
+          if (first_record == nullptr) {
+            first_record = p;
+            first_sample = samples_.size();
+          }
+          // Records make up most of a file, so the rest of it holds about as
+          // many more samples as the bytes so far took per sample, or as
+          // records like this one would fit before there are any. Growing
+          // the samples one at a time would copy each of them over and over.
+          if (samples_.size() == samples_.capacity()) {
+            const size_t num_samples = samples_.size() - first_sample;
+            const size_t bytes_per_sample =
+                num_samples == 0
+                    ? 1 + definition.size
+                    : std::max<size_t>(1, (p - first_record) / num_samples);
+            samples_.reserve(samples_.size() + 1 +
+                             (end - p) / bytes_per_sample);
+          }
+          RETURN_IF_ERROR(AddRecord());
+          break;
+        case kLapMessage:
+          AddLap(&activity_->laps);
+          break;
+        case kSessionMessage:
+          AddLap(&activity_->sessions);
+          break;
+        case kFieldDescriptionMessage:
+          AddDeveloperField();
+          break;
+      }
+      record_size = definition.size;
+    }
+    p += 1 + record_size;
+  }
+  return Status::OkStatus();
+}
+
+Status FitDecoder::DecodeDefinition(const uint8_t header, const uint8_t* p,
+                                    const uint8_t* end, size_t* used) {
+  const uint8_t* const begin = p;
+  // Reserved byte, architecture, global message number, number of fields.
+  if (end - p < 5) return Status::FailureStatus("Truncated definition.");
+  Definition& definition = definitions_[header & kLocalMessageMask];
+  definition.defined = true;
+  definition.big_endian = p[1] == 1;
+  definition.message = ReadUnsigned(p + 2, 2, definition.big_endian);
+  definition.size = 0;
+  definition.fields.clear();
+  const int num_fields = p[4];
+  p += 5;
+  if (end - p < 3 * num_fields) {
+    return Status::FailureStatus("Truncated definition.");
+  }
+  for (int i = 0; i < num_fields; ++i, p += 3) {
+    const uint8_t size = p[1];
+    const BaseType type = static_cast<BaseType>(p[2] & 0x1f);
+    const KnownField* known = FindKnownField(definition.message, p[0]);
+    // Arrays, and fields of an unexpected size, are skipped.
+    if (known != nullptr && type < NUM_BASE_TYPES &&
+        kBaseTypeSizes[type] == size) {
+      definition.fields.push_back({static_cast<uint16_t>(definition.size),
+                                   type, known->slot, known->scale,
+                                   known->offset});
+    }
+    definition.size += size;
+  }
+  if (header & kDeveloperData) {
+    if (end - p < 1) return Status::FailureStatus("Truncated definition.");
+    const int num_developer_fields = *p++;
+    if (end - p < 3 * num_developer_fields) {
+      return Status::FailureStatus("Truncated definition.");
+    }
+    for (int i = 0; i < num_developer_fields; ++i, p += 3) {
+      const uint8_t size = p[1];
+      for (const DeveloperField& field : developer_fields_) {
+        if (field.number == p[0] && field.developer_data_index == p[2] &&
+            field.native != nullptr &&
+            field.native->message == definition.message &&
+            kBaseTypeSizes[field.type] == size) {
+          definition.fields.push_back({static_cast<uint16_t>(definition.size),
+                                       field.type, field.native->slot,
+                                       field.scale, field.offset});
+          break;
+        }
+      }
+      definition.size += size;
+    }
+  }
+  *used = p - begin;
+  return Status::OkStatus();
+}
+
+Status FitDecoder::DecodeData(const Definition& definition, const uint8_t* p) {
+  has_ = 0;
+  for (const Field& field : definition.fields) {
+    double value;
+    if (!ReadValue(p + field.offset, field.type, definition.big_endian,
+                   &value)) {
+      continue;
+    }
+    values_[field.slot] = value / field.scale - field.offset_value;
+    has_ |= 1 << field.slot;
+  }
+  if (has(TIMESTAMP)) {
+    has_timestamp_ = true;
+    last_timestamp_ = static_cast<uint32_t>(values_[TIMESTAMP]);
+  }
+  return Status::OkStatus();
+}
+
+Status FitDecoder::AddRecord() {
+  if (!has(TIMESTAMP)) return Status::FailureStatus("Record without a time.");
+  if (has(ENHANCED_ALTITUDE)) {
+    values_[ALTITUDE] = values_[ENHANCED_ALTITUDE];
+    has_ |= 1 << ALTITUDE;
+  }
+  if (has(ENHANCED_SPEED)) {
+    values_[SPEED] = values_[ENHANCED_SPEED];
+    has_ |= 1 << SPEED;
+  }
+  const TimeSample::TimePoint time = FitTime(values_[TIMESTAMP]);
+  if (samples_.empty() || samples_.back().time() < time) {
+    samples_.emplace_back(time);
+  } else if (samples_.back().time() > time) {
+    return Status::FailureStatus("Records go back in time.");
+  }
+  TimeSample& sample = samples_.back();
+  for (const auto& slot_and_type : kRecordMeasurements) {
+    if (has(slot_and_type.first)) {
+      sample.Add(slot_and_type.second, values_[slot_and_type.first]);
+    }
+  }
+  return Status::OkStatus();
+}
+
+void FitDecoder::AddLap(std::vector<FitLap>* laps) const {
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  FitLap lap;
+  lap.start_time = has(START_TIME) ? FitTime(values_[START_TIME])
+                                   : TimeSample::TimePoint();
+  lap.end_time = has(TIMESTAMP) ? FitTime(values_[TIMESTAMP])
+                                : TimeSample::TimePoint();
+  lap.total_elapsed_seconds =
+      has(TOTAL_ELAPSED_TIME) ? values_[TOTAL_ELAPSED_TIME] : nan;
+  lap.total_timer_seconds =
+      has(TOTAL_TIMER_TIME) ? values_[TOTAL_TIMER_TIME] : nan;
+  lap.total_distance_meters =
+      has(TOTAL_DISTANCE) ? values_[TOTAL_DISTANCE] : nan;
+  lap.total_kilocalories = has(TOTAL_CALORIES) ? values_[TOTAL_CALORIES] : nan;
+  laps->push_back(lap);
+}
+
+void FitDecoder::AddDeveloperField() {
+  if (!has(DEVELOPER_DATA_INDEX) || !has(FIELD_DEFINITION_NUMBER) ||
+      !has(FIT_BASE_TYPE_ID)) {
+    return;
+  }
+  DeveloperField field;
+  field.developer_data_index = values_[DEVELOPER_DATA_INDEX];
+  field.number = values_[FIELD_DEFINITION_NUMBER];
+  field.type = static_cast<BaseType>(
+      static_cast<uint8_t>(values_[FIT_BASE_TYPE_ID]) & 0x1f);
+  if (field.type >= NUM_BASE_TYPES) return;
+  field.scale = has(SCALE) && values_[SCALE] != 0 ? values_[SCALE] : 1;
+  field.offset = has(OFFSET) ? values_[OFFSET] : 0;
+  field.native =
+      has(NATIVE_FIELD_NUM)
+          ? FindKnownField(has(NATIVE_MESG_NUM) ? values_[NATIVE_MESG_NUM]
+                                                : kRecordMessage,
+                           values_[NATIVE_FIELD_NUM])
+          : nullptr;
+  // A later description of the same field replaces the earlier one.
+  for (DeveloperField& existing : developer_fields_) {
+    if (existing.developer_data_index == field.developer_data_index &&
+        existing.number == field.number) {
+      existing = field;
+      return;
+    }
+  }
+  developer_fields_.push_back(field);
+}
+
+void FitDecoder::Flush() {
+  if (samples_.empty()) return;
+  activity_->series.Add(std::move(samples_));
+  samples_.clear();
+}
+
+}  // namespace
+
+Status ParseFit(const char* data, const size_t size, FitActivity* activity) {
+  FitDecoder decoder(activity);
+  return decoder.Decode(reinterpret_cast<const uint8_t*>(data), size);
+}
+
+Status ParseFitFile(const std::string& path, FitActivity* activity) {
+  const std::unique_ptr<MappedFile> file = MappedFile::Open(path);
+  if (file == nullptr) {
+    return Status::FailureStatus(StrCat("Couldn't open ", path));
+  }
+  return ParseFit(file->data(), file->size(), activity);
+}
+
+std::unique_ptr<TimeSeries> ParseFitFile(const std::string& path) {
+  FitActivity activity;
+  const Status status = ParseFitFile(path, &activity);
+  if (!status.ok()) {
+    std::cerr << path << ": " << status << std::endl;
+    return nullptr;
+  }
+  return std::unique_ptr<TimeSeries>(
+      new TimeSeries(std::move(activity.series)));
+}
+
+}  // namespace cycling
@@ -0,0 +1,56 @@
+#ifndef __FIT_UTIL_H__
+#define __FIT_UTIL_H__
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "status.h"
+#include "time_sample.h"
+#include "time_series.h"
+
+namespace cycling {
+
+// A lap or session of a FIT activity, with the totals the device worked out
+// for it. Totals the device didn't record are NaN.
+struct FitLap {
+  TimeSample::TimePoint start_time;
+  TimeSample::TimePoint end_time;
+  double total_elapsed_seconds;
+  double total_timer_seconds;
+  double total_distance_meters;
+  double total_kilocalories;
+};
+
+struct FitActivity {
+  // One sample per point in time that records were written for, with the
+  // fields of all the records for that time.
+  TimeSeries series;
+  std::vector<FitLap> laps;
+  std::vector<FitLap> sessions;
+};
+
+// Decodes the FIT file in [data, data + size), the binary format Garmin and
+// most other devices record in, into activity. Decodes definition and data
+// messages, compressed timestamp headers, either byte order, developer fields
+// and chained files, checking every CRC, in one pass over the data.
+//
+// Records go into activity->series: latitude, longitude, altitude, heart
+// rate, cadence, total distance, speed and power, preferring the enhanced
+// fields where a device writes both. A developer field that says it is the
+// same as one of those record fields, e.g. power from a footpod, counts as
+// that field. Invalid values are left out. Laps and sessions go into
+// activity->laps and activity->sessions. Every other message is skipped.
+Status ParseFit(const char* data, const size_t size, FitActivity* activity);
+
+// Same as ParseFit, for the FIT file at path.
+Status ParseFitFile(const std::string& path, FitActivity* activity);
+
+// Converts the FIT file at path to a TimeSeries, dropping laps and sessions.
+// Prints what is wrong with the file, and returns nullptr, if it can't.
+std::unique_ptr<TimeSeries> ParseFitFile(const std::string& path);
+
+}  // namespace cycling
+
+#endif  // __FIT_UTIL_H__
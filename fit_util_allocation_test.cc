@@ -0,0 +1,117 @@
+// Checks that decoding a FIT file allocates a fixed amount of memory, rather
+// than some for every record. Counting allocations means replacing the global
+// operator new, hence a test of its own.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include "fit_util.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+std::atomic<int64_t> num_allocations(0);
+
+}  // namespace
+
+void* operator new(const size_t size) {
+  ++num_allocations;
+  void* p = std::malloc(size == 0 ? 1 : size);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+namespace cycling {
+namespace {
+
+uint16_t Crc(const std::string& data) {
+  static const uint16_t kTable[16] = {
+      0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+      0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400};
+  uint16_t crc = 0;
+  for (const char c : data) {
+    const uint8_t byte = c;
+    for (const uint8_t nibble : {byte & 0xf, byte >> 4}) {
+      const uint16_t tmp = kTable[crc & 0xf];
+      crc = ((crc >> 4) & 0x0fff) ^ tmp ^ kTable[nibble];
+    }
+  }
+  return crc;
+}
+
+void AppendLittleEndian(const uint64_t value, const int size,
+                        std::string* out) {
+  for (int i = 0; i < size; ++i) out->push_back((value >> 8 * i) & 0xff);
+}
+
+// A FIT file of n records with a position, heart rate and power, one a
+// second, every tenth with a full timestamp and the others compressed.
+std::string Ride(const int n) {
+  const uint32_t start = 800000000;
+  std::string data;
+  // Local message 0 is a record with a timestamp, local message 1 one
+  // without, for compressed timestamp headers.
+  for (const int local : {0, 1}) {
+    data += {static_cast<char>(0x40 | local), 0, 0, 20, 0,
+             static_cast<char>(5 - local)};
+    if (local == 0) {
+      data += {static_cast<char>(253), 4, static_cast<char>(0x86)};
+    }
+    data += {0, 4, static_cast<char>(0x85), 1, 4, static_cast<char>(0x85), 3,
+             1, 2, 7, 2, static_cast<char>(0x84)};
+  }
+  for (int i = 0; i < n; ++i) {
+    const uint32_t time = start + i;
+    if (i % 10 == 0) {
+      data.push_back(0);
+      AppendLittleEndian(time, 4, &data);
+    } else {
+      data.push_back(static_cast<char>(0x80 | 1 << 5 | (time & 0x1f)));
+    }
+    AppendLittleEndian(1 << 29, 4, &data);
+    AppendLittleEndian(1 << 28, 4, &data);
+    AppendLittleEndian(120 + i % 50, 1, &data);
+    AppendLittleEndian(150 + i % 200, 2, &data);
+  }
+  std::string file;
+  file.push_back(14);
+  file.push_back(0x20);
+  AppendLittleEndian(2132, 2, &file);
+  AppendLittleEndian(data.size(), 4, &file);
+  file += ".FIT";
+  AppendLittleEndian(Crc(file), 2, &file);
+  file += data;
+  AppendLittleEndian(Crc(file), 2, &file);
+  return file;
+}
+
+// The number of allocations it takes to decode a ride of n records.
+int64_t CountAllocations(const int n) {
+  const std::string ride = Ride(n);
+  FitActivity activity;
+  const int64_t before = num_allocations;
+  const Status status = ParseFit(ride.data(), ride.size(), &activity);
+  const int64_t after = num_allocations;
+  EXPECT_TRUE(status.ok()) << status;
+  EXPECT_EQ(activity.series.num_samples(), n);
+  return after - before;
+}
+
+TEST(FitUtilAllocationTest, NoAllocationsPerRecord) {
+  const int kNumRecords = 5000;
+  const int64_t once = CountAllocations(kNumRecords);
+  const int64_t twice = CountAllocations(2 * kNumRecords);
+  // The samples are allocated at once, for as many records as the rest of
+  // the file can hold.
+  EXPECT_EQ(twice, once);
+  EXPECT_LT(once, 10);
+}
+
+}  // namespace
+}  // namespace cycling
@@ -0,0 +1,430 @@
+#include "fit_util.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "measurement.h"
+#include "tcx_util.h"
+
+namespace cycling {
+namespace {
+
+const char kFenix3OutdoorRide[] = "fenix3_outdoor_ride.tcx";
+
+// Seconds from the Unix epoch to the FIT one.
+const int64_t kFitEpoch = 631065600;
+
+// Base types.
+const uint8_t kEnum = 0x00;
+const uint8_t kUint8 = 0x02;
+const uint8_t kUint16 = 0x84;
+const uint8_t kSint32 = 0x85;
+const uint8_t kUint32 = 0x86;
+const uint8_t kString = 0x07;
+const uint8_t kFloat32 = 0x88;
+
+// Messages.
+const uint16_t kSession = 18;
+const uint16_t kLap = 19;
+const uint16_t kRecord = 20;
+const uint16_t kEvent = 21;
+const uint16_t kDeveloperDataId = 207;
+const uint16_t kFieldDescription = 206;
+
+struct FieldDefinition {
+  uint8_t number;
+  uint8_t size;
+  uint8_t base_type;
+};
+
+uint16_t Crc(const std::string& data) {
+  static const uint16_t kTable[16] = {
+      0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+      0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400};
+  uint16_t crc = 0;
+  for (const char c : data) {
+    const uint8_t byte = c;
+    for (const uint8_t nibble : {byte & 0xf, byte >> 4}) {
+      const uint16_t tmp = kTable[crc & 0xf];
+      crc = ((crc >> 4) & 0x0fff) ^ tmp ^ kTable[nibble];
+    }
+  }
+  return crc;
+}
+
+void AppendLittleEndian(const uint64_t value, const int size,
+                        std::string* out) {
+  for (int i = 0; i < size; ++i) out->push_back((value >> 8 * i) & 0xff);
+}
+
+// Writes FIT files a message at a time.
+class FitWriter {
+ public:
+  void Define(const int local, const uint16_t message,
+              const std::vector<FieldDefinition>& fields,
+              const bool big_endian = false,
+              const std::vector<FieldDefinition>& developer_fields = {}) {
+    data_.push_back(0x40 | (developer_fields.empty() ? 0 : 0x20) | local);
+    data_.push_back(0);
+    data_.push_back(big_endian ? 1 : 0);
+    if (big_endian) {
+      data_.push_back(message >> 8);
+      data_.push_back(message & 0xff);
+    } else {
+      AppendLittleEndian(message, 2, &data_);
+    }
+    data_.push_back(fields.size());
+    Local& definition = locals_[local];
+    definition.big_endian = big_endian;
+    definition.sizes.clear();
+    for (const FieldDefinition& field : fields) {
+      data_ += {static_cast<char>(field.number), static_cast<char>(field.size),
+                static_cast<char>(field.base_type)};
+      definition.sizes.push_back(field.size);
+    }
+    if (!developer_fields.empty()) {
+      data_.push_back(developer_fields.size());
+      for (const FieldDefinition& field : developer_fields) {
+        // The developer data index goes where the base type would.
+        data_ += {static_cast<char>(field.number),
+                  static_cast<char>(field.size),
+                  static_cast<char>(field.base_type)};
+        definition.sizes.push_back(field.size);
+      }
+    }
+  }
+
+  // Writes a data message with one value per field of local, in order.
+  void Data(const int local, const std::vector<uint64_t>& values) {
+    data_.push_back(local);
+    Values(local, values);
+  }
+
+  // Same as Data, with a compressed timestamp header.
+  void Compressed(const int local, const int time_offset,
+                  const std::vector<uint64_t>& values) {
+    data_.push_back(0x80 | local << 5 | time_offset);
+    Values(local, values);
+  }
+
+  void Raw(const std::string& bytes) { data_ += bytes; }
+
+  // Returns the file written so far, and starts a new one.
+  std::string File() {
+    std::string file;
+    file.push_back(14);
+    file.push_back(0x20);
+    AppendLittleEndian(2132, 2, &file);
+    AppendLittleEndian(data_.size(), 4, &file);
+    file += ".FIT";
+    AppendLittleEndian(Crc(file), 2, &file);
+    file += data_;
+    AppendLittleEndian(Crc(file), 2, &file);
+    data_.clear();
+    return file;
+  }
+
+ private:
+  struct Local {
+    bool big_endian = false;
+    std::vector<int> sizes;
+  };
+
+  void Values(const int local, const std::vector<uint64_t>& values) {
+    const Local& definition = locals_[local];
+    ASSERT_EQ(values.size(), definition.sizes.size());
+    for (size_t i = 0; i < values.size(); ++i) {
+      std::string bytes;
+      AppendLittleEndian(values[i], definition.sizes[i], &bytes);
+      if (definition.big_endian) bytes.assign(bytes.rbegin(), bytes.rend());
+      data_ += bytes;
+    }
+  }
+
+  std::string data_;
+  Local locals_[16];
+};
+
+uint32_t FitTimestamp(const TimeSample::TimePoint& time) {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+             time.time_since_epoch())
+             .count() -
+         kFitEpoch;
+}
+
+TimeSample::TimePoint Time(const uint32_t timestamp) {
+  return TimeSample::TimePoint(std::chrono::seconds(kFitEpoch + timestamp));
+}
+
+uint32_t FloatBits(const float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  return bits;
+}
+
+Status Parse(const std::string& file, FitActivity* activity) {
+  return ParseFit(file.data(), file.size(), activity);
+}
+
+double Value(const TimeSeries& series, const Measurement::Type type,
+             const int index) {
+  return (*series.Values(type))[index];
+}
+
+// The start of a ride: a lap of records, the last ones with compressed
+// timestamps, from a power meter that is described as developer data.
+std::string HandcraftedRide() {
+  const uint32_t start = 800000020;
+  FitWriter writer;
+  // file_id, which is skipped.
+  writer.Define(0, 0, {{0, 1, kEnum}, {4, 4, kUint32}});
+  writer.Data(0, {4, start});
+  writer.Define(1, kDeveloperDataId, {{3, 1, kUint8}});
+  writer.Data(1, {0});
+  writer.Define(1, kFieldDescription,
+                {{0, 1, kUint8},
+                 {1, 1, kUint8},
+                 {2, 1, kUint8},
+                 {3, 8, kString},
+                 {14, 2, kUint16},
+                 {15, 1, kUint8}});
+  writer.Data(1, {0, 0, kUint16, 0x7265776f70 /* "power" */, kRecord, 7});
+  // A developer field that isn't a record field.
+  writer.Data(1, {0, 1, kFloat32, 0x6e6f6973 /* "sion" */, 0xffff, 0xff});
+  writer.Define(2, kRecord,
+                {{253, 4, kUint32},
+                 {0, 4, kSint32},
+                 {1, 4, kSint32},
+                 {2, 2, kUint16},
+                 {3, 1, kUint8},
+                 {5, 4, kUint32},
+                 {73, 4, kUint32}},
+                false, {{0, 2, 0}, {1, 4, 0}});
+  // 45 degrees north, 90 west, 100 m, at 10 m/s, 200 W.
+  writer.Data(2, {start, 1 << 29, static_cast<uint32_t>(-(1 << 30)), 3000,
+                  140, 0, 10000, 200, FloatBits(1.5)});
+  // Everything but the time is invalid.
+  writer.Data(2, {start + 1, 0x7fffffff, 0x7fffffff, 0xffff, 0xff,
+                  0xffffffff, 0xffffffff, 0xffff, 0xffffffff});
+  // An event for the same time as the next record, in big-endian.
+  writer.Define(3, kEvent, {{253, 4, kUint32}, {0, 1, kEnum}}, true);
+  writer.Data(3, {start + 2, 0});
+  // Altitude only, then heart rate for the same time.
+  writer.Define(0, kRecord, {{2, 2, kUint16}}, true);
+  writer.Compressed(0, (start + 2) & 0x1f, {2750});
+  writer.Define(1, kRecord, {{3, 1, kUint8}});
+  writer.Compressed(1, (start + 2) & 0x1f, {150});
+  // 28 seconds later, past the next roll over of the 5 bit offset.
+  writer.Compressed(1, (start + 30) & 0x1f, {155});
+  writer.Define(2, kLap,
+                {{253, 4, kUint32},
+                 {2, 4, kUint32},
+                 {7, 4, kUint32},
+                 {8, 4, kUint32},
+                 {9, 4, kUint32},
+                 {11, 2, kUint16}});
+  writer.Data(2, {start + 42, start, 42000, 41500, 8012, 0xffff});
+  writer.Define(3, kSession, {{253, 4, kUint32}, {2, 4, kUint32}});
+  writer.Data(3, {start + 42, start});
+  return writer.File();
+}
+
+TEST(FitUtilTest, ParseHandcraftedRide) {
+  const uint32_t start = 800000020;
+  FitActivity activity;
+  ASSERT_TRUE(Parse(HandcraftedRide(), &activity).ok());
+  const TimeSeries& series = activity.series;
+  ASSERT_EQ(series.num_samples(), 4);
+  EXPECT_EQ(series.SampleTime(0), Time(start));
+  EXPECT_EQ(series.SampleTime(1), Time(start + 1));
+  EXPECT_EQ(series.SampleTime(2), Time(start + 2));
+  EXPECT_EQ(series.SampleTime(3), Time(start + 30));
+
+  EXPECT_DOUBLE_EQ(Value(series, Measurement::DEGREES_LATITUDE, 0), 45);
+  EXPECT_DOUBLE_EQ(Value(series, Measurement::DEGREES_LONGITUDE, 0), -90);
+  EXPECT_DOUBLE_EQ(Value(series, Measurement::ALTITUDE, 0), 100);
+  EXPECT_DOUBLE_EQ(Value(series, Measurement::HEART_RATE, 0), 140);
+  EXPECT_DOUBLE_EQ(Value(series, Measurement::TOTAL_DISTANCE, 0), 0);
+  EXPECT_DOUBLE_EQ(Value(series, Measurement::SPEED, 0), 10);
+  EXPECT_DOUBLE_EQ(Value(series, Measurement::POWER, 0), 200);
+
+  // The record with only invalid values is a sample without values.
+  EXPECT_TRUE(std::isnan(Value(series, Measurement::HEART_RATE, 1)));
+  EXPECT_TRUE(std::isnan(Value(series, Measurement::ALTITUDE, 1)));
+  // Two records for the same time make one sample.
+  EXPECT_DOUBLE_EQ(Value(series, Measurement::ALTITUDE, 2), 50);
+  EXPECT_DOUBLE_EQ(Value(series, Measurement::HEART_RATE, 2), 150);
+  EXPECT_TRUE(std::isnan(Value(series, Measurement::POWER, 2)));
+  EXPECT_DOUBLE_EQ(Value(series, Measurement::HEART_RATE, 3), 155);
+
+  ASSERT_EQ(activity.laps.size(), 1);
+  const FitLap& lap = activity.laps[0];
+  EXPECT_EQ(lap.start_time, Time(start));
+  EXPECT_EQ(lap.end_time, Time(start + 42));
+  EXPECT_DOUBLE_EQ(lap.total_elapsed_seconds, 42);
+  EXPECT_DOUBLE_EQ(lap.total_timer_seconds, 41.5);
+  EXPECT_DOUBLE_EQ(lap.total_distance_meters, 80.12);
+  EXPECT_TRUE(std::isnan(lap.total_kilocalories));
+  ASSERT_EQ(activity.sessions.size(), 1);
+  EXPECT_EQ(activity.sessions[0].end_time, Time(start + 42));
+  EXPECT_TRUE(std::isnan(activity.sessions[0].total_distance_meters));
+}
+
+TEST(FitUtilTest, ChainedFiles) {
+  FitWriter writer;
+  writer.Define(0, kRecord, {{253, 4, kUint32}, {7, 2, kUint16}});
+  writer.Data(0, {1000, 100});
+  std::string files = writer.File();
+  // Local messages have to be defined again in the next file.
+  writer.Define(0, kRecord, {{253, 4, kUint32}, {3, 1, kUint8}});
+  writer.Data(0, {1001, 120});
+  files += writer.File();
+
+  FitActivity activity;
+  ASSERT_TRUE(Parse(files, &activity).ok());
+  ASSERT_EQ(activity.series.num_samples(), 2);
+  EXPECT_DOUBLE_EQ(Value(activity.series, Measurement::POWER, 0), 100);
+  EXPECT_DOUBLE_EQ(Value(activity.series, Measurement::HEART_RATE, 1), 120);
+}
+
+TEST(FitUtilTest, CompressedTimestampsCountFromAnyMessage) {
+  FitWriter writer;
+  writer.Define(0, kRecord, {{253, 4, kUint32}, {3, 1, kUint8}});
+  writer.Data(0, {1000, 140});
+  // 40 seconds later, more than the 5 bit offset can count from the record.
+  writer.Define(1, kEvent, {{253, 4, kUint32}, {0, 1, kEnum}});
+  writer.Data(1, {1040, 0});
+  writer.Define(2, kRecord, {{3, 1, kUint8}});
+  writer.Compressed(2, 1041 & 0x1f, {150});
+
+  FitActivity activity;
+  ASSERT_TRUE(Parse(writer.File(), &activity).ok());
+  ASSERT_EQ(activity.series.num_samples(), 2);
+  EXPECT_EQ(activity.series.SampleTime(1), Time(1041));
+  EXPECT_DOUBLE_EQ(Value(activity.series, Measurement::HEART_RATE, 1), 150);
+}
+
+TEST(FitUtilTest, Errors) {
+  const std::string ride = HandcraftedRide();
+  std::vector<std::string> bad = {
+      "",
+      ride.substr(0, 10),
+      ride.substr(0, ride.size() - 1),
+  };
+  for (const size_t i : {size_t(9), size_t(20), ride.size() - 1}) {
+    std::string corrupt = ride;
+    corrupt[i] ^= 1;
+    bad.push_back(corrupt);
+  }
+  FitWriter writer;
+  writer.Data(5, {});
+  bad.push_back(writer.File());
+  writer.Define(0, kRecord, {{3, 1, kUint8}});
+  writer.Data(0, {140});
+  bad.push_back(writer.File());
+  writer.Define(0, kRecord, {{253, 4, kUint32}});
+  writer.Data(0, {1000});
+  writer.Data(0, {999});
+  bad.push_back(writer.File());
+  writer.Define(0, kRecord, {{253, 4, kUint32}});
+  writer.Raw(std::string(1, 0));
+  bad.push_back(writer.File());
+  writer.Define(0, kRecord, {{3, 1, kUint8}});
+  writer.Compressed(0, 1, {140});
+  bad.push_back(writer.File());
+
+  for (size_t i = 0; i < bad.size(); ++i) {
+    FitActivity activity;
+    EXPECT_FALSE(Parse(bad[i], &activity).ok()) << i;
+  }
+  FitActivity activity;
+  EXPECT_FALSE(ParseFitFile("no_such_file.fit", &activity).ok());
+  EXPECT_EQ(ParseFitFile("no_such_file.fit"), nullptr);
+}
+
+// Writes the records of a TCX file as FIT.
+std::string ToFit(const TimeSeries& series) {
+  const Measurement::Type kTypes[] = {
+      Measurement::DEGREES_LATITUDE, Measurement::DEGREES_LONGITUDE,
+      Measurement::ALTITUDE,         Measurement::HEART_RATE,
+      Measurement::CADENCE,          Measurement::TOTAL_DISTANCE,
+      Measurement::SPEED,            Measurement::POWER,
+  };
+  // Invalid values, scales and offsets, in the order of kTypes.
+  const uint64_t kInvalid[] = {0x7fffffff, 0x7fffffff, 0xffffffff, 0xff,
+                               0xff,       0xffffffff, 0xffffffff, 0xffff};
+  const double kScales[] = {2147483648.0 / 180, 2147483648.0 / 180, 5, 1, 1,
+                            100, 1000, 1};
+  const double kOffsets[] = {0, 0, 500, 0, 0, 0, 0, 0};
+
+  FitWriter writer;
+  writer.Define(0, kRecord,
+                {{253, 4, kUint32},
+                 {0, 4, kSint32},
+                 {1, 4, kSint32},
+                 {78, 4, kUint32},
+                 {3, 1, kUint8},
+                 {4, 1, kUint8},
+                 {5, 4, kUint32},
+                 {73, 4, kUint32},
+                 {7, 2, kUint16}});
+  for (int i = 0; i < series.num_samples(); ++i) {
+    std::vector<uint64_t> values = {FitTimestamp(series.SampleTime(i))};
+    for (int j = 0; j < 8; ++j) {
+      const double value = Value(series, kTypes[j], i);
+      values.push_back(std::isnan(value)
+                           ? kInvalid[j]
+                           : static_cast<uint64_t>(static_cast<int64_t>(
+                                 std::llround((value + kOffsets[j]) *
+                                              kScales[j]))));
+    }
+    writer.Data(0, values);
+  }
+  return writer.File();
+}
+
+TEST(FitUtilTest, SameAsTcx) {
+  const std::unique_ptr<TimeSeries> tcx = ParseTcxFile(kFenix3OutdoorRide);
+  ASSERT_NE(tcx, nullptr);
+  const std::string path =
+      ::testing::internal::TempDir() + "fit_util_test.fit";
+  std::ofstream(path, std::ios::binary) << ToFit(*tcx);
+
+  const std::unique_ptr<TimeSeries> fit = ParseFitFile(path);
+  ASSERT_NE(fit, nullptr);
+  ASSERT_EQ(fit->num_samples(), tcx->num_samples());
+  for (const auto& type_and_error : {
+           std::make_pair(Measurement::DEGREES_LATITUDE, 1e-7),
+           std::make_pair(Measurement::DEGREES_LONGITUDE, 1e-7),
+           std::make_pair(Measurement::ALTITUDE, 0.1),
+           std::make_pair(Measurement::HEART_RATE, 0.0),
+           std::make_pair(Measurement::CADENCE, 0.0),
+           std::make_pair(Measurement::TOTAL_DISTANCE, 0.005),
+           std::make_pair(Measurement::SPEED, 0.0005),
+           std::make_pair(Measurement::POWER, 0.0),
+       }) {
+    SCOPED_TRACE(type_and_error.first);
+    const TimeSeries::ColumnPtr expected = tcx->Values(type_and_error.first);
+    const TimeSeries::ColumnPtr actual = fit->Values(type_and_error.first);
+    for (int i = 0; i < tcx->num_samples(); ++i) {
+      EXPECT_EQ(fit->SampleTime(i), tcx->SampleTime(i));
+      if (std::isnan((*expected)[i])) {
+        EXPECT_TRUE(std::isnan((*actual)[i])) << i;
+      } else {
+        EXPECT_NEAR((*actual)[i], (*expected)[i], type_and_error.second)
+            << i;
+      }
+    }
+  }
+}
+
+}  // namespace
+}  // namespace cycling
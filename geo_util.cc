@@ -0,0 +1,473 @@
+#include "geo_util.h"
+
+#include <cmath>
+#include <cstddef>
+
+#include <algorithm>
+#include <limits>
+
+#include "cpu_features.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CYCLING_X86 1
+#endif
+
+namespace cycling {
+namespace geo_util {
+
+namespace {
+
+const double kNaN = std::numeric_limits<double>::quiet_NaN();
+const double kDegrees = 180 / kPi;
+
+double Haversine(const double lat1, const double lon1, const double lat2,
+                 const double lon2) {
+  const double half_dlat = (lat2 - lat1) * kRadians / 2;
+  const double half_dlon = (lon2 - lon1) * kRadians / 2;
+  const double a =
+      std::sin(half_dlat) * std::sin(half_dlat) +
+      std::cos(lat1 * kRadians) * std::cos(lat2 * kRadians) *
+          std::sin(half_dlon) * std::sin(half_dlon);
+  return 2 * kEarthRadiusMeters * std::asin(std::sqrt(std::min(1.0, a)));
+}
+
+double Equirectangular(const double lat1, const double lon1, const double lat2,
+                       const double lon2) {
+  const double dlon = WrappedDegrees(lon2 - lon1);
+  const double x = dlon * kRadians * std::cos((lat1 + lat2) / 2 * kRadians);
+  const double y = (lat2 - lat1) * kRadians;
+  return kEarthRadiusMeters * std::sqrt(x * x + y * y);
+}
+
+// Converts radians in [-pi, pi] to degrees in [0, 360).
+double NormalizedDegrees(const double radians) {
+  double degrees = radians * kDegrees;
+  if (degrees < 0) degrees += 360;
+  if (degrees >= 360) degrees -= 360;
+  return degrees;
+}
+
+// The pair kernels set out[k] to the value for positions k and k + 1, for k
+// in [0, n - 1).
+
+void PairDistancesScalar(const DistanceFormula formula, const double* lat,
+                         const double* lon, const size_t n, double* out) {
+  for (size_t k = 0; k + 1 < n; ++k) {
+    out[k] = Distance(formula, lat[k], lon[k], lat[k + 1], lon[k + 1]);
+  }
+}
+
+void PairBearingsScalar(const double* lat, const double* lon, const size_t n,
+                        double* out) {
+  for (size_t k = 0; k + 1 < n; ++k) {
+    out[k] = Bearing(lat[k], lon[k], lat[k + 1], lon[k + 1]);
+  }
+}
+
+#ifdef CYCLING_X86
+
+// The helpers for the pair kernels are always inlined, so that the vectors
+// they return stay in registers.
+
+// pi / 2 split into a part with trailing zero bits and the rest, so that
+// multiples of the first are exact.
+const double kHalfPiHigh = 1.57079632679489655800e+00;
+const double kHalfPiLow = 6.12323399573676603587e-17;
+
+// The Taylor coefficients of sin(x) / x and cos(x) in powers of x^2. Enough of
+// them to be exact to double precision for |x| <= pi / 4.
+const double kSinCoefficients[] = {
+    1.0,          -1.0 / 6,        1.0 / 120,        -1.0 / 5040,
+    1.0 / 362880, -1.0 / 39916800, 1.0 / 6227020800, -1.0 / 1307674368000,
+};
+const double kCosCoefficients[] = {
+    1.0,         -1.0 / 2,       1.0 / 24,        -1.0 / 720,
+    1.0 / 40320, -1.0 / 3628800, 1.0 / 479001600, -1.0 / 87178291200,
+    1.0 / 20922789888000,
+};
+// The Taylor coefficients of atan(x) / x in powers of x^2, good for
+// |x| <= tan(pi / 16).
+const double kAtanCoefficients[] = {
+    1.0,       -1.0 / 3,  1.0 / 5,   -1.0 / 7,  1.0 / 9,
+    -1.0 / 11, 1.0 / 13,  -1.0 / 15, 1.0 / 17,  -1.0 / 19,
+    1.0 / 21,  -1.0 / 23, 1.0 / 25,
+};
+const double kTanPiOver8 = 0.41421356237309503;
+const double kTanPiOver16 = 0.19891236737965800;
+// The Taylor coefficients of asin(x) / x in powers of x^2, good for
+// |x| <= kAsinSeriesLimit.
+const double kAsinCoefficients[] = {
+    1.0,          1.0 / 6,       3.0 / 40,         5.0 / 112,
+    35.0 / 1152,  63.0 / 2816,   231.0 / 13312,    143.0 / 10240,
+    6435.0 / 557056,
+};
+const double kAsinSeriesLimit = 0.1;
+
+template <size_t N>
+inline __attribute__((target("avx2,fma"), always_inline)) __m256d
+PolynomialAvx2(const double (&coefficients)[N], const __m256d z) {
+  __m256d sum = _mm256_set1_pd(coefficients[N - 1]);
+  for (size_t i = N - 1; i-- > 0;) {
+    sum = _mm256_fmadd_pd(sum, z, _mm256_set1_pd(coefficients[i]));
+  }
+  return sum;
+}
+
+// Sets *sin and *cos to the sine and cosine of x, for |x| up to a few pi.
+inline __attribute__((target("avx2,fma"), always_inline)) void SinCosAvx2(
+    const __m256d x, __m256d* sin, __m256d* cos) {
+  // x = quadrant * pi / 2 + r, with |r| <= pi / 4.
+  const __m256d quadrant = _mm256_round_pd(
+      _mm256_mul_pd(x, _mm256_set1_pd(2 / kPi)),
+      _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256d r = _mm256_fnmadd_pd(quadrant, _mm256_set1_pd(kHalfPiHigh), x);
+  r = _mm256_fnmadd_pd(quadrant, _mm256_set1_pd(kHalfPiLow), r);
+  const __m256d z = _mm256_mul_pd(r, r);
+  const __m256d sin_r = _mm256_mul_pd(PolynomialAvx2(kSinCoefficients, z), r);
+  const __m256d cos_r = PolynomialAvx2(kCosCoefficients, z);
+
+  // Rotate by the quadrant, taken mod 4.
+  const __m256d q = _mm256_sub_pd(
+      quadrant,
+      _mm256_mul_pd(_mm256_set1_pd(4),
+                    _mm256_floor_pd(_mm256_mul_pd(quadrant,
+                                                  _mm256_set1_pd(0.25)))));
+  const __m256d one = _mm256_set1_pd(1);
+  const __m256d two = _mm256_set1_pd(2);
+  const __m256d sign = _mm256_set1_pd(-0.0);
+  const __m256d q1 = _mm256_cmp_pd(q, one, _CMP_EQ_OQ);
+  const __m256d q2 = _mm256_cmp_pd(q, two, _CMP_EQ_OQ);
+  const __m256d q3 = _mm256_cmp_pd(q, _mm256_set1_pd(3), _CMP_EQ_OQ);
+  const __m256d odd = _mm256_or_pd(q1, q3);
+  *sin = _mm256_xor_pd(_mm256_blendv_pd(sin_r, cos_r, odd),
+                       _mm256_and_pd(_mm256_or_pd(q2, q3), sign));
+  *cos = _mm256_xor_pd(_mm256_blendv_pd(cos_r, sin_r, odd),
+                       _mm256_and_pd(_mm256_or_pd(q1, q2), sign));
+}
+
+// atan(x) for |x| <= 1. Brings x down to |x| <= tan(pi / 16) where needed,
+// using atan(x) = c + atan((x - tan(c)) / (1 + x tan(c))) with c = pi / 4 and
+// then pi / 8, and sums the Taylor series. The small angles between
+// consecutive samples skip the reduction.
+inline __attribute__((target("avx2,fma"), always_inline)) __m256d AtanAvx2(
+    const __m256d x) {
+  const __m256d sign = _mm256_set1_pd(-0.0);
+  const __m256d limit = _mm256_set1_pd(kTanPiOver16);
+  __m256d t = _mm256_andnot_pd(sign, x);
+  __m256d offset = _mm256_setzero_pd();
+  if (_mm256_movemask_pd(_mm256_cmp_pd(t, limit, _CMP_GT_OQ)) != 0) {
+    const __m256d one = _mm256_set1_pd(1);
+    const __m256d tan_pi_8 = _mm256_set1_pd(kTanPiOver8);
+    const __m256d large = _mm256_cmp_pd(t, tan_pi_8, _CMP_GT_OQ);
+    t = _mm256_blendv_pd(
+        t, _mm256_div_pd(_mm256_sub_pd(t, one), _mm256_add_pd(t, one)),
+        large);
+    offset = _mm256_and_pd(large, _mm256_set1_pd(kPi / 4));
+    // t is now in [-tan(pi / 8), tan(pi / 8)].
+    const __m256d t_sign = _mm256_and_pd(t, sign);
+    const __m256d abs_t = _mm256_andnot_pd(sign, t);
+    const __m256d medium = _mm256_cmp_pd(abs_t, limit, _CMP_GT_OQ);
+    const __m256d reduced =
+        _mm256_div_pd(_mm256_sub_pd(abs_t, tan_pi_8),
+                      _mm256_fmadd_pd(abs_t, tan_pi_8, one));
+    t = _mm256_blendv_pd(t, _mm256_xor_pd(reduced, t_sign), medium);
+    offset = _mm256_add_pd(
+        offset, _mm256_and_pd(medium, _mm256_xor_pd(_mm256_set1_pd(kPi / 8),
+                                                    t_sign)));
+  }
+  const __m256d atan_abs_x = _mm256_fmadd_pd(
+      PolynomialAvx2(kAtanCoefficients, _mm256_mul_pd(t, t)), t, offset);
+  return _mm256_xor_pd(atan_abs_x, _mm256_and_pd(x, sign));
+}
+
+// asin(x) for x in [0, 1]. Sums the Taylor series if every x is small, as
+// for the distance between consecutive samples, and otherwise uses
+// asin(x) = 2 atan(x / (1 + sqrt(1 - x^2))).
+inline __attribute__((target("avx2,fma"), always_inline)) __m256d AsinAvx2(
+    const __m256d x) {
+  const __m256d x_squared = _mm256_mul_pd(x, x);
+  if (_mm256_movemask_pd(_mm256_cmp_pd(x, _mm256_set1_pd(kAsinSeriesLimit),
+                                       _CMP_GT_OQ)) == 0) {
+    return _mm256_mul_pd(PolynomialAvx2(kAsinCoefficients, x_squared), x);
+  }
+  const __m256d one = _mm256_set1_pd(1);
+  return _mm256_mul_pd(
+      _mm256_set1_pd(2),
+      AtanAvx2(_mm256_div_pd(
+          x,
+          _mm256_add_pd(one, _mm256_sqrt_pd(_mm256_sub_pd(one, x_squared))))));
+}
+
+inline __attribute__((target("avx2,fma"), always_inline)) __m256d
+HaversineAvx2(const __m256d lat1, const __m256d lon1, const __m256d lat2,
+              const __m256d lon2) {
+  const __m256d half_radians = _mm256_set1_pd(kRadians / 2);
+  __m256d sin_half_dlat, sin_half_dlon, cos_mean_lat, unused;
+  SinCosAvx2(_mm256_mul_pd(_mm256_sub_pd(lat2, lat1), half_radians),
+             &sin_half_dlat, &unused);
+  SinCosAvx2(_mm256_mul_pd(_mm256_sub_pd(lon2, lon1), half_radians),
+             &sin_half_dlon, &unused);
+  SinCosAvx2(_mm256_mul_pd(_mm256_add_pd(lat1, lat2), half_radians), &unused,
+             &cos_mean_lat);
+  // cos(lat1) cos(lat2) = cos(mean lat)^2 - sin(dlat / 2)^2, which saves a
+  // cosine.
+  const __m256d one = _mm256_set1_pd(1);
+  const __m256d sin2_half_dlat = _mm256_mul_pd(sin_half_dlat, sin_half_dlat);
+  __m256d a = _mm256_fmadd_pd(
+      _mm256_fmsub_pd(cos_mean_lat, cos_mean_lat, sin2_half_dlat),
+      _mm256_mul_pd(sin_half_dlon, sin_half_dlon), sin2_half_dlat);
+  a = _mm256_min_pd(one, _mm256_max_pd(_mm256_setzero_pd(), a));
+  return _mm256_mul_pd(_mm256_set1_pd(2 * kEarthRadiusMeters),
+                       AsinAvx2(_mm256_sqrt_pd(a)));
+}
+
+inline __attribute__((target("avx2,fma"), always_inline)) __m256d
+EquirectangularAvx2(const __m256d lat1, const __m256d lon1, const __m256d lat2,
+                    const __m256d lon2) {
+  const __m256d radians = _mm256_set1_pd(kRadians);
+  const __m256d full_turn = _mm256_set1_pd(360);
+  __m256d dlon = _mm256_sub_pd(lon2, lon1);
+  dlon = _mm256_fnmadd_pd(
+      _mm256_round_pd(_mm256_mul_pd(dlon, _mm256_set1_pd(1.0 / 360)),
+                      _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC),
+      full_turn, dlon);
+  __m256d unused, cos_mean_lat;
+  SinCosAvx2(_mm256_mul_pd(_mm256_add_pd(lat1, lat2),
+                           _mm256_set1_pd(kRadians / 2)),
+             &unused, &cos_mean_lat);
+  const __m256d x = _mm256_mul_pd(_mm256_mul_pd(dlon, radians), cos_mean_lat);
+  const __m256d y = _mm256_mul_pd(_mm256_sub_pd(lat2, lat1), radians);
+  return _mm256_mul_pd(
+      _mm256_set1_pd(kEarthRadiusMeters),
+      _mm256_sqrt_pd(_mm256_fmadd_pd(x, x, _mm256_mul_pd(y, y))));
+}
+
+inline __attribute__((target("avx2,fma"), always_inline)) __m256d BearingAvx2(
+    const __m256d lat1, const __m256d lon1, const __m256d lat2,
+    const __m256d lon2) {
+  const __m256d radians = _mm256_set1_pd(kRadians);
+  __m256d sin_lat1, cos_lat2, sin_dlat, sin_half_dlon, cos_half_dlon, unused;
+  SinCosAvx2(_mm256_mul_pd(lat1, radians), &sin_lat1, &unused);
+  SinCosAvx2(_mm256_mul_pd(lat2, radians), &unused, &cos_lat2);
+  SinCosAvx2(_mm256_mul_pd(_mm256_sub_pd(lat2, lat1), radians), &sin_dlat,
+             &unused);
+  SinCosAvx2(_mm256_mul_pd(_mm256_sub_pd(lon2, lon1),
+                           _mm256_set1_pd(kRadians / 2)),
+             &sin_half_dlon, &cos_half_dlon);
+  const __m256d two = _mm256_set1_pd(2);
+  const __m256d y = _mm256_mul_pd(
+      _mm256_mul_pd(two, _mm256_mul_pd(sin_half_dlon, cos_half_dlon)),
+      cos_lat2);
+  // As in Bearing().
+  const __m256d x = _mm256_fmadd_pd(
+      _mm256_mul_pd(two, _mm256_mul_pd(sin_lat1, cos_lat2)),
+      _mm256_mul_pd(sin_half_dlon, sin_half_dlon), sin_dlat);
+
+  // atan2(y, x) = 2 atan(y / (r + x)) = sign(y) pi - 2 atan(y / (r - x)), by
+  // the half angle formula for tan. Use whichever keeps the argument of atan
+  // in [-1, 1].
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d r = _mm256_sqrt_pd(_mm256_fmadd_pd(x, x, _mm256_mul_pd(y, y)));
+  const __m256d positive = _mm256_cmp_pd(x, zero, _CMP_GE_OQ);
+  __m256d denominator =
+      _mm256_blendv_pd(_mm256_sub_pd(r, x), _mm256_add_pd(r, x), positive);
+  // Both points are the same, or antipodal; atan2(0, 0) is 0.
+  denominator =
+      _mm256_blendv_pd(denominator, _mm256_set1_pd(1),
+                       _mm256_cmp_pd(denominator, zero, _CMP_EQ_OQ));
+  const __m256d twice_atan = _mm256_mul_pd(
+      two, AtanAvx2(_mm256_div_pd(y, denominator)));
+  const __m256d signed_pi =
+      _mm256_or_pd(_mm256_and_pd(y, _mm256_set1_pd(-0.0)),
+                   _mm256_set1_pd(kPi));
+  const __m256d angle = _mm256_blendv_pd(
+      _mm256_sub_pd(signed_pi, twice_atan), twice_atan, positive);
+
+  const __m256d full_turn = _mm256_set1_pd(360);
+  __m256d degrees = _mm256_mul_pd(angle, _mm256_set1_pd(kDegrees));
+  degrees = _mm256_add_pd(
+      degrees,
+      _mm256_and_pd(_mm256_cmp_pd(degrees, zero, _CMP_LT_OQ), full_turn));
+  return _mm256_sub_pd(
+      degrees,
+      _mm256_and_pd(_mm256_cmp_pd(degrees, full_turn, _CMP_GE_OQ),
+                    full_turn));
+}
+
+__attribute__((target("avx2,fma"))) void PairDistancesAvx2(
+    const DistanceFormula formula, const double* lat, const double* lon,
+    const size_t n, double* out) {
+  size_t k = 0;
+  for (; k + 4 < n; k += 4) {
+    const __m256d lat1 = _mm256_loadu_pd(lat + k);
+    const __m256d lon1 = _mm256_loadu_pd(lon + k);
+    const __m256d lat2 = _mm256_loadu_pd(lat + k + 1);
+    const __m256d lon2 = _mm256_loadu_pd(lon + k + 1);
+    _mm256_storeu_pd(out + k,
+                     formula == HAVERSINE
+                         ? HaversineAvx2(lat1, lon1, lat2, lon2)
+                         : EquirectangularAvx2(lat1, lon1, lat2, lon2));
+  }
+  PairDistancesScalar(formula, lat + k, lon + k, n - k, out + k);
+}
+
+__attribute__((target("avx2,fma"))) void PairBearingsAvx2(const double* lat,
+                                                         const double* lon,
+                                                         const size_t n,
+                                                         double* out) {
+  size_t k = 0;
+  for (; k + 4 < n; k += 4) {
+    _mm256_storeu_pd(out + k, BearingAvx2(_mm256_loadu_pd(lat + k),
+                                          _mm256_loadu_pd(lon + k),
+                                          _mm256_loadu_pd(lat + k + 1),
+                                          _mm256_loadu_pd(lon + k + 1)));
+  }
+  PairBearingsScalar(lat + k, lon + k, n - k, out + k);
+}
+
+#endif  // CYCLING_X86
+
+void PairDistances(const DistanceFormula formula, const double* lat,
+                   const double* lon, const size_t n, double* out) {
+#ifdef CYCLING_X86
+  if (HasAvx2()) {
+    PairDistancesAvx2(formula, lat, lon, n, out);
+    return;
+  }
+#endif
+  PairDistancesScalar(formula, lat, lon, n, out);
+}
+
+void PairBearings(const double* lat, const double* lon, const size_t n,
+                  double* out) {
+#ifdef CYCLING_X86
+  if (HasAvx2()) {
+    PairBearingsAvx2(lat, lon, n, out);
+    return;
+  }
+#endif
+  PairBearingsScalar(lat, lon, n, out);
+}
+
+// Sets steps[i] to the value for the previous position and position i, for
+// every sample i with a position but the first, and NaN for samples without
+// one. Runs of samples that all have a position, usually the whole ride, go
+// through pairs() in place; one() bridges the gaps between runs. Returns the
+// index of the first position, or steps.size() if there is none.
+template <typename Pairs, typename One>
+size_t Steps(const std::vector<double>& latitudes,
+             const std::vector<double>& longitudes, const Pairs& pairs,
+             const One& one, std::vector<double>* steps) {
+  const size_t n = std::min(latitudes.size(), longitudes.size());
+  steps->assign(latitudes.size(), kNaN);
+  auto has_position = [&](const size_t i) {
+    return !std::isnan(latitudes[i]) && !std::isnan(longitudes[i]);
+  };
+  size_t first = steps->size();
+  size_t last = steps->size();
+  size_t begin = 0;
+  while (begin < n) {
+    if (!has_position(begin)) {
+      ++begin;
+      continue;
+    }
+    size_t end = begin + 1;
+    while (end < n && has_position(end)) ++end;
+    if (last == steps->size()) {
+      first = begin;
+    } else {
+      (*steps)[begin] = one(latitudes[last], longitudes[last],
+                            latitudes[begin], longitudes[begin]);
+    }
+    pairs(latitudes.data() + begin, longitudes.data() + begin, end - begin,
+          steps->data() + begin + 1);
+    last = end - 1;
+    begin = end;
+  }
+  return first;
+}
+
+}  // namespace
+
+double Distance(const DistanceFormula formula, const double lat1,
+                const double lon1, const double lat2, const double lon2) {
+  switch (formula) {
+    case HAVERSINE:
+      return Haversine(lat1, lon1, lat2, lon2);
+    case EQUIRECTANGULAR:
+      return Equirectangular(lat1, lon1, lat2, lon2);
+  }
+  return kNaN;
+}
+
+double Bearing(const double lat1, const double lon1, const double lat2,
+               const double lon2) {
+  const double phi1 = lat1 * kRadians;
+  const double phi2 = lat2 * kRadians;
+  const double half_dlon = (lon2 - lon1) * kRadians / 2;
+  const double sin_half_dlon = std::sin(half_dlon);
+  const double y = 2 * sin_half_dlon * std::cos(half_dlon) * std::cos(phi2);
+  // cos(phi1) sin(phi2) - sin(phi1) cos(phi2) cos(dlon), rewritten so that it
+  // doesn't cancel catastrophically between nearby points.
+  const double x = std::sin((lat2 - lat1) * kRadians) +
+                   2 * std::sin(phi1) * std::cos(phi2) * sin_half_dlon *
+                       sin_half_dlon;
+  return NormalizedDegrees(std::atan2(y, x));
+}
+
+double DistanceToSegment(const double lat, const double lon, const double lat1,
+                         const double lon1, const double lat2,
+                         const double lon2) {
+  const double scale = std::cos(lat * kRadians);
+  const double bx = WrappedDegrees(lon2 - lon1) * scale;
+  const double by = lat2 - lat1;
+  const double px = WrappedDegrees(lon - lon1) * scale;
+  const double py = lat - lat1;
+  const double length_squared = bx * bx + by * by;
+  const double t =
+      length_squared > 0
+          ? std::max(0.0, std::min(1.0, (px * bx + py * by) / length_squared))
+          : 0;
+  return std::hypot(px - t * bx, py - t * by) * kMetersPerDegree;
+}
+
+std::vector<double> StepDistances(const DistanceFormula formula,
+                                  const std::vector<double>& latitudes,
+                                  const std::vector<double>& longitudes) {
+  std::vector<double> steps;
+  const size_t first = Steps(
+      latitudes, longitudes,
+      [formula](const double* lat, const double* lon, const size_t n,
+                double* out) { PairDistances(formula, lat, lon, n, out); },
+      [formula](const double lat1, const double lon1, const double lat2,
+                const double lon2) {
+        return Distance(formula, lat1, lon1, lat2, lon2);
+      },
+      &steps);
+  if (first < steps.size()) steps[first] = 0;
+  return steps;
+}
+
+std::vector<double> StepBearings(const std::vector<double>& latitudes,
+                                 const std::vector<double>& longitudes) {
+  std::vector<double> steps;
+  Steps(latitudes, longitudes, PairBearings, Bearing, &steps);
+  return steps;
+}
+
+std::vector<double> CumulativeDistance(const DistanceFormula formula,
+                                       const std::vector<double>& latitudes,
+                                       const std::vector<double>& longitudes) {
+  std::vector<double> totals = StepDistances(formula, latitudes, longitudes);
+  double total = 0;
+  for (double& value : totals) {
+    if (std::isnan(value)) continue;
+    total += value;
+    value = total;
+  }
+  return totals;
+}
+
+}  // namespace geo_util
+}  // namespace cycling
@@ -0,0 +1,80 @@
+#ifndef __GEO_UTIL_H__
+#define __GEO_UTIL_H__
+
+#include <cmath>
+#include <vector>
+
+namespace cycling {
+namespace geo_util {
+
+// Distances and bearings between GPS positions, as found in the
+// DEGREES_LATITUDE and DEGREES_LONGITUDE channels of a TimeSeries. Positions
+// are in degrees, distances in meters and bearings in degrees clockwise from
+// north, in [0, 360).
+
+// The mean radius of the earth, which is treated as a sphere.
+constexpr double kEarthRadiusMeters = 6371008.8;
+
+constexpr double kPi = 3.14159265358979323846;
+// Radians per degree.
+constexpr double kRadians = kPi / 180;
+// The length of a degree of latitude, or of longitude on the equator.
+constexpr double kMetersPerDegree = kEarthRadiusMeters * kRadians;
+
+// A difference of longitudes, d, wrapped into [-180, 180], i.e. the short way
+// around, across the antimeridian if need be.
+inline double WrappedDegrees(const double d) {
+  return d - 360 * std::nearbyint(d / 360);
+}
+
+enum DistanceFormula {
+  // The great circle distance. Accurate at any distance, up to the ~0.5% the
+  // earth differs from a sphere.
+  HAVERSINE,
+  // Treats the earth as flat around the mean latitude of the two points.
+  // Cheaper, and within a few mm per km of HAVERSINE for points less than a
+  // few km apart, such as consecutive samples of a ride.
+  EQUIRECTANGULAR,
+};
+
+// The distance and the initial bearing from one position to another. These
+// are the straightforward scalar versions, which the column kernels below
+// are tested against.
+double Distance(const DistanceFormula formula, const double lat1,
+                const double lon1, const double lat2, const double lon2);
+double Bearing(const double lat1, const double lon1, const double lat2,
+               const double lon2);
+
+// The distance from a position to the segment from (lat1, lon1) to
+// (lat2, lon2), treating the earth as flat around the position. Only meant
+// for segments up to a few km long.
+double DistanceToSegment(const double lat, const double lon, const double lat1,
+                         const double lon1, const double lat2,
+                         const double lon2);
+
+// Kernels over whole lat/lon columns. Both inputs have one entry per sample,
+// NaN where a sample has no position, and so does the output. Each sample
+// with a position is paired with the previous sample that has one. The pairs
+// are evaluated four at a time with AVX2 when the CPU has it, using
+// polynomial approximations of the trigonometric functions that agree with
+// the scalar versions to within about 1e-12 relative.
+
+// The distance from the previous position; 0 for the first one.
+std::vector<double> StepDistances(const DistanceFormula formula,
+                                  const std::vector<double>& latitudes,
+                                  const std::vector<double>& longitudes);
+
+// The bearing from the previous position; NaN for the first one.
+std::vector<double> StepBearings(const std::vector<double>& latitudes,
+                                 const std::vector<double>& longitudes);
+
+// The running sum of StepDistances(), i.e. the distance covered along the
+// track up to each position.
+std::vector<double> CumulativeDistance(const DistanceFormula formula,
+                                       const std::vector<double>& latitudes,
+                                       const std::vector<double>& longitudes);
+
+}  // namespace geo_util
+}  // namespace cycling
+
+#endif  // __GEO_UTIL_H__
@@ -0,0 +1,158 @@
+#include "geo_util.h"
+
+#include <cmath>
+#include <limits>
+#include <random>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace cycling {
+namespace geo_util {
+namespace {
+
+using ::testing::DoubleNear;
+using ::testing::ElementsAre;
+using ::testing::NanSensitiveDoubleEq;
+
+const double kNaN = std::numeric_limits<double>::quiet_NaN();
+
+::testing::Matcher<double> IsNan() { return NanSensitiveDoubleEq(kNaN); }
+
+// The difference between two bearings, in degrees.
+double AngleBetween(const double a, const double b) {
+  const double difference = std::abs(a - b);
+  return std::min(difference, 360 - difference);
+}
+
+// A random track: mostly a ride with one second samples, plus jumps between
+// arbitrary positions, repeated positions, and points near the poles and the
+// antimeridian.
+void RandomTrack(const int n, std::vector<double>* latitudes,
+                 std::vector<double>* longitudes) {
+  std::mt19937 random(n);
+  std::uniform_real_distribution<double> any_lat(-90, 90);
+  std::uniform_real_distribution<double> any_lon(-180, 180);
+  std::normal_distribution<double> step(0, 1e-4);
+  std::uniform_int_distribution<int> kind(0, 19);
+  double lat = 47.6;
+  double lon = -122.3;
+  for (int i = 0; i < n; ++i) {
+    switch (kind(random)) {
+      case 0:
+        lat = any_lat(random);
+        lon = any_lon(random);
+        break;
+      case 1:
+        break;
+      case 2:
+        lat = 89.9999 + step(random);
+        break;
+      case 3:
+        lon = 180 - std::abs(step(random));
+        break;
+      case 4:
+        lon = -180 + std::abs(step(random));
+        break;
+      default:
+        lat = std::max(-90.0, std::min(90.0, lat + step(random)));
+        lon += step(random);
+        break;
+    }
+    latitudes->push_back(lat);
+    longitudes->push_back(lon);
+  }
+}
+
+TEST(GeoUtilTest, Distance) {
+  // Paris to London.
+  EXPECT_THAT(Distance(HAVERSINE, 48.8566, 2.3522, 51.5074, -0.1278),
+              DoubleNear(343556.53, 0.01));
+  // One degree along the equator, also across the antimeridian.
+  EXPECT_THAT(Distance(HAVERSINE, 0, 0, 0, 1), DoubleNear(111195.08, 0.01));
+  EXPECT_THAT(Distance(HAVERSINE, 0, 179.5, 0, -179.5),
+              DoubleNear(111195.08, 0.01));
+  EXPECT_THAT(Distance(EQUIRECTANGULAR, 0, 179.5, 0, -179.5),
+              DoubleNear(111195.08, 0.01));
+  EXPECT_EQ(Distance(HAVERSINE, 10, 20, 10, 20), 0);
+  // The formulas agree closely over short distances.
+  EXPECT_THAT(Distance(EQUIRECTANGULAR, 47.6, -122.3, 47.61, -122.29),
+              DoubleNear(Distance(HAVERSINE, 47.6, -122.3, 47.61, -122.29),
+                         0.001));
+}
+
+TEST(GeoUtilTest, Bearing) {
+  EXPECT_THAT(Bearing(0, 0, 1, 0), DoubleNear(0, 1e-12));
+  EXPECT_THAT(Bearing(0, 0, 0, 1), DoubleNear(90, 1e-12));
+  EXPECT_THAT(Bearing(0, 0, -1, 0), DoubleNear(180, 1e-12));
+  EXPECT_THAT(Bearing(0, 0, 0, -1), DoubleNear(270, 1e-12));
+  EXPECT_THAT(Bearing(0, 179.5, 0, -179.5), DoubleNear(90, 1e-12));
+}
+
+TEST(GeoUtilTest, DistanceToSegment) {
+  // 1 km along the equator, from 179.995 east across the antimeridian.
+  const double lon1 = 179.995;
+  const double lon2 = WrappedDegrees(lon1 + 1000 / kMetersPerDegree);
+  const double beyond = WrappedDegrees(lon1 + 1200 / kMetersPerDegree);
+  // Off the middle, the distance is to the line; past an end, to the end.
+  EXPECT_THAT(
+      DistanceToSegment(50 / kMetersPerDegree, 180, 0, lon1, 0, lon2),
+      DoubleNear(50, 1e-6));
+  EXPECT_THAT(DistanceToSegment(0, beyond, 0, lon1, 0, lon2),
+              DoubleNear(200, 1e-6));
+  EXPECT_THAT(DistanceToSegment(0, 180, 0, lon1, 0, lon1),
+              DoubleNear(Distance(EQUIRECTANGULAR, 0, 180, 0, lon1), 1e-6));
+}
+
+TEST(GeoUtilTest, MissingPositions) {
+  const std::vector<double> lat = {kNaN, 0, 0, kNaN, 0, 1};
+  const std::vector<double> lon = {kNaN, 0, 1, 5, 2, kNaN};
+  const double degree = Distance(HAVERSINE, 0, 0, 0, 1);
+  EXPECT_THAT(StepDistances(HAVERSINE, lat, lon),
+              ElementsAre(IsNan(), 0, DoubleNear(degree, 1e-6), IsNan(),
+                          DoubleNear(degree, 1e-6), IsNan()));
+  EXPECT_THAT(CumulativeDistance(HAVERSINE, lat, lon),
+              ElementsAre(IsNan(), 0, DoubleNear(degree, 1e-6), IsNan(),
+                          DoubleNear(2 * degree, 1e-6), IsNan()));
+  EXPECT_THAT(StepBearings(lat, lon),
+              ElementsAre(IsNan(), IsNan(), DoubleNear(90, 1e-9), IsNan(),
+                          DoubleNear(90, 1e-9), IsNan()));
+  EXPECT_TRUE(StepDistances(HAVERSINE, {}, {}).empty());
+  EXPECT_THAT(StepBearings({kNaN}, {kNaN}), ElementsAre(IsNan()));
+}
+
+// The column kernels run four pairs at a time with their own trigonometry;
+// check them against the scalar functions, which use the standard library.
+TEST(GeoUtilTest, KernelsMatchScalarFunctions) {
+  std::vector<double> lat;
+  std::vector<double> lon;
+  RandomTrack(10003, &lat, &lon);
+  for (const DistanceFormula formula : {HAVERSINE, EQUIRECTANGULAR}) {
+    const std::vector<double> steps = StepDistances(formula, lat, lon);
+    const std::vector<double> totals = CumulativeDistance(formula, lat, lon);
+    ASSERT_EQ(steps.size(), lat.size());
+    EXPECT_EQ(steps[0], 0);
+    double total = 0;
+    for (size_t i = 1; i < lat.size(); ++i) {
+      const double expected =
+          Distance(formula, lat[i - 1], lon[i - 1], lat[i], lon[i]);
+      ASSERT_NEAR(steps[i], expected, 1e-12 * expected + 1e-9)
+          << formula << " at " << i;
+      total += steps[i];
+      ASSERT_NEAR(totals[i], total, 1e-9 * total) << i;
+    }
+  }
+  const std::vector<double> bearings = StepBearings(lat, lon);
+  EXPECT_THAT(bearings[0], IsNan());
+  for (size_t i = 1; i < lat.size(); ++i) {
+    if (lat[i] == lat[i - 1] && lon[i] == lon[i - 1]) continue;
+    const double expected = Bearing(lat[i - 1], lon[i - 1], lat[i], lon[i]);
+    ASSERT_GE(bearings[i], 0);
+    ASSERT_LT(bearings[i], 360);
+    ASSERT_LT(AngleBetween(bearings[i], expected), 1e-9) << i;
+  }
+}
+
+}  // namespace
+}  // namespace geo_util
+}  // namespace cycling
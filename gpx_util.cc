@@ -0,0 +1,334 @@
+#include "gpx_util.h"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "measurement.h"
+#include "str_util.h"
+#include "time_sample.h"
+#include "xml_scanner.h"
+#include "xml_text.h"
+#include "xml_util.h"
+
+namespace cycling {
+
+namespace {
+
+enum GpxEntity {
+  GPX_UNKNOWN,
+  CAD,
+  ELE,
+  EXTENSIONS,
+  GPX,
+  HR,
+  LAT,
+  LON,
+  POWER,
+  POWER_IN_WATTS,
+  SPEED,
+  TIME,
+  TRACK_POINT_EXTENSION,
+  TRK,
+  TRKPT,
+  TRKSEG,
+};
+
+struct GpxEntityName {
+  // Lowercase, as names are looked up without regard to case.
+  std::string_view name;
+  GpxEntity entity;
+};
+
+// In the order of GpxEntity, so that an entity is its index.
+constexpr GpxEntityName kEntities[] = {
+    {"(unknown)", GPX_UNKNOWN},
+    {"cad", CAD},
+    {"ele", ELE},
+    {"extensions", EXTENSIONS},
+    {"gpx", GPX},
+    {"hr", HR},
+    {"lat", LAT},
+    {"lon", LON},
+    {"power", POWER},
+    {"powerinwatts", POWER_IN_WATTS},
+    {"speed", SPEED},
+    {"time", TIME},
+    {"trackpointextension", TRACK_POINT_EXTENSION},
+    {"trk", TRK},
+    {"trkpt", TRKPT},
+    {"trkseg", TRKSEG},
+};
+
+constexpr int kNumEntities = sizeof(kEntities) / sizeof(kEntities[0]);
+
+constexpr bool EntitiesAreInOrder() {
+  for (int i = 0; i < kNumEntities; ++i) {
+    if (kEntities[i].entity != i) return false;
+  }
+  return true;
+}
+
+static_assert(EntitiesAreInOrder(), "kEntities is out of order");
+
+constexpr XmlAtomTable kEntityTable(kEntities);
+
+static_assert(kEntityTable.ok(), "No perfect hash of the entity names");
+
+GpxEntity GetGpxEntity(const char* name, const size_t size) {
+  return static_cast<GpxEntity>(kEntityTable.Find(name, size));
+}
+
+// What an element means to the parser, which depends on where in the
+// document it is.
+enum GpxState {
+  IN_DOCUMENT,
+  IN_GPX,
+  IN_TRACK,
+  IN_SEGMENT,
+  IN_TRACKPOINT,
+  IN_EXTENSIONS,
+  IN_TPX,
+  // Elements holding a single value in their text.
+  IN_VALUE,
+  IN_TIME,
+  // Elements whose contents are ignored.
+  IN_SKIPPED,
+};
+
+// An open element.
+struct GpxFrame {
+  GpxState state;
+  // For IN_VALUE, the measurement of the point it is.
+  Measurement::Type type = Measurement::NO_TYPE;
+  // Set once the element has its text, not counting whitespace.
+  bool has_text = false;
+  // The value of IN_VALUE elements.
+  double value = 0;
+};
+
+// Builds a TimeSeries from the elements and text of a GPX document, in
+// document order, holding only the open elements and the point being read.
+// Fed by ScanXml, or by xml_util::ReadXmlFile.
+class GpxStreamParser : public XmlScanHandler {
+ public:
+  GpxStreamParser() { stack_.push_back({IN_DOCUMENT}); }
+
+  Status StartElement(const char* name, const size_t size,
+                      bool* skip) override;
+  Status Attribute(const char* name, const size_t name_size, const char* value,
+                   const size_t value_size) override;
+  Status EndElement() override;
+  Status Text(const char* text, const size_t size) override;
+
+  // Checks that the document was a whole GPX document, and adds the points
+  // to series.
+  Status EndDocument(TimeSeries* series);
+
+ private:
+  Status EndTrackpoint();
+
+  std::vector<GpxFrame> stack_;
+  bool seen_root_ = false;
+  // The point being read.
+  TimeSample sample_;
+  bool has_time_ = false;
+  bool has_latitude_ = false;
+  bool has_longitude_ = false;
+  std::vector<TimeSample> samples_;
+  TimeParser time_parser_;
+};
+
+Status GpxStreamParser::StartElement(const char* name, const size_t size,
+                                     bool* skip) {
+  const GpxEntity entity = GetGpxEntity(name, size);
+  GpxFrame child{IN_SKIPPED};
+  switch (stack_.back().state) {
+    case IN_DOCUMENT:
+      if (entity != GPX || seen_root_) {
+        return Status::FailureStatus(
+            StrCat("Expected a gpx element, got ", std::string(name, size)));
+      }
+      seen_root_ = true;
+      child.state = IN_GPX;
+      break;
+    case IN_GPX:
+      if (entity == TRK) child.state = IN_TRACK;
+      break;
+    case IN_TRACK:
+      if (entity == TRKSEG) child.state = IN_SEGMENT;
+      break;
+    case IN_SEGMENT:
+      if (entity == TRKPT) {
+        child.state = IN_TRACKPOINT;
+        sample_ = TimeSample();
+        has_time_ = has_latitude_ = has_longitude_ = false;
+      }
+      break;
+    case IN_TRACKPOINT:
+      if (entity == ELE) {
+        child.state = IN_VALUE;
+        child.type = Measurement::ALTITUDE;
+      } else if (entity == TIME) {
+        child.state = IN_TIME;
+      } else if (entity == EXTENSIONS) {
+        child.state = IN_EXTENSIONS;
+      }
+      break;
+    case IN_EXTENSIONS:
+      if (entity == TRACK_POINT_EXTENSION) {
+        child.state = IN_TPX;
+      } else if (entity == POWER || entity == POWER_IN_WATTS) {
+        child.state = IN_VALUE;
+        child.type = Measurement::POWER;
+      }
+      break;
+    case IN_TPX:
+      child.state = IN_VALUE;
+      if (entity == HR) {
+        child.type = Measurement::HEART_RATE;
+      } else if (entity == CAD) {
+        child.type = Measurement::CADENCE;
+      } else if (entity == SPEED) {
+        child.type = Measurement::SPEED;
+      } else if (entity == POWER) {
+        child.type = Measurement::POWER;
+      } else {
+        child.state = IN_SKIPPED;
+      }
+      break;
+    case IN_VALUE:
+    case IN_TIME:
+      return Status::FailureStatus(
+          StrCat("Unexpected element in a value: ", std::string(name, size)));
+    case IN_SKIPPED:
+      break;
+  }
+  *skip = child.state == IN_SKIPPED;
+  stack_.push_back(child);
+  return Status::OkStatus();
+}
+
+Status GpxStreamParser::Attribute(const char* name, const size_t name_size,
+                                  const char* value, const size_t value_size) {
+  if (stack_.back().state != IN_TRACKPOINT) return Status::OkStatus();
+  const GpxEntity entity = GetGpxEntity(name, name_size);
+  if (entity != LAT && entity != LON) return Status::OkStatus();
+  const char* begin = value;
+  const char* end = value + value_size;
+  TrimXmlText(&begin, &end);
+  double degrees;
+  RETURN_IF_ERROR(ExtractDouble(begin, end - begin, &degrees));
+  if (entity == LAT) {
+    sample_.Add(Measurement::DEGREES_LATITUDE, degrees);
+    has_latitude_ = true;
+  } else {
+    sample_.Add(Measurement::DEGREES_LONGITUDE, degrees);
+    has_longitude_ = true;
+  }
+  return Status::OkStatus();
+}
+
+Status GpxStreamParser::Text(const char* text, const size_t size) {
+  GpxFrame* frame = &stack_.back();
+  if (frame->state == IN_SKIPPED) return Status::OkStatus();
+  const char* begin = text;
+  const char* end = text + size;
+  TrimXmlText(&begin, &end);
+  if (begin == end) return Status::OkStatus();
+  if (frame->has_text) {
+    return Status::FailureStatus("Expected one value in an element.");
+  }
+  frame->has_text = true;
+  switch (frame->state) {
+    case IN_VALUE:
+      return ExtractDouble(begin, end - begin, &frame->value);
+    case IN_TIME: {
+      TimeSample::TimePoint time;
+      RETURN_IF_ERROR(time_parser_.Parse(begin, end - begin, &time));
+      sample_.set_time(time);
+      has_time_ = true;
+      return Status::OkStatus();
+    }
+    default:
+      break;
+  }
+  return Status::FailureStatus(
+      StrCat("Unexpected text: ", std::string(begin, end)));
+}
+
+Status GpxStreamParser::EndElement() {
+  if (stack_.size() == 1) return Status::FailureStatus("Unexpected end tag.");
+  const GpxFrame frame = stack_.back();
+  stack_.pop_back();
+  switch (frame.state) {
+    case IN_VALUE:
+      if (frame.has_text) sample_.Add(frame.type, frame.value);
+      break;
+    case IN_TRACKPOINT:
+      return EndTrackpoint();
+    default:
+      break;
+  }
+  return Status::OkStatus();
+}
+
+Status GpxStreamParser::EndTrackpoint() {
+  if (!has_latitude_ || !has_longitude_) {
+    return Status::FailureStatus("Expected a trkpt with a lat and a lon.");
+  }
+  if (!has_time_) return Status::OkStatus();
+  if (!samples_.empty()) {
+    const TimeSample::TimePoint last = samples_.back().time();
+    if (sample_.time() < last) {
+      return Status::FailureStatus("Track points go back in time.");
+    }
+    // Like ParseTcxFile, keeps points recorded in the same instant apart.
+    if (sample_.time() == last) {
+      sample_.set_time(last + std::chrono::microseconds(1));
+    }
+  }
+  samples_.push_back(std::move(sample_));
+  return Status::OkStatus();
+}
+
+Status GpxStreamParser::EndDocument(TimeSeries* series) {
+  if (stack_.size() != 1 || !seen_root_) {
+    return Status::FailureStatus("Expected a gpx element.");
+  }
+  series->Add(std::move(samples_));
+  return Status::OkStatus();
+}
+
+}  // namespace
+
+Status ParseGpxFile(const std::string& path,
+                    std::unique_ptr<TimeSeries>* series) {
+  {
+    GpxStreamParser parser;
+    TimeSeries scanned;
+    if (ScanXmlFile(path, &parser).ok() && parser.EndDocument(&scanned).ok()) {
+      series->reset(new TimeSeries(std::move(scanned)));
+      return Status::OkStatus();
+    }
+  }
+  // As for TCX, libxml handles the rest of XML and says what is wrong.
+  GpxStreamParser parser;
+  RETURN_IF_ERROR(xml_util::ReadXmlFile(path, &parser));
+  TimeSeries streamed;
+  RETURN_IF_ERROR(parser.EndDocument(&streamed));
+  series->reset(new TimeSeries(std::move(streamed)));
+  return Status::OkStatus();
+}
+
+std::unique_ptr<TimeSeries> ParseGpxFile(const std::string& path) {
+  std::unique_ptr<TimeSeries> series;
+  const Status status = ParseGpxFile(path, &series);
+  if (!status.ok()) std::cerr << path << ": " << status << std::endl;
+  return series;
+}
+
+}  // namespace cycling
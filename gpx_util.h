@@ -0,0 +1,29 @@
+#ifndef __GPX_UTIL_H__
+#define __GPX_UTIL_H__
+
+#include <memory>
+#include <string>
+
+#include "status.h"
+#include "time_series.h"
+
+namespace cycling {
+
+// Converts the GPX file at path to a TimeSeries, with a sample for every
+// point of its tracks, in the order they come: its position, elevation and
+// time, and the heart rate, cadence, speed and power of Garmin's
+// TrackPointExtension, or power from the <power> and <PowerInWatts>
+// extensions that other apps write. Waypoints, routes, metadata and anything
+// else are skipped, as are track points without a time. Streams through the
+// file, holding only the point being read, like ParseTcxFile. Can be called
+// on several threads at once.
+std::unique_ptr<TimeSeries> ParseGpxFile(const std::string& path);
+
+// Same as ParseGpxFile, but returns what is wrong with the file instead of
+// printing it. series is only set on success.
+Status ParseGpxFile(const std::string& path,
+                    std::unique_ptr<TimeSeries>* series);
+
+}  // namespace cycling
+
+#endif  // __GPX_UTIL_H__
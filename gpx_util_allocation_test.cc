@@ -0,0 +1,86 @@
+// Checks that parsing a GPX file allocates a fixed amount of memory, plus the
+// output series, rather than some for every track point. Counting allocations
+// means replacing the global operator new, hence a test of its own.
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+
+#include "gpx_util.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+std::atomic<int64_t> num_allocations(0);
+
+}  // namespace
+
+void* operator new(const size_t size) {
+  ++num_allocations;
+  void* p = std::malloc(size == 0 ? 1 : size);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+namespace cycling {
+namespace {
+
+// Writes a GPX document with n track points, each with a position, a time,
+// elevation, heart rate, cadence and power, to a temporary file.
+std::string WriteGpx(const int n) {
+  const std::string path = ::testing::internal::TempDir() +
+                           "gpx_util_allocation_test.gpx";
+  FILE* fp = fopen(path.c_str(), "w");
+  fprintf(fp,
+          "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+          "<gpx version=\"1.1\" creator=\"test\" "
+          "xmlns=\"http://www.topografix.com/GPX/1/1\" xmlns:gpxtpx="
+          "\"http://www.garmin.com/xmlschemas/TrackPointExtension/v2\">\n"
+          "<trk><trkseg>\n");
+  for (int i = 0; i < n; ++i) {
+    fprintf(fp,
+            "<trkpt lat=\"%.7f\" lon=\"%.7f\"><ele>%.1f</ele>"
+            "<time>2016-01-01T%02d:%02d:%02dZ</time><extensions>"
+            "<power>%d</power><gpxtpx:TrackPointExtension>"
+            "<gpxtpx:hr>%d</gpxtpx:hr><gpxtpx:cad>%d</gpxtpx:cad>"
+            "</gpxtpx:TrackPointExtension></extensions></trkpt>\n",
+            45 + i * 1e-5, 7 + i * 1e-5, 100 + i % 100 * 0.5, 10 + i / 3600,
+            i / 60 % 60, i % 60, 150 + i % 200, 120 + i % 50, 80 + i % 20);
+  }
+  fprintf(fp, "</trkseg></trk>\n</gpx>\n");
+  fclose(fp);
+  return path;
+}
+
+// The number of allocations it takes to parse a file with n track points.
+int64_t CountAllocations(const int n) {
+  const std::string path = WriteGpx(n);
+  const int64_t before = num_allocations;
+  std::unique_ptr<TimeSeries> series = ParseGpxFile(path);
+  const int64_t after = num_allocations;
+  EXPECT_NE(series.get(), nullptr);
+  if (series != nullptr) {
+    EXPECT_EQ(series->num_samples(), n);
+  }
+  return after - before;
+}
+
+TEST(GpxUtilAllocationTest, NoAllocationsPerTrackPoint) {
+  // Warms up what is set up once per process.
+  CountAllocations(10);
+  const int kNumTrackPoints = 5000;
+  const int64_t once = CountAllocations(kNumTrackPoints);
+  const int64_t twice = CountAllocations(2 * kNumTrackPoints);
+  // As for TCX, only the vector of samples grows with the file.
+  EXPECT_LE(twice - once, 1);
+  EXPECT_LT(once, 100);
+}
+
+}  // namespace
+}  // namespace cycling
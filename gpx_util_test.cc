@@ -0,0 +1,276 @@
+#include "gpx_util.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "measurement.h"
+#include "str_util.h"
+#include "tcx_util.h"
+
+namespace cycling {
+namespace {
+
+const char kFenix3OutdoorRide[] = "fenix3_outdoor_ride.tcx";
+
+const char kGpxStart[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<gpx version=\"1.1\" creator=\"test\" "
+    "xmlns=\"http://www.topografix.com/GPX/1/1\" "
+    "xmlns:gpxtpx="
+    "\"http://www.garmin.com/xmlschemas/TrackPointExtension/v2\">\n";
+
+// Writes contents to a temporary file, and returns its path.
+std::string WriteFile(const std::string& name, const std::string& contents) {
+  const std::string path = ::testing::internal::TempDir() + name;
+  std::ofstream(path, std::ios::binary) << contents;
+  return path;
+}
+
+std::unique_ptr<TimeSeries> Parse(const std::string& gpx) {
+  std::unique_ptr<TimeSeries> series;
+  const Status status =
+      ParseGpxFile(WriteFile("gpx_util_test.gpx", gpx), &series);
+  EXPECT_TRUE(status.ok()) << status;
+  return series;
+}
+
+bool Fails(const std::string& gpx) {
+  std::unique_ptr<TimeSeries> series;
+  return !ParseGpxFile(WriteFile("gpx_util_test.gpx", gpx), &series).ok() &&
+         series == nullptr;
+}
+
+double Value(const TimeSeries& series, const Measurement::Type type,
+             const int index) {
+  return (*series.Values(type))[index];
+}
+
+TimeSample::TimePoint Time(const int64_t seconds) {
+  return TimeSample::TimePoint(std::chrono::seconds(seconds));
+}
+
+// Two segments of a ride, with what else GPX files have around them.
+const std::string& Ride() {
+  static const std::string ride = StrCat(
+      kGpxStart,
+      "<metadata><name>Ride</name><time>2016-07-23T08:00:00Z</time>"
+      "</metadata>\n"
+      "<wpt lat=\"1\" lon=\"2\"><time>2016-07-23T07:00:00Z</time></wpt>\n"
+      "<trk><name>Morning ride</name><type>cycling</type><trkseg>\n"
+      "<trkpt lat=\"47.5\" lon=\"-122.25\"><ele>12.5</ele>"
+      "<time>2016-07-23T08:51:44Z</time><extensions>"
+      "<power>250</power><gpxtpx:TrackPointExtension>"
+      "<gpxtpx:atemp>21</gpxtpx:atemp><gpxtpx:hr>140</gpxtpx:hr>"
+      "<gpxtpx:cad>90</gpxtpx:cad><gpxtpx:speed>8.5</gpxtpx:speed>"
+      "</gpxtpx:TrackPointExtension></extensions></trkpt>\n"
+      // No time: skipped.
+      "<trkpt lat=\"47.6\" lon=\"-122.26\"><ele>13</ele></trkpt>\n"
+      "</trkseg><trkseg>\n"
+      "<trkpt lon = '-122.27' lat = ' 47.7 '>"
+      "<time>2016-07-23T08:51:45.500Z</time><sat>7</sat></trkpt>\n"
+      // The same time again.
+      "<trkpt lat=\"47.8\" lon=\"-122.28\"><ele></ele>"
+      "<time>2016-07-23T08:51:45.500Z</time><extensions>"
+      "<PowerInWatts>300</PowerInWatts></extensions></trkpt>\n"
+      "</trkseg></trk>\n"
+      "<rte><rtept lat=\"1\" lon=\"2\"/></rte>\n"
+      "</gpx>\n");
+  return ride;
+}
+
+TEST(GpxUtilTest, ParseRide) {
+  const std::unique_ptr<TimeSeries> series = Parse(Ride());
+  ASSERT_NE(series, nullptr);
+  ASSERT_EQ(series->num_samples(), 3);
+  const TimeSample::TimePoint start = Time(1469263904);
+  EXPECT_EQ(series->SampleTime(0), start);
+  EXPECT_EQ(series->SampleTime(1),
+            start + std::chrono::milliseconds(1500));
+  EXPECT_EQ(series->SampleTime(2), start + std::chrono::milliseconds(1500) +
+                                       std::chrono::microseconds(1));
+
+  EXPECT_DOUBLE_EQ(Value(*series, Measurement::DEGREES_LATITUDE, 0), 47.5);
+  EXPECT_DOUBLE_EQ(Value(*series, Measurement::DEGREES_LONGITUDE, 0),
+                   -122.25);
+  EXPECT_DOUBLE_EQ(Value(*series, Measurement::ALTITUDE, 0), 12.5);
+  EXPECT_DOUBLE_EQ(Value(*series, Measurement::HEART_RATE, 0), 140);
+  EXPECT_DOUBLE_EQ(Value(*series, Measurement::CADENCE, 0), 90);
+  EXPECT_DOUBLE_EQ(Value(*series, Measurement::SPEED, 0), 8.5);
+  EXPECT_DOUBLE_EQ(Value(*series, Measurement::POWER, 0), 250);
+
+  EXPECT_DOUBLE_EQ(Value(*series, Measurement::DEGREES_LATITUDE, 1), 47.7);
+  EXPECT_DOUBLE_EQ(Value(*series, Measurement::DEGREES_LONGITUDE, 1),
+                   -122.27);
+  EXPECT_TRUE(std::isnan(Value(*series, Measurement::ALTITUDE, 1)));
+  EXPECT_TRUE(std::isnan(Value(*series, Measurement::HEART_RATE, 1)));
+  EXPECT_TRUE(std::isnan(Value(*series, Measurement::ALTITUDE, 2)));
+  EXPECT_DOUBLE_EQ(Value(*series, Measurement::POWER, 2), 300);
+}
+
+// The same ride, with what only libxml handles.
+std::string RideForLibxml() {
+  std::string ride = Ride();
+  ride.insert(ride.find("<trk>"), "<!-- A comment. -->");
+  ride.insert(ride.find("Morning ride"), "&amp; ");
+  return ride;
+}
+
+TEST(GpxUtilTest, ParseWithLibxml) {
+  const std::unique_ptr<TimeSeries> expected = Parse(Ride());
+  const std::unique_ptr<TimeSeries> actual = Parse(RideForLibxml());
+  ASSERT_NE(actual, nullptr);
+  ASSERT_EQ(actual->num_samples(), expected->num_samples());
+  for (int i = 0; i < expected->num_samples(); ++i) {
+    EXPECT_EQ(actual->SampleTime(i), expected->SampleTime(i));
+    EXPECT_EQ(Value(*actual, Measurement::DEGREES_LATITUDE, i),
+              Value(*expected, Measurement::DEGREES_LATITUDE, i));
+  }
+  EXPECT_DOUBLE_EQ(Value(*actual, Measurement::POWER, 2), 300);
+}
+
+TEST(GpxUtilTest, Errors) {
+  const std::string point = "<time>2016-07-23T08:51:44Z</time></trkpt>";
+  for (const std::string& gpx : {
+           std::string("<gpx>"),
+           std::string("<gpx></gpx><gpx></gpx>"),
+           std::string("<TrainingCenterDatabase/>"),
+           StrCat(kGpxStart, "</gpx>", "<gpx/>"),
+           StrCat(kGpxStart, "text</gpx>"),
+           StrCat(kGpxStart, "<trk><trkseg><trkpt lat=\"1\">", point,
+                  "</trkseg></trk></gpx>"),
+           StrCat(kGpxStart, "<trk><trkseg><trkpt lat=\"1\" lon=\"x\">",
+                  point, "</trkseg></trk></gpx>"),
+           StrCat(kGpxStart,
+                  "<trk><trkseg><trkpt lat=\"1\" lon=\"2\"><ele>1 m</ele>",
+                  point, "</trkseg></trk></gpx>"),
+           StrCat(kGpxStart,
+                  "<trk><trkseg><trkpt lat=\"1\" lon=\"2\"><ele>1<b/></ele>",
+                  point, "</trkseg></trk></gpx>"),
+           StrCat(kGpxStart,
+                  "<trk><trkseg><trkpt lat=\"1\" lon=\"2\">"
+                  "<time>yesterday</time></trkpt></trkseg></trk></gpx>"),
+           StrCat(kGpxStart,
+                  "<trk><trkseg><trkpt lat=\"1\" lon=\"2\">"
+                  "<time>2016-07-23T08:51:45Z</time></trkpt>"
+                  "<trkpt lat=\"1\" lon=\"2\">",
+                  point, "</trkseg></trk></gpx>"),
+       }) {
+    EXPECT_TRUE(Fails(gpx)) << gpx;
+  }
+  std::unique_ptr<TimeSeries> series;
+  EXPECT_FALSE(ParseGpxFile("no_such_file.gpx", &series).ok());
+  EXPECT_EQ(ParseGpxFile("no_such_file.gpx"), nullptr);
+}
+
+std::string FormatTime(const TimeSample::TimePoint& time) {
+  const int64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                             time.time_since_epoch())
+                             .count();
+  const time_t seconds = micros / 1000000;
+  struct tm tm;
+  gmtime_r(&seconds, &tm);
+  char buffer[64];
+  const size_t size =
+      strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &tm);
+  snprintf(buffer + size, sizeof(buffer) - size, ".%06dZ",
+           static_cast<int>(micros % 1000000));
+  return buffer;
+}
+
+// Writes the points of series that have a position as GPX.
+std::string ToGpx(const TimeSeries& series, std::vector<int>* written) {
+  std::string gpx = StrCat(kGpxStart, "<trk><trkseg>\n");
+  char buffer[128];
+  for (int i = 0; i < series.num_samples(); ++i) {
+    const double latitude = Value(series, Measurement::DEGREES_LATITUDE, i);
+    const double longitude = Value(series, Measurement::DEGREES_LONGITUDE, i);
+    if (std::isnan(latitude) || std::isnan(longitude)) continue;
+    written->push_back(i);
+    snprintf(buffer, sizeof(buffer), "<trkpt lat=\"%.17g\" lon=\"%.17g\">",
+             latitude, longitude);
+    gpx += buffer;
+    const double altitude = Value(series, Measurement::ALTITUDE, i);
+    if (!std::isnan(altitude)) {
+      snprintf(buffer, sizeof(buffer), "<ele>%.17g</ele>", altitude);
+      gpx += buffer;
+    }
+    gpx += "<time>" + FormatTime(series.SampleTime(i)) + "</time>";
+    gpx += "<extensions><gpxtpx:TrackPointExtension>";
+    for (const auto& type_and_tag : {
+             std::make_pair(Measurement::HEART_RATE, "hr"),
+             std::make_pair(Measurement::CADENCE, "cad"),
+             std::make_pair(Measurement::SPEED, "speed"),
+         }) {
+      const double value = Value(series, type_and_tag.first, i);
+      if (std::isnan(value)) continue;
+      snprintf(buffer, sizeof(buffer), "<gpxtpx:%s>%.17g</gpxtpx:%s>",
+               type_and_tag.second, value, type_and_tag.second);
+      gpx += buffer;
+    }
+    gpx += "</gpxtpx:TrackPointExtension></extensions></trkpt>\n";
+  }
+  return gpx + "</trkseg></trk></gpx>\n";
+}
+
+TEST(GpxUtilTest, SameAsTcx) {
+  const std::unique_ptr<TimeSeries> tcx = ParseTcxFile(kFenix3OutdoorRide);
+  ASSERT_NE(tcx, nullptr);
+  std::vector<int> written;
+  const std::unique_ptr<TimeSeries> gpx = Parse(ToGpx(*tcx, &written));
+  ASSERT_NE(gpx, nullptr);
+  ASSERT_GT(written.size(), 1000);
+  ASSERT_EQ(gpx->num_samples(), written.size());
+  for (const Measurement::Type type :
+       {Measurement::DEGREES_LATITUDE, Measurement::DEGREES_LONGITUDE,
+        Measurement::ALTITUDE, Measurement::HEART_RATE, Measurement::CADENCE,
+        Measurement::SPEED}) {
+    SCOPED_TRACE(type);
+    const TimeSeries::ColumnPtr expected = tcx->Values(type);
+    const TimeSeries::ColumnPtr actual = gpx->Values(type);
+    for (size_t i = 0; i < written.size(); ++i) {
+      EXPECT_EQ(gpx->SampleTime(i), tcx->SampleTime(written[i]));
+      const double value = (*expected)[written[i]];
+      if (std::isnan(value)) {
+        EXPECT_TRUE(std::isnan((*actual)[i])) << i;
+      } else {
+        EXPECT_EQ((*actual)[i], value) << i;
+      }
+    }
+  }
+}
+
+TEST(GpxUtilTest, ParseOnManyThreads) {
+  const std::string paths[] = {
+      WriteFile("gpx_util_test_scanned.gpx", Ride()),
+      WriteFile("gpx_util_test_read.gpx", RideForLibxml()),
+  };
+  std::atomic<int> num_mismatches(0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&, i]() {
+      for (int j = 0; j < 50; ++j) {
+        const std::unique_ptr<TimeSeries> series =
+            ParseGpxFile(paths[(i + j) % 2]);
+        if (series == nullptr || series->num_samples() != 3 ||
+            Value(*series, Measurement::POWER, 2) != 300) {
+          ++num_mismatches;
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  EXPECT_EQ(num_mismatches, 0);
+}
+
+}  // namespace
+}  // namespace cycling
@@ -80,7 +80,8 @@ Grapher::Graph Grapher::Plot(const TimeSeries& series, const TimePoint& start,
                              const Duration& width, const Duration& increment,
                              const Duration& look_behind,
                              const Measurement::Type type, const double coef,
-                             const double stage) {
+                             const double stage,
+                             const TimeSeries::VisitFilter filter) {
   Graph graph = {start, start + width, 0, 1};
   std::vector<Sample> data;
   data.reserve(static_cast<size_t>((width + increment + look_behind).count() / 1000000));
@@ -95,7 +96,8 @@ Grapher::Graph Grapher::Plot(const TimeSeries& series, const TimePoint& start,
                [&](const TimePoint& time, const double value) {
                  const double d = value * coef;
                  data.push_back({time, d});
-               });
+               },
+               filter);
   series.FinishVisit();
 
   double min0, min1, max0, max1;
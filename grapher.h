@@ -72,10 +72,15 @@ class Grapher {
   //
   // The output graph is in the space x=[0,1],y=[0,1]. Any scaling must be done
   // outside by callers of this function.
+  //
+  // With filter set to TimeSeries::MOVING_ONLY, samples recorded while stopped
+  // are left out of both the points and the y-axis bounds.
   static Graph Plot(const TimeSeries& series, const TimePoint& current_time,
                     const Duration& width, const Duration& increment,
                     const Duration& look_behind, const Measurement::Type type,
-                    const double coef, const double stage);
+                    const double coef, const double stage,
+                    const TimeSeries::VisitFilter filter =
+                        TimeSeries::ALL_SAMPLES);
 };
 
 }  // namespace cycling
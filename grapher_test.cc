@@ -47,6 +47,32 @@ TEST(GrapherTest, Plot) {
   }
 }
 
+TEST(GrapherTest, PlotMovingOnly) {
+  TimeSeries time_series;
+  const Time start = std::chrono::system_clock::now();
+
+  // A stop in the middle of the window with a much lower heart rate.
+  for (int i = 0; i < 60; ++i) {
+    const bool stopped = i >= 20 && i < 40;
+    time_series.Add(
+        TimeSample(start + std::chrono::seconds(i))
+            .Add(Measurement(Measurement::HEART_RATE, stopped ? 60 : 150))
+            .Add(Measurement(Measurement::SPEED, stopped ? 0 : 10)));
+  }
+
+  Grapher::Graph all = Grapher::Plot(
+      time_series, start + kLookBehind, kWindow, kIncrement, kLookBehind,
+      Measurement::HEART_RATE, 1.0, 0);
+  Grapher::Graph moving = Grapher::Plot(
+      time_series, start + kLookBehind, kWindow, kIncrement, kLookBehind,
+      Measurement::HEART_RATE, 1.0, 0, TimeSeries::MOVING_ONLY);
+  EXPECT_EQ(all.points.size(), 36);
+  ASSERT_EQ(moving.points.size(), 20);
+  for (const Grapher::Point& point : moving.points) {
+    EXPECT_EQ(point.y, moving.points[0].y);
+  }
+}
+
 }  // namespace
 }  // namespace cycling
 
@@ -0,0 +1,423 @@
+#include "heatmap.h"
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+
+#include <algorithm>
+#include <limits>
+#include <mutex>
+#include <set>
+
+#include "geo_util.h"
+#include "measurement.h"
+#include "parallel.h"
+#include "str_util.h"
+
+namespace cycling {
+
+namespace {
+
+using geo_util::kPi;
+using geo_util::kRadians;
+
+// Web Mercator stops short of the poles, where the map would be square.
+const double kMaxLatitude = 85.0511287798;
+// Tracks are drawn at most this zoomed in, so that pixel coordinates fit
+// comfortably in an int64_t and tile coordinates in 32 bits.
+const int kMaxZoom = 24;
+
+const int kTileBits = 8;
+const int kTileSize = Heatmap::kTileSize;
+const int kTilePixels = kTileSize * kTileSize;
+static_assert(1 << kTileBits == kTileSize, "kTileBits doesn't match");
+
+uint64_t TileKey(const int64_t x, const int64_t y) {
+  return static_cast<uint64_t>(x) << 32 | static_cast<uint32_t>(y);
+}
+int KeyX(const uint64_t key) { return static_cast<int>(key >> 32); }
+int KeyY(const uint64_t key) { return static_cast<int>(key & 0xffffffff); }
+
+// Draws lines into the tiles of one thread. The tile of the last pixel is
+// remembered, since a track stays in the same tile for many pixels.
+class Canvas {
+ public:
+  Canvas(const int zoom, std::unordered_map<uint64_t,
+                                            std::unique_ptr<float[]>>* tiles)
+      : world_size_(static_cast<int64_t>(kTileSize) << zoom), tiles_(tiles) {}
+
+  int64_t world_size() const { return world_size_; }
+
+  // Adds to every pixel the length of the line from (x0, y0) to (x1, y1)
+  // that runs through it, walking the pixels it crosses in order.
+  void DrawLine(const double x0, const double y0, const double x1,
+                const double y1) {
+    const double dx = x1 - x0;
+    const double dy = y1 - y0;
+    const double length = std::hypot(dx, dy);
+    if (length == 0) return;
+    const double kInfinity = std::numeric_limits<double>::infinity();
+    int64_t x = static_cast<int64_t>(std::floor(x0));
+    int64_t y = static_cast<int64_t>(std::floor(y0));
+    const int64_t step_x = dx > 0 ? 1 : -1;
+    const int64_t step_y = dy > 0 ? 1 : -1;
+    // The fraction of the line at which it next enters a new column or row,
+    // and the fraction it takes to cross one.
+    double next_x = dx != 0 ? (x + (dx > 0) - x0) / dx : kInfinity;
+    double next_y = dy != 0 ? (y + (dy > 0) - y0) / dy : kInfinity;
+    const double delta_x = dx != 0 ? 1 / std::abs(dx) : kInfinity;
+    const double delta_y = dy != 0 ? 1 / std::abs(dy) : kInfinity;
+    int64_t pixels_left =
+        std::abs(static_cast<int64_t>(std::floor(x1)) - x) +
+        std::abs(static_cast<int64_t>(std::floor(y1)) - y);
+    double t = 0;
+    while (true) {
+      const double t_next =
+          pixels_left > 0 ? std::min(1.0, std::min(next_x, next_y)) : 1.0;
+      Add(x, y, static_cast<float>((t_next - t) * length));
+      if (t_next >= 1) break;
+      t = t_next;
+      --pixels_left;
+      if (next_x < next_y) {
+        x += step_x;
+        next_x += delta_x;
+      } else {
+        y += step_y;
+        next_y += delta_y;
+      }
+    }
+  }
+
+ private:
+  void Add(const int64_t x, const int64_t y, const float length) {
+    if (x < 0 || y < 0 || x >= world_size_ || y >= world_size_) return;
+    const uint64_t key = TileKey(x >> kTileBits, y >> kTileBits);
+    if (tile_ == nullptr || key != key_) {
+      std::unique_ptr<float[]>& tile = (*tiles_)[key];
+      if (tile == nullptr) tile.reset(new float[kTilePixels]());
+      tile_ = tile.get();
+      key_ = key;
+    }
+    tile_[(y & (kTileSize - 1)) * kTileSize + (x & (kTileSize - 1))] +=
+        length;
+  }
+
+  const int64_t world_size_;
+  std::unordered_map<uint64_t, std::unique_ptr<float[]>>* tiles_;
+  float* tile_ = nullptr;
+  uint64_t key_ = 0;
+};
+
+// Projects the track of series to Web Mercator pixels and draws it.
+void DrawRide(const TimeSeries& series, const double max_gap_meters,
+              Canvas* canvas) {
+  if (series.num_samples() == 0) return;
+  const TimeSeries::ColumnPtr lat =
+      series.Values(Measurement::DEGREES_LATITUDE);
+  const TimeSeries::ColumnPtr lon =
+      series.Values(Measurement::DEGREES_LONGITUDE);
+  const double world_size = static_cast<double>(canvas->world_size());
+  // A pixel at the equator, in meters. The map is stretched by 1 / cos(lat)
+  // away from it.
+  const double equator_meters =
+      2 * kPi * geo_util::kEarthRadiusMeters / world_size;
+  bool started = false;
+  double previous_x = 0, previous_y = 0;
+  for (size_t i = 0; i < lat->size(); ++i) {
+    const double point_lat = (*lat)[i];
+    const double point_lon = (*lon)[i];
+    if (std::isnan(point_lat) || std::isnan(point_lon)) continue;
+    const double sin_lat = std::sin(
+        std::max(-kMaxLatitude, std::min(kMaxLatitude, point_lat)) *
+        kRadians);
+    const double x = (point_lon + 180) / 360 * world_size;
+    // ln(tan(pi/4 + lat/2)), the Mercator y, written with a single log.
+    const double y =
+        (0.5 - std::log((1 + sin_lat) / (1 - sin_lat)) / (4 * kPi)) *
+        world_size;
+    if (started) {
+      const double pixels = std::hypot(x - previous_x, y - previous_y);
+      const double meters =
+          pixels * equator_meters * std::sqrt(1 - sin_lat * sin_lat);
+      // Steps across the antimeridian span the whole map; leave them out.
+      if (meters <= max_gap_meters &&
+          std::abs(x - previous_x) < world_size / 2) {
+        canvas->DrawLine(previous_x, previous_y, x, y);
+      }
+    }
+    started = true;
+    previous_x = x;
+    previous_y = y;
+  }
+}
+
+std::vector<uint64_t> SortedKeys(
+    const std::unordered_map<uint64_t, std::unique_ptr<float[]>>& tiles) {
+  std::vector<uint64_t> keys;
+  keys.reserve(tiles.size());
+  for (const auto& tile : tiles) keys.push_back(tile.first);
+  std::sort(keys.begin(), keys.end());
+  return keys;
+}
+
+// The density at which the colors of a zoom saturate: the 99.5th percentile
+// of the pixels some ride passes through, estimated from at most about a
+// million of them.
+float Saturation(
+    const std::unordered_map<uint64_t, std::unique_ptr<float[]>>& tiles) {
+  const size_t kMaxSamples = 1 << 20;
+  const size_t stride = std::max<size_t>(
+      1, tiles.size() * kTilePixels / kMaxSamples);
+  std::vector<float> values;
+  size_t i = 0;
+  for (const auto& tile : tiles) {
+    for (int p = 0; p < kTilePixels; ++p, ++i) {
+      if (i % stride == 0 && tile.second[p] > 0) {
+        values.push_back(tile.second[p]);
+      }
+    }
+  }
+  if (values.empty()) return 1;
+  const auto percentile = values.begin() + values.size() * 995 / 1000;
+  std::nth_element(values.begin(), percentile, values.end());
+  return *percentile;
+}
+
+void PutBigEndian32(const uint32_t value, std::string* out) {
+  out->push_back(static_cast<char>(value >> 24));
+  out->push_back(static_cast<char>(value >> 16));
+  out->push_back(static_cast<char>(value >> 8));
+  out->push_back(static_cast<char>(value));
+}
+
+void PutPngChunk(const char* type, const std::string& data, std::string* png) {
+  PutBigEndian32(data.size(), png);
+  const size_t begin = png->size();
+  png->append(type, 4);
+  png->append(data);
+  PutBigEndian32(crc32(0, reinterpret_cast<const Bytef*>(&(*png)[begin]),
+                       png->size() - begin),
+                 png);
+}
+
+// A PNG of the RGBA pixels of one tile.
+std::string EncodePng(const std::vector<uint8_t>& rgba) {
+  std::string png("\x89PNG\r\n\x1a\n", 8);
+  std::string header;
+  PutBigEndian32(kTileSize, &header);
+  PutBigEndian32(kTileSize, &header);
+  // 8 bits per channel, RGBA, no interlacing.
+  header.append("\x08\x06\x00\x00\x00", 5);
+  PutPngChunk("IHDR", header, &png);
+
+  std::string raw;
+  raw.reserve(kTileSize * (4 * kTileSize + 1));
+  for (int y = 0; y < kTileSize; ++y) {
+    raw.push_back(0);  // No filter.
+    raw.append(reinterpret_cast<const char*>(&rgba[y * 4 * kTileSize]),
+               4 * kTileSize);
+  }
+  // Most of a tile is the same few colors, which deflate squeezes to a few
+  // KB.
+  uLongf size = compressBound(raw.size());
+  std::string compressed(size, '\0');
+  const int result = compress2(reinterpret_cast<Bytef*>(&compressed[0]), &size,
+                               reinterpret_cast<const Bytef*>(raw.data()),
+                               raw.size(), Z_DEFAULT_COMPRESSION);
+  // compress2() only fails when it runs out of memory, or of room, which
+  // compressBound() leaves enough of.
+  assert(result == Z_OK);
+  (void)result;
+  compressed.resize(size);
+  PutPngChunk("IDAT", compressed, &png);
+  PutPngChunk("IEND", "", &png);
+  return png;
+}
+
+// Colors a tile black to red to yellow to white as its density rises.
+std::string EncodeTile(const float* tile, const float saturation,
+                       const Heatmap::ImageFormat format) {
+  const double scale = 1 / std::log1p(saturation);
+  const int channels = format == Heatmap::PNG ? 4 : 3;
+  std::vector<uint8_t> pixels(channels * kTilePixels);
+  for (int p = 0; p < kTilePixels; ++p) {
+    const double t = std::min(1.0, std::log1p(tile[p]) * scale);
+    auto channel = [t](const double offset) {
+      return static_cast<uint8_t>(
+          std::lround(255 * std::max(0.0, std::min(1.0, 3 * t - offset))));
+    };
+    uint8_t* pixel = &pixels[channels * p];
+    pixel[0] = channel(0);
+    pixel[1] = channel(1);
+    pixel[2] = channel(2);
+    if (channels == 4) pixel[3] = static_cast<uint8_t>(std::lround(255 * t));
+  }
+  if (format == Heatmap::PNG) return EncodePng(pixels);
+  std::string ppm = StrCat("P6\n", kTileSize, " ", kTileSize, "\n255\n");
+  ppm.append(pixels.begin(), pixels.end());
+  return ppm;
+}
+
+Status MakeDirectory(const std::string& path) {
+  if (mkdir(path.c_str(), 0777) != 0 && errno != EEXIST) {
+    return Status::FailureStatus(StrCat("Couldn't create ", path));
+  }
+  return Status::OkStatus();
+}
+
+Status WriteFile(const std::string& path, const std::string& contents) {
+  FILE* fp = fopen(path.c_str(), "wb");
+  if (fp == nullptr) {
+    return Status::FailureStatus(StrCat("Couldn't open ", path));
+  }
+  const bool ok =
+      fwrite(contents.data(), 1, contents.size(), fp) == contents.size();
+  if (fclose(fp) != 0 || !ok) {
+    return Status::FailureStatus(StrCat("Couldn't write ", path));
+  }
+  return Status::OkStatus();
+}
+
+}  // namespace
+
+Heatmap::Heatmap(const int min_zoom, const int max_zoom)
+    : min_zoom_(min_zoom),
+      max_zoom_(max_zoom),
+      zooms_(max_zoom - min_zoom + 1) {}
+
+std::unique_ptr<Heatmap> Heatmap::Build(
+    const std::vector<const TimeSeries*>& rides,
+    const HeatmapOptions& options, const int num_threads) {
+  const int max_zoom = std::max(0, std::min(kMaxZoom, options.max_zoom));
+  const int min_zoom = std::max(0, std::min(max_zoom, options.min_zoom));
+  std::unique_ptr<Heatmap> heatmap(new Heatmap(min_zoom, max_zoom));
+  const int threads = std::max(1, num_threads);
+
+  // Every thread draws into tiles of its own.
+  std::vector<TileMap> drawn(threads);
+  std::vector<std::unique_ptr<Canvas>> canvases;
+  for (TileMap& tiles : drawn) {
+    canvases.emplace_back(new Canvas(max_zoom, &tiles));
+  }
+  ParallelFor(rides.size(), threads, [&](const int thread, const size_t i) {
+    DrawRide(*rides[i], options.max_gap_meters, canvases[thread].get());
+  });
+
+  // The first thread to draw a tile hands it over, and the others' copies
+  // are added to it, one tile per task.
+  TileMap& top = heatmap->zooms_.back();
+  for (TileMap& tiles : drawn) {
+    for (auto& tile : tiles) {
+      std::unique_ptr<float[]>& merged = top[tile.first];
+      if (merged == nullptr) merged = std::move(tile.second);
+    }
+  }
+  const std::vector<uint64_t> top_keys = SortedKeys(top);
+  ParallelFor(top_keys.size(), threads, [&](const int, const size_t i) {
+    float* merged = top.find(top_keys[i])->second.get();
+    for (const TileMap& tiles : drawn) {
+      const auto tile = tiles.find(top_keys[i]);
+      if (tile == tiles.end() || tile->second == nullptr) continue;
+      for (int p = 0; p < kTilePixels; ++p) merged[p] += tile->second[p];
+    }
+  });
+  drawn.clear();
+
+  // Each zoom out adds up the four tiles under every tile.
+  for (int zoom = max_zoom - 1; zoom >= min_zoom; --zoom) {
+    const TileMap& children = heatmap->zooms_[zoom - min_zoom + 1];
+    TileMap& parents = heatmap->zooms_[zoom - min_zoom];
+    for (const auto& child : children) {
+      std::unique_ptr<float[]>& parent =
+          parents[TileKey(KeyX(child.first) / 2, KeyY(child.first) / 2)];
+      if (parent == nullptr) parent.reset(new float[kTilePixels]());
+    }
+    const std::vector<uint64_t> keys = SortedKeys(parents);
+    ParallelFor(keys.size(), threads, [&](const int, const size_t i) {
+      float* parent = parents.find(keys[i])->second.get();
+      const int x = KeyX(keys[i]);
+      const int y = KeyY(keys[i]);
+      for (int quadrant = 0; quadrant < 4; ++quadrant) {
+        const int qx = quadrant & 1;
+        const int qy = quadrant >> 1;
+        const auto child = children.find(TileKey(2 * x + qx, 2 * y + qy));
+        if (child == children.end()) continue;
+        const int half = kTileSize / 2;
+        for (int cy = 0; cy < kTileSize; ++cy) {
+          const float* row = &child->second[cy * kTileSize];
+          float* out = &parent[(qy * half + cy / 2) * kTileSize + qx * half];
+          for (int cx = 0; cx < kTileSize; ++cx) out[cx / 2] += row[cx];
+        }
+      }
+    });
+  }
+  return heatmap;
+}
+
+std::vector<std::pair<int, int>> Heatmap::Tiles(const int zoom) const {
+  std::vector<std::pair<int, int>> tiles;
+  if (zoom < min_zoom_ || zoom > max_zoom_) return tiles;
+  for (const uint64_t key : SortedKeys(zooms_[zoom - min_zoom_])) {
+    tiles.emplace_back(KeyX(key), KeyY(key));
+  }
+  return tiles;
+}
+
+const float* Heatmap::Tile(const int zoom, const int x, const int y) const {
+  if (zoom < min_zoom_ || zoom > max_zoom_) return nullptr;
+  const TileMap& tiles = zooms_[zoom - min_zoom_];
+  const auto tile = tiles.find(TileKey(x, y));
+  return tile == tiles.end() ? nullptr : tile->second.get();
+}
+
+Status Heatmap::WriteTiles(const std::string& directory,
+                           const ImageFormat format,
+                           const int num_threads) const {
+  const char* extension = format == PNG ? ".png" : ".ppm";
+  RETURN_IF_ERROR(MakeDirectory(directory));
+  struct Job {
+    int zoom;
+    uint64_t key;
+    float saturation;
+  };
+  std::vector<Job> jobs;
+  for (int zoom = min_zoom_; zoom <= max_zoom_; ++zoom) {
+    const TileMap& tiles = zooms_[zoom - min_zoom_];
+    const float saturation = Saturation(tiles);
+    const std::string zoom_directory = StrCat(directory, "/", zoom);
+    RETURN_IF_ERROR(MakeDirectory(zoom_directory));
+    std::set<int> columns;
+    for (const uint64_t key : SortedKeys(tiles)) {
+      if (columns.insert(KeyX(key)).second) {
+        RETURN_IF_ERROR(
+            MakeDirectory(StrCat(zoom_directory, "/", KeyX(key))));
+      }
+      jobs.push_back({zoom, key, saturation});
+    }
+  }
+
+  std::mutex mutex;
+  Status result = Status::OkStatus();
+  ParallelFor(jobs.size(), std::max(1, num_threads),
+              [&](const int, const size_t i) {
+                const Job& job = jobs[i];
+                const float* tile =
+                    zooms_[job.zoom - min_zoom_].find(job.key)->second.get();
+                const Status status = WriteFile(
+                    StrCat(directory, "/", job.zoom, "/", KeyX(job.key), "/",
+                           KeyY(job.key), extension),
+                    EncodeTile(tile, job.saturation, format));
+                if (!status.ok()) {
+                  std::lock_guard<std::mutex> lock(mutex);
+                  if (result.ok()) result = status;
+                }
+              });
+  return result;
+}
+
+}  // namespace cycling
@@ -0,0 +1,85 @@
+#ifndef __HEATMAP_H__
+#define __HEATMAP_H__
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "status.h"
+#include "time_series.h"
+
+namespace cycling {
+
+struct HeatmapOptions {
+  // Tracks are drawn at max_zoom, and every zoom down to min_zoom is made by
+  // adding up 2x2 pixels of the next one.
+  int min_zoom = 8;
+  int max_zoom = 14;
+  // Consecutive positions further apart than this are taken to be a gap in
+  // the recording, e.g. a GPS dropout, and aren't joined.
+  double max_gap_meters = 500;
+};
+
+// A heatmap of where a library of rides went, in Web Mercator tiles of
+// kTileSize pixels, numbered like the tiles of online maps: at zoom z, tile
+// (x, y) covers column x and row y of a 2^z by 2^z grid, with (0, 0) in the
+// north-west.
+//
+// Each pixel holds the length of track that runs through it, in pixels of
+// max_zoom. Build() projects and draws the rides on num_threads threads, each
+// into tiles of its own, and then adds the threads' tiles together, so the
+// drawing needs no synchronization at all. Tiles are dense, so memory grows
+// with the area the rides cover at max_zoom, times the number of threads
+// while drawing.
+class Heatmap {
+ public:
+  static constexpr int kTileSize = 256;
+
+  enum ImageFormat {
+    // 8-bit RGBA, transparent where no ride went, to be laid over a map.
+    PNG,
+    // Binary RGB on black.
+    PPM,
+  };
+
+  static std::unique_ptr<Heatmap> Build(
+      const std::vector<const TimeSeries*>& rides,
+      const HeatmapOptions& options, const int num_threads);
+
+  Heatmap(const Heatmap&) = delete;
+  Heatmap& operator=(const Heatmap&) = delete;
+
+  int min_zoom() const { return min_zoom_; }
+  int max_zoom() const { return max_zoom_; }
+
+  // The tiles at zoom that some ride passes through, as (x, y), sorted.
+  std::vector<std::pair<int, int>> Tiles(const int zoom) const;
+
+  // The pixels of a tile, row by row from the north-west corner, or nullptr
+  // if no ride passes through it.
+  const float* Tile(const int zoom, const int x, const int y) const;
+
+  // Writes every tile to directory/zoom/x/y.png or .ppm, creating the
+  // directories as needed, on num_threads threads. Densities are shown on a
+  // log scale that saturates at the 99.5th percentile of each zoom. PNGs are
+  // deflated with zlib.
+  Status WriteTiles(const std::string& directory, const ImageFormat format,
+                    const int num_threads) const;
+
+ private:
+  using TileMap = std::unordered_map<uint64_t, std::unique_ptr<float[]>>;
+
+  Heatmap(const int min_zoom, const int max_zoom);
+
+  int min_zoom_;
+  int max_zoom_;
+  // The tiles of each zoom from min_zoom_, by TileKey().
+  std::vector<TileMap> zooms_;
+};
+
+}  // namespace cycling
+
+#endif  // __HEATMAP_H__
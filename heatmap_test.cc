@@ -0,0 +1,192 @@
+#include "heatmap.h"
+
+#include <zlib.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace cycling {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::FloatNear;
+using ::testing::Pair;
+
+const double kPi = 3.14159265358979323846;
+const int kZoom = 12;
+const double kWorldSize = Heatmap::kTileSize * std::pow(2.0, kZoom);
+
+struct Pixel {
+  double x;
+  double y;
+};
+
+// A ride through the given pixels of zoom kZoom, one per second.
+std::unique_ptr<TimeSeries> MakeRide(const std::vector<Pixel>& pixels) {
+  std::unique_ptr<TimeSeries> series(new TimeSeries);
+  for (size_t i = 0; i < pixels.size(); ++i) {
+    const double lon = pixels[i].x / kWorldSize * 360 - 180;
+    const double lat =
+        std::atan(std::sinh(kPi * (1 - 2 * pixels[i].y / kWorldSize))) * 180 /
+        kPi;
+    TimeSample sample(
+        TimeSeries::TimePoint() + std::chrono::hours(400000) +
+            std::chrono::seconds(i),
+        Measurement(Measurement::DEGREES_LATITUDE, lat));
+    sample.Add(Measurement(Measurement::DEGREES_LONGITUDE, lon));
+    series->Add(sample);
+  }
+  return series;
+}
+
+double Total(const Heatmap& heatmap, const int zoom) {
+  double total = 0;
+  for (const auto& tile : heatmap.Tiles(zoom)) {
+    const float* pixels = heatmap.Tile(zoom, tile.first, tile.second);
+    for (int p = 0; p < Heatmap::kTileSize * Heatmap::kTileSize; ++p) {
+      total += pixels[p];
+    }
+  }
+  return total;
+}
+
+HeatmapOptions Options() {
+  HeatmapOptions options;
+  options.min_zoom = kZoom - 3;
+  options.max_zoom = kZoom;
+  return options;
+}
+
+TEST(HeatmapTest, LineDensity) {
+  // Along row 250 of tile (2000, 1400), then down into the tile below.
+  const double x = 2000 * 256, y = 1400 * 256;
+  const auto ride =
+      MakeRide({{x + 10.5, y + 250.5}, {x + 20.5, y + 250.5},
+                {x + 20.5, y + 260.5}});
+  const auto heatmap = Heatmap::Build({ride.get()}, Options(), 1);
+  EXPECT_EQ(heatmap->min_zoom(), kZoom - 3);
+  EXPECT_THAT(heatmap->Tiles(kZoom),
+              ElementsAre(Pair(2000, 1400), Pair(2000, 1401)));
+  const float* tile = heatmap->Tile(kZoom, 2000, 1400);
+  ASSERT_TRUE(tile != nullptr);
+  EXPECT_THAT(tile[250 * 256 + 10], FloatNear(0.5, 1e-3));
+  for (int i = 11; i <= 20; ++i) {
+    EXPECT_THAT(tile[250 * 256 + i], FloatNear(1, 1e-3)) << i;
+  }
+  EXPECT_THAT(tile[255 * 256 + 20], FloatNear(1, 1e-3));
+  EXPECT_EQ(tile[251 * 256 + 21], 0);
+  const float* below = heatmap->Tile(kZoom, 2000, 1401);
+  ASSERT_TRUE(below != nullptr);
+  EXPECT_THAT(below[3 * 256 + 20], FloatNear(1, 1e-3));
+  EXPECT_THAT(below[4 * 256 + 20], FloatNear(0.5, 1e-3));
+  EXPECT_TRUE(heatmap->Tile(kZoom, 2001, 1400) == nullptr);
+  EXPECT_TRUE(heatmap->Tile(kZoom + 1, 4000, 2800) == nullptr);
+
+  // Zooming out keeps the total length.
+  for (int zoom = kZoom - 3; zoom <= kZoom; ++zoom) {
+    EXPECT_NEAR(Total(*heatmap, zoom), 20, 1e-3) << zoom;
+  }
+  EXPECT_THAT(heatmap->Tiles(kZoom - 1), ElementsAre(Pair(1000, 700)));
+  EXPECT_THAT(heatmap->Tile(kZoom - 1, 1000, 700)[125 * 256 + 10],
+              FloatNear(2, 1e-3));
+}
+
+TEST(HeatmapTest, GapsAreNotJoined) {
+  // At zoom 12 a pixel is about 38 m at the equator, so 20 pixels are more
+  // than the default 500 m gap.
+  const double x = kWorldSize / 2, y = kWorldSize / 2 + 0.5;
+  const auto ride = MakeRide({{x, y}, {x + 5, y}, {x + 25, y}, {x + 30, y}});
+  const auto heatmap = Heatmap::Build({ride.get()}, Options(), 1);
+  EXPECT_NEAR(Total(*heatmap, kZoom), 10, 1e-3);
+}
+
+TEST(HeatmapTest, ThreadsAddUp) {
+  std::mt19937 random(5);
+  std::normal_distribution<double> step(0, 3);
+  std::vector<std::unique_ptr<TimeSeries>> rides;
+  std::vector<const TimeSeries*> library;
+  for (int r = 0; r < 40; ++r) {
+    std::vector<Pixel> pixels;
+    Pixel pixel = {2000 * 256.0 + 128, 1400 * 256.0 + 128};
+    for (int i = 0; i < 1000; ++i) {
+      pixel.x += step(random);
+      pixel.y += step(random);
+      pixels.push_back(pixel);
+    }
+    rides.push_back(MakeRide(pixels));
+    library.push_back(rides.back().get());
+  }
+  const auto serial = Heatmap::Build(library, Options(), 1);
+  const auto parallel = Heatmap::Build(library, Options(), 4);
+  for (int zoom = kZoom - 3; zoom <= kZoom; ++zoom) {
+    ASSERT_EQ(serial->Tiles(zoom), parallel->Tiles(zoom));
+    for (const auto& tile : serial->Tiles(zoom)) {
+      const float* a = serial->Tile(zoom, tile.first, tile.second);
+      const float* b = parallel->Tile(zoom, tile.first, tile.second);
+      for (int p = 0; p < Heatmap::kTileSize * Heatmap::kTileSize; ++p) {
+        ASSERT_NEAR(a[p], b[p], 1e-3 * (1 + a[p]));
+      }
+    }
+  }
+}
+
+std::string ReadFile(const std::string& path) {
+  std::string contents;
+  FILE* fp = fopen(path.c_str(), "rb");
+  if (fp == nullptr) return contents;
+  char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+    contents.append(buffer, n);
+  }
+  fclose(fp);
+  return contents;
+}
+
+TEST(HeatmapTest, WriteTiles) {
+  const double x = 2000 * 256, y = 1400 * 256;
+  const auto ride = MakeRide({{x + 10.5, y + 100.5}, {x + 20.5, y + 100.5}});
+  const auto heatmap = Heatmap::Build({ride.get()}, Options(), 1);
+  const std::string directory =
+      ::testing::internal::TempDir() + "heatmap_test_tiles";
+  ASSERT_TRUE(heatmap->WriteTiles(directory, Heatmap::PNG, 2).ok());
+  const std::string png = ReadFile(directory + "/12/2000/1400.png");
+  EXPECT_EQ(png.substr(0, 8), std::string("\x89PNG\r\n\x1a\n", 8));
+  EXPECT_EQ(png.substr(png.size() - 8, 4), "IEND");
+  // A mostly black tile compresses to a small fraction of its pixels.
+  ASSERT_LT(png.size(), 256 * 256 * 4 / 50);
+  // The image data follows the signature and the 25 bytes of IHDR, and
+  // inflates to a filter byte and 256 RGBA pixels per row.
+  ASSERT_EQ(png.substr(37, 4), "IDAT");
+  const std::string idat = png.substr(
+      41, static_cast<uint8_t>(png[35]) << 8 | static_cast<uint8_t>(png[36]));
+  std::string raw(256 * (1 + 256 * 4), '\x7f');
+  uLongf raw_size = raw.size();
+  ASSERT_EQ(uncompress(reinterpret_cast<Bytef*>(&raw[0]), &raw_size,
+                       reinterpret_cast<const Bytef*>(idat.data()),
+                       idat.size()),
+            Z_OK);
+  EXPECT_EQ(raw_size, raw.size());
+  EXPECT_EQ(raw.substr(100 * (1 + 256 * 4) + 1 + 4 * 15, 4),
+            "\xff\xff\xff\xff");
+  EXPECT_EQ(raw.substr(0, 5), std::string(5, '\0'));
+
+  ASSERT_TRUE(heatmap->WriteTiles(directory, Heatmap::PPM, 1).ok());
+  const std::string ppm = ReadFile(directory + "/12/2000/1400.ppm");
+  ASSERT_EQ(ppm.size(), 15 + 256 * 256 * 3);
+  EXPECT_EQ(ppm.substr(0, 15), "P6\n256 256\n255\n");
+  // The middle of the line is saturated, and the rest is black.
+  const size_t pixel = 15 + 3 * (100 * 256 + 15);
+  EXPECT_EQ(ppm.substr(pixel, 3), "\xff\xff\xff");
+  EXPECT_EQ(ppm.substr(15, 3), std::string(3, '\0'));
+
+  EXPECT_FALSE(heatmap->WriteTiles("/dev/null/tiles", Heatmap::PNG, 1).ok());
+}
+
+}  // namespace
+}  // namespace cycling
@@ -1,17 +1,22 @@
 #include <cassert>
 #include <cmath>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 
 #include <algorithm>
 #include <chrono>
 #include <map>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 #include "grapher.h"
 #include "measurement.h"
 #include "si_var.h"
+#include "status.h"
 #include "string_buffer.h"
+#include "tcx_ingest.h"
 #include "tcx_util.h"
 #include "time_series.h"
 
@@ -142,7 +147,45 @@ void DumpTimeSeries(const std::string& file_path) {
   fclose(fp);
 }
 
+// Parses every TCX file under directory on num_threads threads, reporting
+// each file as it is done and the overall throughput at the end.
+int IngestDirectory(const std::string& directory, const int num_threads) {
+  IngestOptions options;
+  options.num_threads = num_threads;
+  int num_files = 0;
+  int num_failures = 0;
+  const auto start = std::chrono::steady_clock::now();
+  const Status status = IngestTcxDirectory(
+      directory, options,
+      [&](const std::string& path, const Status& status,
+          std::unique_ptr<TimeSeries> series) {
+        ++num_files;
+        if (!status.ok()) {
+          ++num_failures;
+          std::cerr << path << ": " << status << std::endl;
+          return;
+        }
+        printf("%s: %d samples\n", path.c_str(), series->num_samples());
+      });
+  if (!status.ok()) {
+    std::cerr << status << std::endl;
+    return 1;
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  printf("%d files, %d failed, in %.2fs on %d threads\n", num_files,
+         num_failures, elapsed.count(), options.num_threads);
+  return 0;
+}
+
 int Main(int argc, char** argv) {
+  // cycling --ingest <directory> [num_threads]
+  if (argc >= 3 && strcmp(argv[1], "--ingest") == 0) {
+    const unsigned int cores = std::thread::hardware_concurrency();
+    return IngestDirectory(argv[2], argc >= 4 ? std::max(1, atoi(argv[3]))
+                                              : std::max(1u, cores));
+  }
+
   const SiVar rider_weight = 85 * SiVar::Kilogram();
 
   for (int power_coef = 10; power_coef <= 500; power_coef += 10) {
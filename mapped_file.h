@@ -0,0 +1,32 @@
+#ifndef __MAPPED_FILE_H__
+#define __MAPPED_FILE_H__
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace cycling {
+
+// A file mapped into memory, read only, for as long as the object lives.
+class MappedFile {
+ public:
+  // Returns nullptr if the file can't be opened or mapped, or is empty.
+  static std::unique_ptr<MappedFile> Open(const std::string& path);
+
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  MappedFile(const char* data, const size_t size) : data_(data), size_(size) {}
+
+  const char* const data_;
+  const size_t size_;
+};
+
+}  // namespace cycling
+
+#endif  // __MAPPED_FILE_H__
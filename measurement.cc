@@ -32,6 +32,7 @@ Measurement::Measurement(const Type type, const double coef) : type_(type) {
     case HRV:
     case CADENCE:
     case GEAR:
+    case GRADE:
       value_ = SiVar(SiBaseUnit::UNITLESS, coef);
       break;
     case SPEED:
@@ -46,6 +47,7 @@ Measurement::Measurement(const Type type, const double coef) : type_(type) {
       value_ = SiVar(SiUnit::Meter(), coef);
       break;
     case TOTAL_JOULES:
+    case W_PRIME_BALANCE:
       value_ = SiVar(SiUnit::Joule(), coef);
       break;
     case NUM_MEASUREMENTS:
@@ -64,6 +66,7 @@ Measurement::Measurement(const Type type, const SiVar& var)
     case HRV:
     case CADENCE:
     case GEAR:
+    case GRADE:
       assert(value_.unit() == SiBaseUnit::UNITLESS);
       break;
     case SPEED:
@@ -78,6 +81,7 @@ Measurement::Measurement(const Type type, const SiVar& var)
       assert(value_.unit() == SiUnit::Meter());
       break;
     case TOTAL_JOULES:
+    case W_PRIME_BALANCE:
       assert(value_.unit() == SiUnit::Joule());
       break;
     case NUM_MEASUREMENTS:
@@ -113,6 +117,10 @@ std::string Measurement::ToString() const {
       return DtoA(value_.coef() / 1000.0) + " km";
     case TOTAL_JOULES:
       return DtoA(value_.coef() / 4.814) + " total kCal";
+    case W_PRIME_BALANCE:
+      return DtoA(value_.coef() / 1000.0) + " kJ W' bal";
+    case GRADE:
+      return DtoA(value_.coef() * 100.0) + "% grade";
     case NUM_MEASUREMENTS:
       assert(false);
       return "";
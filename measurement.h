@@ -37,6 +37,11 @@ class Measurement {
     TOTAL_DISTANCE,
     // The total joules burned thus far, up to and including this sample.
     TOTAL_JOULES,
+    // The remaining anaerobic work capacity (W'), in joules.
+    W_PRIME_BALANCE,
+    // Altitude gained over horizontal distance covered, e.g. 0.05 for a 5%
+    // climb. Unitless.
+    GRADE,
 
     NUM_MEASUREMENTS,
   };
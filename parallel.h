@@ -0,0 +1,33 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+namespace cycling {
+
+// Runs task(thread, i) for every i in [0, n) on up to num_threads threads,
+// this one among them. Each thread takes the next i as soon as it is done with
+// the last one, so uneven tasks, such as rides of different lengths, keep
+// every thread busy. thread, in [0, num_threads), says which thread runs the
+// call, for tasks that keep state per thread.
+template <typename Task>
+void ParallelFor(const size_t n, const int num_threads, const Task& task) {
+  std::atomic<size_t> next{0};
+  auto worker = [&](const int thread) {
+    for (size_t i = next++; i < n; i = next++) task(thread, i);
+  };
+  const int num_workers =
+      static_cast<int>(std::min<size_t>(std::max(1, num_threads), n));
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_workers; ++i) threads.emplace_back(worker, i);
+  worker(0);
+  for (std::thread& thread : threads) thread.join();
+}
+
+}  // namespace cycling
+
+#endif  // __PARALLEL_H__
@@ -0,0 +1,31 @@
+#include "parallel.h"
+
+#include <atomic>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace cycling {
+namespace {
+
+TEST(ParallelTest, RunsEveryTaskOnce) {
+  for (const size_t n : {size_t(0), size_t(1), size_t(3), size_t(1000)}) {
+    for (const int num_threads : {0, 1, 4}) {
+      std::vector<std::atomic<int>> runs(n);
+      std::atomic<bool> bad_thread{false};
+      ParallelFor(n, num_threads, [&](const int thread, const size_t i) {
+        if (thread < 0 || thread >= std::max(1, num_threads)) {
+          bad_thread = true;
+        }
+        ++runs[i];
+      });
+      for (size_t i = 0; i < n; ++i) {
+        EXPECT_EQ(runs[i], 1) << n << " " << num_threads << " " << i;
+      }
+      EXPECT_FALSE(bad_thread);
+    }
+  }
+}
+
+}  // namespace
+}  // namespace cycling
@@ -0,0 +1,35 @@
+#include "ride_test_util.h"
+
+#include <chrono>
+#include <cmath>
+
+#include "measurement.h"
+
+namespace cycling {
+
+const TimeSeries::TimePoint kRideStart =
+    TimeSeries::TimePoint() + std::chrono::hours(400000);
+
+TimeSeries::TimePoint RideTime(const int seconds) {
+  return kRideStart + std::chrono::seconds(seconds);
+}
+
+std::unique_ptr<TimeSeries> MakeRide(const std::vector<GeoPoint>& positions,
+                                     const int start_seconds,
+                                     const double power) {
+  std::unique_ptr<TimeSeries> series(new TimeSeries);
+  for (size_t i = 0; i < positions.size(); ++i) {
+    TimeSample sample(RideTime(start_seconds + static_cast<int>(i)),
+                      Measurement(Measurement::POWER, power));
+    sample.Add(Measurement(Measurement::HEART_RATE, 150));
+    if (!std::isnan(positions[i].lat)) {
+      sample.Add(Measurement(Measurement::DEGREES_LATITUDE, positions[i].lat));
+      sample.Add(
+          Measurement(Measurement::DEGREES_LONGITUDE, positions[i].lon));
+    }
+    series->Add(sample);
+  }
+  return series;
+}
+
+}  // namespace cycling
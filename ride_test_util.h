@@ -0,0 +1,29 @@
+#ifndef __RIDE_TEST_UTIL_H__
+#define __RIDE_TEST_UTIL_H__
+
+#include <memory>
+#include <vector>
+
+#include "spatial_index.h"
+#include "time_series.h"
+
+namespace cycling {
+
+// Rides for the tests of code that works on GPS tracks.
+
+// The time rides made by MakeRide() are counted from.
+extern const TimeSeries::TimePoint kRideStart;
+
+// seconds after kRideStart.
+TimeSeries::TimePoint RideTime(const int seconds);
+
+// A ride through positions, one sample per second starting start_seconds
+// after kRideStart, at a constant power and a heart rate of 150. NaN leaves
+// the position out.
+std::unique_ptr<TimeSeries> MakeRide(const std::vector<GeoPoint>& positions,
+                                     const int start_seconds = 0,
+                                     const double power = 200);
+
+}  // namespace cycling
+
+#endif  // __RIDE_TEST_UTIL_H__
@@ -0,0 +1,176 @@
+#include "sample_query.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "cpu_features.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CYCLING_X86 1
+#endif
+
+namespace cycling {
+
+namespace {
+
+const double kInfinity = std::numeric_limits<double>::infinity();
+
+size_t NumWords(const size_t num_bits) { return (num_bits + 63) / 64; }
+
+// Sets bit i of out iff values[i] matches predicate. NaN never matches.
+void MatchScalar(const double* values, const size_t n,
+                 const RangePredicate& predicate, uint64_t* out) {
+  for (size_t word = 0; word < NumWords(n); ++word) {
+    const size_t begin = word * 64;
+    const size_t end = std::min(n, begin + 64);
+    uint64_t bits = 0;
+    for (size_t i = begin; i < end; ++i) {
+      const double v = values[i];
+      const bool above = predicate.min_inclusive ? v >= predicate.min
+                                                 : v > predicate.min;
+      const bool below = predicate.max_inclusive ? v <= predicate.max
+                                                 : v < predicate.max;
+      bits |= static_cast<uint64_t>(above && below) << (i - begin);
+    }
+    out[word] = bits;
+  }
+}
+
+#ifdef CYCLING_X86
+
+// Same as MatchScalar for the first n / 64 words. The comparison predicates
+// are template arguments since _mm256_cmp_pd needs them as immediates.
+template <int kMinCompare, int kMaxCompare>
+__attribute__((target("avx2"))) void MatchAvx2Words(
+    const double* values, const size_t num_words,
+    const RangePredicate& predicate, uint64_t* out) {
+  const __m256d min = _mm256_set1_pd(predicate.min);
+  const __m256d max = _mm256_set1_pd(predicate.max);
+  for (size_t word = 0; word < num_words; ++word) {
+    const double* v = values + word * 64;
+    uint64_t bits = 0;
+    for (int i = 0; i < 16; ++i) {
+      const __m256d x = _mm256_loadu_pd(v + i * 4);
+      const __m256d match = _mm256_and_pd(_mm256_cmp_pd(x, min, kMinCompare),
+                                          _mm256_cmp_pd(x, max, kMaxCompare));
+      bits |= static_cast<uint64_t>(_mm256_movemask_pd(match)) << (i * 4);
+    }
+    out[word] = bits;
+  }
+}
+
+void MatchAvx2(const double* values, const size_t n,
+               const RangePredicate& predicate, uint64_t* out) {
+  const size_t num_words = n / 64;
+  // The ordered (_OQ) comparisons are false for NaN, so missing values never
+  // match.
+  if (predicate.min_inclusive && predicate.max_inclusive) {
+    MatchAvx2Words<_CMP_GE_OQ, _CMP_LE_OQ>(values, num_words, predicate, out);
+  } else if (predicate.min_inclusive) {
+    MatchAvx2Words<_CMP_GE_OQ, _CMP_LT_OQ>(values, num_words, predicate, out);
+  } else if (predicate.max_inclusive) {
+    MatchAvx2Words<_CMP_GT_OQ, _CMP_LE_OQ>(values, num_words, predicate, out);
+  } else {
+    MatchAvx2Words<_CMP_GT_OQ, _CMP_LT_OQ>(values, num_words, predicate, out);
+  }
+  MatchScalar(values + num_words * 64, n - num_words * 64, predicate,
+              out + num_words);
+}
+
+#endif  // CYCLING_X86
+
+void Match(const double* values, const size_t n,
+           const RangePredicate& predicate, uint64_t* out) {
+#ifdef CYCLING_X86
+  if (HasAvx2()) {
+    MatchAvx2(values, n, predicate, out);
+    return;
+  }
+#endif
+  MatchScalar(values, n, predicate, out);
+}
+
+// Returns the index of the first bit at or after i that equals value, or n if
+// there is none.
+size_t FindNext(const std::vector<uint64_t>& mask, const size_t n, size_t i,
+                const bool value) {
+  if (i >= n) return n;
+  size_t word = i / 64;
+  uint64_t bits = (value ? mask[word] : ~mask[word]) & (~0ULL << (i % 64));
+  while (bits == 0) {
+    if (++word == mask.size()) return n;
+    bits = value ? mask[word] : ~mask[word];
+  }
+  return std::min(n, word * 64 + __builtin_ctzll(bits));
+}
+
+}  // namespace
+
+RangePredicate RangePredicate::GreaterThan(const Measurement::Type type,
+                                           const double value) {
+  return {type, value, kInfinity, false, true};
+}
+
+RangePredicate RangePredicate::AtLeast(const Measurement::Type type,
+                                       const double value) {
+  return {type, value, kInfinity, true, true};
+}
+
+RangePredicate RangePredicate::LessThan(const Measurement::Type type,
+                                        const double value) {
+  return {type, -kInfinity, value, true, false};
+}
+
+RangePredicate RangePredicate::AtMost(const Measurement::Type type,
+                                      const double value) {
+  return {type, -kInfinity, value, true, true};
+}
+
+RangePredicate RangePredicate::Between(const Measurement::Type type,
+                                       const double min, const double max) {
+  return {type, min, max, true, true};
+}
+
+SampleQuery::SampleQuery(const Combiner combiner,
+                         const std::vector<RangePredicate>& predicates)
+    : combiner_(combiner), predicates_(predicates) {}
+
+std::vector<uint64_t> SampleQuery::Select(const TimeSeries& series) const {
+  const size_t n = series.num_samples();
+  std::vector<uint64_t> mask(NumWords(n), combiner_ == ALL_OF ? ~0ULL : 0);
+  if (n % 64 != 0 && !mask.empty()) mask.back() &= (1ULL << (n % 64)) - 1;
+  std::vector<uint64_t> matches(mask.size());
+  for (const RangePredicate& predicate : predicates_) {
+    const TimeSeries::ColumnPtr values = series.Values(predicate.type);
+    // The series may have grown since n was read; only look at the first n.
+    const size_t size = std::min(n, values->size());
+    std::fill(matches.begin(), matches.end(), 0);
+    Match(values->data(), size, predicate, matches.data());
+    for (size_t i = 0; i < mask.size(); ++i) {
+      if (combiner_ == ALL_OF) {
+        mask[i] &= matches[i];
+      } else {
+        mask[i] |= matches[i];
+      }
+    }
+  }
+  return mask;
+}
+
+std::vector<TimeSeries::Interval> SampleQuery::SelectIntervals(
+    const TimeSeries& series) const {
+  const std::vector<uint64_t> mask = Select(series);
+  const size_t n = mask.size() * 64;
+  std::vector<TimeSeries::Interval> intervals;
+  for (size_t begin = FindNext(mask, n, 0, true); begin < n;
+       begin = FindNext(mask, n, begin, true)) {
+    const size_t end = FindNext(mask, n, begin, false);
+    intervals.push_back({series.SampleTime(static_cast<int>(begin)),
+                         series.SampleTime(static_cast<int>(end - 1))});
+    begin = end;
+  }
+  return intervals;
+}
+
+}  // namespace cycling
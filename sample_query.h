@@ -0,0 +1,79 @@
+#ifndef __SAMPLE_QUERY_H__
+#define __SAMPLE_QUERY_H__
+
+#include <cstdint>
+#include <vector>
+
+#include "measurement.h"
+#include "time_series.h"
+
+namespace cycling {
+
+// Checks that the value of one channel lies within a range. Samples that lack
+// the channel never match.
+struct RangePredicate {
+  static RangePredicate GreaterThan(const Measurement::Type type,
+                                    const double value);
+  static RangePredicate AtLeast(const Measurement::Type type,
+                                const double value);
+  static RangePredicate LessThan(const Measurement::Type type,
+                                 const double value);
+  static RangePredicate AtMost(const Measurement::Type type,
+                               const double value);
+  // Matches min <= value <= max.
+  static RangePredicate Between(const Measurement::Type type, const double min,
+                                const double max);
+
+  Measurement::Type type;
+  // Values are in the base unit of type, as in TimeSeries::Values().
+  double min;
+  double max;
+  bool min_inclusive;
+  bool max_inclusive;
+};
+
+// A conjunction or disjunction of RangePredicates that is evaluated over whole
+// channels at once. Each predicate is a single pass of SIMD comparisons over
+// one column (AVX2 when the CPU has it), producing one bit per sample, so a
+// query costs about as much as reading the columns it touches.
+//
+// E.g. all seconds with POWER > 300, HEART_RATE < 150 and CADENCE > 90:
+//   SampleQuery query(SampleQuery::ALL_OF,
+//                     {RangePredicate::GreaterThan(Measurement::POWER, 300),
+//                      RangePredicate::LessThan(Measurement::HEART_RATE, 150),
+//                      RangePredicate::GreaterThan(Measurement::CADENCE, 90)});
+//   series.Visit(query.SelectIntervals(series), visitor);
+class SampleQuery {
+ public:
+  enum Combiner {
+    // A sample is selected if it matches every predicate, or if there are no
+    // predicates.
+    ALL_OF,
+    // A sample is selected if it matches at least one predicate.
+    ANY_OF,
+  };
+
+  SampleQuery(const Combiner combiner,
+              const std::vector<RangePredicate>& predicates);
+  SampleQuery(const SampleQuery&) = default;
+  SampleQuery& operator=(const SampleQuery&) = default;
+  ~SampleQuery() = default;
+
+  // Returns one bit per sample of series: bit (i % 64) of word (i / 64) is set
+  // iff sample i is selected. Bits past the last sample are clear.
+  std::vector<uint64_t> Select(const TimeSeries& series) const;
+
+  // Returns the runs of consecutive selected samples as intervals from the
+  // time of the first sample of the run to the time of the last. The result
+  // can be passed straight to TimeSeries::Visit().
+  std::vector<TimeSeries::Interval> SelectIntervals(
+      const TimeSeries& series) const;
+
+ private:
+  Combiner combiner_;
+  std::vector<RangePredicate> predicates_;
+};
+
+}  // namespace cycling
+
+#endif  // __SAMPLE_QUERY_H__
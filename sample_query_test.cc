@@ -0,0 +1,137 @@
+#include "sample_query.h"
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "measurement.h"
+
+namespace cycling {
+namespace {
+
+using TimePoint = TimeSeries::TimePoint;
+
+const TimePoint kStart = TimePoint() + std::chrono::hours(24 * 365 * 40);
+
+TimePoint At(const int seconds) {
+  return kStart + std::chrono::seconds(seconds);
+}
+
+// Adds samples with random power, heart rate and cadence. Every measurement is
+// missing from about one sample in ten.
+void AddRandomSamples(const int num_samples, TimeSeries* series) {
+  std::mt19937 random(num_samples);
+  std::uniform_int_distribution<int> watts(0, 500), bpm(80, 190),
+      rpm(60, 120), missing(0, 9);
+  for (int i = 0; i < num_samples; ++i) {
+    TimeSample sample(At(i));
+    if (missing(random) != 0) {
+      sample.Add(Measurement(Measurement::POWER, watts(random)));
+    }
+    if (missing(random) != 0) {
+      sample.Add(Measurement(Measurement::HEART_RATE, bpm(random)));
+    }
+    if (missing(random) != 0) {
+      sample.Add(Measurement(Measurement::CADENCE, rpm(random)));
+    }
+    series->Add(sample);
+  }
+}
+
+bool Matches(const RangePredicate& p, const TimeSample& sample) {
+  if (!sample.has_value(p.type)) return false;
+  const double v = sample.coef(p.type);
+  return (p.min_inclusive ? v >= p.min : v > p.min) &&
+         (p.max_inclusive ? v <= p.max : v < p.max);
+}
+
+// The straightforward per-sample evaluation of the query.
+std::vector<bool> Expected(const TimeSeries& series,
+                           const SampleQuery::Combiner combiner,
+                           const std::vector<RangePredicate>& predicates) {
+  std::vector<bool> expected;
+  series.Visit(series.BeginTime(), series.EndTime(),
+               [&](const TimeSample& sample) {
+                 bool selected = combiner == SampleQuery::ALL_OF;
+                 for (const RangePredicate& p : predicates) {
+                   if (combiner == SampleQuery::ALL_OF) {
+                     selected = selected && Matches(p, sample);
+                   } else {
+                     selected = selected || Matches(p, sample);
+                   }
+                 }
+                 expected.push_back(selected);
+               });
+  return expected;
+}
+
+class SampleQueryTest : public ::testing::TestWithParam<int> {};
+
+TEST_P(SampleQueryTest, MatchesPerSampleEvaluation) {
+  TimeSeries series;
+  AddRandomSamples(GetParam(), &series);
+  const std::vector<std::vector<RangePredicate>> queries = {
+      {},
+      {RangePredicate::GreaterThan(Measurement::POWER, 300)},
+      {RangePredicate::GreaterThan(Measurement::POWER, 300),
+       RangePredicate::LessThan(Measurement::HEART_RATE, 150),
+       RangePredicate::GreaterThan(Measurement::CADENCE, 90)},
+      {RangePredicate::AtLeast(Measurement::POWER, 250),
+       RangePredicate::AtMost(Measurement::HEART_RATE, 100)},
+      {RangePredicate::Between(Measurement::CADENCE, 85, 95),
+       RangePredicate::Between(Measurement::SPEED, 0, 100)},
+  };
+  for (const auto combiner : {SampleQuery::ALL_OF, SampleQuery::ANY_OF}) {
+    for (const auto& predicates : queries) {
+      const std::vector<bool> expected =
+          Expected(series, combiner, predicates);
+      const std::vector<uint64_t> mask =
+          SampleQuery(combiner, predicates).Select(series);
+      ASSERT_EQ(mask.size(), (GetParam() + 63) / 64);
+      for (int i = 0; i < static_cast<int>(mask.size()) * 64; ++i) {
+        const bool selected = (mask[i / 64] >> (i % 64)) & 1;
+        ASSERT_EQ(selected, i < GetParam() && expected[i])
+            << "sample " << i << " of " << GetParam();
+      }
+    }
+  }
+}
+
+INSTANTIATE_TEST_CASE_P(Sizes, SampleQueryTest,
+                        ::testing::Values(1, 63, 64, 65, 200, 1000, 3600));
+
+TEST(SampleQueryIntervalsTest, RunsAndVisit) {
+  TimeSeries series;
+  const std::vector<int> watts = {100, 350, 360, 100, 100, 400, 0, 310, 320};
+  for (int i = 0; i < static_cast<int>(watts.size()); ++i) {
+    series.Add(TimeSample(At(i), Measurement(Measurement::POWER, watts[i])));
+  }
+  const SampleQuery query(
+      SampleQuery::ALL_OF,
+      {RangePredicate::GreaterThan(Measurement::POWER, 300)});
+  const std::vector<TimeSeries::Interval> intervals =
+      query.SelectIntervals(series);
+  const std::vector<TimeSeries::Interval> expected = {
+      {At(1), At(2)}, {At(5), At(5)}, {At(7), At(8)}};
+  EXPECT_EQ(intervals, expected);
+
+  std::vector<double> visited;
+  series.Visit(intervals, Measurement::POWER,
+               [&visited](const TimePoint& /*time*/, const double coef) {
+                 visited.push_back(coef);
+               });
+  EXPECT_THAT(visited, ::testing::ElementsAre(350, 360, 400, 310, 320));
+}
+
+TEST(SampleQueryIntervalsTest, Empty) {
+  TimeSeries series;
+  const SampleQuery query(SampleQuery::ALL_OF, {});
+  EXPECT_TRUE(query.Select(series).empty());
+  EXPECT_TRUE(query.SelectIntervals(series).empty());
+}
+
+}  // namespace
+}  // namespace cycling
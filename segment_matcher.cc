@@ -0,0 +1,367 @@
+#include "segment_matcher.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+#include "geo_util.h"
+#include "measurement.h"
+#include "parallel.h"
+
+namespace cycling {
+
+namespace {
+
+using TimePoint = SegmentEffort::TimePoint;
+using geo_util::kMetersPerDegree;
+using geo_util::kRadians;
+using geo_util::WrappedDegrees;
+
+// The number of consecutive positions that share a bounding box.
+const size_t kChunkSize = 64;
+
+// A position in meters east and north of the origin of a Plane.
+struct XY {
+  double x;
+  double y;
+};
+
+double Dot(const XY& a, const XY& b) { return a.x * b.x + a.y * b.y; }
+double Cross(const XY& a, const XY& b) { return a.x * b.y - a.y * b.x; }
+XY Minus(const XY& a, const XY& b) { return {a.x - b.x, a.y - b.y}; }
+
+// The equirectangular projection around a segment. Scale errors grow with
+// the distance from the origin, but a ride and a segment are projected the
+// same way, so distances between nearby points stay accurate.
+struct Plane {
+  double lat;
+  double lon;
+  double meters_per_degree_lon;
+
+  XY Project(const double point_lat, const double point_lon) const {
+    return {WrappedDegrees(point_lon - lon) * meters_per_degree_lon,
+            (point_lat - lat) * kMetersPerDegree};
+  }
+};
+
+// A line across the road through center, perpendicular to direction (a unit
+// vector), reaching half_width to either side.
+struct Gate {
+  XY center;
+  XY direction;
+  double half_width;
+
+  // Returns where along a->b, in [0,1], the path crosses the gate heading in
+  // direction, or -1 if it doesn't.
+  double Crossing(const XY& a, const XY& b) const {
+    const double sa = Dot(Minus(a, center), direction);
+    const double sb = Dot(Minus(b, center), direction);
+    if (!(sa < 0 && sb >= 0)) return -1;
+    const double t = sa / (sa - sb);
+    const XY crossing = {a.x + t * (b.x - a.x), a.y + t * (b.y - a.y)};
+    return std::abs(Cross(Minus(crossing, center), direction)) <= half_width
+               ? t
+               : -1;
+  }
+};
+
+struct PreparedSegment {
+  Plane plane;
+  // The polyline without repeated points, and the distance along it up to
+  // each point.
+  std::vector<XY> points;
+  std::vector<double> along;
+  Gate start;
+  Gate finish;
+  // Holds the start gate. A ride that doesn't come near it can't match.
+  GeoBox start_box;
+};
+
+// The positions of a ride and where to look for them.
+struct Track {
+  // Only the samples that have a position, in order.
+  std::vector<double> lat;
+  std::vector<double> lon;
+  std::vector<double> seconds;
+  // Chunk c holds positions [c * kChunkSize, (c + 1) * kChunkSize], that is,
+  // every pair of consecutive positions starting in it.
+  std::vector<GeoBox> chunk_boxes;
+  GeoBox box;
+};
+
+XY Unit(const XY& v) {
+  const double length = std::hypot(v.x, v.y);
+  return {v.x / length, v.y / length};
+}
+
+bool Prepare(const RouteSegment& segment, const SegmentMatchOptions& options,
+             PreparedSegment* prepared) {
+  if (segment.polyline.empty()) return false;
+  const GeoPoint& origin = segment.polyline[0];
+  double min_lat = origin.lat, max_lat = origin.lat;
+  for (const GeoPoint& point : segment.polyline) {
+    min_lat = std::min(min_lat, point.lat);
+    max_lat = std::max(max_lat, point.lat);
+  }
+  prepared->plane = {origin.lat, origin.lon,
+                     kMetersPerDegree *
+                         std::cos((min_lat + max_lat) / 2 * kRadians)};
+  for (const GeoPoint& point : segment.polyline) {
+    const XY xy = prepared->plane.Project(point.lat, point.lon);
+    if (prepared->points.empty()) {
+      prepared->points.push_back(xy);
+      prepared->along.push_back(0);
+      continue;
+    }
+    const double length = std::hypot(xy.x - prepared->points.back().x,
+                                     xy.y - prepared->points.back().y);
+    if (length < 1e-6) continue;
+    prepared->points.push_back(xy);
+    prepared->along.push_back(prepared->along.back() + length);
+  }
+  const std::vector<XY>& points = prepared->points;
+  const size_t n = points.size();
+  if (n < 2) return false;
+  prepared->start = {points[0], Unit(Minus(points[1], points[0])),
+                     options.gate_meters};
+  prepared->finish = {points[n - 1], Unit(Minus(points[n - 1], points[n - 2])),
+                      options.gate_meters};
+  // A little extra so that rounding doesn't lose a crossing at the very end
+  // of the gate.
+  const double reach = options.gate_meters + 1;
+  const double lat_reach = reach / kMetersPerDegree;
+  const double lon_reach = reach / prepared->plane.meters_per_degree_lon;
+  prepared->start_box = {origin.lat - lat_reach, origin.lon - lon_reach,
+                         origin.lat + lat_reach, origin.lon + lon_reach};
+  return true;
+}
+
+void Extend(const double lat, const double lon, GeoBox* box) {
+  box->min_lat = std::min(box->min_lat, lat);
+  box->max_lat = std::max(box->max_lat, lat);
+  box->min_lon = std::min(box->min_lon, lon);
+  box->max_lon = std::max(box->max_lon, lon);
+}
+
+Track ExtractTrack(const TimeSeries& series) {
+  Track track;
+  const double kInfinity = std::numeric_limits<double>::infinity();
+  const GeoBox kEmpty = {kInfinity, kInfinity, -kInfinity, -kInfinity};
+  track.box = kEmpty;
+  if (series.num_samples() == 0) return track;
+  const TimeSeries::ColumnPtr lat =
+      series.Values(Measurement::DEGREES_LATITUDE);
+  const TimeSeries::ColumnPtr lon =
+      series.Values(Measurement::DEGREES_LONGITUDE);
+  const TimeSeries::ColumnPtr seconds = series.Seconds();
+  for (size_t i = 0; i < lat->size(); ++i) {
+    if (std::isnan((*lat)[i]) || std::isnan((*lon)[i])) continue;
+    track.lat.push_back((*lat)[i]);
+    track.lon.push_back((*lon)[i]);
+    track.seconds.push_back((*seconds)[i]);
+  }
+  const size_t n = track.lat.size();
+  for (size_t begin = 0; begin + 1 < n; begin += kChunkSize) {
+    GeoBox box = kEmpty;
+    for (size_t i = begin; i <= std::min(begin + kChunkSize, n - 1); ++i) {
+      Extend(track.lat[i], track.lon[i], &box);
+    }
+    track.chunk_boxes.push_back(box);
+    Extend(box.min_lat, box.min_lon, &track.box);
+    Extend(box.max_lat, box.max_lon, &track.box);
+  }
+  return track;
+}
+
+// Whether the boxes overlap. b must not wrap; a track crossing the
+// antimeridian gets a box spanning every longitude, which is merely slow.
+bool Overlaps(const GeoBox& a, const GeoBox& b) {
+  if (a.max_lat < b.min_lat || b.max_lat < a.min_lat) return false;
+  for (const double shift : {-360.0, 0.0, 360.0}) {
+    if (a.min_lon <= b.max_lon + shift && b.min_lon + shift <= a.max_lon) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Follows track from the pair (i, i + 1), which crosses the start gate at
+// start_fraction, along the corridor of segment. On success, returns true
+// with the pair (*end - 1, *end) crossing the finish gate at *end_fraction.
+bool Follow(const PreparedSegment& segment, const Track& track, const size_t i,
+            const double start_fraction, const double corridor_meters,
+            size_t* end, double* end_fraction) {
+  const std::vector<XY>& points = segment.points;
+  const std::vector<double>& along = segment.along;
+  const size_t last_leg = points.size() - 2;
+  const double length = along.back();
+  size_t leg = 0;
+  double progress = 0;
+  XY previous = segment.plane.Project(track.lat[i], track.lon[i]);
+  for (size_t j = i + 1; j < track.lat.size(); ++j) {
+    const XY point = segment.plane.Project(track.lat[j], track.lon[j]);
+    // Nothing past here is within reach of this step.
+    const double reach =
+        progress + std::hypot(point.x - previous.x, point.y - previous.y) +
+        corridor_meters;
+    if (reach >= length) {
+      const double fraction = segment.finish.Crossing(previous, point);
+      if (fraction >= 0 && (j > i + 1 || fraction > start_fraction)) {
+        *end = j;
+        *end_fraction = fraction;
+        return true;
+      }
+    }
+    // Find the nearest point of the polyline, looking only ahead of the last
+    // one so that loops and switchbacks aren't matched out of order.
+    double best = std::numeric_limits<double>::infinity();
+    for (size_t m = leg; m <= last_leg && along[m] <= reach; ++m) {
+      const XY a = points[m];
+      const XY direction = Minus(points[m + 1], a);
+      const double leg_length = along[m + 1] - along[m];
+      const double t = std::max(
+          0.0, std::min(1.0, Dot(Minus(point, a), direction) /
+                                 (leg_length * leg_length)));
+      const double distance = std::hypot(point.x - a.x - t * direction.x,
+                                         point.y - a.y - t * direction.y);
+      if (distance < best) {
+        best = distance;
+        leg = m;
+        progress = along[m] + t * leg_length;
+      }
+    }
+    if (best > corridor_meters) return false;
+    previous = point;
+  }
+  return false;
+}
+
+double Interpolate(const std::vector<double>& seconds, const size_t j,
+                   const double fraction) {
+  return seconds[j] + fraction * (seconds[j + 1] - seconds[j]);
+}
+
+// The mean of the values of column between seconds begin and end, or 0.
+double Average(const TimeSeries::Column& seconds,
+               const TimeSeries::Column& column, const double begin,
+               const double end) {
+  const size_t first =
+      std::lower_bound(seconds.begin(), seconds.end(), begin) -
+      seconds.begin();
+  double sum = 0;
+  int count = 0;
+  for (size_t i = first; i < seconds.size() && seconds[i] <= end; ++i) {
+    if (std::isnan(column[i])) continue;
+    sum += column[i];
+    ++count;
+  }
+  return count > 0 ? sum / count : 0;
+}
+
+TimePoint ToTimePoint(const TimePoint& begin, const double seconds) {
+  return begin + std::chrono::duration_cast<TimePoint::duration>(
+                     std::chrono::duration<double>(seconds));
+}
+
+// Appends every traversal of the segments by the ride to efforts, as
+// (segment index, effort).
+void MatchRide(const std::vector<PreparedSegment>& segments,
+               const std::vector<int>& segment_indexes,
+               const TimeSeries& series, const int ride,
+               const double corridor_meters,
+               std::vector<std::pair<int, SegmentEffort>>* efforts) {
+  const Track track = ExtractTrack(series);
+  if (track.chunk_boxes.empty()) return;
+  TimeSeries::ColumnPtr seconds, power, heart_rate;
+  for (size_t s = 0; s < segments.size(); ++s) {
+    const PreparedSegment& segment = segments[s];
+    if (!Overlaps(track.box, segment.start_box)) continue;
+    // The first pair that may start a traversal, past the end of the last
+    // one.
+    size_t resume = 0;
+    for (size_t c = 0; c < track.chunk_boxes.size(); ++c) {
+      if (!Overlaps(track.chunk_boxes[c], segment.start_box)) continue;
+      const size_t chunk_end =
+          std::min((c + 1) * kChunkSize, track.lat.size() - 1);
+      for (size_t i = std::max(c * kChunkSize, resume); i < chunk_end; ++i) {
+        const double start_fraction = segment.start.Crossing(
+            segment.plane.Project(track.lat[i], track.lon[i]),
+            segment.plane.Project(track.lat[i + 1], track.lon[i + 1]));
+        if (start_fraction < 0) continue;
+        size_t end;
+        double end_fraction;
+        if (!Follow(segment, track, i, start_fraction, corridor_meters, &end,
+                    &end_fraction)) {
+          continue;
+        }
+        if (seconds == nullptr) {
+          seconds = series.Seconds();
+          power = series.Values(Measurement::POWER);
+          heart_rate = series.Values(Measurement::HEART_RATE);
+        }
+        const double begin_seconds =
+            Interpolate(track.seconds, i, start_fraction);
+        const double end_seconds =
+            Interpolate(track.seconds, end - 1, end_fraction);
+        SegmentEffort effort;
+        effort.ride = ride;
+        effort.begin = ToTimePoint(series.BeginTime(), begin_seconds);
+        effort.end = ToTimePoint(series.BeginTime(), end_seconds);
+        effort.elapsed_seconds = end_seconds - begin_seconds;
+        effort.average_power =
+            Average(*seconds, *power, begin_seconds, end_seconds);
+        effort.average_heart_rate =
+            Average(*seconds, *heart_rate, begin_seconds, end_seconds);
+        efforts->emplace_back(segment_indexes[s], effort);
+        // The pair that crossed the finish may also start the next lap.
+        resume = std::max(end - 1, i + 1);
+        i = resume - 1;
+      }
+    }
+  }
+}
+
+}  // namespace
+
+std::vector<std::vector<SegmentEffort>> MatchSegments(
+    const std::vector<RouteSegment>& segments,
+    const std::vector<const TimeSeries*>& rides,
+    const SegmentMatchOptions& options, const int num_threads) {
+  std::vector<PreparedSegment> prepared;
+  std::vector<int> segment_indexes;
+  for (size_t s = 0; s < segments.size(); ++s) {
+    PreparedSegment segment;
+    if (!Prepare(segments[s], options, &segment)) continue;
+    prepared.push_back(std::move(segment));
+    segment_indexes.push_back(s);
+  }
+
+  std::vector<std::vector<std::pair<int, SegmentEffort>>> ride_efforts(
+      rides.size());
+  ParallelFor(rides.size(), num_threads, [&](const int, const size_t i) {
+    MatchRide(prepared, segment_indexes, *rides[i], i, options.corridor_meters,
+              &ride_efforts[i]);
+  });
+
+  std::vector<std::vector<SegmentEffort>> efforts(segments.size());
+  for (const auto& ride : ride_efforts) {
+    for (const auto& effort : ride) {
+      efforts[effort.first].push_back(effort.second);
+    }
+  }
+  for (std::vector<SegmentEffort>& leaderboard : efforts) {
+    std::sort(leaderboard.begin(), leaderboard.end(),
+              [](const SegmentEffort& a, const SegmentEffort& b) {
+                if (a.elapsed_seconds != b.elapsed_seconds) {
+                  return a.elapsed_seconds < b.elapsed_seconds;
+                }
+                if (a.ride != b.ride) return a.ride < b.ride;
+                return a.begin < b.begin;
+              });
+  }
+  return efforts;
+}
+
+}  // namespace cycling
@@ -0,0 +1,59 @@
+#ifndef __SEGMENT_MATCHER_H__
+#define __SEGMENT_MATCHER_H__
+
+#include <vector>
+
+#include "spatial_index.h"
+#include "time_series.h"
+
+namespace cycling {
+
+// A stretch of road that rides are compared on, e.g. a climb.
+struct RouteSegment {
+  // The road from the start to the finish, at least two distinct points.
+  std::vector<GeoPoint> polyline;
+};
+
+// One traversal of a RouteSegment by a ride.
+struct SegmentEffort {
+  using TimePoint = TimeSeries::TimePoint;
+
+  // The index of the ride in the library.
+  int ride;
+  // When the ride crossed the start and finish gates, interpolated between
+  // the samples on either side.
+  TimePoint begin;
+  TimePoint end;
+  double elapsed_seconds;
+  // The mean of the samples between begin and end, or 0 if there were none.
+  double average_power;
+  double average_heart_rate;
+};
+
+struct SegmentMatchOptions {
+  // The gates are lines across the road at the first and the last point of
+  // the polyline, reaching this far to either side. A traversal starts when
+  // a ride crosses the start gate heading along the segment.
+  double gate_meters = 25;
+  // Between the gates, every position of the ride must be this close to the
+  // polyline, or the attempt is dropped.
+  double corridor_meters = 30;
+};
+
+// Finds every traversal of every segment in the DEGREES_LATITUDE and
+// DEGREES_LONGITUDE channels of rides, on num_threads threads. The result at
+// index i holds the efforts on segments[i], fastest first.
+//
+// Each ride's track is cut into short chunks with a bounding box each, so a
+// segment is only tried where its start gate lies within a chunk; the track
+// is then followed from the gate along the corridor. Segments are assumed to
+// be short enough (tens of kilometers) that a flat projection around them is
+// accurate.
+std::vector<std::vector<SegmentEffort>> MatchSegments(
+    const std::vector<RouteSegment>& segments,
+    const std::vector<const TimeSeries*>& rides,
+    const SegmentMatchOptions& options, const int num_threads);
+
+}  // namespace cycling
+
+#endif  // __SEGMENT_MATCHER_H__
@@ -0,0 +1,176 @@
+#include "segment_matcher.h"
+
+#include <cmath>
+#include <random>
+
+#include "geo_util.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "ride_test_util.h"
+
+namespace cycling {
+namespace {
+
+using ::testing::DoubleNear;
+using ::testing::ElementsAre;
+using ::testing::Field;
+using ::testing::IsEmpty;
+using ::testing::SizeIs;
+
+using geo_util::kMetersPerDegree;
+using geo_util::kRadians;
+
+// The positions of a rider going along route at speed meters per second,
+// one per second.
+std::vector<GeoPoint> Ride(const std::vector<GeoPoint>& route,
+                           const double speed) {
+  std::vector<GeoPoint> points;
+  double carry = 0;
+  for (size_t i = 0; i + 1 < route.size(); ++i) {
+    const GeoPoint& a = route[i];
+    const GeoPoint& b = route[i + 1];
+    const double length =
+        geo_util::Distance(geo_util::EQUIRECTANGULAR, a.lat, a.lon, b.lat,
+                           b.lon);
+    for (double d = carry; d < length; d += speed) {
+      const double f = d / length;
+      points.push_back(
+          {a.lat + f * (b.lat - a.lat), a.lon + f * (b.lon - a.lon)});
+      carry = d + speed - length;
+    }
+  }
+  return points;
+}
+
+// meters north of p.
+GeoPoint North(const GeoPoint& p, const double meters) {
+  return {p.lat + meters / kMetersPerDegree, p.lon};
+}
+
+// meters east of p.
+GeoPoint East(const GeoPoint& p, const double meters) {
+  return {p.lat,
+          p.lon + meters / kMetersPerDegree /
+                      std::cos(p.lat * kRadians)};
+}
+
+const GeoPoint kBottom = {47.6, -122.35};
+
+class SegmentMatcherTest : public ::testing::Test {
+ protected:
+  std::vector<const TimeSeries*> Library() const {
+    std::vector<const TimeSeries*> library;
+    for (const auto& ride : rides_) library.push_back(ride.get());
+    return library;
+  }
+
+  std::vector<std::unique_ptr<TimeSeries>> rides_;
+};
+
+TEST_F(SegmentMatcherTest, StraightClimb) {
+  // 1 km north, drawn with a kink that the rides don't follow exactly.
+  const RouteSegment climb = {
+      {kBottom, East(North(kBottom, 500), 5), North(kBottom, 1000)}};
+  // Through the whole climb at 5 m/s, and at 10 m/s with a GPS dropout.
+  rides_.push_back(MakeRide(
+      Ride({North(kBottom, -200), North(kBottom, 1200)}, 5), 0, 250));
+  std::vector<GeoPoint> dropout =
+      Ride({North(kBottom, -200), North(kBottom, 1200)}, 10);
+  for (int i = 50; i < 60; ++i) dropout[i] = {std::nan(""), std::nan("")};
+  rides_.push_back(MakeRide(dropout, 10000, 400));
+  // Down the climb, only half of it, and off the road in the middle.
+  rides_.push_back(MakeRide(
+      Ride({North(kBottom, 1200), North(kBottom, -200)}, 5), 0, 100));
+  rides_.push_back(MakeRide(
+      Ride({North(kBottom, -200), North(kBottom, 500)}, 5), 0, 100));
+  rides_.push_back(MakeRide(Ride({North(kBottom, -200), North(kBottom, 400),
+                                  East(North(kBottom, 500), 100),
+                                  North(kBottom, 600), North(kBottom, 1200)},
+                                 5),
+                            0, 100));
+
+  const auto efforts =
+      MatchSegments({climb}, Library(), SegmentMatchOptions(), 2);
+  ASSERT_THAT(efforts, SizeIs(1));
+  ASSERT_THAT(efforts[0], ElementsAre(Field(&SegmentEffort::ride, 1),
+                                      Field(&SegmentEffort::ride, 0)));
+  const SegmentEffort& fast = efforts[0][0];
+  EXPECT_THAT(fast.elapsed_seconds, DoubleNear(100, 0.01));
+  EXPECT_EQ(fast.begin, RideTime(10020));
+  EXPECT_EQ(fast.end, RideTime(10120));
+  EXPECT_EQ(fast.average_power, 400);
+  EXPECT_EQ(fast.average_heart_rate, 150);
+  const SegmentEffort& slow = efforts[0][1];
+  EXPECT_THAT(slow.elapsed_seconds, DoubleNear(200, 0.01));
+  EXPECT_EQ(slow.average_power, 250);
+}
+
+TEST_F(SegmentMatcherTest, Laps) {
+  // A 400 m square, starting and finishing halfway up the first side.
+  const GeoPoint a = kBottom;
+  const GeoPoint b = North(a, 100);
+  const GeoPoint c = East(b, 100);
+  const GeoPoint d = East(a, 100);
+  const GeoPoint start = North(a, 50);
+  const RouteSegment lap = {{start, b, c, d, a, start}};
+  // Three and a bit laps, which pass the start four times.
+  rides_.push_back(
+      MakeRide(Ride({a, b, c, d, a, b, c, d, a, b, c, d, a, b}, 8)));
+  // The short segment up the first side is ridden four times.
+  const RouteSegment side = {{North(a, 10), North(a, 90)}};
+  const auto efforts =
+      MatchSegments({lap, side, {{a}}}, Library(), SegmentMatchOptions(), 1);
+  ASSERT_THAT(efforts, SizeIs(3));
+  ASSERT_THAT(efforts[0], SizeIs(3));
+  for (const SegmentEffort& effort : efforts[0]) {
+    EXPECT_THAT(effort.elapsed_seconds, DoubleNear(50, 0.01));
+  }
+  EXPECT_THAT(efforts[1], SizeIs(4));
+  // A segment without length can't be matched.
+  EXPECT_THAT(efforts[2], IsEmpty());
+}
+
+TEST_F(SegmentMatcherTest, ParallelMatchesSerial) {
+  std::mt19937 random(3);
+  std::normal_distribution<double> wobble(0, 3);
+  std::uniform_real_distribution<double> speed(4, 12);
+  std::vector<RouteSegment> segments;
+  for (int s = 0; s < 10; ++s) {
+    const GeoPoint start = East(kBottom, 300 * s);
+    segments.push_back(
+        {{start, North(start, 300), East(North(start, 300), 300)}});
+  }
+  for (int r = 0; r < 30; ++r) {
+    const GeoPoint start = North(East(kBottom, 300 * (r % 10)), -100);
+    std::vector<GeoPoint> points =
+        Ride({start, North(start, 400), East(North(start, 400), 400)},
+             speed(random));
+    for (GeoPoint& point : points) {
+      point = East(North(point, wobble(random)), wobble(random));
+    }
+    rides_.push_back(MakeRide(points, 1000 * r, r));
+  }
+  const auto serial =
+      MatchSegments(segments, Library(), SegmentMatchOptions(), 1);
+  const auto parallel =
+      MatchSegments(segments, Library(), SegmentMatchOptions(), 4);
+  ASSERT_EQ(serial.size(), parallel.size());
+  int matched = 0;
+  for (size_t s = 0; s < serial.size(); ++s) {
+    ASSERT_EQ(serial[s].size(), parallel[s].size());
+    for (size_t i = 0; i < serial[s].size(); ++i) {
+      EXPECT_EQ(serial[s][i].ride, parallel[s][i].ride);
+      EXPECT_EQ(serial[s][i].begin, parallel[s][i].begin);
+      EXPECT_EQ(serial[s][i].elapsed_seconds, parallel[s][i].elapsed_seconds);
+      if (i > 0) {
+        EXPECT_LE(serial[s][i - 1].elapsed_seconds,
+                  serial[s][i].elapsed_seconds);
+      }
+    }
+    matched += serial[s].size();
+  }
+  EXPECT_EQ(matched, 30);
+}
+
+}  // namespace
+}  // namespace cycling
@@ -0,0 +1,40 @@
+#include "segmentation.h"
+
+#include "measurement.h"
+
+namespace cycling {
+
+bool Segment::operator==(const Segment& rhs) const {
+  return kind == rhs.kind && begin_index == rhs.begin_index &&
+         end_index == rhs.end_index && begin == rhs.begin && end == rhs.end;
+}
+
+std::vector<Segment> SegmentSamples(const std::vector<TimeSample>& samples,
+                                    const SegmentationOptions& options) {
+  std::vector<Segment> segments;
+  Segment::Kind kind = Segment::MOVING;
+  for (int i = 0; i < static_cast<int>(samples.size()); ++i) {
+    const TimeSample& sample = samples[i];
+    bool new_segment = segments.empty();
+    if (i > 0 &&
+        sample.time() - samples[i - 1].time() > options.max_sample_gap) {
+      segments.push_back(
+          {Segment::GAP, i, i, samples[i - 1].time(), sample.time()});
+      new_segment = true;
+    }
+    if (sample.has_value(Measurement::SPEED)) {
+      kind = sample.value(Measurement::SPEED).coef() < options.min_moving_speed
+                 ? Segment::STOPPED
+                 : Segment::MOVING;
+    }
+    if (new_segment || segments.back().kind != kind) {
+      segments.push_back({kind, i, i + 1, sample.time(), sample.time()});
+    } else {
+      segments.back().end_index = i + 1;
+      segments.back().end = sample.time();
+    }
+  }
+  return segments;
+}
+
+}  // namespace cycling
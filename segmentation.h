@@ -0,0 +1,55 @@
+#ifndef __SEGMENTATION_H__
+#define __SEGMENTATION_H__
+
+#include <chrono>
+#include <vector>
+
+#include "time_sample.h"
+
+namespace cycling {
+
+// A maximal run of consecutive samples in which the athlete was either moving
+// or stopped, or a hole in the recording between two samples.
+struct Segment {
+  using TimePoint = TimeSample::TimePoint;
+
+  enum Kind {
+    MOVING,
+    STOPPED,
+    // No samples were recorded between begin and end. begin_index ==
+    // end_index, and both point at the first sample after the gap.
+    GAP,
+  };
+  Kind kind;
+
+  // The samples in the segment are [begin_index, end_index).
+  int begin_index;
+  int end_index;
+
+  // The times of the first and last samples in the segment. For a GAP, these
+  // are the times of the samples on either side of the gap.
+  TimePoint begin;
+  TimePoint end;
+
+  bool operator==(const Segment& rhs) const;
+  bool operator!=(const Segment& rhs) const { return !(*this == rhs); }
+};
+
+struct SegmentationOptions {
+  // Samples whose SPEED is below this, in m/s, are considered stopped.
+  // Samples without a SPEED measurement keep the state of the sample before
+  // them, and are considered moving if there is no such sample.
+  double min_moving_speed = 0.5;
+  // Consecutive samples further apart than this are separated by a GAP.
+  std::chrono::system_clock::duration max_sample_gap = std::chrono::seconds(10);
+};
+
+// Splits samples, which must be sorted by time, into segments in a single
+// pass. Every sample belongs to exactly one MOVING or STOPPED segment, and the
+// segments are returned in time order.
+std::vector<Segment> SegmentSamples(const std::vector<TimeSample>& samples,
+                                    const SegmentationOptions& options);
+
+}  // namespace cycling
+
+#endif  // __SEGMENTATION_H__
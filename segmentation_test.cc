@@ -0,0 +1,78 @@
+#include "segmentation.h"
+
+#include <chrono>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "measurement.h"
+
+namespace cycling {
+namespace {
+
+using TimePoint = Segment::TimePoint;
+
+TimePoint At(const int seconds) {
+  return TimePoint() + std::chrono::seconds(seconds);
+}
+
+TimeSample Speed(const int seconds, const double m_s) {
+  return TimeSample(At(seconds), Measurement(Measurement::SPEED, m_s));
+}
+
+TimeSample Hr(const int seconds) {
+  return TimeSample(At(seconds), Measurement(Measurement::HEART_RATE, 120));
+}
+
+TEST(SegmentationTest, Empty) {
+  EXPECT_TRUE(SegmentSamples({}, SegmentationOptions()).empty());
+}
+
+TEST(SegmentationTest, AllMoving) {
+  const std::vector<TimeSample> samples = {Speed(0, 5), Speed(1, 5),
+                                           Speed(2, 6)};
+  const std::vector<Segment> expected = {{Segment::MOVING, 0, 3, At(0), At(2)}};
+  EXPECT_EQ(SegmentSamples(samples, SegmentationOptions()), expected);
+}
+
+TEST(SegmentationTest, NoSpeedIsMoving) {
+  const std::vector<TimeSample> samples = {Hr(0), Hr(1), Hr(2)};
+  const std::vector<Segment> expected = {{Segment::MOVING, 0, 3, At(0), At(2)}};
+  EXPECT_EQ(SegmentSamples(samples, SegmentationOptions()), expected);
+}
+
+TEST(SegmentationTest, StopsAndGaps) {
+  const std::vector<TimeSample> samples = {
+      Speed(0, 5), Speed(1, 5),   Speed(2, 0.1), Hr(3),
+      Speed(4, 0), Speed(5, 4),   Hr(6),         Speed(60, 4),
+      Speed(61, 0), Speed(100, 0),
+  };
+  const std::vector<Segment> expected = {
+      {Segment::MOVING, 0, 2, At(0), At(1)},
+      {Segment::STOPPED, 2, 5, At(2), At(4)},
+      {Segment::MOVING, 5, 7, At(5), At(6)},
+      {Segment::GAP, 7, 7, At(6), At(60)},
+      {Segment::MOVING, 7, 8, At(60), At(60)},
+      {Segment::STOPPED, 8, 9, At(61), At(61)},
+      {Segment::GAP, 9, 9, At(61), At(100)},
+      {Segment::STOPPED, 9, 10, At(100), At(100)},
+  };
+  EXPECT_EQ(SegmentSamples(samples, SegmentationOptions()), expected);
+}
+
+TEST(SegmentationTest, Options) {
+  SegmentationOptions options;
+  options.min_moving_speed = 2;
+  options.max_sample_gap = std::chrono::seconds(60);
+  const std::vector<TimeSample> samples = {Speed(0, 1.5), Speed(30, 1.5),
+                                           Speed(31, 2.5)};
+  const std::vector<Segment> expected = {
+      {Segment::STOPPED, 0, 2, At(0), At(30)},
+      {Segment::MOVING, 2, 3, At(31), At(31)},
+  };
+  EXPECT_EQ(SegmentSamples(samples, options), expected);
+}
+
+}  // namespace
+}  // namespace cycling
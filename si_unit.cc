@@ -71,7 +71,7 @@ std::string SiUnit::ToString() const {
   if (*this == Joule()) return "J";
   if (*this == Watt()) return "W";
   if (*this == MetersPerSecond()) return "m/s";
-  static std::map<SiBaseUnit, std::string> units = {
+  static const std::map<SiBaseUnit, std::string> units = {
       {SiBaseUnit::UNITLESS, ""},   {SiBaseUnit::AMPERE, "amp"},
       {SiBaseUnit::CANDELA, "can"}, {SiBaseUnit::KELVIN, "kelvin"},
       {SiBaseUnit::KILOGRAM, "kg"}, {SiBaseUnit::METER, "m"},
@@ -81,7 +81,7 @@ std::string SiUnit::ToString() const {
   if (units_.size() > 1) s += "(";
   for (const auto& p : units_) {
     if (s != "" && s != "(") s += " ";
-    s += units[p.first];
+    s += units.at(p.first);
     if (p.second != 1) {
       sprintf(buf, "%d", p.second);
       s += buf;
@@ -0,0 +1,393 @@
+#include "signal_filter.h"
+
+#include <cassert>
+#include <cmath>
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#include "cpu_features.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CYCLING_X86 1
+#endif
+
+namespace cycling {
+
+namespace {
+
+const double kNaN = std::numeric_limits<double>::quiet_NaN();
+
+// The number of samples FilterChain pushes through all of its stages at a
+// time.
+const size_t kBlockSize = 256;
+
+// Solves matrix * x = rhs by Gaussian elimination with partial pivoting.
+// matrix is n x n, row major.
+std::vector<double> Solve(std::vector<double> matrix, std::vector<double> rhs) {
+  const size_t n = rhs.size();
+  for (size_t col = 0; col < n; ++col) {
+    size_t pivot = col;
+    for (size_t row = col + 1; row < n; ++row) {
+      if (std::abs(matrix[row * n + col]) > std::abs(matrix[pivot * n + col])) {
+        pivot = row;
+      }
+    }
+    for (size_t k = 0; k < n; ++k) {
+      std::swap(matrix[col * n + k], matrix[pivot * n + k]);
+    }
+    std::swap(rhs[col], rhs[pivot]);
+    for (size_t row = col + 1; row < n; ++row) {
+      const double factor = matrix[row * n + col] / matrix[col * n + col];
+      for (size_t k = col; k < n; ++k) {
+        matrix[row * n + k] -= factor * matrix[col * n + k];
+      }
+      rhs[row] -= factor * rhs[col];
+    }
+  }
+  std::vector<double> x(n);
+  for (size_t row = n; row-- > 0;) {
+    double sum = rhs[row];
+    for (size_t k = row + 1; k < n; ++k) sum -= matrix[row * n + k] * x[k];
+    x[row] = sum / matrix[row * n + row];
+  }
+  return x;
+}
+
+// Returns the weights that give the value at the newest sample of the least
+// squares polynomial fit over a window of samples, oldest first.
+std::vector<double> SavitzkyGolayCoefficients(const int window,
+                                              const int order) {
+  const int num_terms = order + 1;
+  // Sample j sits at t = (j - (window - 1)) / scale. Scaling keeps the normal
+  // equations well conditioned and doesn't change the value at t = 0.
+  const double scale = std::max(1, window - 1);
+  std::vector<double> powers(window * num_terms);
+  for (int j = 0; j < window; ++j) {
+    const double t = (j - (window - 1)) / scale;
+    double power = 1;
+    for (int k = 0; k < num_terms; ++k, power *= t) {
+      powers[j * num_terms + k] = power;
+    }
+  }
+  std::vector<double> normal(num_terms * num_terms, 0);
+  for (int j = 0; j < window; ++j) {
+    for (int a = 0; a < num_terms; ++a) {
+      for (int b = 0; b < num_terms; ++b) {
+        normal[a * num_terms + b] +=
+            powers[j * num_terms + a] * powers[j * num_terms + b];
+      }
+    }
+  }
+  // The fitted value at t = 0 is the constant term, so only the first row of
+  // the inverse of the normal matrix is needed. It is symmetric, so that is
+  // the solution of normal * u = e0.
+  std::vector<double> e0(num_terms, 0);
+  e0[0] = 1;
+  const std::vector<double> u = Solve(normal, e0);
+  std::vector<double> coefficients(window, 0);
+  for (int j = 0; j < window; ++j) {
+    for (int k = 0; k < num_terms; ++k) {
+      coefficients[j] += u[k] * powers[j * num_terms + k];
+    }
+  }
+  return coefficients;
+}
+
+// out[i] = sum over j of coefficients[j] * in[i + j], for i in [0, n).
+void FirScalar(const std::vector<double>& coefficients, const double* in,
+               const size_t n, double* out) {
+  for (size_t i = 0; i < n; ++i) {
+    double sum = 0;
+    for (size_t j = 0; j < coefficients.size(); ++j) {
+      sum += coefficients[j] * in[i + j];
+    }
+    out[i] = sum;
+  }
+}
+
+#ifdef CYCLING_X86
+
+__attribute__((target("avx2"))) void FirAvx2(
+    const std::vector<double>& coefficients, const double* in, const size_t n,
+    double* out) {
+  const size_t vector_end = n - n % 4;
+  for (size_t i = 0; i < vector_end; i += 4) {
+    __m256d sum = _mm256_setzero_pd();
+    for (size_t j = 0; j < coefficients.size(); ++j) {
+      sum = _mm256_add_pd(sum,
+                          _mm256_mul_pd(_mm256_set1_pd(coefficients[j]),
+                                        _mm256_loadu_pd(in + i + j)));
+    }
+    _mm256_storeu_pd(out + i, sum);
+  }
+  FirScalar(coefficients, in + vector_end, n - vector_end, out + vector_end);
+}
+
+// Runs the EMA over whole groups of four inputs for as long as none of them is
+// NaN. Within a group, each output is a fixed combination of the previous
+// output and the group's inputs, so the four are computed at once. Returns the
+// number of inputs consumed and updates *average.
+__attribute__((target("avx2"))) size_t EmaAvx2(const double alpha,
+                                               const double* in,
+                                               const size_t n, double* out,
+                                               double* average) {
+  const double keep = 1 - alpha;
+  // Lane k of weights[j] is the weight of input j in output k, and lane k of
+  // decay is the weight of the output before the group.
+  __m256d weights[4];
+  for (int j = 0; j < 4; ++j) {
+    double w[4];
+    for (int k = 0; k < 4; ++k) {
+      w[k] = k < j ? 0 : alpha * std::pow(keep, k - j);
+    }
+    weights[j] = _mm256_loadu_pd(w);
+  }
+  const __m256d decay =
+      _mm256_setr_pd(keep, keep * keep, keep * keep * keep,
+                     keep * keep * keep * keep);
+  double last = *average;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const __m256d x = _mm256_loadu_pd(in + i);
+    if (_mm256_movemask_pd(_mm256_cmp_pd(x, x, _CMP_UNORD_Q)) != 0) break;
+    __m256d y = _mm256_mul_pd(decay, _mm256_set1_pd(last));
+    for (int j = 0; j < 4; ++j) {
+      y = _mm256_add_pd(
+          y, _mm256_mul_pd(weights[j], _mm256_set1_pd(in[i + j])));
+    }
+    _mm256_storeu_pd(out + i, y);
+    last = out[i + 3];
+  }
+  *average = last;
+  return i;
+}
+
+#endif  // CYCLING_X86
+
+}  // namespace
+
+void SignalFilter::Filter(const double* in, const size_t n, double* out) {
+  for (size_t i = 0; i < n; ++i) out[i] = Add(in[i]);
+}
+
+ExponentialMovingAverage::ExponentialMovingAverage(const double alpha)
+    : alpha_(alpha) {
+  assert(alpha > 0 && alpha <= 1);
+}
+
+double ExponentialMovingAverage::Add(const double value) {
+  if (std::isnan(value)) return kNaN;
+  if (!started_) {
+    average_ = value;
+    started_ = true;
+  } else {
+    average_ = alpha_ * value + (1 - alpha_) * average_;
+  }
+  return average_;
+}
+
+void ExponentialMovingAverage::Filter(const double* in, const size_t n,
+                                      double* out) {
+#ifdef CYCLING_X86
+  const bool has_avx2 = HasAvx2();
+#endif
+  size_t i = 0;
+  while (i < n) {
+#ifdef CYCLING_X86
+    if (started_ && has_avx2 && !std::isnan(in[i])) {
+      const size_t done = EmaAvx2(alpha_, in + i, n - i, out + i, &average_);
+      i += done;
+      if (done > 0) continue;
+    }
+#endif
+    out[i] = Add(in[i]);
+    ++i;
+  }
+}
+
+void ExponentialMovingAverage::Reset() {
+  started_ = false;
+  average_ = 0;
+}
+
+MovingMedian::MovingMedian(const int window) : window_(window) {
+  assert(window > 0);
+}
+
+double MovingMedian::Add(const double value) {
+  if (std::isnan(value)) return kNaN;
+  values_.push_back(value);
+  if (low_.empty() || value <= *low_.rbegin()) {
+    low_.insert(value);
+  } else {
+    high_.insert(value);
+  }
+  if (values_.size() > window_) {
+    const double oldest = values_.front();
+    values_.pop_front();
+    // Every value in low_ is at most every value in high_.
+    if (oldest <= *low_.rbegin()) {
+      low_.erase(low_.find(oldest));
+    } else {
+      high_.erase(high_.find(oldest));
+    }
+  }
+  Rebalance();
+  if (low_.size() > high_.size()) return *low_.rbegin();
+  return (*low_.rbegin() + *high_.begin()) / 2;
+}
+
+void MovingMedian::Rebalance() {
+  while (low_.size() > high_.size() + 1) {
+    auto largest = std::prev(low_.end());
+    high_.insert(*largest);
+    low_.erase(largest);
+  }
+  while (high_.size() > low_.size()) {
+    low_.insert(*high_.begin());
+    high_.erase(high_.begin());
+  }
+}
+
+void MovingMedian::Reset() {
+  values_.clear();
+  low_.clear();
+  high_.clear();
+}
+
+SavitzkyGolay::SavitzkyGolay(const int window, const int order)
+    : coefficients_(SavitzkyGolayCoefficients(window, order)),
+      history_(window - 1) {
+  assert(order >= 0 && window > order);
+}
+
+double SavitzkyGolay::Add(const double value) {
+  if (std::isnan(value)) return kNaN;
+  const size_t window = coefficients_.size();
+  if (num_history_ < window - 1) {
+    history_[num_history_++] = value;
+    return value;
+  }
+  double sum = coefficients_[window - 1] * value;
+  for (size_t j = 0; j + 1 < window; ++j) {
+    sum += coefficients_[j] * history_[j];
+  }
+  if (window > 1) {
+    std::copy(history_.begin() + 1, history_.begin() + (window - 1),
+              history_.begin());
+    history_[window - 2] = value;
+  }
+  return sum;
+}
+
+void SavitzkyGolay::Filter(const double* in, const size_t n, double* out) {
+  // Lines the valid inputs up after the history, so that the window of every
+  // output is contiguous.
+  const size_t window = coefficients_.size();
+  if (history_.size() < num_history_ + n) history_.resize(num_history_ + n);
+  size_t num_values = num_history_;
+  for (size_t i = 0; i < n; ++i) {
+    if (!std::isnan(in[i])) history_[num_values++] = in[i];
+  }
+  // Until the window has filled, inputs pass through.
+  const size_t first_full = std::max(num_history_, window - 1);
+  const size_t num_fitted = num_values - std::min(num_values, first_full);
+  if (fitted_.size() < num_fitted) fitted_.resize(num_fitted);
+  const double* first_window = history_.data() + first_full - (window - 1);
+#ifdef CYCLING_X86
+  if (HasAvx2()) {
+    FirAvx2(coefficients_, first_window, num_fitted, fitted_.data());
+  } else {
+    FirScalar(coefficients_, first_window, num_fitted, fitted_.data());
+  }
+#else
+  FirScalar(coefficients_, first_window, num_fitted, fitted_.data());
+#endif
+  size_t next = num_history_;
+  for (size_t i = 0; i < n; ++i) {
+    if (std::isnan(in[i])) {
+      out[i] = kNaN;
+    } else {
+      out[i] = next < first_full ? history_[next] : fitted_[next - first_full];
+      ++next;
+    }
+  }
+  // Keep the last window - 1 inputs.
+  const size_t keep = std::min(num_values, window - 1);
+  std::copy(history_.begin() + (num_values - keep),
+            history_.begin() + num_values, history_.begin());
+  num_history_ = keep;
+}
+
+void SavitzkyGolay::Reset() { num_history_ = 0; }
+
+KalmanFilter::KalmanFilter(const double process_variance,
+                           const double measurement_variance)
+    : process_variance_(process_variance),
+      measurement_variance_(measurement_variance) {
+  assert(process_variance >= 0 && measurement_variance > 0);
+}
+
+double KalmanFilter::Add(const double value) {
+  if (std::isnan(value)) return kNaN;
+  if (!started_) {
+    estimate_ = value;
+    variance_ = measurement_variance_;
+    started_ = true;
+    return estimate_;
+  }
+  variance_ += process_variance_;
+  const double gain = variance_ / (variance_ + measurement_variance_);
+  estimate_ += gain * (value - estimate_);
+  variance_ *= 1 - gain;
+  return estimate_;
+}
+
+void KalmanFilter::Reset() {
+  started_ = false;
+  estimate_ = 0;
+  variance_ = 0;
+}
+
+FilterChain& FilterChain::Append(std::unique_ptr<SignalFilter> filter) {
+  filters_.push_back(std::move(filter));
+  return *this;
+}
+
+double FilterChain::Add(double value) {
+  for (const auto& filter : filters_) value = filter->Add(value);
+  return value;
+}
+
+void FilterChain::Filter(const double* in, const size_t n, double* out) {
+  if (filters_.empty()) {
+    std::copy(in, in + n, out);
+    return;
+  }
+  for (size_t begin = 0; begin < n; begin += kBlockSize) {
+    const size_t size = std::min(kBlockSize, n - begin);
+    filters_[0]->Filter(in + begin, size, out + begin);
+    for (size_t i = 1; i < filters_.size(); ++i) {
+      filters_[i]->Filter(out + begin, size, out + begin);
+    }
+  }
+}
+
+void FilterChain::Reset() {
+  for (const auto& filter : filters_) filter->Reset();
+}
+
+TimeSeries::Column FilterChannel(const TimeSeries& series,
+                                 const Measurement::Type type,
+                                 SignalFilter* filter) {
+  filter->Reset();
+  const TimeSeries::ColumnPtr values = series.Values(type);
+  TimeSeries::Column filtered(values->size());
+  filter->Filter(values->data(), values->size(), filtered.data());
+  return filtered;
+}
+
+}  // namespace cycling
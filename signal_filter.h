@@ -0,0 +1,154 @@
+#ifndef __SIGNAL_FILTER_H__
+#define __SIGNAL_FILTER_H__
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <set>
+#include <vector>
+
+#include "measurement.h"
+#include "time_series.h"
+
+namespace cycling {
+
+// A causal smoothing filter over one channel of equally spaced samples, e.g.
+// the POWER or ALTITUDE column of a TimeSeries. Each output depends only on the
+// current and earlier inputs, so a filter can run on live data one sample at a
+// time with Add(), or over a whole column with Filter(); both give the same
+// result and leave the filter in the same state.
+//
+// NaN marks a missing sample. It produces a NaN output and leaves the filter's
+// state untouched, so the samples on either side of a gap are treated as
+// neighbors.
+class SignalFilter {
+ public:
+  virtual ~SignalFilter() = default;
+
+  // Feeds the next input value and returns the filtered value.
+  virtual double Add(const double value) = 0;
+
+  // Same as calling Add() for in[0] to in[n - 1] and storing the results in
+  // out, which may be the same array as in. Filters override this with a
+  // batch implementation where the math allows one.
+  virtual void Filter(const double* in, const size_t n, double* out);
+
+  // Forgets every input seen so far.
+  virtual void Reset() = 0;
+};
+
+// out = alpha * in + (1 - alpha) * previous out, starting at the first input.
+// The batch path advances four samples per step with AVX2.
+class ExponentialMovingAverage : public SignalFilter {
+ public:
+  // alpha must be in (0, 1]. For a time constant of tau samples, use
+  // alpha = 1 / (tau + 1).
+  explicit ExponentialMovingAverage(const double alpha);
+
+  double Add(const double value) override;
+  void Filter(const double* in, const size_t n, double* out) override;
+  void Reset() override;
+
+ private:
+  double alpha_;
+  bool started_ = false;
+  double average_ = 0;
+};
+
+// The median of the last `window` inputs (fewer until that many have been
+// seen). Keeps the window in two balanced multisets, so each sample costs
+// O(log window). Removes spikes without smearing steps the way averages do.
+class MovingMedian : public SignalFilter {
+ public:
+  explicit MovingMedian(const int window);
+
+  double Add(const double value) override;
+  void Reset() override;
+
+ private:
+  // Moves values between low_ and high_ until low_ has as many as high_ or one
+  // more.
+  void Rebalance();
+
+  size_t window_;
+  // The inputs in the window, oldest first.
+  std::deque<double> values_;
+  // The smaller and larger halves of the window.
+  std::multiset<double> low_;
+  std::multiset<double> high_;
+};
+
+// Fits a polynomial of degree `order` to the last `window` inputs by least
+// squares and outputs its value at the newest input, i.e. a causal
+// Savitzky-Golay filter. Smooths noise while following ramps and curves with
+// less lag than averaging. Inputs pass through unchanged until the window has
+// filled. The fit is a fixed FIR filter, which the batch path runs with AVX2.
+class SavitzkyGolay : public SignalFilter {
+ public:
+  // window must be greater than order.
+  SavitzkyGolay(const int window, const int order);
+
+  double Add(const double value) override;
+  void Filter(const double* in, const size_t n, double* out) override;
+  void Reset() override;
+
+ private:
+  // The weights applied to the last window inputs, oldest first.
+  std::vector<double> coefficients_;
+  // The last window - 1 inputs, oldest first, followed by scratch space for
+  // Filter(). Like fitted_, it only grows, so that a stream filtered block by
+  // block reuses the space of the blocks before.
+  std::vector<double> history_;
+  size_t num_history_ = 0;
+  // The outputs of the last Filter() that had a full window.
+  std::vector<double> fitted_;
+};
+
+// A one dimensional Kalman filter that models the signal as a random walk:
+// each step the true value drifts with variance process_variance, and each
+// input measures it with noise of variance measurement_variance. The ratio of
+// the two sets how closely the output follows the inputs. Useful for GPS
+// altitude, whose noise is roughly known.
+class KalmanFilter : public SignalFilter {
+ public:
+  KalmanFilter(const double process_variance,
+               const double measurement_variance);
+
+  double Add(const double value) override;
+  void Reset() override;
+
+ private:
+  double process_variance_;
+  double measurement_variance_;
+  bool started_ = false;
+  double estimate_ = 0;
+  double variance_ = 0;
+};
+
+// Runs several filters in sequence, e.g. a median to remove spikes followed by
+// an EMA. Filter() pushes one cache-sized block at a time through every stage,
+// so the column is only read and written once.
+class FilterChain : public SignalFilter {
+ public:
+  FilterChain() = default;
+
+  // Adds a stage after all the existing ones.
+  FilterChain& Append(std::unique_ptr<SignalFilter> filter);
+
+  double Add(const double value) override;
+  void Filter(const double* in, const size_t n, double* out) override;
+  void Reset() override;
+
+ private:
+  std::vector<std::unique_ptr<SignalFilter>> filters_;
+};
+
+// Resets filter and runs it over the values of type in series, see
+// TimeSeries::Values(). Samples lacking type stay NaN.
+TimeSeries::Column FilterChannel(const TimeSeries& series,
+                                 const Measurement::Type type,
+                                 SignalFilter* filter);
+
+}  // namespace cycling
+
+#endif  // __SIGNAL_FILTER_H__
@@ -0,0 +1,177 @@
+#include "signal_filter.h"
+
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <random>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace cycling {
+namespace {
+
+using ::testing::DoubleEq;
+using ::testing::DoubleNear;
+using ::testing::ElementsAre;
+using ::testing::NanSensitiveDoubleEq;
+
+const double kNaN = std::numeric_limits<double>::quiet_NaN();
+
+::testing::Matcher<double> IsNan() { return NanSensitiveDoubleEq(kNaN); }
+
+std::vector<double> AddAll(const std::vector<double>& in,
+                           SignalFilter* filter) {
+  std::vector<double> out;
+  for (const double value : in) out.push_back(filter->Add(value));
+  return out;
+}
+
+// Noisy power with occasional dropouts, long enough to cover several blocks.
+std::vector<double> NoisyPower(const int n) {
+  std::mt19937 random(n);
+  std::normal_distribution<double> noise(0, 20);
+  std::uniform_int_distribution<int> missing(0, 49);
+  std::vector<double> values(n);
+  for (int i = 0; i < n; ++i) {
+    values[i] = missing(random) == 0 ? kNaN : 200 + 50 * std::sin(i / 30.0) +
+                                                  noise(random);
+  }
+  return values;
+}
+
+// Checks that Filter() matches Add() sample by sample, also when the input is
+// split into uneven batches and when filtering in place.
+void ExpectBatchMatchesStreaming(SignalFilter* filter) {
+  const std::vector<double> in = NoisyPower(1000);
+  filter->Reset();
+  const std::vector<double> expected = AddAll(in, filter);
+
+  for (const size_t batch : {1000, 7, 1}) {
+    filter->Reset();
+    std::vector<double> out = in;
+    for (size_t begin = 0; begin < in.size(); begin += batch) {
+      const size_t size = std::min(batch, in.size() - begin);
+      filter->Filter(out.data() + begin, size, out.data() + begin);
+    }
+    for (size_t i = 0; i < in.size(); ++i) {
+      if (std::isnan(expected[i])) {
+        ASSERT_TRUE(std::isnan(out[i])) << i;
+      } else {
+        ASSERT_NEAR(out[i], expected[i], 1e-9) << "batch " << batch << " at "
+                                               << i;
+      }
+    }
+  }
+}
+
+TEST(SignalFilterTest, ExponentialMovingAverage) {
+  ExponentialMovingAverage ema(0.5);
+  EXPECT_THAT(AddAll({100, 200, kNaN, 100, 300}, &ema),
+              ElementsAre(100, 150, IsNan(), 125, 212.5));
+  ema.Reset();
+  EXPECT_EQ(ema.Add(10), 10);
+  ExpectBatchMatchesStreaming(&ema);
+}
+
+TEST(SignalFilterTest, MovingMedian) {
+  MovingMedian median(3);
+  EXPECT_THAT(AddAll({100, 2000, 110, 105, kNaN, 0, 120, 120}, &median),
+              ElementsAre(100, 1050, 110, 110, IsNan(), 105, 105, 120));
+  ExpectBatchMatchesStreaming(&median);
+
+  // Matches a brute force median for a larger even window.
+  MovingMedian wide(10);
+  const std::vector<double> in = NoisyPower(300);
+  std::vector<double> window;
+  for (const double value : in) {
+    const double result = wide.Add(value);
+    if (std::isnan(value)) continue;
+    window.push_back(value);
+    if (window.size() > 10) window.erase(window.begin());
+    std::vector<double> sorted = window;
+    std::sort(sorted.begin(), sorted.end());
+    const size_t mid = sorted.size() / 2;
+    const double expected = sorted.size() % 2 == 1
+                                ? sorted[mid]
+                                : (sorted[mid - 1] + sorted[mid]) / 2;
+    ASSERT_EQ(result, expected);
+  }
+}
+
+TEST(SignalFilterTest, SavitzkyGolayFollowsPolynomials) {
+  // A quadratic fit reproduces a quadratic exactly once the window is full.
+  SavitzkyGolay quadratic(7, 2);
+  std::vector<double> in;
+  for (int i = 0; i < 20; ++i) in.push_back(3 + 2 * i - 0.5 * i * i);
+  const std::vector<double> out = AddAll(in, &quadratic);
+  for (int i = 0; i < 20; ++i) EXPECT_NEAR(out[i], in[i], 1e-9) << i;
+
+  // Order 0 is a moving average of the last window inputs.
+  SavitzkyGolay average(3, 0);
+  EXPECT_THAT(AddAll({3, 6, 9, kNaN, 12, 0}, &average),
+              ElementsAre(3, 6, DoubleEq(6), IsNan(), DoubleEq(9),
+                          DoubleEq(7)));
+  ExpectBatchMatchesStreaming(&quadratic);
+  SavitzkyGolay wide(31, 3);
+  ExpectBatchMatchesStreaming(&wide);
+}
+
+TEST(SignalFilterTest, KalmanFilter) {
+  KalmanFilter kalman(0.01, 25);
+  EXPECT_EQ(kalman.Add(100), 100);
+  // A constant signal stays put; a step is followed gradually.
+  EXPECT_EQ(kalman.Add(100), 100);
+  const double after_step = kalman.Add(110);
+  EXPECT_GT(after_step, 100);
+  EXPECT_LT(after_step, 110);
+  EXPECT_THAT(kalman.Add(kNaN), IsNan());
+  double estimate = after_step;
+  for (int i = 0; i < 2000; ++i) estimate = kalman.Add(110);
+  EXPECT_THAT(estimate, DoubleNear(110, 1e-6));
+  ExpectBatchMatchesStreaming(&kalman);
+}
+
+TEST(SignalFilterTest, FilterChain) {
+  FilterChain chain;
+  chain.Append(std::unique_ptr<SignalFilter>(new MovingMedian(5)))
+      .Append(std::unique_ptr<SignalFilter>(new ExponentialMovingAverage(0.2)))
+      .Append(std::unique_ptr<SignalFilter>(new SavitzkyGolay(9, 2)));
+  MovingMedian median(5);
+  ExponentialMovingAverage ema(0.2);
+  SavitzkyGolay savitzky_golay(9, 2);
+  const std::vector<double> in = NoisyPower(700);
+  const std::vector<double> out = AddAll(in, &chain);
+  for (size_t i = 0; i < in.size(); ++i) {
+    const double expected =
+        savitzky_golay.Add(ema.Add(median.Add(in[i])));
+    if (std::isnan(expected)) {
+      ASSERT_TRUE(std::isnan(out[i]));
+    } else {
+      ASSERT_EQ(out[i], expected);
+    }
+  }
+  ExpectBatchMatchesStreaming(&chain);
+
+  FilterChain empty;
+  EXPECT_EQ(empty.Add(42), 42);
+}
+
+TEST(SignalFilterTest, FilterChannel) {
+  TimeSeries series;
+  const auto start = TimeSeries::TimePoint() + std::chrono::hours(1000);
+  const std::vector<double> watts = {100, 300, 200};
+  for (size_t i = 0; i < watts.size(); ++i) {
+    series.Add(TimeSample(start + std::chrono::seconds(i),
+                          Measurement(Measurement::POWER, watts[i])));
+  }
+  series.Add(TimeSample(start + std::chrono::seconds(3),
+                        Measurement(Measurement::HEART_RATE, 150)));
+  MovingMedian median(3);
+  median.Add(1000);
+  EXPECT_THAT(FilterChannel(series, Measurement::POWER, &median),
+              ElementsAre(100, 200, 200, IsNan()));
+}
+
+}  // namespace
+}  // namespace cycling
@@ -0,0 +1,429 @@
+#include "spatial_index.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+#include "geo_util.h"
+#include "measurement.h"
+#include "parallel.h"
+#include "str_util.h"
+
+namespace cycling {
+
+namespace {
+
+using geo_util::kMetersPerDegree;
+using geo_util::kRadians;
+using geo_util::WrappedDegrees;
+
+// Consecutive samples further apart than this many cells are taken to be a
+// GPS glitch or a gap in the recording, e.g. a transfer by car, and the cells
+// between them aren't filled in.
+const int64_t kMaxCrossedCells = 64;
+
+const char kMagic[8] = {'C', 'Y', 'C', 'S', 'P', 'I', 'D', 'X'};
+const uint64_t kByteOrder = 0x0102030405060708;
+
+// The start of an index file, followed by the cells (including the sentinel)
+// and the postings, each in native layout.
+struct FileHeader {
+  char magic[8];
+  uint64_t byte_order;
+  double cell_degrees;
+  uint64_t num_rides;
+  uint64_t num_cells;
+  uint64_t num_postings;
+};
+
+// Rows run from the south pole to the north pole, and columns east from the
+// antimeridian. A cell's key is its row-major index, so the cells of a row
+// that lie between two columns have consecutive keys.
+struct Grid {
+  explicit Grid(const double cell_degrees)
+      : cell_degrees(cell_degrees),
+        num_rows(static_cast<int64_t>(std::ceil(180 / cell_degrees))),
+        num_columns(static_cast<int64_t>(std::ceil(360 / cell_degrees))) {}
+
+  int64_t Row(const double lat) const {
+    const double row = std::floor((lat + 90) / cell_degrees);
+    return static_cast<int64_t>(
+        std::max(0.0, std::min<double>(num_rows - 1, row)));
+  }
+
+  // The column of lon, counting on past the last column instead of wrapping
+  // around.
+  int64_t UnwrappedColumn(const double lon) const {
+    return static_cast<int64_t>(std::floor((lon + 180) / cell_degrees));
+  }
+
+  int64_t Wrap(const int64_t column) const {
+    const int64_t wrapped = column % num_columns;
+    return wrapped < 0 ? wrapped + num_columns : wrapped;
+  }
+
+  int64_t Column(const double lon) const {
+    return Wrap(UnwrappedColumn(lon));
+  }
+
+  // The number of columns between two columns, the short way around.
+  int64_t ColumnDistance(const int64_t a, const int64_t b) const {
+    const int64_t distance = std::abs(a - b);
+    return std::min(distance, num_columns - distance);
+  }
+
+  uint64_t Key(const int64_t row, const int64_t column) const {
+    return static_cast<uint64_t>(row * num_columns + column);
+  }
+
+  GeoPoint Center(const int64_t row, const int64_t column) const {
+    return {(row + 0.5) * cell_degrees - 90,
+            (column + 0.5) * cell_degrees - 180};
+  }
+
+  double cell_degrees;
+  int64_t num_rows;
+  int64_t num_columns;
+};
+
+struct Entry {
+  uint64_t key;
+  SpatialIndex::Posting posting;
+};
+
+bool EntryLess(const Entry& a, const Entry& b) {
+  if (a.key != b.key) return a.key < b.key;
+  if (a.posting.ride != b.posting.ride) {
+    return a.posting.ride < b.posting.ride;
+  }
+  return a.posting.begin < b.posting.begin;
+}
+
+// Sorts entries with EntryLess. num_threads slices are sorted at once, and
+// then merged pairwise, also in parallel.
+void SortEntries(const int num_threads, std::vector<Entry>* entries) {
+  const size_t num_slices = std::max(1, num_threads);
+  std::vector<size_t> bounds;
+  for (size_t i = 0; i <= num_slices; ++i) {
+    bounds.push_back(entries->size() * i / num_slices);
+  }
+  const auto begin = entries->begin();
+  ParallelFor(num_slices, num_threads, [&](const int, const size_t i) {
+    std::sort(begin + bounds[i], begin + bounds[i + 1], EntryLess);
+  });
+  for (size_t width = 1; width < num_slices; width *= 2) {
+    std::vector<size_t> firsts;
+    for (size_t i = 0; i + width < num_slices; i += 2 * width) {
+      firsts.push_back(i);
+    }
+    ParallelFor(firsts.size(), num_threads, [&](const int, const size_t k) {
+      const size_t i = firsts[k];
+      std::inplace_merge(begin + bounds[i], begin + bounds[i + width],
+                         begin + bounds[std::min(i + 2 * width, num_slices)],
+                         EntryLess);
+    });
+  }
+}
+
+// Returns the postings of one ride, keyed by cell, in time order.
+std::vector<Entry> RideEntries(const TimeSeries& series, const uint32_t ride,
+                               const Grid& grid) {
+  std::vector<Entry> entries;
+  if (series.num_samples() == 0) return entries;
+  const TimeSeries::ColumnPtr lat =
+      series.Values(Measurement::DEGREES_LATITUDE);
+  const TimeSeries::ColumnPtr lon =
+      series.Values(Measurement::DEGREES_LONGITUDE);
+  const TimeSeries::ColumnPtr seconds = series.Seconds();
+  const int64_t begin = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            series.BeginTime().time_since_epoch())
+                            .count();
+  auto add = [&](const int64_t row, const int64_t column, const int64_t from,
+                 const int64_t to) {
+    entries.push_back({grid.Key(row, column), {from, to, ride, 0}});
+  };
+
+  // The cell of the last sample with a position, when the ride entered it,
+  // and that sample.
+  bool started = false;
+  int64_t row = 0;
+  int64_t column = 0;
+  int64_t entered = 0;
+  int64_t previous_time = 0;
+  GeoPoint previous = {0, 0};
+  for (size_t i = 0; i < lat->size(); ++i) {
+    const GeoPoint point = {(*lat)[i], (*lon)[i]};
+    if (std::isnan(point.lat) || std::isnan(point.lon)) continue;
+    const int64_t time = begin + std::llround((*seconds)[i] * 1000);
+    const int64_t next_row = grid.Row(point.lat);
+    const int64_t next_column = grid.Column(point.lon);
+    if (!started) {
+      started = true;
+      row = next_row;
+      column = next_column;
+      entered = time;
+    } else if (next_row != row || next_column != column) {
+      // The visit lasts until the first sample in the next cell, so that the
+      // postings of neighboring cells overlap.
+      add(row, column, entered, time);
+      const int64_t steps =
+          2 * std::max(std::abs(next_row - row),
+                       grid.ColumnDistance(next_column, column));
+      if (steps > 2 && steps <= 2 * kMaxCrossedCells) {
+        const double dlon = WrappedDegrees(point.lon - previous.lon);
+        for (int64_t k = 1; k < steps; ++k) {
+          const double f = k / static_cast<double>(steps);
+          const int64_t r =
+              grid.Row(previous.lat + f * (point.lat - previous.lat));
+          const int64_t c = grid.Column(previous.lon + f * dlon);
+          if ((r == row && c == column) ||
+              (r == next_row && c == next_column) ||
+              entries.back().key == grid.Key(r, c)) {
+            continue;
+          }
+          add(r, c, previous_time, time);
+        }
+      }
+      row = next_row;
+      column = next_column;
+      entered = previous_time;
+    }
+    previous_time = time;
+    previous = point;
+  }
+  if (started) add(row, column, entered, previous_time);
+  return entries;
+}
+
+TimeSeries::TimePoint ToTimePoint(const int64_t milliseconds) {
+  return TimeSeries::TimePoint(std::chrono::milliseconds(milliseconds));
+}
+
+}  // namespace
+
+SpatialIndex::SpatialIndex(const double cell_degrees, const int num_rides)
+    : cell_degrees_(cell_degrees), num_rides_(num_rides) {}
+
+std::unique_ptr<SpatialIndex> SpatialIndex::Build(
+    const std::vector<const TimeSeries*>& rides, const double cell_degrees,
+    const int num_threads) {
+  const Grid grid(cell_degrees);
+  std::vector<std::vector<Entry>> ride_entries(rides.size());
+  ParallelFor(rides.size(), num_threads, [&](const int, const size_t i) {
+    ride_entries[i] = RideEntries(*rides[i], static_cast<uint32_t>(i), grid);
+  });
+  size_t num_entries = 0;
+  for (const std::vector<Entry>& ride : ride_entries) {
+    num_entries += ride.size();
+  }
+  std::vector<Entry> entries;
+  entries.reserve(num_entries);
+  for (std::vector<Entry>& ride : ride_entries) {
+    entries.insert(entries.end(), ride.begin(), ride.end());
+    std::vector<Entry>().swap(ride);
+  }
+  SortEntries(num_threads, &entries);
+
+  std::unique_ptr<SpatialIndex> index(
+      new SpatialIndex(cell_degrees, static_cast<int>(rides.size())));
+  index->owned_postings_.reserve(entries.size());
+  for (const Entry& entry : entries) {
+    if (index->owned_cells_.empty() ||
+        index->owned_cells_.back().key != entry.key) {
+      index->owned_cells_.push_back(
+          {entry.key, index->owned_postings_.size()});
+    }
+    index->owned_postings_.push_back(entry.posting);
+  }
+  index->owned_cells_.push_back(
+      {std::numeric_limits<uint64_t>::max(), index->owned_postings_.size()});
+  index->cells_ = index->owned_cells_.data();
+  index->num_cells_ = index->owned_cells_.size() - 1;
+  index->postings_ = index->owned_postings_.data();
+  index->num_postings_ = index->owned_postings_.size();
+  return index;
+}
+
+std::unique_ptr<SpatialIndex> SpatialIndex::Open(const std::string& path) {
+  std::unique_ptr<MappedFile> file = MappedFile::Open(path);
+  if (file == nullptr || file->size() < sizeof(FileHeader)) return nullptr;
+
+  const char* data = file->data();
+  const size_t size = file->size();
+  const FileHeader* header = reinterpret_cast<const FileHeader*>(data);
+  const size_t space = size - sizeof(FileHeader);
+  const bool valid =
+      memcmp(header->magic, kMagic, sizeof(kMagic)) == 0 &&
+      header->byte_order == kByteOrder && header->cell_degrees > 0 &&
+      header->cell_degrees <= 180 &&
+      header->num_rides <=
+          static_cast<uint64_t>(std::numeric_limits<int>::max()) &&
+      header->num_cells < space / sizeof(Cell) &&
+      header->num_postings <= space / sizeof(Posting) &&
+      space == (header->num_cells + 1) * sizeof(Cell) +
+                   header->num_postings * sizeof(Posting);
+  const Cell* cells =
+      reinterpret_cast<const Cell*>(data + sizeof(FileHeader));
+  if (!valid || cells[header->num_cells].first_posting !=
+                    header->num_postings) {
+    return nullptr;
+  }
+
+  std::unique_ptr<SpatialIndex> index(new SpatialIndex(
+      header->cell_degrees, static_cast<int>(header->num_rides)));
+  index->cells_ = cells;
+  index->num_cells_ = header->num_cells;
+  index->postings_ = reinterpret_cast<const Posting*>(
+      data + sizeof(FileHeader) + (header->num_cells + 1) * sizeof(Cell));
+  index->num_postings_ = header->num_postings;
+  index->file_ = std::move(file);
+  return index;
+}
+
+Status SpatialIndex::Save(const std::string& path) const {
+  FILE* fp = fopen(path.c_str(), "wb");
+  if (fp == nullptr) {
+    return Status::FailureStatus(StrCat("Couldn't open ", path));
+  }
+  FileHeader header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.byte_order = kByteOrder;
+  header.cell_degrees = cell_degrees_;
+  header.num_rides = num_rides_;
+  header.num_cells = num_cells_;
+  header.num_postings = num_postings_;
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+            fwrite(cells_, sizeof(Cell), num_cells_ + 1, fp) ==
+                num_cells_ + 1 &&
+            fwrite(postings_, sizeof(Posting), num_postings_, fp) ==
+                num_postings_;
+  ok = fclose(fp) == 0 && ok;
+  if (!ok) return Status::FailureStatus(StrCat("Couldn't write ", path));
+  return Status::OkStatus();
+}
+
+template <typename Visitor>
+void SpatialIndex::VisitCells(const int64_t min_row, const int64_t max_row,
+                              const int64_t min_column,
+                              const int64_t max_column,
+                              const Visitor& visitor) const {
+  const Grid grid(cell_degrees_);
+  int64_t first_column = 0;
+  int64_t last_column = grid.num_columns - 1;
+  if (max_column - min_column + 1 < grid.num_columns) {
+    first_column = grid.Wrap(min_column);
+    last_column = first_column + (max_column - min_column);
+  }
+  auto visit_range = [&](const int64_t row, const int64_t begin,
+                         const int64_t end) {
+    const uint64_t last = grid.Key(row, end);
+    const Cell* cell = std::lower_bound(
+        cells_, cells_ + num_cells_, grid.Key(row, begin),
+        [](const Cell& cell, const uint64_t key) { return cell.key < key; });
+    for (; cell->key <= last; ++cell) {
+      visitor(static_cast<size_t>(cell - cells_), row,
+              static_cast<int64_t>(cell->key % grid.num_columns));
+    }
+  };
+  for (int64_t row = std::max<int64_t>(0, min_row);
+       row <= std::min(max_row, grid.num_rows - 1); ++row) {
+    visit_range(row, first_column,
+                std::min(last_column, grid.num_columns - 1));
+    if (last_column >= grid.num_columns) {
+      visit_range(row, 0, last_column - grid.num_columns);
+    }
+  }
+}
+
+std::vector<RideSegment> SpatialIndex::Collect(
+    std::vector<size_t> cell_indexes) const {
+  std::sort(cell_indexes.begin(), cell_indexes.end());
+  cell_indexes.erase(std::unique(cell_indexes.begin(), cell_indexes.end()),
+                     cell_indexes.end());
+  std::vector<const Posting*> postings;
+  for (const size_t i : cell_indexes) {
+    for (uint64_t p = cells_[i].first_posting; p < cells_[i + 1].first_posting;
+         ++p) {
+      postings.push_back(&postings_[p]);
+    }
+  }
+  std::sort(postings.begin(), postings.end(),
+            [](const Posting* a, const Posting* b) {
+              if (a->ride != b->ride) return a->ride < b->ride;
+              return a->begin < b->begin;
+            });
+
+  std::vector<RideSegment> segments;
+  int64_t end = 0;
+  for (const Posting* posting : postings) {
+    const int ride = static_cast<int>(posting->ride);
+    if (!segments.empty() && segments.back().ride == ride &&
+        posting->begin <= end) {
+      end = std::max(end, posting->end);
+      segments.back().interval.end = ToTimePoint(end);
+      continue;
+    }
+    end = posting->end;
+    segments.push_back(
+        {ride, {ToTimePoint(posting->begin), ToTimePoint(posting->end)}});
+  }
+  return segments;
+}
+
+std::vector<RideSegment> SpatialIndex::QueryBox(const GeoBox& box) const {
+  if (!(box.min_lat <= box.max_lat)) return {};
+  const Grid grid(cell_degrees_);
+  int64_t max_column = grid.UnwrappedColumn(box.max_lon);
+  if (box.min_lon > box.max_lon) max_column += grid.num_columns;
+  std::vector<size_t> cell_indexes;
+  VisitCells(grid.Row(box.min_lat), grid.Row(box.max_lat),
+             grid.UnwrappedColumn(box.min_lon), max_column,
+             [&](const size_t cell, const int64_t, const int64_t) {
+               cell_indexes.push_back(cell);
+             });
+  return Collect(std::move(cell_indexes));
+}
+
+std::vector<RideSegment> SpatialIndex::QueryCorridor(
+    const std::vector<GeoPoint>& polyline, const double radius_meters) const {
+  const Grid grid(cell_degrees_);
+  const double radius_degrees = radius_meters / kMetersPerDegree;
+  // Cells are tested by their center, so allow for the distance from the
+  // center to the corners.
+  const double reach =
+      radius_meters + cell_degrees_ * kMetersPerDegree * std::sqrt(0.5);
+  std::vector<size_t> cell_indexes;
+  const size_t num_segments =
+      polyline.size() < 2 ? polyline.size() : polyline.size() - 1;
+  for (size_t i = 0; i < num_segments; ++i) {
+    const GeoPoint& a = polyline[i];
+    const GeoPoint& b = polyline[std::min(i + 1, polyline.size() - 1)];
+    const double dlon = WrappedDegrees(b.lon - a.lon);
+    const double max_abs_lat =
+        std::max(std::abs(a.lat), std::abs(b.lat)) + radius_degrees;
+    const double lon_margin =
+        max_abs_lat >= 90
+            ? 360
+            : std::min(360.0,
+                       radius_degrees / std::cos(max_abs_lat * kRadians));
+    VisitCells(
+        grid.Row(std::min(a.lat, b.lat) - radius_degrees),
+        grid.Row(std::max(a.lat, b.lat) + radius_degrees),
+        grid.UnwrappedColumn(a.lon + std::min(0.0, dlon) - lon_margin),
+        grid.UnwrappedColumn(a.lon + std::max(0.0, dlon) + lon_margin),
+        [&](const size_t cell, const int64_t row, const int64_t column) {
+          const GeoPoint center = grid.Center(row, column);
+          if (geo_util::DistanceToSegment(center.lat, center.lon, a.lat, a.lon,
+                                          b.lat, b.lon) <= reach) {
+            cell_indexes.push_back(cell);
+          }
+        });
+  }
+  return Collect(std::move(cell_indexes));
+}
+
+}  // namespace cycling
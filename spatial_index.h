@@ -0,0 +1,136 @@
+#ifndef __SPATIAL_INDEX_H__
+#define __SPATIAL_INDEX_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+#include "status.h"
+#include "time_series.h"
+
+namespace cycling {
+
+// A position in degrees.
+struct GeoPoint {
+  double lat;
+  double lon;
+};
+
+// The area between two latitudes and two longitudes, in degrees, edges
+// included. If min_lon > max_lon the box wraps across the antimeridian.
+struct GeoBox {
+  double min_lat;
+  double min_lon;
+  double max_lat;
+  double max_lon;
+};
+
+// A stretch of one ride, e.g. where it passed through the area of a query.
+struct RideSegment {
+  // The index of the ride in the library the index was built from.
+  int ride;
+  TimeSeries::Interval interval;
+
+  bool operator==(const RideSegment& rhs) const {
+    return ride == rhs.ride && interval == rhs.interval;
+  }
+};
+
+// Maps the GPS tracks of a library of rides to the places they pass through,
+// so that "which rides went through here" doesn't need to look at every ride.
+//
+// The earth is cut into a grid of cells cell_degrees on a side, and every visit
+// of a ride to a cell becomes a posting (ride, time range). The postings are
+// sorted by cell and stored in flat arrays, so the index can be written to a
+// file and later mapped back into memory with Open() at no cost. A query looks
+// up the cells it covers by binary search and merges their postings into
+// candidate RideSegments. Candidates are cell-accurate: a segment can start a
+// little before the ride enters the area and end a little after it leaves.
+//
+// This class is thread safe; queries don't modify it.
+class SpatialIndex {
+ public:
+  // The layout of the index, in memory and on disk. The postings of the i-th
+  // cell run from its first_posting up to the first_posting of the next one.
+  // The cells end with a sentinel whose key is past every cell.
+  struct Cell {
+    uint64_t key;
+    uint64_t first_posting;
+  };
+  // One visit of a ride to a cell.
+  struct Posting {
+    // Milliseconds since the epoch.
+    int64_t begin;
+    int64_t end;
+    uint32_t ride;
+    uint32_t unused;
+  };
+
+  // About 550 m north-south.
+  static constexpr double kDefaultCellDegrees = 0.005;
+
+  // Indexes the DEGREES_LATITUDE and DEGREES_LONGITUDE channels of rides on
+  // num_threads threads. Samples without a position are skipped, and cells
+  // the track crosses between two samples are included.
+  static std::unique_ptr<SpatialIndex> Build(
+      const std::vector<const TimeSeries*>& rides, const double cell_degrees,
+      const int num_threads);
+
+  // Maps an index written by Save() into memory. Returns nullptr if path can't
+  // be read or doesn't hold an index written on a machine of the same
+  // endianness.
+  static std::unique_ptr<SpatialIndex> Open(const std::string& path);
+
+  SpatialIndex(const SpatialIndex&) = delete;
+  SpatialIndex& operator=(const SpatialIndex&) = delete;
+
+  Status Save(const std::string& path) const;
+
+  double cell_degrees() const { return cell_degrees_; }
+  int num_rides() const { return num_rides_; }
+  size_t num_cells() const { return num_cells_; }
+  size_t num_postings() const { return num_postings_; }
+
+  // Returns the stretches of rides that may pass through box, sorted by ride
+  // and time. Overlapping and touching stretches of a ride are merged.
+  std::vector<RideSegment> QueryBox(const GeoBox& box) const;
+
+  // Same as QueryBox(), for the area within radius_meters of polyline, e.g.
+  // the road up a climb.
+  std::vector<RideSegment> QueryCorridor(const std::vector<GeoPoint>& polyline,
+                                         const double radius_meters) const;
+
+ private:
+  SpatialIndex(const double cell_degrees, const int num_rides);
+
+  // Calls visitor(cell_index, row, column) for every cell of the index in rows
+  // [min_row, max_row] and columns [min_column, max_column]. Columns past the
+  // last one wrap around to the first, for areas that cross the antimeridian.
+  template <typename Visitor>
+  void VisitCells(const int64_t min_row, const int64_t max_row,
+                  const int64_t min_column, const int64_t max_column,
+                  const Visitor& visitor) const;
+
+  // Merges the postings of the given cells into RideSegments.
+  std::vector<RideSegment> Collect(std::vector<size_t> cell_indexes) const;
+
+  double cell_degrees_;
+  int num_rides_;
+  const Cell* cells_ = nullptr;
+  size_t num_cells_ = 0;
+  const Posting* postings_ = nullptr;
+  size_t num_postings_ = 0;
+
+  // An index is backed either by these, after Build(), or by a mapped file,
+  // after Open().
+  std::vector<Cell> owned_cells_;
+  std::vector<Posting> owned_postings_;
+  std::unique_ptr<MappedFile> file_;
+};
+
+}  // namespace cycling
+
+#endif  // __SPATIAL_INDEX_H__
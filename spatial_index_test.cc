@@ -0,0 +1,197 @@
+#include "spatial_index.h"
+
+#include <unistd.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "ride_test_util.h"
+
+namespace cycling {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::Eq;
+using ::testing::Field;
+using ::testing::IsEmpty;
+using ::testing::Pointwise;
+
+// n points from from to to, evenly spaced.
+std::vector<GeoPoint> Line(const GeoPoint& from, const GeoPoint& to,
+                           const int n) {
+  std::vector<GeoPoint> points;
+  for (int i = 0; i < n; ++i) {
+    const double f = i / (n - 1.0);
+    points.push_back({from.lat + f * (to.lat - from.lat),
+                      from.lon + f * (to.lon - from.lon)});
+  }
+  return points;
+}
+
+class SpatialIndexTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // East along 47.6 N, north along 122.35 W, and a ride in Paris.
+    rides_.push_back(MakeRide(Line({47.6, -122.4}, {47.6, -122.3}, 1001)));
+    rides_.push_back(
+        MakeRide(Line({47.55, -122.35}, {47.65, -122.35}, 1001), 5000));
+    rides_.push_back(MakeRide(Line({48.85, 2.30}, {48.86, 2.35}, 500)));
+    for (const auto& ride : rides_) library_.push_back(ride.get());
+  }
+
+  std::vector<std::unique_ptr<TimeSeries>> rides_;
+  std::vector<const TimeSeries*> library_;
+};
+
+TEST_F(SpatialIndexTest, QueryBox) {
+  const auto index =
+      SpatialIndex::Build(library_, SpatialIndex::kDefaultCellDegrees, 2);
+  EXPECT_EQ(index->num_rides(), 3);
+  const std::vector<RideSegment> segments =
+      index->QueryBox({47.599, -122.351, 47.601, -122.349});
+  ASSERT_THAT(segments, ElementsAre(Field(&RideSegment::ride, 0),
+                                    Field(&RideSegment::ride, 1)));
+  // Ride 0 is in the box from 490 s to 510 s, and ride 1 from 5490 s to
+  // 5510 s. The segments cover that, plus at most the rest of the cell.
+  EXPECT_LE(segments[0].interval.begin, RideTime(490));
+  EXPECT_GE(segments[0].interval.end, RideTime(510));
+  EXPECT_LT(segments[0].interval.end - segments[0].interval.begin,
+            std::chrono::seconds(120));
+  EXPECT_LE(segments[1].interval.begin, RideTime(5490));
+  EXPECT_GE(segments[1].interval.end, RideTime(5510));
+  EXPECT_LT(segments[1].interval.end - segments[1].interval.begin,
+            std::chrono::seconds(120));
+
+  EXPECT_THAT(index->QueryBox({48.0, -100.0, 49.0, -99.0}), IsEmpty());
+  // Paris, with a box that wraps all the way around.
+  EXPECT_THAT(index->QueryBox({48.8, 2.0, 48.9, 1.0}),
+              ElementsAre(Field(&RideSegment::ride, 2)));
+}
+
+TEST_F(SpatialIndexTest, QueryCorridor) {
+  const auto index =
+      SpatialIndex::Build(library_, SpatialIndex::kDefaultCellDegrees, 1);
+  const std::vector<RideSegment> segments = index->QueryCorridor(
+      {{47.56, -122.35}, {47.60, -122.3501}, {47.64, -122.35}}, 50);
+  ASSERT_THAT(segments, ElementsAre(Field(&RideSegment::ride, 0),
+                                    Field(&RideSegment::ride, 1)));
+  // Ride 0 only crosses the corridor; ride 1 follows it.
+  EXPECT_LT(segments[0].interval.end - segments[0].interval.begin,
+            std::chrono::seconds(120));
+  EXPECT_LE(segments[1].interval.begin, RideTime(5100));
+  EXPECT_GE(segments[1].interval.end, RideTime(5900));
+
+  // A single point is a circle.
+  EXPECT_THAT(index->QueryCorridor({{48.855, 2.325}}, 100),
+              ElementsAre(Field(&RideSegment::ride, 2)));
+  EXPECT_THAT(index->QueryCorridor({}, 100), IsEmpty());
+}
+
+TEST_F(SpatialIndexTest, SaveAndOpen) {
+  const auto built =
+      SpatialIndex::Build(library_, SpatialIndex::kDefaultCellDegrees, 4);
+  const std::string path =
+      ::testing::internal::TempDir() + "spatial_index_test.index";
+  ASSERT_TRUE(built->Save(path).ok());
+  const auto opened = SpatialIndex::Open(path);
+  ASSERT_TRUE(opened != nullptr);
+  EXPECT_EQ(opened->num_rides(), 3);
+  EXPECT_EQ(opened->num_cells(), built->num_cells());
+  EXPECT_EQ(opened->num_postings(), built->num_postings());
+  EXPECT_EQ(opened->cell_degrees(), built->cell_degrees());
+  const GeoBox box = {47.5, -122.5, 47.7, -122.2};
+  EXPECT_THAT(opened->QueryBox(box), Pointwise(Eq(), built->QueryBox(box)));
+
+  // Truncated files and other files are rejected.
+  FILE* fp = fopen(path.c_str(), "r+");
+  ASSERT_TRUE(fp != nullptr);
+  ASSERT_EQ(ftruncate(fileno(fp), 100), 0);
+  fclose(fp);
+  EXPECT_TRUE(SpatialIndex::Open(path) == nullptr);
+  std::remove(path.c_str());
+  EXPECT_TRUE(SpatialIndex::Open(path) == nullptr);
+}
+
+TEST(SpatialIndexEdgeTest, AntimeridianGapsAndJumps) {
+  std::vector<GeoPoint> track = Line({-17.0, 179.95}, {-17.0, 180.05}, 101);
+  for (GeoPoint& point : track) {
+    if (point.lon > 180) point.lon -= 360;
+  }
+  const double kNaN = std::nan("");
+  // No GPS for a while, then two samples 0.05 degrees (10 cells) apart.
+  track.push_back({kNaN, kNaN});
+  track.push_back({-17.0, -179.9});
+  track.push_back({-17.0, -179.85});
+  const auto ride = MakeRide(track);
+  const auto no_gps = MakeRide({{kNaN, kNaN}, {kNaN, kNaN}});
+  const TimeSeries empty;
+  const auto index = SpatialIndex::Build(
+      {ride.get(), no_gps.get(), &empty}, SpatialIndex::kDefaultCellDegrees,
+      3);
+  EXPECT_THAT(index->QueryBox({-17.01, 179.99, -16.99, -179.99}),
+              ElementsAre(Field(&RideSegment::ride, 0)));
+  // Between the two far apart samples.
+  const std::vector<RideSegment> between =
+      index->QueryBox({-17.01, -179.876, -16.99, -179.874});
+  ASSERT_THAT(between, ElementsAre(Field(&RideSegment::ride, 0)));
+  EXPECT_EQ(between[0].interval.begin, RideTime(102));
+  EXPECT_EQ(between[0].interval.end, RideTime(103));
+}
+
+// Every sample of every ride in a box must be covered by a segment, whatever
+// the number of threads the index was built with.
+TEST(SpatialIndexEdgeTest, NoMissedSamples) {
+  std::mt19937 random(7);
+  std::normal_distribution<double> step(0, 3e-4);
+  std::vector<std::unique_ptr<TimeSeries>> rides;
+  std::vector<std::vector<GeoPoint>> tracks;
+  for (int r = 0; r < 20; ++r) {
+    std::vector<GeoPoint> track;
+    GeoPoint point = {45.0, 7.0};
+    for (int i = 0; i < 2000; ++i) {
+      point.lat += step(random);
+      point.lon += step(random);
+      track.push_back(point);
+    }
+    tracks.push_back(track);
+    rides.push_back(MakeRide(track, 10000 * r));
+  }
+  std::vector<const TimeSeries*> library;
+  for (const auto& ride : rides) library.push_back(ride.get());
+  const auto index = SpatialIndex::Build(library, 0.002, 1);
+  const auto parallel = SpatialIndex::Build(library, 0.002, 5);
+
+  std::uniform_real_distribution<double> center(-0.05, 0.05);
+  for (int q = 0; q < 50; ++q) {
+    const GeoBox box = {45.0 + center(random), 7.0 + center(random), 0, 0};
+    const GeoBox query = {box.min_lat, box.min_lon, box.min_lat + 0.01,
+                          box.min_lon + 0.01};
+    const std::vector<RideSegment> segments = index->QueryBox(query);
+    EXPECT_THAT(parallel->QueryBox(query), Pointwise(Eq(), segments));
+    for (size_t r = 0; r < tracks.size(); ++r) {
+      for (size_t i = 0; i < tracks[r].size(); ++i) {
+        const GeoPoint& p = tracks[r][i];
+        if (p.lat < query.min_lat || p.lat > query.max_lat ||
+            p.lon < query.min_lon || p.lon > query.max_lon) {
+          continue;
+        }
+        const TimeSeries::TimePoint time = RideTime(10000 * r + i);
+        bool covered = false;
+        for (const RideSegment& segment : segments) {
+          covered |= segment.ride == static_cast<int>(r) &&
+                     segment.interval.begin <= time &&
+                     time <= segment.interval.end;
+        }
+        ASSERT_TRUE(covered) << "query " << q << " ride " << r << " sample "
+                             << i;
+      }
+    }
+  }
+}
+
+}  // namespace
+}  // namespace cycling
@@ -13,10 +13,13 @@ class Status {
     FAILURE,
   };
 
-  static Status OkStatus(const std::string& message = "");
+  // Inline, and without building a message, as parsers return one for every
+  // value they read.
+  static Status OkStatus() { return Status(); }
+  static Status OkStatus(const std::string& message);
   static Status FailureStatus(const std::string& message);
 
-  Status() : Status(OK, "") {}
+  Status() : code_(OK) {}
   Status(const Status& rhs) = default;
   Status(Status&& rhs) = default;
   Status& operator=(const Status& rhs) = default;
@@ -0,0 +1,169 @@
+#include "tcx_ingest.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <cstdio>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "str_util.h"
+#include "tcx_util.h"
+
+namespace cycling {
+namespace {
+
+bool HasTcxExtension(const std::string& name) {
+  for (const std::string extension : {".tcx", ".tcx.gz"}) {
+    if (name.size() > extension.size() &&
+        ToLowercase(name.substr(name.size() - extension.size())) ==
+            extension) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Status ListDirectory(const std::string& directory,
+                     std::vector<std::string>* paths) {
+  DIR* dir = opendir(directory.c_str());
+  if (dir == nullptr) {
+    return Status::FailureStatus(StrCat("Couldn't list ", directory));
+  }
+  std::vector<std::string> subdirectories;
+  while (const dirent* entry = readdir(dir)) {
+    const std::string name = entry->d_name;
+    if (name == "." || name == "..") continue;
+    const std::string path = StrCat(directory, "/", name);
+    struct stat info;
+    if (lstat(path.c_str(), &info) != 0) continue;
+    if (S_ISDIR(info.st_mode)) {
+      subdirectories.push_back(path);
+    } else if (HasTcxExtension(name) &&
+               stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+      paths->push_back(path);
+    }
+  }
+  closedir(dir);
+  for (const std::string& subdirectory : subdirectories) {
+    RETURN_IF_ERROR(ListDirectory(subdirectory, paths));
+  }
+  return Status::OkStatus();
+}
+
+// The size of the XML in the file at path. gzip files end with the size
+// they decompress to, modulo 2^32.
+size_t XmlSize(const std::string& path) {
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0) return 0;
+  size_t size = info.st_size;
+  FILE* fp = fopen(path.c_str(), "rb");
+  if (fp == nullptr) return size;
+  unsigned char magic[2];
+  unsigned char trailer[4];
+  if (fread(magic, 1, 2, fp) == 2 && magic[0] == 0x1f && magic[1] == 0x8b &&
+      fseek(fp, -4, SEEK_END) == 0 && fread(trailer, 1, 4, fp) == 4) {
+    size = trailer[0] | trailer[1] << 8 | trailer[2] << 16 |
+           static_cast<size_t>(trailer[3]) << 24;
+  }
+  fclose(fp);
+  return size;
+}
+
+}  // namespace
+
+void IngestTcxFiles(const std::vector<std::string>& paths,
+                    const IngestOptions& options,
+                    const IngestCallback& callback) {
+  const size_t n = paths.size();
+  std::vector<size_t> sizes(n);
+  for (size_t i = 0; i < n; ++i) sizes[i] = XmlSize(paths[i]);
+
+  struct Result {
+    bool parsed = false;
+    Status status;
+    std::unique_ptr<TimeSeries> series;
+  };
+  std::vector<Result> results(n);
+  // Everything below is guarded by mutex. Files are started in order, and
+  // their bytes count against the budget until they are delivered.
+  std::mutex mutex;
+  std::condition_variable changed;
+  size_t next = 0;
+  size_t bytes_in_flight = 0;
+  std::deque<size_t> parsed;
+
+  auto worker = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      changed.wait(lock, [&]() {
+        return next == n || bytes_in_flight == 0 ||
+               bytes_in_flight + sizes[next] <= options.max_bytes_in_flight;
+      });
+      if (next == n) return;
+      const size_t i = next++;
+      bytes_in_flight += sizes[i];
+      lock.unlock();
+      std::unique_ptr<TimeSeries> series;
+      Status status = ParseTcxFile(paths[i], &series);
+      lock.lock();
+      results[i].parsed = true;
+      results[i].status = std::move(status);
+      results[i].series = std::move(series);
+      if (!options.in_order) parsed.push_back(i);
+      changed.notify_all();
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 0; i < std::max(1, options.num_threads); ++i) {
+    threads.emplace_back(worker);
+  }
+
+  // Deliver on this thread, so that callback needn't be thread safe. The
+  // budget never holds back the next file in order: once everything before it
+  // is delivered, nothing is in flight until it starts.
+  std::unique_lock<std::mutex> lock(mutex);
+  for (size_t delivered = 0; delivered < n; ++delivered) {
+    size_t i = delivered;
+    if (options.in_order) {
+      changed.wait(lock, [&]() { return results[i].parsed; });
+    } else {
+      changed.wait(lock, [&]() { return !parsed.empty(); });
+      i = parsed.front();
+      parsed.pop_front();
+    }
+    Result result = std::move(results[i]);
+    lock.unlock();
+    callback(paths[i], result.status, std::move(result.series));
+    lock.lock();
+    bytes_in_flight -= sizes[i];
+    changed.notify_all();
+  }
+  lock.unlock();
+  for (std::thread& thread : threads) thread.join();
+}
+
+Status ListTcxFiles(const std::string& directory,
+                    std::vector<std::string>* paths) {
+  std::vector<std::string> found;
+  RETURN_IF_ERROR(ListDirectory(directory, &found));
+  std::sort(found.begin(), found.end());
+  *paths = std::move(found);
+  return Status::OkStatus();
+}
+
+Status IngestTcxDirectory(const std::string& directory,
+                          const IngestOptions& options,
+                          const IngestCallback& callback) {
+  std::vector<std::string> paths;
+  RETURN_IF_ERROR(ListTcxFiles(directory, &paths));
+  IngestTcxFiles(paths, options, callback);
+  return Status::OkStatus();
+}
+
+}  // namespace cycling
@@ -0,0 +1,59 @@
+#ifndef __TCX_INGEST_H__
+#define __TCX_INGEST_H__
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "status.h"
+#include "time_series.h"
+
+namespace cycling {
+
+struct IngestOptions {
+  // Files are parsed on this many threads, one file per thread at a time.
+  int num_threads = 4;
+  // A file is only started while the files that are being parsed, or are
+  // parsed but not yet delivered, add up to no more than this many bytes of
+  // XML, as compressed files count what they decompress to. The parsed series
+  // take memory in proportion. A file bigger than the budget is parsed on its
+  // own.
+  size_t max_bytes_in_flight = 256 << 20;
+  // Deliver the files in the order they were listed, holding back the ones
+  // that finish early, rather than as soon as they are parsed.
+  bool in_order = false;
+};
+
+// Receives each file of a batch: its path, and either the parsed series or
+// what is wrong with the file, in which case series is nullptr.
+using IngestCallback =
+    std::function<void(const std::string& path, const Status& status,
+                       std::unique_ptr<TimeSeries> series)>;
+
+// Parses every file in paths with ParseTcxFile on a pool of
+// options.num_threads threads, and hands each one to callback. Files that
+// can't be read or parsed are reported to callback too, and don't stop the
+// others. callback is called on the calling thread, one file at a time, while
+// the pool carries on with the next files; it gets every file exactly once
+// before this returns.
+void IngestTcxFiles(const std::vector<std::string>& paths,
+                    const IngestOptions& options,
+                    const IngestCallback& callback);
+
+// Finds the files whose names end in .tcx or .tcx.gz, in any case, under
+// directory and its subdirectories, sorted by path. Symbolic links to files
+// are followed, those to directories aren't.
+Status ListTcxFiles(const std::string& directory,
+                    std::vector<std::string>* paths);
+
+// Ingests every file ListTcxFiles finds under directory. Fails only if the
+// directory can't be listed, before anything is delivered.
+Status IngestTcxDirectory(const std::string& directory,
+                          const IngestOptions& options,
+                          const IngestCallback& callback);
+
+}  // namespace cycling
+
+#endif  // __TCX_INGEST_H__
@@ -0,0 +1,159 @@
+#include "tcx_ingest.h"
+
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include <cstdio>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "tcx_util.h"
+
+namespace cycling {
+namespace {
+
+using ::testing::ElementsAre;
+
+const char kFenix3IndoorRide[] = "fenix3_indoor_ride.tcx";
+const char kFenix3OutdoorRide[] = "fenix3_outdoor_ride.tcx";
+const char kTrainerroadRide[] = "trainerroad_ride.tcx";
+
+void Copy(const std::string& from, const std::string& to) {
+  std::ifstream in(from, std::ios::binary);
+  std::ofstream out(to, std::ios::binary);
+  out << in.rdbuf();
+}
+
+void Gzip(const std::string& from, const std::string& to) {
+  std::ifstream in(from, std::ios::binary);
+  std::stringstream contents;
+  contents << in.rdbuf();
+  gzFile file = gzopen(to.c_str(), "wb");
+  gzwrite(file, contents.str().data(), contents.str().size());
+  gzclose(file);
+}
+
+// Builds a directory of rides, a broken file and files to leave alone, and
+// returns its path.
+std::string MakeLibrary() {
+  const std::string root = ::testing::internal::TempDir() + "tcx_ingest_test";
+  mkdir(root.c_str(), 0777);
+  mkdir((root + "/2016").c_str(), 0777);
+  Copy(kFenix3OutdoorRide, root + "/b.tcx");
+  Copy(kTrainerroadRide, root + "/2016/a.TCX");
+  Copy(kFenix3IndoorRide, root + "/2016/c.tcx");
+  Gzip(kFenix3IndoorRide, root + "/2016/d.tcx.gz");
+  std::ofstream(root + "/broken.tcx") << "<TrainingCenterDatabase>";
+  std::ofstream(root + "/notes.txt") << "Not a ride.";
+  std::ofstream(root + "/.tcx") << "Not a ride either.";
+  return root;
+}
+
+struct Delivered {
+  std::string path;
+  bool ok;
+  int num_samples;
+};
+
+std::vector<Delivered> Ingest(const std::vector<std::string>& paths,
+                              const IngestOptions& options) {
+  std::vector<Delivered> delivered;
+  IngestTcxFiles(paths, options,
+                 [&](const std::string& path, const Status& status,
+                     std::unique_ptr<TimeSeries> series) {
+                   EXPECT_EQ(status.ok(), series != nullptr);
+                   delivered.push_back({path, status.ok(),
+                                        series ? series->num_samples() : -1});
+                 });
+  return delivered;
+}
+
+TEST(TcxIngestTest, ListTcxFiles) {
+  const std::string root = MakeLibrary();
+  std::vector<std::string> paths;
+  ASSERT_TRUE(ListTcxFiles(root, &paths).ok());
+  EXPECT_THAT(paths,
+              ElementsAre(root + "/2016/a.TCX", root + "/2016/c.tcx",
+                          root + "/2016/d.tcx.gz", root + "/b.tcx",
+                          root + "/broken.tcx"));
+  EXPECT_FALSE(ListTcxFiles(root + "/missing", &paths).ok());
+}
+
+TEST(TcxIngestTest, InOrder) {
+  const std::string root = MakeLibrary();
+  std::vector<std::string> paths;
+  ASSERT_TRUE(ListTcxFiles(root, &paths).ok());
+  paths.push_back(root + "/missing.tcx");
+
+  for (const int num_threads : {1, 2, 8}) {
+    // A budget of one byte parses one file at a time.
+    for (const size_t max_bytes_in_flight : {size_t(1), size_t(256) << 20}) {
+      IngestOptions options;
+      options.num_threads = num_threads;
+      options.max_bytes_in_flight = max_bytes_in_flight;
+      options.in_order = true;
+      const std::vector<Delivered> delivered = Ingest(paths, options);
+      ASSERT_EQ(delivered.size(), paths.size());
+      for (size_t i = 0; i < paths.size(); ++i) {
+        SCOPED_TRACE(paths[i]);
+        EXPECT_EQ(delivered[i].path, paths[i]);
+        const bool broken = i >= 4;
+        EXPECT_EQ(delivered[i].ok, !broken);
+        if (!broken) {
+          EXPECT_EQ(delivered[i].num_samples,
+                    ParseTcxFile(paths[i])->num_samples());
+        }
+      }
+    }
+  }
+}
+
+TEST(TcxIngestTest, AsParsed) {
+  const std::string root = MakeLibrary();
+  std::vector<std::string> paths;
+  ASSERT_TRUE(ListTcxFiles(root, &paths).ok());
+  // The same file many times over.
+  for (int i = 0; i < 20; ++i) paths.push_back(paths[0]);
+
+  IngestOptions options;
+  options.num_threads = 3;
+  options.max_bytes_in_flight = 1 << 20;
+  const std::vector<Delivered> delivered = Ingest(paths, options);
+  ASSERT_EQ(delivered.size(), paths.size());
+  std::multiset<std::string> expected(paths.begin(), paths.end());
+  std::multiset<std::string> actual;
+  int failures = 0;
+  for (const Delivered& file : delivered) {
+    actual.insert(file.path);
+    if (!file.ok) ++failures;
+  }
+  EXPECT_EQ(actual, expected);
+  EXPECT_EQ(failures, 1);
+}
+
+TEST(TcxIngestTest, IngestTcxDirectory) {
+  int num_files = 0;
+  EXPECT_TRUE(IngestTcxDirectory(MakeLibrary(), IngestOptions(),
+                                 [&](const std::string&, const Status&,
+                                     std::unique_ptr<TimeSeries>) {
+                                   ++num_files;
+                                 })
+                  .ok());
+  EXPECT_EQ(num_files, 5);
+  EXPECT_FALSE(IngestTcxDirectory("no_such_directory", IngestOptions(),
+                                  [&](const std::string&, const Status&,
+                                      std::unique_ptr<TimeSeries>) {
+                                    ++num_files;
+                                  })
+                   .ok());
+  EXPECT_EQ(num_files, 5);
+}
+
+}  // namespace
+}  // namespace cycling
@@ -1,13 +1,25 @@
 #include "tcx_util.h"
 
+#include <algorithm>
+#include <bitset>
 #include <cctype>
-#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
 #include <iostream>
-#include <map>
+#include <iterator>
 #include <memory>
+#include <set>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
+#include "mapped_file.h"
 #include "measurement.h"
+#include "parallel.h"
 #include "si_base_unit.h"
 #include "si_unit.h"
 #include "si_var.h"
@@ -15,14 +27,16 @@
 #include "str_util.h"
 #include "time_sample.h"
 #include "time_series.h"
+#include "xml_scanner.h"
+#include "xml_text.h"
 #include "xml_util.h"
 
 namespace cycling {
 
 namespace {
 
-using SampleHandler = std::function<Status(const XmlNode*, TimeSample*)>;
-using SeriesHandler = std::function<Status(const XmlNode*, TimeSeries*)>;
+using SampleHandler = Status (*)(const XmlNode*, TimeSample*);
+using SeriesHandler = Status (*)(const XmlNode*, TimeSeries*);
 
 template <typename T, typename... Args>
 std::unique_ptr<T> make_unique(Args&&... args) {
@@ -84,7 +98,14 @@ enum TcxEntity {
   WATTS,
 };
 
-const std::initializer_list<std::pair<std::string, TcxEntity>> kEntities = {
+struct TcxEntityName {
+  // Lowercase, as names are looked up without regard to case.
+  std::string_view name;
+  TcxEntity entity;
+};
+
+// In the order of TcxEntity, so that an entity is its index.
+constexpr TcxEntityName kEntities[] = {
     {"(unknown)", TCX_UNKNOWN},
     {"(text)", TCX_TEXT},
     {"activities", ACTIVITIES},
@@ -92,7 +113,7 @@ const std::initializer_list<std::pair<std::string, TcxEntity>> kEntities = {
     {"altitudemeters", ALTITUDE_METERS},
     {"author", AUTHOR},
     {"averageheartratebpm", AVERAGE_HEART_RATE_BPM},
-    {"avgbikecadence", AVG_RUN_CADENCE},
+    {"avgbikecadence", AVG_BIKE_CADENCE},
     {"avgruncadence", AVG_RUN_CADENCE},
     {"avgspeed", AVG_SPEED},
     {"avgwatts", AVG_WATTS},
@@ -139,23 +160,35 @@ const std::initializer_list<std::pair<std::string, TcxEntity>> kEntities = {
     {"watts", WATTS},
 };
 
-TcxEntity GetTcxEntity(const XmlNode* node) {
-  static std::map<std::string, TcxEntity> entities;
-  if (entities.empty()) {
-    for (const auto& p : kEntities) entities[p.first] = p.second;
+constexpr int kNumEntities = sizeof(kEntities) / sizeof(kEntities[0]);
+
+constexpr bool EntitiesAreInOrder() {
+  for (int i = 0; i < kNumEntities; ++i) {
+    if (kEntities[i].entity != i) return false;
   }
+  return true;
+}
+
+static_assert(EntitiesAreInOrder(), "kEntities is out of order");
+
+constexpr XmlAtomTable kEntityTable(kEntities);
+
+static_assert(kEntityTable.ok(), "No perfect hash of the entity names");
+// Tag names are interned as entities as soon as they are read, so the parsers
+// only ever compare entities.
+TcxEntity GetTcxEntity(const char* name, const size_t size) {
+  return static_cast<TcxEntity>(kEntityTable.Find(name, size));
+}
+
+TcxEntity GetTcxEntity(const XmlNode* node) {
   if (node == nullptr) return TCX_UNKNOWN;
   if (node->type == XmlNode::FREE_TEXT) return TCX_TEXT;
-  auto it = entities.find(ToLowercase(node->name));
-  if (it == entities.end()) return TCX_UNKNOWN;
-  return it->second;
+  return GetTcxEntity(node->name.data(), node->name.size());
 }
 
 std::string GetTcxEntityName(const TcxEntity entity) {
-  static const std::vector<std::pair<std::string, TcxEntity>> entities(
-      kEntities);
-  if (entity < 0 || entity >= entities.size()) return "(unknown)";
-  return entities[entity].first;
+  if (entity < 0 || entity >= kNumEntities) return "(unknown)";
+  return std::string(kEntities[entity].name);
 }
 
 Status EntityMatches(const XmlNode* node, const XmlNode* parent,
@@ -354,25 +387,34 @@ std::string ConvertToString(const XmlNode* node, const int indent) {
   return ret;
 }
 
-template <typename HandlerMap, typename OutputData>
-Status ParseWithHandlers(const XmlNode* node, const HandlerMap& handlers,
+// How to parse the children of a node that are a given entity.
+template <typename Handler>
+struct EntityHandler {
+  TcxEntity entity;
+  Handler parse;
+};
+
+template <typename Handler, size_t N, typename OutputData>
+Status ParseWithHandlers(const XmlNode* node,
+                         const EntityHandler<Handler> (&handlers)[N],
                          OutputData* data) {
   for (const auto& kid : node->children) {
     const TcxEntity entity = GetTcxEntity(kid.get());
-    auto it = handlers.find(entity);
-    if (it == handlers.end()) {
+    const EntityHandler<Handler>* handler = handlers;
+    while (handler < handlers + N && handler->entity != entity) ++handler;
+    if (handler == handlers + N) {
       return Status::FailureStatus(StrCat("Unexpected child of ", node->name,
                                           ": ", GetTcxEntityName(entity), "\n",
                                           ConvertToString(kid.get(), 0)));
     }
-    RETURN_IF_ERROR(it->second(kid.get(), data));
+    RETURN_IF_ERROR(handler->parse(kid.get(), data));
   }
   return Status::OkStatus();
 }
 
 Status ParseLap(const XmlNode* node, TimeSeries* series) {
   RETURN_IF_ERROR(ChildCountGreaterThan(node, 0));
-  const std::map<TcxEntity, SeriesHandler> kHandlers = {
+  static constexpr EntityHandler<SeriesHandler> kHandlers[] = {
       {TOTAL_TIME_SECONDS, ParseTotalTimeSeconds},
       {DISTANCE_METERS, ParseDistanceMeters},
       {MAXIMUM_SPEED, ParseMaximumSpeed},
@@ -389,47 +431,6 @@ Status ParseLap(const XmlNode* node, TimeSeries* series) {
   return Status::OkStatus();
 }
 
-Status ExtractDouble(const std::string& str, double* d) {
-  int n;
-  if (sscanf(str.c_str(), "%lf%n", d, &n) != 1 || n != str.size()) {
-    return Status::FailureStatus(
-        StrCat("Expected string to contain one float, got ", str, " instead."));
-  }
-  return Status::OkStatus();
-}
-
-Status ExtractInt(const std::string& str, int* i) {
-  int n;
-  if (sscanf(str.c_str(), "%d%n", i, &n) != 1 || n != str.size()) {
-    return Status::FailureStatus(
-        StrCat("Expected string to contain one int, got ", str, " instead."));
-  }
-  return Status::OkStatus();
-}
-
-Status ExtractTime(const std::string& str, TimeSample::TimePoint* time) {
-  int y, m, d, h, min, s, ms, n;
-  if (sscanf(str.c_str(), "%4d-%2d-%2dT%2d:%2d:%2d.%dZ%n", &y, &m, &d, &h, &min,
-             &s, &ms, &n) != 7 ||
-      n < str.size()) {
-    if (sscanf(str.c_str(), "%4d-%2d-%2dT%2d:%2d:%2dZ%n", &y, &m, &d, &h, &min,
-               &s, &n) != 6 ||
-        n < str.size()) {
-      return Status::FailureStatus(
-          StrCat("Expected a Time value, got '", str, "' instead."));
-    }
-  }
-  struct tm c_time;
-  c_time.tm_sec = s;
-  c_time.tm_min = min;
-  c_time.tm_hour = h;
-  c_time.tm_mday = d;
-  c_time.tm_mon = m - 1;
-  c_time.tm_year = y - 1900;
-  *time = std::chrono::system_clock::from_time_t(mktime(&c_time));
-  return Status::OkStatus();
-}
-
 Status ParseTotalTimeSeconds(const XmlNode* node, TimeSeries* series) {
   const std::string* time;
   RETURN_IF_ERROR(ContainsOneTextChild(node, &time));
@@ -539,7 +540,7 @@ Status ParseTrack(const XmlNode* node, TimeSeries* series) {
 
 Status ParseTrackpoint(const XmlNode* node, TimeSample* sample) {
   RETURN_IF_ERROR(ChildCountGreaterThan(node, 0));
-  const std::map<TcxEntity, SampleHandler> kHandlers = {
+  static constexpr EntityHandler<SampleHandler> kHandlers[] = {
       {TIME, ParseTime},
       {POSITION, ParsePosition},
       {CADENCE, ParseCadenceSample},
@@ -564,7 +565,7 @@ Status ParseTime(const XmlNode* node, TimeSample* sample) {
 
 Status ParsePosition(const XmlNode* node, TimeSample* sample) {
   RETURN_IF_ERROR(ChildCountEquals(node, 2));
-  const std::map<TcxEntity, SampleHandler> kHandlers = {
+  static constexpr EntityHandler<SampleHandler> kHandlers[] = {
       {LATITUDE_DEGREES, ParseLatitudeDegrees},
       {LONGITUDE_DEGREES, ParseLongitudeDegrees},
   };
@@ -604,7 +605,7 @@ Status ParseDistanceMetersSample(const XmlNode* node, TimeSample* sample) {
   RETURN_IF_ERROR(ContainsOneTextChild(node, &elev));
   double d;
   RETURN_IF_ERROR(ExtractDouble(*elev, &d));
-  sample->Add(Measurement(Measurement::INCREMENTAL_DISTANCE, d));
+  sample->Add(Measurement(Measurement::TOTAL_DISTANCE, d));
   return Status::OkStatus();
 }
 
@@ -625,7 +626,7 @@ Status ParseExtensionsSample(const XmlNode* node, TimeSample* sample) {
 
 Status ParseTpx(const XmlNode* node, TimeSample* sample) {
   RETURN_IF_ERROR(ChildCountGreaterThan(node, 0));
-  const std::map<TcxEntity, SampleHandler> kHandlers = {
+  static constexpr EntityHandler<SampleHandler> kHandlers[] = {
       {SPEED, ParseSpeed}, {WATTS, ParseWatts}, {RUN_CADENCE, ParseRunCadence},
   };
   RETURN_IF_ERROR(ParseWithHandlers(node, kHandlers, sample));
@@ -670,7 +671,7 @@ Status ParseExtensions(const XmlNode* node, TimeSeries* series) {
 
 Status ParseLx(const XmlNode* node, TimeSeries* series) {
   RETURN_IF_ERROR(ChildCountGreaterThan(node, 0));
-  const std::map<TcxEntity, SeriesHandler> kHandlers = {
+  static constexpr EntityHandler<SeriesHandler> kHandlers[] = {
       {AVG_RUN_CADENCE, ParseAvgRunCadence},
       {MAX_RUN_CADENCE, ParseMaxRunCadence},
       {AVG_BIKE_CADENCE, ParseAvgRunCadence},
@@ -767,9 +768,677 @@ Status BeginParse(const XmlNode* node, TimeSeries* series) {
   return Status::OkStatus();
 }
 
+// What an element means to the streaming parser, which depends on where in
+// the document it is. The rules mirror the Parse* functions above, so both
+// parsers accept the same documents.
+enum TcxState {
+  IN_DOCUMENT,
+  IN_DATABASE,
+  IN_ACTIVITIES,
+  IN_ACTIVITY,
+  IN_LAP,
+  IN_LAP_EXTENSIONS,
+  IN_LX,
+  IN_HEART_RATE,
+  IN_TRACK,
+  IN_TRACKPOINT,
+  IN_POSITION,
+  IN_TRACKPOINT_EXTENSIONS,
+  IN_TPX,
+  // Elements holding a single value in their text.
+  IN_TEXT,
+  IN_INT,
+  IN_DOUBLE,
+  IN_TIME,
+  // Elements whose contents are ignored.
+  IN_SKIPPED,
+};
+
+// An open element.
+struct TcxFrame {
+  TcxState state = IN_DOCUMENT;
+  TcxEntity entity = TCX_UNKNOWN;
+  // For values, the measurement of the trackpoint they are, or NO_TYPE if
+  // they are only checked.
+  Measurement::Type type = Measurement::NO_TYPE;
+  // Element and text children so far, not counting whitespace.
+  int num_children = 0;
+  // Set once the database has its activities, or the activity its creator;
+  // the rest of their children are ignored.
+  bool done = false;
+  // The value of IN_INT and IN_DOUBLE elements, and of IN_TIME ones.
+  double value = 0;
+  TimeSample::TimePoint time = TimeSample::TimePoint();
+};
+
+// The measurements of the trackpoints to keep.
+using TcxChannels = std::bitset<Measurement::NUM_MEASUREMENTS>;
+
+// Builds a TimeSeries from the elements and text of a TCX document, in
+// document order, holding only the open elements and the trackpoint being
+// read. Fed by ScanXml, or by xml_util::ReadXmlFile.
+class TcxStreamParser : public XmlScanHandler {
+ public:
+  explicit TcxStreamParser(TimeSeries* series) : series_(series) {
+    stack_.push_back({IN_DOCUMENT, TCX_UNKNOWN});
+    channels_.set();
+  }
+
+  // Only keeps the measurements in channels. The elements of the others are
+  // skipped like unknown ones, so their text is neither parsed nor checked.
+  TcxStreamParser(TimeSeries* series, const TcxChannels& channels)
+      : TcxStreamParser(series) {
+    channels_ = channels;
+  }
+
+  // Parses a piece of a document, which is taken to start inside the
+  // elements of context, outermost first. The trackpoints are kept in
+  // samples() rather than added to a series, and the children of the context
+  // are only checked by JoinTo().
+  explicit TcxStreamParser(const std::vector<TcxFrame>& context)
+      : series_(nullptr),
+        context_(context),
+        stack_(context),
+        open_context_(context.size()) {
+    channels_.set();
+  }
+
+  Status StartElement(const char* name, const size_t size,
+                      bool* skip) override;
+  Status EndElement() override;
+  Status Text(const char* text, const size_t size) override;
+  Status EndDocument();
+
+  // For a piece: checks that stack, the elements open where the piece
+  // starts, is what the piece was taken to start inside, and carries it over
+  // the piece.
+  Status JoinTo(std::vector<TcxFrame>* stack) const;
+
+  // For a piece: makes the times of its trackpoints unique as ParseTcxFile
+  // would, given the trackpoint before the piece at previous, if any. Only
+  // the leading ones can change.
+  void FollowOn(const TimeSample* previous);
+
+  // For a piece: its trackpoints, and how many of them have each type of
+  // measurement.
+  std::vector<TimeSample>* samples() { return &samples_; }
+  const TimeSeries::ValueCounts& num_values() const { return num_values_; }
+
+ private:
+  // Sets up child, an element under parent.
+  Status Enter(TcxFrame* parent, const char* name, const size_t size,
+               TcxFrame* child);
+  Status CheckChildren(const TcxFrame& frame) const;
+  // For a piece: adds sample_ to samples_.
+  void AddToPiece();
+
+  TimeSeries* series_;
+  TcxChannels channels_;
+  std::vector<TcxFrame> context_;
+  std::vector<TcxFrame> stack_;
+  // How many of the context's elements are still open, and the ones that the
+  // piece closed, innermost first.
+  size_t open_context_ = 0;
+  std::vector<TcxFrame> closed_context_;
+  std::vector<TimeSample> samples_;
+  TimeSeries::ValueCounts num_values_ = {};
+  // The times, as read, of the trackpoints at the start of a piece, up to the
+  // first that is more than a microsecond after the one before. Making the
+  // times unique depends on the trackpoint before, which only FollowOn()
+  // knows, but never reaches past those.
+  std::vector<TimeSample::TimePoint> leading_times_;
+  TimeSample sample_;
+  TimeParser time_parser_;
+};
+
+Status TcxStreamParser::StartElement(const char* name, const size_t size,
+                                     bool* skip) {
+  TcxFrame child{IN_SKIPPED, GetTcxEntity(name, size)};
+  TcxFrame* parent = &stack_.back();
+  if (parent->state != IN_SKIPPED) {
+    RETURN_IF_ERROR(Enter(parent, name, size, &child));
+  }
+  *skip = child.state == IN_SKIPPED;
+  ++parent->num_children;
+  stack_.push_back(std::move(child));
+  return Status::OkStatus();
+}
+
+Status TcxStreamParser::Enter(TcxFrame* parent, const char* name,
+                              const size_t size, TcxFrame* child) {
+  auto enter = [child](const TcxState state, const Measurement::Type type) {
+    child->state = state;
+    child->type = type;
+    return Status::OkStatus();
+  };
+  const Measurement::Type kNone = Measurement::NO_TYPE;
+  // A trackpoint element holding measurements of the given types, which is
+  // skipped whole unless one of them is wanted.
+  auto enter_if = [this, &enter](const TcxState state,
+                                 const Measurement::Type type,
+                                 std::initializer_list<Measurement::Type>
+                                     types) {
+    for (const Measurement::Type wanted : types) {
+      if (channels_[wanted]) return enter(state, type);
+    }
+    return enter(IN_SKIPPED, kNone);
+  };
+  switch (parent->state) {
+    case IN_DOCUMENT:
+      if (child->entity == TRAINING_CENTER_DATABASE) {
+        return enter(IN_DATABASE, kNone);
+      }
+      break;
+    case IN_DATABASE:
+      if (child->entity == ACTIVITIES && !parent->done) {
+        parent->done = true;
+        return enter(IN_ACTIVITIES, kNone);
+      }
+      return enter(IN_SKIPPED, kNone);
+    case IN_ACTIVITIES:
+      if (child->entity == ACTIVITY) return enter(IN_ACTIVITY, kNone);
+      break;
+    case IN_ACTIVITY:
+      if (parent->done) return enter(IN_SKIPPED, kNone);
+      if (parent->num_children == 0) {
+        if (child->entity == ID) return enter(IN_TEXT, kNone);
+        break;
+      }
+      if (child->entity == LAP) return enter(IN_LAP, kNone);
+      if (child->entity == CREATOR) {
+        parent->done = true;
+        return enter(IN_SKIPPED, kNone);
+      }
+      break;
+    case IN_LAP:
+      switch (child->entity) {
+        case TOTAL_TIME_SECONDS:
+        case DISTANCE_METERS:
+        case MAXIMUM_SPEED:
+        case CALORIES:
+          return enter(IN_DOUBLE, kNone);
+        case CADENCE:
+          return enter(IN_INT, kNone);
+        case EXTENSIONS:
+          return enter(IN_LAP_EXTENSIONS, kNone);
+        case AVERAGE_HEART_RATE_BPM:
+        case MAXIMUM_HEART_RATE_BPM:
+          return enter(IN_HEART_RATE, kNone);
+        case INTENSITY:
+        case TRIGGER_METHOD:
+          return enter(IN_TEXT, kNone);
+        case TRACK:
+          return enter(IN_TRACK, kNone);
+        default:
+          break;
+      }
+      break;
+    case IN_LAP_EXTENSIONS:
+      if (child->entity == LX) return enter(IN_LX, kNone);
+      break;
+    case IN_LX:
+      switch (child->entity) {
+        case AVG_SPEED:
+          return enter(IN_DOUBLE, kNone);
+        case AVG_RUN_CADENCE:
+        case MAX_RUN_CADENCE:
+        case AVG_BIKE_CADENCE:
+        case MAX_BIKE_CADENCE:
+        case AVG_WATTS:
+        case MAX_WATTS:
+        case STEPS:
+          return enter(IN_INT, kNone);
+        default:
+          break;
+      }
+      break;
+    case IN_HEART_RATE:
+      // Only entered for trackpoints if their heart rate is wanted.
+      if (child->entity == VALUE) return enter(IN_INT, parent->type);
+      break;
+    case IN_TRACK:
+      if (child->entity == TRACKPOINT) {
+        sample_ = TimeSample();
+        return enter(IN_TRACKPOINT, kNone);
+      }
+      break;
+    case IN_TRACKPOINT:
+      switch (child->entity) {
+        case TIME:
+          return enter(IN_TIME, kNone);
+        case POSITION:
+          return enter_if(IN_POSITION, kNone,
+                          {Measurement::DEGREES_LATITUDE,
+                           Measurement::DEGREES_LONGITUDE});
+        case CADENCE:
+          return enter_if(IN_INT, Measurement::CADENCE,
+                          {Measurement::CADENCE});
+        case ALTITUDE_METERS:
+          return enter_if(IN_DOUBLE, Measurement::ALTITUDE,
+                          {Measurement::ALTITUDE});
+        case DISTANCE_METERS:
+          return enter_if(IN_DOUBLE, Measurement::TOTAL_DISTANCE,
+                          {Measurement::TOTAL_DISTANCE});
+        case HEART_RATE_BPM:
+          return enter_if(IN_HEART_RATE, Measurement::HEART_RATE,
+                          {Measurement::HEART_RATE});
+        case EXTENSIONS:
+          return enter_if(IN_TRACKPOINT_EXTENSIONS, kNone,
+                          {Measurement::SPEED, Measurement::POWER,
+                           Measurement::CADENCE});
+        default:
+          break;
+      }
+      break;
+    case IN_POSITION:
+      if (child->entity == LATITUDE_DEGREES) {
+        return enter_if(IN_DOUBLE, Measurement::DEGREES_LATITUDE,
+                        {Measurement::DEGREES_LATITUDE});
+      }
+      if (child->entity == LONGITUDE_DEGREES) {
+        return enter_if(IN_DOUBLE, Measurement::DEGREES_LONGITUDE,
+                        {Measurement::DEGREES_LONGITUDE});
+      }
+      break;
+    case IN_TRACKPOINT_EXTENSIONS:
+      if (child->entity == TPX) return enter(IN_TPX, kNone);
+      break;
+    case IN_TPX:
+      switch (child->entity) {
+        case SPEED:
+          return enter_if(IN_DOUBLE, Measurement::SPEED, {Measurement::SPEED});
+        case WATTS:
+          return enter_if(IN_INT, Measurement::POWER, {Measurement::POWER});
+        case RUN_CADENCE:
+          return enter_if(IN_INT, Measurement::CADENCE,
+                          {Measurement::CADENCE});
+        default:
+          break;
+      }
+      break;
+    case IN_TEXT:
+    case IN_INT:
+    case IN_DOUBLE:
+    case IN_TIME:
+    case IN_SKIPPED:
+      break;
+  }
+  return Status::FailureStatus(
+      StrCat("Unexpected child of ", GetTcxEntityName(parent->entity), ": ",
+             std::string(name, size), "."));
+}
+
+Status TcxStreamParser::Text(const char* text, const size_t size) {
+  TcxFrame* frame = &stack_.back();
+  if (frame->state == IN_SKIPPED) return Status::OkStatus();
+  const char* begin = text;
+  const char* end = text + size;
+  TrimXmlText(&begin, &end);
+  if (begin == end) return Status::OkStatus();
+  ++frame->num_children;
+  switch (frame->state) {
+    case IN_TEXT:
+      return Status::OkStatus();
+    case IN_INT: {
+      int i;
+      RETURN_IF_ERROR(ExtractInt(begin, end - begin, &i));
+      frame->value = i;
+      return Status::OkStatus();
+    }
+    case IN_DOUBLE:
+      return ExtractDouble(begin, end - begin, &frame->value);
+    case IN_TIME:
+      return time_parser_.Parse(begin, end - begin, &frame->time);
+    case IN_DATABASE:
+      return Status::OkStatus();
+    case IN_ACTIVITY:
+      if (frame->done) return Status::OkStatus();
+      break;
+    default:
+      break;
+  }
+  return Status::FailureStatus(
+      StrCat("Unexpected text under ", GetTcxEntityName(frame->entity), ": ",
+             std::string(begin, end)));
+}
+
+Status TcxStreamParser::CheckChildren(const TcxFrame& frame) const {
+  int min = 1, max = 1;
+  switch (frame.state) {
+    case IN_DOCUMENT:
+    case IN_SKIPPED:
+      return Status::OkStatus();
+    case IN_DATABASE:
+      if (!frame.done) {
+        return Status::FailureStatus(
+            "Could not find an activities node under the database.");
+      }
+      return Status::OkStatus();
+    case IN_ACTIVITY:
+      min = 2;
+      max = -1;
+      break;
+    case IN_POSITION:
+      min = max = 2;
+      break;
+    case IN_LAP:
+    case IN_LAP_EXTENSIONS:
+    case IN_LX:
+    case IN_TRACK:
+    case IN_TRACKPOINT:
+    case IN_TPX:
+      max = -1;
+      break;
+    default:
+      break;
+  }
+  if (frame.num_children < min ||
+      (max >= 0 && frame.num_children > max)) {
+    return Status::FailureStatus(
+        StrCat("Unexpected number of children of ",
+               GetTcxEntityName(frame.entity), ": ", frame.num_children, "."));
+  }
+  return Status::OkStatus();
+}
+
+Status TcxStreamParser::EndElement() {
+  if (stack_.size() == 1) return Status::FailureStatus("Unexpected end tag.");
+  const TcxFrame frame = std::move(stack_.back());
+  stack_.pop_back();
+  if (stack_.size() < open_context_) {
+    // Its children before the piece are unknown until the pieces are joined.
+    open_context_ = stack_.size();
+    closed_context_.push_back(frame);
+    return Status::OkStatus();
+  }
+  RETURN_IF_ERROR(CheckChildren(frame));
+  // Values were parsed when their text came, and count once the element is
+  // known to hold nothing else.
+  switch (frame.state) {
+    case IN_INT:
+    case IN_DOUBLE:
+      if (frame.type != Measurement::NO_TYPE) {
+        sample_.Add(frame.type, frame.value);
+      }
+      break;
+    case IN_TIME:
+      sample_.set_time(frame.time);
+      break;
+    case IN_TRACKPOINT:
+      if (series_ == nullptr) {
+        AddToPiece();
+        break;
+      }
+      if (series_->num_samples() > 0 && series_->EndTime() == sample_.time()) {
+        sample_.set_time(sample_.time() + std::chrono::microseconds(1));
+      }
+      series_->Add(std::move(sample_));
+      break;
+    default:
+      break;
+  }
+  return Status::OkStatus();
+}
+
+void TcxStreamParser::AddToPiece() {
+  const TimeSample::TimePoint time = sample_.time();
+  if (leading_times_.size() == samples_.size() &&
+      (leading_times_.empty() ||
+       time - leading_times_.back() <= std::chrono::microseconds(1))) {
+    leading_times_.push_back(time);
+  }
+  // As for a series, in EndElement().
+  if (!samples_.empty() && samples_.back().time() == time) {
+    sample_.set_time(time + std::chrono::microseconds(1));
+  }
+  for (int i = 0; i < Measurement::NUM_MEASUREMENTS; ++i) {
+    if (sample_.has_value(static_cast<Measurement::Type>(i))) ++num_values_[i];
+  }
+  samples_.push_back(std::move(sample_));
+}
+
+void TcxStreamParser::FollowOn(const TimeSample* previous) {
+  if (previous == nullptr) return;
+  TimeSample::TimePoint last = previous->time();
+  for (size_t i = 0; i < leading_times_.size(); ++i) {
+    TimeSample::TimePoint time = leading_times_[i];
+    if (time == last) time += std::chrono::microseconds(1);
+    samples_[i].set_time(time);
+    last = time;
+  }
+}
+
+Status TcxStreamParser::EndDocument() {
+  if (stack_.size() != 1 || stack_.back().num_children != 1) {
+    return Status::FailureStatus("Expected a TrainingCenterDatabase.");
+  }
+  return Status::OkStatus();
+}
+
+Status TcxStreamParser::JoinTo(std::vector<TcxFrame>* stack) const {
+  // The piece was parsed as if in context_, which only matters as far as
+  // Enter() looks at the frames: only an activity cares how many children it
+  // has had.
+  bool same = stack->size() == context_.size();
+  for (size_t i = 0; same && i < context_.size(); ++i) {
+    const TcxFrame& frame = (*stack)[i];
+    const TcxFrame& assumed = context_[i];
+    same = frame.state == assumed.state && frame.entity == assumed.entity &&
+           frame.type == assumed.type && frame.done == assumed.done &&
+           (frame.state != IN_ACTIVITY ||
+            (frame.num_children == 0) == (assumed.num_children == 0));
+  }
+  if (!same) {
+    return Status::FailureStatus("The piece doesn't start where assumed.");
+  }
+  // Counting the children from before the piece too.
+  for (const TcxFrame& closed : closed_context_) {
+    TcxFrame frame = std::move(stack->back());
+    stack->pop_back();
+    frame.num_children +=
+        closed.num_children - context_[stack->size()].num_children;
+    frame.done = closed.done;
+    RETURN_IF_ERROR(CheckChildren(frame));
+  }
+  for (size_t i = 0; i < stack->size(); ++i) {
+    (*stack)[i].num_children +=
+        stack_[i].num_children - context_[i].num_children;
+    (*stack)[i].done = stack_[i].done;
+  }
+  stack->insert(stack->end(), stack_.begin() + stack->size(), stack_.end());
+  return Status::OkStatus();
+}
+
+// Where the first piece of a document starts.
+const std::vector<TcxFrame>& DocumentContext() {
+  static const std::vector<TcxFrame>* const context =
+      new std::vector<TcxFrame>{{IN_DOCUMENT, TCX_UNKNOWN}};
+  return *context;
+}
+
+// Where the other pieces, which start with a Trackpoint, are taken to start:
+// in the track of a lap, after the activity's Id.
+const std::vector<TcxFrame>& TrackContext() {
+  const Measurement::Type kNone = Measurement::NO_TYPE;
+  static const std::vector<TcxFrame>* const context =
+      new std::vector<TcxFrame>{
+          {IN_DOCUMENT, TCX_UNKNOWN, kNone, 1},
+          {IN_DATABASE, TRAINING_CENTER_DATABASE, kNone, 1, true},
+          {IN_ACTIVITIES, ACTIVITIES, kNone, 1},
+          {IN_ACTIVITY, ACTIVITY, kNone, 1},
+          {IN_LAP, LAP, kNone, 1},
+          {IN_TRACK, TRACK},
+      };
+  return *context;
+}
+
+// Pieces are at least this big, for threads to have enough to do.
+const size_t kMinPieceSize = 64 << 10;
+
+// Cuts [data, data + size) into at most num_pieces pieces of about the same
+// size, just before Trackpoint start tags. Returns where the pieces start.
+std::vector<size_t> CutAtTrackpoints(const char* data, const size_t size,
+                                     const int num_pieces) {
+  const std::string_view text(data, size);
+  const std::string_view tag = "<Trackpoint";
+  std::vector<size_t> starts = {0};
+  for (int i = 1; i < num_pieces; ++i) {
+    size_t at = std::max(starts.back() + 1, size / num_pieces * i);
+    for (; (at = text.find(tag, at)) != std::string_view::npos; ++at) {
+      const size_t after = at + tag.size();
+      if (after < size && (text[after] == '>' || text[after] == '/' ||
+                           isspace(static_cast<unsigned char>(text[after])))) {
+        break;
+      }
+    }
+    if (at == std::string_view::npos) break;
+    starts.push_back(at);
+  }
+  return starts;
+}
+
+// Parses the file at path in pieces on num_threads threads, into series.
+// Fails if the file is too small to be worth cutting, or if the pieces don't
+// fit together as ParseTcxFile would read the file, leaving series as it was.
+Status ParseTcxPieces(const std::string& path, const int num_threads,
+                      TimeSeries* series) {
+  const std::unique_ptr<MappedFile> file = MappedFile::Open(path);
+  if (file == nullptr) {
+    return Status::FailureStatus(StrCat("Couldn't map ", path));
+  }
+  const size_t max_pieces =
+      std::min<size_t>(num_threads * 4, file->size() / kMinPieceSize);
+  const std::vector<size_t> starts =
+      CutAtTrackpoints(file->data(), file->size(), max_pieces);
+  if (starts.size() < 2) return Status::FailureStatus("Too small to cut up.");
+  std::vector<std::string> prefixes;
+  RETURN_IF_ERROR(
+      ScanXmlRootPrefixes(file->data(), file->size(), &prefixes));
+
+  struct Piece {
+    std::unique_ptr<TcxStreamParser> parser;
+    XmlPieceEnds ends;
+    Status status;
+  };
+  std::vector<Piece> pieces(starts.size());
+  ParallelFor(pieces.size(), num_threads, [&](const int, const size_t i) {
+    const bool first = i == 0;
+    const size_t end = i + 1 < starts.size() ? starts[i + 1] : file->size();
+    Piece& piece = pieces[i];
+    piece.parser.reset(
+        new TcxStreamParser(first ? DocumentContext() : TrackContext()));
+    piece.status = ScanXmlPiece(
+        file->data() + starts[i], end - starts[i], first,
+        first ? std::vector<std::string>() : prefixes, piece.parser.get(),
+        &piece.ends);
+  });
+
+  // Follow the open elements from piece to piece, as one parser would.
+  std::vector<TcxFrame> stack = DocumentContext();
+  std::vector<std::string> open;
+  size_t num_samples = 0;
+  TimeSeries::ValueCounts num_values = {};
+  for (Piece& piece : pieces) {
+    RETURN_IF_ERROR(piece.status);
+    RETURN_IF_ERROR(piece.parser->JoinTo(&stack));
+    for (const std::string& name : piece.ends.closed) {
+      if (open.empty() || open.back() != name) {
+        return Status::FailureStatus(StrCat("Mismatched end tag ", name));
+      }
+      open.pop_back();
+    }
+    open.insert(open.end(), piece.ends.open.begin(), piece.ends.open.end());
+    num_samples += piece.parser->samples()->size();
+    for (int i = 0; i < Measurement::NUM_MEASUREMENTS; ++i) {
+      num_values[i] += piece.parser->num_values()[i];
+    }
+  }
+  if (!open.empty() || stack.size() != 1 || stack[0].num_children != 1) {
+    return Status::FailureStatus("Expected a TrainingCenterDatabase.");
+  }
+
+  // The pieces made their times unique and counted their values as they were
+  // parsed, so they are only moved, in bulk, into the first one.
+  std::vector<TimeSample> samples = std::move(*pieces[0].parser->samples());
+  samples.reserve(num_samples);
+  for (size_t i = 1; i < pieces.size(); ++i) {
+    TcxStreamParser* parser = pieces[i].parser.get();
+    parser->FollowOn(samples.empty() ? nullptr : &samples.back());
+    samples.insert(samples.end(),
+                   std::make_move_iterator(parser->samples()->begin()),
+                   std::make_move_iterator(parser->samples()->end()));
+    pieces[i].parser.reset();
+  }
+  series->Add(std::move(samples), num_values);
+  return Status::OkStatus();
+}
+
+Status ParseTcxStream(const std::string& path, const TcxChannels& channels,
+                      std::unique_ptr<TimeSeries>* series) {
+  {
+    TimeSeries scanned;
+    TcxStreamParser parser(&scanned, channels);
+    if (ScanXmlFile(path, &parser).ok() && parser.EndDocument().ok()) {
+      series->reset(new TimeSeries(std::move(scanned)));
+      return Status::OkStatus();
+    }
+  }
+  // Anything the scanner doesn't handle, and anything wrong with the file,
+  // goes through libxml, which knows all of XML and says what is wrong.
+  TimeSeries streamed;
+  TcxStreamParser parser(&streamed, channels);
+  RETURN_IF_ERROR(xml_util::ReadXmlFile(path, &parser));
+  RETURN_IF_ERROR(parser.EndDocument());
+  series->reset(new TimeSeries(std::move(streamed)));
+  return Status::OkStatus();
+}
+
 }  // namespace
 
+Status ParseTcxFile(const std::string& path,
+                    std::unique_ptr<TimeSeries>* series) {
+  return ParseTcxStream(path, TcxChannels().set(), series);
+}
+
 std::unique_ptr<TimeSeries> ParseTcxFile(const std::string& path) {
+  std::unique_ptr<TimeSeries> series;
+  const Status status = ParseTcxFile(path, &series);
+  if (!status.ok()) std::cerr << path << ": " << status << std::endl;
+  return series;
+}
+
+Status ParseTcxFile(const std::string& path,
+                    const std::set<Measurement::Type>& types,
+                    std::unique_ptr<TimeSeries>* series) {
+  TcxChannels channels;
+  for (const Measurement::Type type : types) {
+    if (type > Measurement::NO_TYPE && type < Measurement::NUM_MEASUREMENTS) {
+      channels.set(type);
+    }
+  }
+  return ParseTcxStream(path, channels, series);
+}
+
+std::unique_ptr<TimeSeries> ParseTcxFile(
+    const std::string& path, const std::set<Measurement::Type>& types) {
+  std::unique_ptr<TimeSeries> series;
+  const Status status = ParseTcxFile(path, types, &series);
+  if (!status.ok()) std::cerr << path << ": " << status << std::endl;
+  return series;
+}
+
+std::unique_ptr<TimeSeries> ParseTcxFileInParallel(const std::string& path,
+                                                   const int num_threads) {
+  if (num_threads > 1) {
+    TimeSeries series;
+    if (ParseTcxPieces(path, num_threads, &series).ok()) {
+      return make_unique<TimeSeries>(std::move(series));
+    }
+  }
+  return ParseTcxFile(path);
+}
+
+std::unique_ptr<TimeSeries> ParseTcxFileWithDom(const std::string& path) {
   std::unique_ptr<XmlNode> node = xml_util::ParseXmlFile(path);
   if (!node) return nullptr;
   TimeSeries series;
@@ -1,15 +1,49 @@
 #ifndef __TCX_UTIL_H__
 #define __TCX_UTIL_H__
 
+#include <memory>
+#include <set>
 #include <string>
 
+#include "measurement.h"
+#include "status.h"
 #include "time_series.h"
 
 namespace cycling {
 
 // Converts the TCX file at path to a TimeSeries, stripping out lap information.
+// Streams through the file, holding only the trackpoint being read.
 std::unique_ptr<TimeSeries> ParseTcxFile(const std::string& path);
 
+// Same as ParseTcxFile, but returns what is wrong with the file instead of
+// printing it. series is only set on success.
+Status ParseTcxFile(const std::string& path,
+                    std::unique_ptr<TimeSeries>* series);
+
+// Same as ParseTcxFile, but only keeps the measurements of the given types,
+// e.g. {POWER} for a job that only looks at power. The elements holding the
+// other measurements, such as the whole Position for {POWER}, are skipped
+// without their text being parsed or checked, so files that are wrong only
+// there still parse. Every trackpoint is kept, with its time.
+std::unique_ptr<TimeSeries> ParseTcxFile(
+    const std::string& path, const std::set<Measurement::Type>& types);
+Status ParseTcxFile(const std::string& path,
+                    const std::set<Measurement::Type>& types,
+                    std::unique_ptr<TimeSeries>* series);
+
+// Same as ParseTcxFile, for very long recordings: cuts the file into pieces
+// at its trackpoints, and parses them on num_threads threads. Each piece is
+// parsed as if it were in the middle of a track, and the pieces are then
+// checked to fit together, in order, exactly as ParseTcxFile would read the
+// file. Small files, and ones whose pieces don't fit together, are parsed
+// as ParseTcxFile does.
+std::unique_ptr<TimeSeries> ParseTcxFileInParallel(const std::string& path,
+                                                   const int num_threads);
+
+// Same as ParseTcxFile, but reads the whole file into an XmlNode tree first.
+// Several times slower, and uses memory in proportion to the file.
+std::unique_ptr<TimeSeries> ParseTcxFileWithDom(const std::string& path);
+
 }  // namespace cycling
 
 #endif
@@ -0,0 +1,89 @@
+// Checks that parsing a TCX file allocates a fixed amount of memory, plus the
+// output series, rather than some for every trackpoint. Counting allocations
+// means replacing the global operator new, hence a test of its own.
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+
+#include "gtest/gtest.h"
+#include "tcx_util.h"
+
+namespace {
+
+std::atomic<int64_t> num_allocations(0);
+
+}  // namespace
+
+void* operator new(const size_t size) {
+  ++num_allocations;
+  void* p = std::malloc(size == 0 ? 1 : size);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+namespace cycling {
+namespace {
+
+// Writes a TCX document with n trackpoints, each with a time, a position,
+// heart rate, cadence and power, to a temporary file.
+std::string WriteTcx(const int n) {
+  const std::string path = ::testing::internal::TempDir() +
+                           "tcx_util_allocation_test.tcx";
+  FILE* fp = fopen(path.c_str(), "w");
+  fprintf(fp,
+          "<?xml version=\"1.0\"?>\n"
+          "<TrainingCenterDatabase xmlns:ns3=\"urn:tpx\">\n"
+          "<Activities><Activity Sport=\"Biking\">\n"
+          "<Id>2016-01-01T10:00:00Z</Id><Lap><TotalTimeSeconds>1"
+          "</TotalTimeSeconds><Track>\n");
+  for (int i = 0; i < n; ++i) {
+    fprintf(fp,
+            "<Trackpoint><Time>2016-01-01T%02d:%02d:%02dZ</Time><Position>"
+            "<LatitudeDegrees>%.7f</LatitudeDegrees><LongitudeDegrees>%.7f"
+            "</LongitudeDegrees></Position><HeartRateBpm><Value>%d</Value>"
+            "</HeartRateBpm><Cadence>%d</Cadence><Extensions><ns3:TPX>"
+            "<ns3:Watts>%d</ns3:Watts></ns3:TPX></Extensions></Trackpoint>\n",
+            10 + i / 3600, i / 60 % 60, i % 60, 45 + i * 1e-5, 7 + i * 1e-5,
+            120 + i % 50, 80 + i % 20, 150 + i % 200);
+  }
+  fprintf(fp,
+          "</Track></Lap></Activity></Activities></TrainingCenterDatabase>\n");
+  fclose(fp);
+  return path;
+}
+
+// The number of allocations it takes to parse a file with n trackpoints.
+int64_t CountAllocations(const int n) {
+  const std::string path = WriteTcx(n);
+  const int64_t before = num_allocations;
+  std::unique_ptr<TimeSeries> series = ParseTcxFile(path);
+  const int64_t after = num_allocations;
+  EXPECT_NE(series.get(), nullptr);
+  if (series != nullptr) {
+    EXPECT_EQ(series->num_samples(), n);
+  }
+  return after - before;
+}
+
+TEST(TcxUtilAllocationTest, NoAllocationsPerTrackpoint) {
+  // Warms up what is set up once per process.
+  CountAllocations(10);
+  const int kNumTrackpoints = 5000;
+  const int64_t once = CountAllocations(kNumTrackpoints);
+  const int64_t twice = CountAllocations(2 * kNumTrackpoints);
+  // The samples of the series are kept in a vector which doubles as it grows,
+  // so twice the trackpoints take one more allocation, and the parser itself
+  // should take none.
+  EXPECT_LE(twice - once, 1);
+  EXPECT_LT(once, 100);
+}
+
+}  // namespace
+}  // namespace cycling
@@ -1,8 +1,23 @@
 #include "tcx_util.h"
 
+#include <zlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
+#include "measurement.h"
+#include "str_util.h"
+
 namespace cycling {
 namespace {
 
@@ -42,5 +57,347 @@ TEST(TcxUtilTest, ParseTrainerRoadRide) {
   EXPECT_NE(ParseTcxFile(kTrainerroadRide).get(), nullptr);
 }
 
+TEST(TcxUtilTest, DistanceIsCumulative) {
+  std::unique_ptr<TimeSeries> series = ParseTcxFile(kTrainerroadRide);
+  ASSERT_NE(series.get(), nullptr);
+  const TimeSeries::ColumnPtr total =
+      series->Values(Measurement::TOTAL_DISTANCE);
+  const TimeSeries::ColumnPtr incremental =
+      series->Values(Measurement::INCREMENTAL_DISTANCE);
+  double sum = 0, last = 0;
+  for (size_t i = 0; i < total->size(); ++i) {
+    if (std::isnan((*total)[i])) continue;
+    EXPECT_GE((*total)[i], last);
+    last = (*total)[i];
+    sum += (*incremental)[i];
+  }
+  EXPECT_GT(last, 0);
+  EXPECT_NEAR(sum, last, 1e-6);
+}
+
+void ExpectSameSeries(const TimeSeries* expected, const TimeSeries* actual) {
+  ASSERT_EQ(expected == nullptr, actual == nullptr);
+  if (expected == nullptr) return;
+  ASSERT_EQ(expected->num_samples(), actual->num_samples());
+  for (int i = 0; i < expected->num_samples(); ++i) {
+    ASSERT_EQ(expected->SampleTime(i), actual->SampleTime(i)) << i;
+  }
+  for (int t = Measurement::NO_TYPE + 1; t < Measurement::NUM_MEASUREMENTS;
+       ++t) {
+    const auto type = static_cast<Measurement::Type>(t);
+    if (TimeSeries::IsDerived(type)) continue;
+    const TimeSeries::ColumnPtr a = expected->Values(type);
+    const TimeSeries::ColumnPtr b = actual->Values(type);
+    ASSERT_EQ(a->size(), b->size()) << t;
+    for (size_t i = 0; i < a->size(); ++i) {
+      if (std::isnan((*a)[i])) {
+        ASSERT_TRUE(std::isnan((*b)[i])) << t << " " << i;
+      } else {
+        ASSERT_EQ((*a)[i], (*b)[i]) << t << " " << i;
+      }
+    }
+  }
+}
+
+TEST(TcxUtilTest, StreamingMatchesDom) {
+  for (const char* path :
+       {k310OutdoorRun, kFenix3IndoorIntervalsRun, kFenix3IndoorRide,
+        kFenix3OutdoorIntervalsRun, kFenix3OutdoorLongRun, kFenix3OutdoorRide,
+        kTrainerroadRide}) {
+    SCOPED_TRACE(path);
+    ExpectSameSeries(ParseTcxFileWithDom(path).get(), ParseTcxFile(path).get());
+  }
+}
+
+// Writes a TCX document with the given trackpoints and creator name to a
+// temporary file.
+std::string WriteTcx(const std::string& trackpoints,
+                     const std::string& creator = "Anything <b>goes</b>") {
+  const std::string path =
+      ::testing::internal::TempDir() + "tcx_util_test.tcx";
+  FILE* fp = fopen(path.c_str(), "w");
+  fprintf(fp,
+          "<?xml version=\"1.0\"?>\n"
+          "<TrainingCenterDatabase xmlns:ns3=\"urn:tpx\">\n"
+          "<Activities><Activity Sport=\"Biking\">\n"
+          "<Id>2016-01-01T10:00:00Z</Id><Lap><TotalTimeSeconds>2"
+          "</TotalTimeSeconds><Track>%s</Track></Lap>\n"
+          "<Creator><Name>%s</Name></Creator>\n"
+          "</Activity></Activities></TrainingCenterDatabase>\n",
+          trackpoints.c_str(), creator.c_str());
+  fclose(fp);
+  return path;
+}
+
+TEST(TcxUtilTest, StreamingAgreesOnEdgeCases) {
+  const std::string kTime = "<Time>2016-01-01T10:00:00Z</Time>";
+  // Fine, with a duplicate time.
+  const std::string kTrackpoints =
+      "<Trackpoint>" + kTime + "<Cadence> 90 </Cadence></Trackpoint>" +
+      "<Trackpoint>" + kTime + "<HeartRateBpm><Value>150</Value>" +
+      "</HeartRateBpm><Extensions><ns3:TPX><ns3:Watts>250</ns3:Watts>" +
+      "</ns3:TPX></Extensions></Trackpoint>";
+  for (const std::string& trackpoints : {
+           kTrackpoints,
+           // A position needs both coordinates.
+           "<Trackpoint>" + kTime + "<Position><LatitudeDegrees>1" +
+               "</LatitudeDegrees></Position></Trackpoint>",
+           // Not a number.
+           "<Trackpoint>" + kTime + "<Cadence>90.5</Cadence></Trackpoint>",
+           // Unexpected tags and text.
+           "<Trackpoint>" + kTime + "<Gear>3</Gear></Trackpoint>",
+           "<Trackpoint>" + kTime + "<Cadenc>90</Cadenc></Trackpoint>",
+           "<Trackpoint>" + kTime + "<Cadences>90</Cadences></Trackpoint>",
+           // Tag names are looked up without regard to case.
+           "<TRACKPOINT>" + kTime + "<cadence>90</cadence></TRACKPOINT>",
+           "<Trackpoint>" + kTime + "3</Trackpoint>",
+           "<Trackpoint>" + kTime + "<Cadence/></Trackpoint>",
+           std::string("<Trackpoint/>"),
+           // Not XML.
+           "<Trackpoint>" + kTime,
+       }) {
+    SCOPED_TRACE(trackpoints);
+    // The reference makes the XML scanner give up, and libxml take over.
+    for (const char* creator : {"Anything <b>goes</b>", "Q&amp;A"}) {
+      const std::string path = WriteTcx(trackpoints, creator);
+      ExpectSameSeries(ParseTcxFileWithDom(path).get(),
+                       ParseTcxFile(path).get());
+    }
+  }
+
+  std::unique_ptr<TimeSeries> series = ParseTcxFile(WriteTcx(kTrackpoints));
+  ASSERT_NE(series.get(), nullptr);
+  ASSERT_EQ(series->num_samples(), 2);
+  EXPECT_EQ(series->SampleTime(1) - series->SampleTime(0),
+            std::chrono::microseconds(1));
+  EXPECT_EQ((*series->Values(Measurement::CADENCE))[0], 90);
+  EXPECT_EQ((*series->Values(Measurement::HEART_RATE))[1], 150);
+  EXPECT_EQ((*series->Values(Measurement::POWER))[1], 250);
+
+  series = ParseTcxFile(WriteTcx("<trackPoint>" + kTime +
+                                 "<CADENCE>90</CADENCE></trackPoint>"));
+  ASSERT_NE(series.get(), nullptr);
+  ASSERT_EQ(series->num_samples(), 1);
+  EXPECT_EQ((*series->Values(Measurement::CADENCE))[0], 90);
+}
+
+TEST(TcxUtilTest, ParallelMatchesSerial) {
+  for (const char* path :
+       {k310OutdoorRun, kFenix3IndoorIntervalsRun, kFenix3IndoorRide,
+        kFenix3OutdoorIntervalsRun, kFenix3OutdoorLongRun, kFenix3OutdoorRide,
+        kTrainerroadRide}) {
+    SCOPED_TRACE(path);
+    const std::unique_ptr<TimeSeries> expected = ParseTcxFile(path);
+    for (const int num_threads : {2, 3, 8}) {
+      ExpectSameSeries(expected.get(),
+                       ParseTcxFileInParallel(path, num_threads).get());
+    }
+  }
+}
+
+// Big enough to be cut into many pieces, with a new lap every 500 and times
+// that repeat in pairs.
+std::string ManyTrackpoints(const int n, const std::string& middle) {
+  std::string trackpoints;
+  char time[64];
+  for (int i = 0; i < n; ++i) {
+    if (i == n / 2) trackpoints += middle;
+    if (i > 0 && i % 500 == 0) {
+      trackpoints +=
+          "</Track></Lap>\n<Lap><TotalTimeSeconds>500</TotalTimeSeconds>"
+          "<Track>";
+    }
+    snprintf(time, sizeof(time), "2016-01-01T%02d:%02d:%02d.500Z",
+             i / 2 / 3600, i / 2 / 60 % 60, i / 2 % 60);
+    trackpoints += StrCat(
+        "\n<Trackpoint><Time>", time, "</Time><Position><LatitudeDegrees>",
+        45 + i * 1e-5, "</LatitudeDegrees><LongitudeDegrees>", 7 + i * 1e-5,
+        "</LongitudeDegrees></Position><Cadence>", 80 + i % 20,
+        "</Cadence></Trackpoint>");
+  }
+  return trackpoints;
+}
+
+TEST(TcxUtilTest, ParallelAgreesOnEdgeCases) {
+  const int kNumTrackpoints = 4000;
+  const std::string kNewTrack = "<Track>";
+  for (const std::string& middle : {
+           std::string(),
+           // The rest of the activity is ignored.
+           std::string("</Track></Lap><Creator><Name>x</Name></Creator>"
+                       "<Lap><TotalTimeSeconds>1</TotalTimeSeconds><Track>"),
+           // Makes the XML scanner give up.
+           std::string("<!-- A comment -->"),
+           // Errors.
+           std::string("<Trackpoint><Time>noon</Time></Trackpoint>"),
+           std::string("</Track></Lap></Activity></Activities>"
+                       "</TrainingCenterDatabase><Track>"),
+           std::string("</Track></Lap><Lap><Track>"),
+           std::string("</Lap><Lap><Track>"),
+           std::string("<Track>"),
+       }) {
+    SCOPED_TRACE(middle);
+    const std::string path = WriteTcx(ManyTrackpoints(kNumTrackpoints, middle));
+    const std::unique_ptr<TimeSeries> expected = ParseTcxFile(path);
+    ExpectSameSeries(expected.get(), ParseTcxFileInParallel(path, 4).get());
+    if (middle.empty()) {
+      ASSERT_NE(expected.get(), nullptr);
+      EXPECT_EQ(expected->num_samples(), kNumTrackpoints);
+    }
+  }
+}
+
+TEST(TcxUtilTest, ParallelMakesTimesUniqueAcrossPieces) {
+  // Times come in threes a microsecond apart, the first two the same, so
+  // that where a piece starts decides the times of its first trackpoints.
+  const int kNumTrackpoints = 9000;
+  std::string trackpoints;
+  char time[64];
+  for (int i = 0; i < kNumTrackpoints; ++i) {
+    const int microseconds = i / 3 * 3 + std::max(0, i % 3 - 1);
+    snprintf(time, sizeof(time), "2016-01-01T10:%02d:%02d.%06dZ",
+             microseconds / 60000000, microseconds / 1000000 % 60,
+             microseconds % 1000000);
+    trackpoints += StrCat("\n<Trackpoint><Time>", time, "</Time><Cadence>",
+                          80 + i % 20, "</Cadence></Trackpoint>");
+  }
+  const std::string path = WriteTcx(trackpoints);
+  const std::unique_ptr<TimeSeries> expected = ParseTcxFile(path);
+  ASSERT_NE(expected.get(), nullptr);
+  ASSERT_EQ(expected->num_samples(), kNumTrackpoints);
+  for (const int num_threads : {2, 3, 5, 8}) {
+    ExpectSameSeries(expected.get(),
+                     ParseTcxFileInParallel(path, num_threads).get());
+  }
+}
+
+TEST(TcxUtilTest, ParseGzipFiles) {
+  for (const char* path :
+       {kFenix3IndoorIntervalsRun, kFenix3OutdoorRide, kTrainerroadRide}) {
+    SCOPED_TRACE(path);
+    std::ifstream in(path, std::ios::binary);
+    std::stringstream contents;
+    contents << in.rdbuf();
+    const std::string gzip_path =
+        ::testing::internal::TempDir() + "tcx_util_test.tcx.gz";
+    gzFile file = gzopen(gzip_path.c_str(), "wb");
+    gzwrite(file, contents.str().data(), contents.str().size());
+    gzclose(file);
+
+    const std::unique_ptr<TimeSeries> expected = ParseTcxFile(path);
+    ExpectSameSeries(expected.get(), ParseTcxFile(gzip_path).get());
+    ExpectSameSeries(expected.get(),
+                     ParseTcxFileInParallel(gzip_path, 4).get());
+    ExpectSameSeries(expected.get(), ParseTcxFileWithDom(gzip_path).get());
+  }
+}
+
+TEST(TcxUtilTest, ParseTimes) {
+  const std::vector<std::string> times = {
+      "2016-01-01T10:00:00Z",
+      "2016-01-01T10:00:00.25Z",
+      "2016-01-01T11:00:01+01:00",
+      "2016-01-01T05:30:02.123456789-04:30",
+      "2016-01-02T00:00:03+14:00",
+      "2016-02-29T10:00:00Z",
+  };
+  std::string trackpoints;
+  for (const std::string& time : times) {
+    trackpoints += "<Trackpoint><Time>" + time + "</Time></Trackpoint>";
+  }
+  const std::string path = WriteTcx(trackpoints);
+  std::unique_ptr<TimeSeries> series = ParseTcxFile(path);
+  ASSERT_NE(series.get(), nullptr);
+  ExpectSameSeries(ParseTcxFileWithDom(path).get(), series.get());
+  ASSERT_EQ(series->num_samples(), times.size());
+  // 2016-01-01T10:00:00Z.
+  const TimeSample::TimePoint start =
+      std::chrono::system_clock::from_time_t(1451642400);
+  const auto at = [start](const int64_t nanoseconds) {
+    return start + std::chrono::duration_cast<TimeSample::TimePoint::duration>(
+                       std::chrono::nanoseconds(nanoseconds));
+  };
+  EXPECT_EQ(series->SampleTime(0), start);
+  EXPECT_EQ(series->SampleTime(1), at(250000000));
+  EXPECT_EQ(series->SampleTime(2), at(1000000000));
+  EXPECT_EQ(series->SampleTime(3), at(2123456789));
+  EXPECT_EQ(series->SampleTime(4), at(3000000000));
+  EXPECT_EQ(series->SampleTime(5), start + std::chrono::hours(59 * 24));
+
+  for (const char* time : {
+           "2016-02-30T10:00:00Z",
+           "2015-02-29T10:00:00Z",
+           "2016-1-01T10:00:00Z",
+           "2016-01-01T24:00:00Z",
+           "2016-01-01T10:00:00",
+           "2016-01-01T10:00:00.000",
+           "2016-01-01T10:00:00.Z",
+           "2016-01-01T10:00:00+01",
+           "2016-01-01T10:00:00Zulu",
+       }) {
+    SCOPED_TRACE(time);
+    const std::string path =
+        WriteTcx(std::string("<Trackpoint><Time>") + time +
+                 "</Time></Trackpoint>");
+    EXPECT_EQ(ParseTcxFile(path).get(), nullptr);
+    EXPECT_EQ(ParseTcxFileWithDom(path).get(), nullptr);
+  }
+}
+
+TEST(TcxUtilTest, ParseOnlyRequestedTypes) {
+  for (const char* path : {kFenix3IndoorIntervalsRun, kFenix3OutdoorRide,
+                           kTrainerroadRide}) {
+    SCOPED_TRACE(path);
+    const std::unique_ptr<TimeSeries> all = ParseTcxFile(path);
+    ASSERT_NE(all.get(), nullptr);
+    for (const std::set<Measurement::Type>& types :
+         std::vector<std::set<Measurement::Type>>{
+             {},
+             {Measurement::POWER},
+             {Measurement::DEGREES_LATITUDE, Measurement::DEGREES_LONGITUDE},
+             {Measurement::DEGREES_LONGITUDE},
+             {Measurement::HEART_RATE, Measurement::CADENCE,
+              Measurement::SPEED},
+             {Measurement::ALTITUDE, Measurement::TOTAL_DISTANCE},
+         }) {
+      const std::unique_ptr<TimeSeries> some = ParseTcxFile(path, types);
+      ASSERT_NE(some.get(), nullptr);
+      ASSERT_EQ(all->num_samples(), some->num_samples());
+      for (int i = 0; i < all->num_samples(); ++i) {
+        ASSERT_EQ(all->SampleTime(i), some->SampleTime(i)) << i;
+      }
+      for (int t = Measurement::NO_TYPE + 1; t < Measurement::NUM_MEASUREMENTS;
+           ++t) {
+        const auto type = static_cast<Measurement::Type>(t);
+        if (TimeSeries::IsDerived(type)) continue;
+        const TimeSeries::ColumnPtr expected = all->Values(type);
+        const TimeSeries::ColumnPtr actual = some->Values(type);
+        for (size_t i = 0; i < actual->size(); ++i) {
+          if (types.count(type) == 0 || std::isnan((*expected)[i])) {
+            ASSERT_TRUE(std::isnan((*actual)[i])) << t << " " << i;
+          } else {
+            ASSERT_EQ((*expected)[i], (*actual)[i]) << t << " " << i;
+          }
+        }
+      }
+    }
+  }
+
+  // What isn't wanted isn't looked at either.
+  const std::string path = WriteTcx(
+      "<Trackpoint><Time>2016-01-01T10:00:00Z</Time><Position>"
+      "<LatitudeDegrees>north</LatitudeDegrees></Position>"
+      "<Extensions><ns3:TPX><ns3:Watts>250</ns3:Watts></ns3:TPX></Extensions>"
+      "</Trackpoint>");
+  EXPECT_EQ(ParseTcxFile(path).get(), nullptr);
+  const std::set<Measurement::Type> kLatitude = {Measurement::DEGREES_LATITUDE};
+  EXPECT_EQ(ParseTcxFile(path, kLatitude).get(), nullptr);
+  const std::set<Measurement::Type> kPower = {Measurement::POWER};
+  const std::unique_ptr<TimeSeries> series = ParseTcxFile(path, kPower);
+  ASSERT_NE(series.get(), nullptr);
+  ASSERT_EQ(series->num_samples(), 1);
+  EXPECT_EQ((*series->Values(Measurement::POWER))[0], 250);
+}
+
 }  // namespace
 }  // namespace cycling
@@ -9,8 +9,7 @@ TimeSample::TimeSample(const TimePoint& time) : time_(time) {}
 
 TimeSample::TimeSample(const TimePoint& time, const Measurement& m)
     : time_(time) {
-  has_[m.type()] = true;
-  measurements_[m.type()] = m.value();
+  Add(m);
 }
 
 TimeSample::TimeSample(const TimePoint& time,
@@ -21,24 +20,26 @@ TimeSample::TimeSample(const TimePoint& time,
 
 TimeSample& TimeSample::Add(const Measurement& m) {
   has_[m.type()] = true;
-  measurements_[m.type()] = m.value();
+  coefs_[m.type()] = m.value().coef();
   return *this;
 }
 
-bool TimeSample::has_value(const Measurement::Type type) const {
-  return has_[type];
+TimeSample& TimeSample::Remove(const Measurement::Type type) {
+  has_[type] = false;
+  coefs_[type] = 0;
+  return *this;
 }
 
 SiVar TimeSample::value(const Measurement::Type type) const {
   assert(has_value(type));
-  return measurements_[type];
+  return Measurement(type, coefs_[type]).value();
 }
 
 bool TimeSample::operator==(const TimeSample& rhs) const {
   if (time_ != rhs.time_) return false;
   for (int i = 0; i < Measurement::NUM_MEASUREMENTS; ++i) {
     if (has_[i] != rhs.has_[i]) return false;
-    if (has_[i] && measurements_[i] != rhs.measurements_[i]) return false;
+    if (has_[i] && coefs_[i] != rhs.coefs_[i]) return false;
   }
   return true;
 }
@@ -51,16 +52,13 @@ bool TimeSample::operator<(const TimeSample& rhs) const {
   if (time_ != rhs.time_) return time_ < rhs.time_;
   for (int i = 0; i < Measurement::NUM_MEASUREMENTS; ++i) {
     if (has_[i] != rhs.has_[i]) return !has_[i];
-    if (has_[i] && measurements_[i] != rhs.measurements_[i]) {
-      return measurements_[i] < rhs.measurements_[i];
-    }
+    if (has_[i] && coefs_[i] != rhs.coefs_[i]) return coefs_[i] < rhs.coefs_[i];
   }
   return false;
 }
 
 bool TimeSample::operator>(const TimeSample& rhs) const {
-  if (time_ != rhs.time_) return time_ > rhs.time_;
-  return measurements_ > rhs.measurements_;
+  return rhs < *this;
 }
 
 bool TimeSample::operator<=(const TimeSample& rhs) const {
@@ -1,6 +1,7 @@
 #ifndef __TIME_SAMPLE_H__
 #define __TIME_SAMPLE_H__
 
+#include <cassert>
 #include <chrono>
 #include <iostream>
 #include <vector>
@@ -50,19 +51,36 @@ class TimeSample {
   // of the same type was not previously present.
   TimeSample& Add(const Measurement& m);
 
+  // Same as Add(Measurement(type, coef)), without building the units.
+  TimeSample& Add(const Measurement::Type type, const double coef) {
+    has_[type] = true;
+    coefs_[type] = coef;
+    return *this;
+  }
+
+  // Removes the measurement of the given type, if there is one.
+  TimeSample& Remove(const Measurement::Type type);
+
   const TimePoint& time() const { return time_; }
   void set_time(const TimePoint& t) { time_ = t; }
 
-  bool has_value(const Measurement::Type type) const;
+  bool has_value(const Measurement::Type type) const { return has_[type]; }
 
   SiVar value(const Measurement::Type type) const;
 
-  void set(const Measurement::Type type, const SiVar value);
+  // Same as value(type).coef(), without building the units.
+  double coef(const Measurement::Type type) const {
+    assert(has_value(type));
+    return coefs_[type];
+  }
 
  private:
   TimePoint time_;
   bool has_[Measurement::NUM_MEASUREMENTS] = {false};
-  SiVar measurements_[Measurement::NUM_MEASUREMENTS];
+  // The value of each measurement in the base unit of its type, which is all
+  // there is to it: the units follow from the type. Keeps samples small, so
+  // reading a channel out of many of them touches little memory.
+  double coefs_[Measurement::NUM_MEASUREMENTS] = {0};
 };
 
 }  // namespace cycling
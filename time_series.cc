@@ -1,14 +1,24 @@
 #include "time_series.h"
 
 #include <cassert>
+#include <cmath>
+#include <cstdint>
 
 #include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <limits>
 #include <mutex>
 
+#include "derived_channels.h"
+
 namespace cycling {
   
 namespace {
 using MutexLock = std::lock_guard<std::mutex>;
+
+// How far back GRADE looks to smooth out altitude noise.
+const double kGradeWindowMeters = 20;
 }  // namespace
 
 TimeSeries::TimeSeries() {
@@ -25,7 +35,115 @@ void TimeSeries::Add(TimeSample&& sample) {
   if (!samples_.empty()) {
     assert(sample.time() > samples_.back().time());
   }
-  samples_.push_back(sample);
+  for (int i = 0; i < Measurement::NUM_MEASUREMENTS; ++i) {
+    if (sample.has_value(static_cast<Measurement::Type>(i))) ++num_values_[i];
+  }
+  samples_.push_back(std::move(sample));
+  InvalidateLocked();
+}
+
+void TimeSeries::Add(std::vector<TimeSample>&& samples) {
+  ValueCounts num_values = {};
+  for (const TimeSample& sample : samples) {
+    for (int i = 0; i < Measurement::NUM_MEASUREMENTS; ++i) {
+      if (sample.has_value(static_cast<Measurement::Type>(i))) ++num_values[i];
+    }
+  }
+  Add(std::move(samples), num_values);
+}
+
+void TimeSeries::Add(std::vector<TimeSample>&& samples,
+                     const ValueCounts& num_values) {
+  MutexLock lock{*mutex_};
+  assert(samples.empty() || samples_.empty() ||
+         samples.front().time() > samples_.back().time());
+  assert(std::adjacent_find(samples.begin(), samples.end(),
+                            [](const TimeSample& a, const TimeSample& b) {
+                              return a.time() >= b.time();
+                            }) == samples.end());
+  for (int i = 0; i < Measurement::NUM_MEASUREMENTS; ++i) {
+    num_values_[i] += num_values[i];
+  }
+  if (samples_.empty()) {
+    samples_ = std::move(samples);
+  } else {
+    samples_.insert(samples_.end(), std::make_move_iterator(samples.begin()),
+                    std::make_move_iterator(samples.end()));
+  }
+  samples.clear();
+  InvalidateLocked();
+}
+
+void TimeSeries::SetValues(const Measurement::Type type,
+                           const Column& values) {
+  MutexLock lock{*mutex_};
+  SetValuesLocked({type}, {&values});
+}
+
+void TimeSeries::SetValues(const std::vector<Measurement::Type>& types,
+                           const std::vector<Column>& values) {
+  assert(types.size() == values.size());
+  std::vector<const Column*> pointers;
+  for (const Column& column : values) pointers.push_back(&column);
+  MutexLock lock{*mutex_};
+  SetValuesLocked(types, pointers);
+}
+
+void TimeSeries::SetValuesLocked(const std::vector<Measurement::Type>& types,
+                                 const std::vector<const Column*>& values) {
+  // Comparing against a cached column is cheaper than against the samples,
+  // but not enough to be worth extracting one. A derived column doesn't
+  // reflect the samples though. A channel at a time, as in CopyValues().
+  std::vector<uint8_t> derived(types.size());
+  std::vector<uint8_t> changed(types.size());
+  for (size_t k = 0; k < types.size(); ++k) {
+    const Measurement::Type type = types[k];
+    const Column& column = *values[k];
+    assert(column.size() == samples_.size());
+    derived[k] = num_values_[type] == 0 && IsDerived(type);
+    const Column* current = derived[k] ? nullptr : columns_[type].get();
+    for (size_t i = 0; i < samples_.size(); ++i) {
+      const double value = column[i];
+      if (current && ((*current)[i] == value ||
+                      (std::isnan((*current)[i]) && std::isnan(value)))) {
+        continue;
+      }
+      TimeSample& sample = samples_[i];
+      const bool had_value = sample.has_value(type);
+      if (std::isnan(value)) {
+        if (!had_value) continue;
+        sample.Remove(type);
+        --num_values_[type];
+      } else {
+        if (had_value && sample.coef(type) == value) continue;
+        sample.Add(Measurement(type, value));
+        if (!had_value) ++num_values_[type];
+      }
+      changed[k] = true;
+    }
+  }
+  if (std::find(changed.begin(), changed.end(), 1) == changed.end()) return;
+  // Every derived column is dropped, whichever types changed, rather than
+  // working out which of them depend on those types.
+  for (int i = 0; i < Measurement::NUM_MEASUREMENTS; ++i) {
+    if (IsDerived(static_cast<Measurement::Type>(i))) columns_[i].reset();
+  }
+  for (size_t k = 0; k < types.size(); ++k) {
+    if (!changed[k]) continue;
+    columns_[types[k]] =
+        derived[k] ? nullptr : std::make_shared<const Column>(*values[k]);
+  }
+  segments_valid_ = false;
+  cached_columns_.clear();
+  ++generation_;
+}
+
+void TimeSeries::InvalidateLocked() {
+  segments_valid_ = false;
+  seconds_.reset();
+  for (ColumnPtr& column : columns_) column.reset();
+  cached_columns_.clear();
+  ++generation_;
 }
 
 TimeSeries::TimePoint TimeSeries::BeginTime() const {
@@ -40,6 +158,176 @@ TimeSeries::TimePoint TimeSeries::EndTime() const {
   return samples_.back().time();
 }
   
+TimeSeries::TimePoint TimeSeries::SampleTime(const int index) const {
+  MutexLock lock{*mutex_};
+  assert(index >= 0 && index < static_cast<int>(samples_.size()));
+  return samples_[index].time();
+}
+
+bool TimeSeries::IsDerived(const Measurement::Type type) {
+  switch (type) {
+    case Measurement::TOTAL_JOULES:
+    case Measurement::INCREMENTAL_DISTANCE:
+    case Measurement::TOTAL_DISTANCE:
+    case Measurement::GRADE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+TimeSeries::ColumnPtr TimeSeries::Seconds() const {
+  MutexLock lock{*mutex_};
+  return SecondsLocked();
+}
+
+TimeSeries::ColumnPtr TimeSeries::Values(const Measurement::Type type) const {
+  MutexLock lock{*mutex_};
+  return ValuesLocked(type);
+}
+
+void TimeSeries::CopyValues(const std::vector<Measurement::Type>& types,
+                            std::vector<Column>* columns) const {
+  MutexLock lock{*mutex_};
+  columns->resize(types.size());
+  std::vector<size_t> scanned;
+  for (size_t k = 0; k < types.size(); ++k) {
+    Column& column = (*columns)[k];
+    if (columns_[types[k]] || num_values_[types[k]] == 0) {
+      const Column& values = *ValuesLocked(types[k]);
+      column.assign(values.begin(), values.end());
+    } else {
+      column.resize(samples_.size());
+      scanned.push_back(k);
+    }
+  }
+  // A channel at a time keeps the loops simple enough to be fast, and the
+  // samples are small enough to stay in the cache from one to the next.
+  for (const size_t k : scanned) {
+    const Measurement::Type type = types[k];
+    double* column = (*columns)[k].data();
+    for (size_t i = 0; i < samples_.size(); ++i) {
+      column[i] = samples_[i].has_value(type)
+                      ? samples_[i].coef(type)
+                      : std::numeric_limits<double>::quiet_NaN();
+    }
+    // Copying is cheap next to scanning, and lets SetValues() compare new
+    // values against a column instead of the samples.
+    columns_[type] = std::make_shared<const Column>((*columns)[k]);
+  }
+}
+
+TimeSeries::ColumnPtr TimeSeries::CachedColumn(
+    const std::string& key, const std::function<Column()>& compute) const {
+  int64_t generation;
+  {
+    MutexLock lock{*mutex_};
+    auto it = cached_columns_.find(key);
+    if (it != cached_columns_.end()) return it->second;
+    generation = generation_;
+  }
+  ColumnPtr column = std::make_shared<const Column>(compute());
+  MutexLock lock{*mutex_};
+  if (generation != generation_) return column;
+  // Another thread may have computed the same column in the meantime, in which
+  // case everyone shares the first one.
+  return cached_columns_.emplace(key, std::move(column)).first->second;
+}
+
+const TimeSeries::ColumnPtr& TimeSeries::SecondsLocked() const {
+  if (!seconds_) {
+    Column seconds(samples_.size());
+    for (size_t i = 0; i < samples_.size(); ++i) {
+      seconds[i] = std::chrono::duration_cast<std::chrono::duration<double>>(
+                       samples_[i].time() - samples_.front().time())
+                       .count();
+    }
+    seconds_ = std::make_shared<const Column>(std::move(seconds));
+  }
+  return seconds_;
+}
+
+const TimeSeries::ColumnPtr& TimeSeries::ValuesLocked(
+    const Measurement::Type type) const {
+  ColumnPtr& column = columns_[type];
+  if (column) return column;
+  if (num_values_[type] == 0 && IsDerived(type)) {
+    column = std::make_shared<const Column>(Derive(type));
+    return column;
+  }
+  if (num_values_[type] == 0) {
+    column = std::make_shared<const Column>(
+        samples_.size(), std::numeric_limits<double>::quiet_NaN());
+    return column;
+  }
+  // Reading the samples costs far more than writing the columns, so every
+  // channel with values is extracted in the same scan.
+  std::vector<int> types;
+  for (int i = 0; i < Measurement::NUM_MEASUREMENTS; ++i) {
+    if (!columns_[i] && num_values_[i] > 0) types.push_back(i);
+  }
+  std::vector<Column> values(
+      types.size(),
+      Column(samples_.size(), std::numeric_limits<double>::quiet_NaN()));
+  for (size_t i = 0; i < samples_.size(); ++i) {
+    for (size_t k = 0; k < types.size(); ++k) {
+      const Measurement::Type t = static_cast<Measurement::Type>(types[k]);
+      if (samples_[i].has_value(t)) values[k][i] = samples_[i].coef(t);
+    }
+  }
+  for (size_t k = 0; k < types.size(); ++k) {
+    columns_[types[k]] = std::make_shared<const Column>(std::move(values[k]));
+  }
+  return column;
+}
+
+TimeSeries::Column TimeSeries::Derive(const Measurement::Type type) const {
+  switch (type) {
+    case Measurement::TOTAL_JOULES:
+      return derived_channels::CumulativeEnergy(
+          *SecondsLocked(), *ValuesLocked(Measurement::POWER));
+    case Measurement::INCREMENTAL_DISTANCE:
+      return derived_channels::IncrementalDistance(
+          *ValuesLocked(Measurement::TOTAL_DISTANCE));
+    case Measurement::TOTAL_DISTANCE:
+      if (num_values_[Measurement::INCREMENTAL_DISTANCE] > 0) {
+        return derived_channels::TotalDistanceFromIncrements(
+            *ValuesLocked(Measurement::INCREMENTAL_DISTANCE));
+      }
+      if (num_values_[Measurement::SPEED] > 0) {
+        return derived_channels::TotalDistanceFromSpeed(
+            *SecondsLocked(), *ValuesLocked(Measurement::SPEED));
+      }
+      break;
+    case Measurement::GRADE:
+      return derived_channels::Grade(
+          *ValuesLocked(Measurement::TOTAL_DISTANCE),
+          *ValuesLocked(Measurement::ALTITUDE), kGradeWindowMeters);
+    default:
+      break;
+  }
+  return Column(samples_.size(), std::numeric_limits<double>::quiet_NaN());
+}
+
+void TimeSeries::set_segmentation_options(const SegmentationOptions& options) {
+  MutexLock lock{*mutex_};
+  segmentation_options_ = options;
+  segments_valid_ = false;
+}
+
+std::vector<Segment> TimeSeries::Segments() const {
+  MutexLock lock{*mutex_};
+  return SegmentsLocked();
+}
+
+const std::vector<Segment>& TimeSeries::SegmentsLocked() const {
+  if (!segments_valid_) {
+    segments_ = SegmentSamples(samples_, segmentation_options_);
+    segments_valid_ = true;
+  }
+  return segments_;
+}
+
 void TimeSeries::PrepareVisit() const {
   mutex_->lock();
 }
@@ -48,26 +336,76 @@ void TimeSeries::FinishVisit() const {
   mutex_->unlock();
 }
   
-void TimeSeries::Visit(const TimePoint& begin, const TimePoint& end,
-                       const Measurement::Type type,
-                       const MeasurementVisitor& visitor) const {
-  auto b = std::lower_bound(samples_.begin(), samples_.end(), begin);
+template <typename Visitor>
+void TimeSeries::VisitIndexes(const TimePoint& begin, const TimePoint& end,
+                              const VisitFilter filter,
+                              const Visitor& visitor) const {
+  auto b = std::lower_bound(
+      samples_.begin(), samples_.end(), begin,
+      [](const TimeSample& s, const TimePoint& t) { return s.time() < t; });
   if (b == samples_.end()) b = samples_.begin();
-  while (b != samples_.end() && b->time() <= end) {
-    if (b->has_value(type)) {
-      visitor(b->time(), b->value(type).coef());
+  int index = static_cast<int>(b - samples_.begin());
+  const int num_samples = static_cast<int>(samples_.size());
+  if (filter == ALL_SAMPLES) {
+    for (; index < num_samples && samples_[index].time() <= end; ++index) {
+      visitor(index);
+    }
+    return;
+  }
+  const std::vector<Segment>& segments = SegmentsLocked();
+  auto segment = std::upper_bound(
+      segments.begin(), segments.end(), index,
+      [](const int i, const Segment& s) { return i < s.end_index; });
+  for (; segment != segments.end() && segment->begin <= end; ++segment) {
+    if (segment->kind != Segment::MOVING) continue;
+    index = std::max(index, segment->begin_index);
+    for (; index < segment->end_index && samples_[index].time() <= end;
+         ++index) {
+      visitor(index);
     }
-    ++b;
   }
 }
 
 void TimeSeries::Visit(const TimePoint& begin, const TimePoint& end,
-                       const SampleVisitor& visitor) const {
-  auto b = std::lower_bound(samples_.begin(), samples_.end(), begin);
-  if (b == samples_.end()) b = samples_.begin();
-  while (b != samples_.end() && b->time() <= end) {
-    visitor(*b);
-    ++b;
+                       const Measurement::Type type,
+                       const MeasurementVisitor& visitor,
+                       const VisitFilter filter) const {
+  if (num_values_[type] == 0 && IsDerived(type)) {
+    const Column& values = *ValuesLocked(type);
+    VisitIndexes(begin, end, filter, [&](const int index) {
+      if (!std::isnan(values[index])) {
+        visitor(samples_[index].time(), values[index]);
+      }
+    });
+    return;
+  }
+  VisitIndexes(begin, end, filter, [&](const int index) {
+    const TimeSample& sample = samples_[index];
+    if (sample.has_value(type)) visitor(sample.time(), sample.coef(type));
+  });
+}
+
+void TimeSeries::Visit(const TimePoint& begin, const TimePoint& end,
+                       const SampleVisitor& visitor,
+                       const VisitFilter filter) const {
+  VisitIndexes(begin, end, filter,
+               [&](const int index) { visitor(samples_[index]); });
+}
+
+void TimeSeries::Visit(const std::vector<Interval>& intervals,
+                       const Measurement::Type type,
+                       const MeasurementVisitor& visitor,
+                       const VisitFilter filter) const {
+  for (const Interval& interval : intervals) {
+    Visit(interval.begin, interval.end, type, visitor, filter);
+  }
+}
+
+void TimeSeries::Visit(const std::vector<Interval>& intervals,
+                       const SampleVisitor& visitor,
+                       const VisitFilter filter) const {
+  for (const Interval& interval : intervals) {
+    Visit(interval.begin, interval.end, visitor, filter);
   }
 }
 
@@ -1,22 +1,57 @@
 #ifndef __TIME_SERIES_H__
 #define __TIME_SERIES_H__
 
+#include <array>
+#include <cstdint>
 #include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <vector>
 
+#include "segmentation.h"
 #include "time_sample.h"
 
 namespace cycling {
 
 // Holds a collection of sequential, but not necessarily uniformly separated,
 // TimeSamples. This class is thread safe.
+//
+// Besides the measurements that were added, a series can provide derived
+// channels (see IsDerived()). They are computed from other channels the first
+// time they are read, cached, and dropped again on the next Add() or
+// SetValues(), so they cost nothing unless someone reads them.
 class TimeSeries {
  public:
   using TimePoint = TimeSample::TimePoint;
+  // One value per sample, in sample order. NaN marks samples that lack the
+  // value.
+  using Column = std::vector<double>;
+  using ColumnPtr = std::shared_ptr<const Column>;
   using MeasurementVisitor =
       std::function<void(const TimePoint&, const double)>;
   using SampleVisitor =
       std::function<void(const TimeSample&)>;
+  // The number of samples with a value of each type, indexed by type.
+  using ValueCounts = std::array<int, Measurement::NUM_MEASUREMENTS>;
+
+  // A closed range of time [begin,end], e.g. one run of selected samples.
+  struct Interval {
+    TimePoint begin;
+    TimePoint end;
+
+    bool operator==(const Interval& rhs) const {
+      return begin == rhs.begin && end == rhs.end;
+    }
+  };
+
+  // Which samples Visit() calls the visitor for.
+  enum VisitFilter {
+    ALL_SAMPLES,
+    // Only samples in MOVING segments. See Segments().
+    MOVING_ONLY,
+  };
 
   TimeSeries();
   TimeSeries(const TimeSeries&) = delete;
@@ -29,25 +64,125 @@ class TimeSeries {
   // contained.
   void Add(const TimeSample& sample);
   void Add(TimeSample&& sample);
+  // Same as adding each of samples in turn, but takes the lock and
+  // invalidates the derived data once.
+  void Add(std::vector<TimeSample>&& samples);
+  // Same as above, for callers that counted the values of each type as they
+  // built samples, so that they aren't looked at again. An empty series takes
+  // over the vector itself.
+  void Add(std::vector<TimeSample>&& samples, const ValueCounts& num_values);
+  // Sets the value of type in sample i to values[i] for every sample, in the
+  // base unit of type, and removes it where values[i] is NaN. values must have
+  // one entry per sample. Only samples whose value changes are touched.
+  void SetValues(const Measurement::Type type, const Column& values);
+  // Same as SetValues() for each of types in turn, with values[k] for
+  // types[k], but drops what was computed from them only once.
+  void SetValues(const std::vector<Measurement::Type>& types,
+                 const std::vector<Column>& values);
   TimePoint BeginTime() const;
   TimePoint EndTime() const;
   int num_samples() const { return static_cast<int>(samples_.size()); }
+  // The time of the sample at index, which must be in [0, num_samples()).
+  TimePoint SampleTime(const int index) const;
+
+  // Returns true if values of type are derived from other channels when no
+  // sample in the series has them: TOTAL_JOULES from POWER,
+  // INCREMENTAL_DISTANCE from TOTAL_DISTANCE, TOTAL_DISTANCE from
+  // INCREMENTAL_DISTANCE or SPEED, and GRADE from ALTITUDE and TOTAL_DISTANCE.
+  static bool IsDerived(const Measurement::Type type);
+
+  // Returns the time of every sample, in seconds since BeginTime().
+  ColumnPtr Seconds() const;
+
+  // Returns the values of type for every sample, in the base unit of type.
+  // Derived channels are computed here if needed. The column is cached until
+  // the next Add(), and stays valid for as long as the caller holds on to it.
+  // The first call extracts every recorded channel in a single scan of the
+  // samples, so reading several channels costs about as much as reading one.
+  ColumnPtr Values(const Measurement::Type type) const;
+
+  // Copies the values of types[k] into (*columns)[k] for every k, like
+  // Values(), but only reads those channels out of the samples. Reuses the
+  // storage of the columns, so a caller that keeps them from call to call
+  // doesn't allocate once they are big enough.
+  void CopyValues(const std::vector<Measurement::Type>& types,
+                  std::vector<Column>* columns) const;
+
+  // Returns the column cached under key, calling compute to fill it in on
+  // first use. compute runs without the series' lock held, so it may read the
+  // series through Values() and Seconds(). Like derived channels, cached
+  // columns are dropped on the next Add().
+  ColumnPtr CachedColumn(const std::string& key,
+                         const std::function<Column()>& compute) const;
+
+  // Replaces the options used to compute Segments().
+  void set_segmentation_options(const SegmentationOptions& options);
+
+  // Returns the moving, stopped and gap segments of the series. They are
+  // computed in one pass on first use and cached until the next Add().
+  std::vector<Segment> Segments() const;
 
   void PrepareVisit() const;
   void FinishVisit() const;
   
   // Calls visitor for every measurement of type `type` in the range
-  // [begin,end).
+  // [begin,end). This includes derived values, see IsDerived().
   void Visit(const TimePoint& begin, const TimePoint& end,
-             const Measurement::Type type,
-             const MeasurementVisitor& visitor) const;
+             const Measurement::Type type, const MeasurementVisitor& visitor,
+             const VisitFilter filter = ALL_SAMPLES) const;
 
-  // Calls visitor for every measurement in the range [begin,end).
+  // Calls visitor for every measurement in the range [begin,end). Derived
+  // values are not part of the samples.
   void Visit(const TimePoint& begin, const TimePoint& end,
-             const SampleVisitor& visitor) const;
+             const SampleVisitor& visitor,
+             const VisitFilter filter = ALL_SAMPLES) const;
+
+  // Same as above, for each interval in turn. intervals must be sorted and
+  // must not overlap.
+  void Visit(const std::vector<Interval>& intervals,
+             const Measurement::Type type, const MeasurementVisitor& visitor,
+             const VisitFilter filter = ALL_SAMPLES) const;
+  void Visit(const std::vector<Interval>& intervals,
+             const SampleVisitor& visitor,
+             const VisitFilter filter = ALL_SAMPLES) const;
 
  private:
+  // Calls visitor with the index of every sample in [begin,end) that passes
+  // filter. With MOVING_ONLY, whole non-moving segments are skipped without
+  // looking at their samples.
+  template <typename Visitor>
+  void VisitIndexes(const TimePoint& begin, const TimePoint& end,
+                    const VisitFilter filter, const Visitor& visitor) const;
+
+  // Same as Segments(), Seconds() and Values(), but the caller must already
+  // hold mutex_.
+  const std::vector<Segment>& SegmentsLocked() const;
+  const ColumnPtr& SecondsLocked() const;
+  const ColumnPtr& ValuesLocked(const Measurement::Type type) const;
+
+  // Sets the values of types[k] to *values[k] for every k, as SetValues()
+  // does. The caller must hold mutex_.
+  void SetValuesLocked(const std::vector<Measurement::Type>& types,
+                       const std::vector<const Column*>& values);
+
+  // Drops everything computed from the samples. The caller must hold mutex_.
+  void InvalidateLocked();
+
+  // Computes the derived channel type. The caller must hold mutex_.
+  Column Derive(const Measurement::Type type) const;
+
   std::vector<TimeSample> samples_;
+  // The number of samples that have a value of each type.
+  int num_values_[Measurement::NUM_MEASUREMENTS] = {0};
+  mutable ColumnPtr seconds_;
+  mutable ColumnPtr columns_[Measurement::NUM_MEASUREMENTS];
+  mutable std::map<std::string, ColumnPtr> cached_columns_;
+  // Incremented by every change to the samples, so that CachedColumn() can
+  // tell whether the samples changed while it was computing a column.
+  int64_t generation_ = 0;
+  SegmentationOptions segmentation_options_;
+  mutable bool segments_valid_ = false;
+  mutable std::vector<Segment> segments_;
   mutable std::unique_ptr<std::mutex> mutex_;
 };
 
@@ -1,7 +1,10 @@
 #include "time_series.h"
 
 #include <chrono>
+#include <cmath>
 #include <functional>
+#include <limits>
+#include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
@@ -96,6 +99,41 @@ TEST_F(TimeSeriesTest, Times) {
   EXPECT_EQ(time_series_.EndTime(), now_ + second_ * 5);
 }
 
+TEST_F(TimeSeriesTest, AddMany) {
+  TimeSeries series;
+  series.Add(time_samples_[0]);
+  std::vector<TimeSample> samples(time_samples_ + 1, time_samples_ + kSize);
+  series.Add(std::move(samples));
+  EXPECT_TRUE(samples.empty());
+  ASSERT_EQ(series.num_samples(), kSize);
+  EXPECT_EQ(series.EndTime(), now_ + second_ * 5);
+  EXPECT_EQ(*series.Values(Measurement::HEART_RATE),
+            *time_series_.Values(Measurement::HEART_RATE));
+  EXPECT_EQ(*series.Values(Measurement::TOTAL_DISTANCE),
+            *time_series_.Values(Measurement::TOTAL_DISTANCE));
+}
+
+TEST_F(TimeSeriesTest, AddManyCounted) {
+  TimeSeries series;
+  std::vector<TimeSample> samples(time_samples_, time_samples_ + kSize);
+  TimeSeries::ValueCounts num_values = {};
+  for (const Measurement::Type type :
+       {Measurement::HEART_RATE, Measurement::GEAR, Measurement::CADENCE,
+        Measurement::TOTAL_DISTANCE}) {
+    num_values[type] = kSize;
+  }
+  num_values[Measurement::POWER] = kSize - 1;
+  num_values[Measurement::TOTAL_JOULES] = 1;
+  series.Add(std::move(samples), num_values);
+  EXPECT_TRUE(samples.empty());
+  ASSERT_EQ(series.num_samples(), kSize);
+  for (const Measurement::Type type :
+       {Measurement::HEART_RATE, Measurement::GEAR, Measurement::CADENCE,
+        Measurement::TOTAL_DISTANCE}) {
+    EXPECT_EQ(*series.Values(type), *time_series_.Values(type)) << type;
+  }
+}
+
 TEST_F(TimeSeriesTest, Visit) {
   int index, sample_index;
   std::vector<double> expected;
@@ -159,5 +197,141 @@ TEST_F(TimeSeriesTest, Visit) {
   EXPECT_EQ(index, kSize);
 }
 
+TEST(TimeSeriesDerivedTest, DerivedChannels) {
+  TimeSeries series;
+  const TimePoint start = Now();
+  const std::chrono::seconds second(1);
+  for (int i = 0; i < 5; ++i) {
+    series.Add(TimeSample(start + second * i)
+                   .Add(Power(100 * i))
+                   .Add(Measurement(Measurement::TOTAL_DISTANCE, 10.0 * i))
+                   .Add(Measurement(Measurement::ALTITUDE, 100 + 0.5 * i)));
+  }
+  EXPECT_TRUE(TimeSeries::IsDerived(Measurement::TOTAL_JOULES));
+  EXPECT_FALSE(TimeSeries::IsDerived(Measurement::POWER));
+
+  EXPECT_THAT(*series.Seconds(), ::testing::ElementsAre(0, 1, 2, 3, 4));
+  TimeSeries::ColumnPtr joules = series.Values(Measurement::TOTAL_JOULES);
+  EXPECT_THAT(*joules, ::testing::ElementsAre(0, 100, 300, 600, 1000));
+  // Cached until the next Add().
+  EXPECT_EQ(series.Values(Measurement::TOTAL_JOULES), joules);
+  EXPECT_THAT(*series.Values(Measurement::INCREMENTAL_DISTANCE),
+              ::testing::ElementsAre(0, 10, 10, 10, 10));
+  EXPECT_THAT(*series.Values(Measurement::GRADE),
+              ::testing::ElementsAre(
+                  ::testing::NanSensitiveDoubleEq(
+                      std::numeric_limits<double>::quiet_NaN()),
+                  0.05, 0.05, 0.05, 0.05));
+
+  std::vector<double> visited;
+  series.Visit(start, start + second * 10, Measurement::TOTAL_JOULES,
+               [&visited](const TimePoint& time, const double coef) {
+                 visited.push_back(coef);
+               });
+  EXPECT_THAT(visited, ::testing::ElementsAre(0, 100, 300, 600, 1000));
+
+  series.Add(TimeSample(start + second * 6).Add(Power(50)));
+  TimeSeries::ColumnPtr new_joules = series.Values(Measurement::TOTAL_JOULES);
+  EXPECT_NE(new_joules, joules);
+  EXPECT_THAT(*new_joules,
+              ::testing::ElementsAre(0, 100, 300, 600, 1000, 1100));
+  // The old column is still valid for whoever holds it.
+  EXPECT_EQ(joules->size(), 5);
+}
+
+TEST(TimeSeriesDerivedTest, NativeValuesWin) {
+  TimeSeries series;
+  const TimePoint start = Now();
+  series.Add(TimeSample(start).Add(Power(100)).Add(Cals(1)));
+  series.Add(TimeSample(start + std::chrono::seconds(1)).Add(Power(100)));
+  const TimeSeries::ColumnPtr joules = series.Values(Measurement::TOTAL_JOULES);
+  ASSERT_EQ(joules->size(), 2);
+  EXPECT_DOUBLE_EQ((*joules)[0], 4.184);
+  EXPECT_TRUE(std::isnan((*joules)[1]));
+}
+
+TEST(TimeSeriesDerivedTest, TotalDistanceFromSpeed) {
+  TimeSeries series;
+  const TimePoint start = Now();
+  for (int i = 0; i < 3; ++i) {
+    series.Add(TimeSample(start + std::chrono::seconds(i))
+                   .Add(Measurement(Measurement::SPEED, 5)));
+  }
+  EXPECT_THAT(*series.Values(Measurement::TOTAL_DISTANCE),
+              ::testing::ElementsAre(0, 5, 10));
+}
+
+TEST(TimeSeriesDerivedTest, SetValues) {
+  TimeSeries series;
+  const TimePoint start = Now();
+  for (int i = 0; i < 3; ++i) {
+    series.Add(TimeSample(start + std::chrono::seconds(i)).Add(Power(100)));
+  }
+  const TimeSeries::ColumnPtr joules = series.Values(Measurement::TOTAL_JOULES);
+  const double kNaN = std::numeric_limits<double>::quiet_NaN();
+  series.SetValues(Measurement::POWER, {200, kNaN, 100});
+  EXPECT_THAT(*series.Values(Measurement::POWER),
+              ::testing::ElementsAre(
+                  200, ::testing::NanSensitiveDoubleEq(kNaN), 100));
+  // Derived channels are recomputed from the new values.
+  EXPECT_THAT(*series.Values(Measurement::TOTAL_JOULES),
+              ::testing::ElementsAre(0, 0, 100));
+  EXPECT_THAT(*joules, ::testing::ElementsAre(0, 100, 200));
+
+  series.SetValues(Measurement::POWER, {kNaN, kNaN, kNaN});
+  series.Visit(start, start + std::chrono::seconds(2),
+               [](const TimeSample& sample) {
+                 EXPECT_FALSE(sample.has_value(Measurement::POWER));
+               });
+}
+
+TEST(TimeSeriesSegmentsTest, MovingOnlyVisit) {
+  TimeSeries series;
+  const TimePoint start = Now();
+  const std::chrono::seconds second(1);
+  // Moving for 10s, stopped for 5s, then a 60s gap and moving for 10s more.
+  for (int i = 0; i < 15; ++i) {
+    series.Add(TimeSample(start + second * i)
+                   .Add(Measurement(Measurement::SPEED, i < 10 ? 8 : 0))
+                   .Add(Power(i)));
+  }
+  for (int i = 75; i < 85; ++i) {
+    series.Add(TimeSample(start + second * i)
+                   .Add(Measurement(Measurement::SPEED, 8))
+                   .Add(Power(i)));
+  }
+
+  const std::vector<Segment> segments = series.Segments();
+  ASSERT_EQ(segments.size(), 4);
+  EXPECT_EQ(segments[0].kind, Segment::MOVING);
+  EXPECT_EQ(segments[1].kind, Segment::STOPPED);
+  EXPECT_EQ(segments[2].kind, Segment::GAP);
+  EXPECT_EQ(segments[3].kind, Segment::MOVING);
+
+  std::vector<double> watts;
+  auto visitor = [&watts](const TimePoint& time, const double coef) {
+    watts.push_back(coef);
+  };
+  series.Visit(start + second * 8, start + second * 77, Measurement::POWER,
+               visitor, TimeSeries::MOVING_ONLY);
+  EXPECT_THAT(watts, ::testing::ElementsAre(8, 9, 75, 76, 77));
+
+  watts.clear();
+  series.Visit(start + second * 11, start + second * 14, Measurement::POWER,
+               visitor, TimeSeries::MOVING_ONLY);
+  EXPECT_TRUE(watts.empty());
+
+  int num_samples = 0;
+  series.Visit(start, start + second * 100,
+               [&num_samples](const TimeSample& sample) { ++num_samples; },
+               TimeSeries::MOVING_ONLY);
+  EXPECT_EQ(num_samples, 20);
+
+  // Adding a sample invalidates the cached segments.
+  series.Add(TimeSample(start + second * 86)
+                 .Add(Measurement(Measurement::SPEED, 0)));
+  EXPECT_EQ(series.Segments().size(), 5);
+}
+
 }  // namespace
 }  // namespace cycling
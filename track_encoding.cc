@@ -0,0 +1,249 @@
+#include "track_encoding.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <utility>
+
+#include "geo_util.h"
+#include "measurement.h"
+
+namespace cycling {
+
+namespace {
+
+using geo_util::kPi;
+using geo_util::kRadians;
+
+// Fixed point units per degree.
+const double kUnits = 1e7;
+// The level takes the low bits of the time difference.
+const int kLevelBits = 3;
+static_assert(kNumTrackLevels == 1 << kLevelBits,
+              "levels must fit in kLevelBits");
+
+// A point in fixed point.
+struct Fixed {
+  int64_t time;  // Milliseconds since the epoch.
+  int64_t lat;
+  int64_t lon;
+};
+
+int64_t ToFixed(const double degrees) {
+  return static_cast<int64_t>(std::llround(degrees * kUnits));
+}
+
+uint64_t ZigZag(const int64_t value) {
+  return (static_cast<uint64_t>(value) << 1) ^
+         static_cast<uint64_t>(value >> 63);
+}
+
+int64_t UnZigZag(const uint64_t value) {
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+void PutVarint(uint64_t value, std::string* out) {
+  char bytes[10];
+  int n = 0;
+  while (value >= 0x80) {
+    bytes[n++] = static_cast<char>(value | 0x80);
+    value >>= 7;
+  }
+  bytes[n++] = static_cast<char>(value);
+  out->append(bytes, n);
+}
+
+// Reads a varint from [*position, end). Returns false if it's truncated or
+// too long.
+bool GetVarint(const char** position, const char* end, uint64_t* value) {
+  uint64_t result = 0;
+  for (int shift = 0; shift < 64 && *position < end; shift += 7) {
+    const uint8_t byte = static_cast<uint8_t>(*(*position)++);
+    result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (byte < 0x80) {
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+// The distance in meters from p to the segment from a to b.
+double DistanceToSegment(const Fixed& p, const Fixed& a, const Fixed& b) {
+  return geo_util::DistanceToSegment(p.lat / kUnits, p.lon / kUnits,
+                                     a.lat / kUnits, a.lon / kUnits,
+                                     b.lat / kUnits, b.lon / kUnits);
+}
+
+// Returns the coarsest level of every point. Douglas-Peucker keeps the point
+// furthest from the line between the ends of a stretch if it is further than
+// the tolerance, and recurses on both halves. Recording that distance for
+// every point, capped by the distance of the point that split its stretch,
+// runs it for every tolerance at once.
+std::vector<uint8_t> Levels(const std::vector<Fixed>& points) {
+  const size_t n = points.size();
+  std::vector<uint8_t> levels(n, 0);
+  if (n == 0) return levels;
+  levels[0] = levels[n - 1] = kNumTrackLevels - 1;
+  auto level_of = [](const double distance) {
+    int level = 0;
+    while (level + 1 < kNumTrackLevels &&
+           distance >= TrackLevelTolerance(level + 1)) {
+      ++level;
+    }
+    return level;
+  };
+  // Stretches (first, last) to split, with the level of the point that split
+  // them.
+  struct Stretch {
+    size_t first;
+    size_t last;
+    int cap;
+  };
+  std::vector<Stretch> stack;
+  if (n > 2) stack.push_back({0, n - 1, kNumTrackLevels - 1});
+  while (!stack.empty()) {
+    const Stretch stretch = stack.back();
+    stack.pop_back();
+    size_t furthest = stretch.first + 1;
+    double distance = -1;
+    for (size_t i = stretch.first + 1; i < stretch.last; ++i) {
+      const double d = DistanceToSegment(points[i], points[stretch.first],
+                                         points[stretch.last]);
+      if (d > distance) {
+        distance = d;
+        furthest = i;
+      }
+    }
+    const int level = std::min(stretch.cap, level_of(distance));
+    levels[furthest] = level;
+    // Level 0 keeps everything; there is nothing left to decide.
+    if (level == 0) continue;
+    if (furthest - stretch.first > 1) {
+      stack.push_back({stretch.first, furthest, level});
+    }
+    if (stretch.last - furthest > 1) {
+      stack.push_back({furthest, stretch.last, level});
+    }
+  }
+  return levels;
+}
+
+void Encode(const std::vector<Fixed>& points, std::string* encoded) {
+  const std::vector<uint8_t> levels = Levels(points);
+  uint64_t counts[kNumTrackLevels] = {0};
+  for (const uint8_t level : levels) {
+    for (int l = 0; l <= level; ++l) ++counts[l];
+  }
+  for (const uint64_t count : counts) PutVarint(count, encoded);
+  Fixed previous = {0, 0, 0};
+  for (size_t i = 0; i < points.size(); ++i) {
+    const Fixed& point = points[i];
+    PutVarint(ZigZag(point.time - previous.time) << kLevelBits | levels[i],
+              encoded);
+    PutVarint(ZigZag(point.lat - previous.lat), encoded);
+    PutVarint(ZigZag(point.lon - previous.lon), encoded);
+    previous = point;
+  }
+}
+
+int64_t ToMilliseconds(const TimeSeries::TimePoint& time) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             time.time_since_epoch())
+      .count();
+}
+
+}  // namespace
+
+double TrackLevelTolerance(const int level) {
+  return level <= 0 ? 0 : std::ldexp(1.0, 2 * (level - 1));
+}
+
+int TrackLevelForZoom(const int zoom, const double latitude) {
+  const double meters_per_pixel = 2 * kPi * geo_util::kEarthRadiusMeters *
+                                  std::cos(latitude * kRadians) /
+                                  std::ldexp(256.0, zoom);
+  int level = 0;
+  while (level + 1 < kNumTrackLevels &&
+         TrackLevelTolerance(level + 1) <= meters_per_pixel / 2) {
+    ++level;
+  }
+  return level;
+}
+
+void EncodeTrack(const TimeSeries& series, std::string* encoded) {
+  std::vector<Fixed> points;
+  if (series.num_samples() > 0) {
+    const TimeSeries::ColumnPtr lat =
+        series.Values(Measurement::DEGREES_LATITUDE);
+    const TimeSeries::ColumnPtr lon =
+        series.Values(Measurement::DEGREES_LONGITUDE);
+    points.reserve(lat->size());
+    for (size_t i = 0; i < lat->size(); ++i) {
+      if (std::isnan((*lat)[i]) || std::isnan((*lon)[i])) continue;
+      points.push_back({ToMilliseconds(series.SampleTime(i)),
+                        ToFixed((*lat)[i]), ToFixed((*lon)[i])});
+    }
+  }
+  Encode(points, encoded);
+}
+
+void EncodeTrack(const std::vector<TrackPoint>& points,
+                 std::string* encoded) {
+  std::vector<Fixed> fixed;
+  fixed.reserve(points.size());
+  for (const TrackPoint& point : points) {
+    fixed.push_back(
+        {ToMilliseconds(point.time), ToFixed(point.lat), ToFixed(point.lon)});
+  }
+  Encode(fixed, encoded);
+}
+
+TrackDecoder::TrackDecoder(const std::string& encoded, const int level)
+    : TrackDecoder(encoded.data(), encoded.size(), level) {}
+
+TrackDecoder::TrackDecoder(const char* data, const size_t size,
+                           const int level)
+    : data_(data),
+      position_(data),
+      end_(data + size),
+      level_(std::max(0, std::min(kNumTrackLevels - 1, level))) {
+  for (int l = 0; l < kNumTrackLevels; ++l) {
+    uint64_t count;
+    if (!GetVarint(&position_, end_, &count)) {
+      ok_ = false;
+      return;
+    }
+    if (l == 0) remaining_ = count;
+    if (l == level_) num_points_ = count;
+  }
+}
+
+bool TrackDecoder::Next(TrackPoint* point) {
+  while (ok_ && remaining_ > 0) {
+    uint64_t time_and_level, lat, lon;
+    if (!GetVarint(&position_, end_, &time_and_level) ||
+        !GetVarint(&position_, end_, &lat) ||
+        !GetVarint(&position_, end_, &lon)) {
+      ok_ = false;
+      return false;
+    }
+    --remaining_;
+    time_ += UnZigZag(time_and_level >> kLevelBits);
+    lat_ += UnZigZag(lat);
+    lon_ += UnZigZag(lon);
+    if (static_cast<int>(time_and_level & (kNumTrackLevels - 1)) < level_) {
+      continue;
+    }
+    point->time =
+        TimeSeries::TimePoint(std::chrono::duration_cast<
+                              TimeSeries::TimePoint::duration>(
+            std::chrono::milliseconds(time_)));
+    point->lat = lat_ / kUnits;
+    point->lon = lon_ / kUnits;
+    return true;
+  }
+  return false;
+}
+
+}  // namespace cycling
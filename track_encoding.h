@@ -0,0 +1,92 @@
+#ifndef __TRACK_ENCODING_H__
+#define __TRACK_ENCODING_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "time_series.h"
+
+namespace cycling {
+
+// A compact binary form of a GPS track, for archives and map rendering.
+//
+// Positions are stored in fixed point with a resolution of 1e-7 degrees
+// (about 1 cm) and times with a resolution of a millisecond, each as the
+// zigzag varint of its difference from the previous point, so a ride sampled
+// every second takes about 6 bytes per point instead of 24.
+//
+// Every point also records the coarsest of kNumTrackLevels simplification
+// levels it belongs to. Level 0 holds every point; level k > 0 holds the
+// points Douglas-Peucker keeps at a tolerance of TrackLevelTolerance(k), and
+// the first and last points are in every level. A renderer picks a level
+// with TrackLevelForZoom() and decodes just its points, in one pass and
+// without allocating.
+
+struct TrackPoint {
+  TimeSeries::TimePoint time;
+  double lat;
+  double lon;
+};
+
+constexpr int kNumTrackLevels = 8;
+
+// The Douglas-Peucker tolerance of level, in meters: 0 for level 0, then
+// 1 m, 4 m, 16 m, ... up to 4096 m for the last level.
+double TrackLevelTolerance(const int level);
+
+// Returns the coarsest level whose points are within half a pixel of the
+// full track on a Web Mercator map at zoom, around latitude.
+int TrackLevelForZoom(const int zoom, const double latitude);
+
+// Appends the positions in the DEGREES_LATITUDE and DEGREES_LONGITUDE
+// channels of series to encoded. Samples without a position are left out.
+void EncodeTrack(const TimeSeries& series, std::string* encoded);
+// Same as above for points, which must be in time order.
+void EncodeTrack(const std::vector<TrackPoint>& points, std::string* encoded);
+
+// Reads the points of one level back from an encoded track:
+//
+//   TrackDecoder decoder(encoded, TrackLevelForZoom(zoom, lat));
+//   TrackPoint point;
+//   while (decoder.Next(&point)) Draw(point);
+//   if (!decoder.ok()) ...
+//
+// The encoded data must outlive the decoder.
+class TrackDecoder {
+ public:
+  TrackDecoder(const std::string& encoded, const int level);
+  TrackDecoder(const char* data, const size_t size, const int level);
+
+  // The number of points of the level, e.g. to reserve room for them.
+  size_t num_points() const { return num_points_; }
+
+  // Stores the next point of the level in point. Returns false at the end of
+  // the track or if the data is corrupt.
+  bool Next(TrackPoint* point);
+
+  // False if the data turned out to be corrupt.
+  bool ok() const { return ok_; }
+
+  // The number of bytes of the encoded track, which may be followed by other
+  // data. Only valid once Next() returned false and ok() is true.
+  size_t encoded_size() const { return position_ - data_; }
+
+ private:
+  const char* data_;
+  const char* position_;
+  const char* end_;
+  int level_;
+  bool ok_ = true;
+  size_t num_points_ = 0;
+  // The points of every level left to read.
+  uint64_t remaining_ = 0;
+  int64_t time_ = 0;
+  int64_t lat_ = 0;
+  int64_t lon_ = 0;
+};
+
+}  // namespace cycling
+
+#endif  // __TRACK_ENCODING_H__
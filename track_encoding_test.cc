@@ -0,0 +1,152 @@
+#include "track_encoding.h"
+
+#include <chrono>
+#include <cmath>
+#include <random>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace cycling {
+namespace {
+
+using ::testing::DoubleNear;
+using ::testing::ElementsAre;
+using ::testing::Field;
+
+const TimeSeries::TimePoint kStart =
+    TimeSeries::TimePoint() + std::chrono::hours(400000);
+
+TimeSeries::TimePoint At(const int milliseconds) {
+  return kStart + std::chrono::milliseconds(milliseconds);
+}
+
+std::vector<TrackPoint> Decode(const std::string& encoded, const int level) {
+  TrackDecoder decoder(encoded, level);
+  std::vector<TrackPoint> points;
+  points.reserve(decoder.num_points());
+  TrackPoint point;
+  while (decoder.Next(&point)) points.push_back(point);
+  EXPECT_TRUE(decoder.ok());
+  EXPECT_EQ(points.size(), decoder.num_points());
+  EXPECT_EQ(decoder.encoded_size(), encoded.size());
+  return points;
+}
+
+// A wandering ride with one point per second.
+std::vector<TrackPoint> RandomRide(const int n) {
+  std::mt19937 random(n);
+  std::normal_distribution<double> turn(0, 0.05);
+  std::vector<TrackPoint> points;
+  double lat = 47.6, lon = -122.3, heading = 0;
+  for (int i = 0; i < n; ++i) {
+    heading += turn(random);
+    lat += 8e-5 * std::cos(heading);
+    lon += 1.2e-4 * std::sin(heading);
+    points.push_back({At(1000 * i), lat, lon});
+  }
+  return points;
+}
+
+TEST(TrackEncodingTest, RoundTrip) {
+  const std::vector<TrackPoint> ride = RandomRide(3600);
+  std::string encoded;
+  EncodeTrack(ride, &encoded);
+  // About 6 bytes per point.
+  EXPECT_LT(encoded.size(), 7 * ride.size());
+  const std::vector<TrackPoint> decoded = Decode(encoded, 0);
+  ASSERT_EQ(decoded.size(), ride.size());
+  for (size_t i = 0; i < ride.size(); ++i) {
+    ASSERT_EQ(decoded[i].time, ride[i].time);
+    ASSERT_NEAR(decoded[i].lat, ride[i].lat, 5e-8);
+    ASSERT_NEAR(decoded[i].lon, ride[i].lon, 5e-8);
+  }
+}
+
+TEST(TrackEncodingTest, TimeSeries) {
+  TimeSeries series;
+  const double kNaN = std::nan("");
+  const std::vector<TrackPoint> points = {{At(0), 1, 2},
+                                          {At(500), kNaN, kNaN},
+                                          {At(1250), -1.5, 179.9999999},
+                                          {At(2000), -1.5, -179.9999999}};
+  for (const TrackPoint& point : points) {
+    TimeSample sample(point.time, Measurement(Measurement::POWER, 100));
+    if (!std::isnan(point.lat)) {
+      sample.Add(Measurement(Measurement::DEGREES_LATITUDE, point.lat));
+      sample.Add(Measurement(Measurement::DEGREES_LONGITUDE, point.lon));
+    }
+    series.Add(sample);
+  }
+  std::string encoded;
+  EncodeTrack(series, &encoded);
+  EXPECT_THAT(
+      Decode(encoded, 0),
+      ElementsAre(Field(&TrackPoint::time, At(0)),
+                  Field(&TrackPoint::time, At(1250)),
+                  Field(&TrackPoint::time, At(2000))));
+  EXPECT_THAT(Decode(encoded, 0)[2].lon, DoubleNear(-179.9999999, 1e-9));
+
+  std::string empty;
+  EncodeTrack(TimeSeries(), &empty);
+  EXPECT_TRUE(Decode(empty, 3).empty());
+}
+
+TEST(TrackEncodingTest, Levels) {
+  // 1 km east with 1 m of noise, and a clean 50 m detour in the middle.
+  std::vector<TrackPoint> points;
+  for (int i = 0; i <= 1000; ++i) {
+    double north = i % 2 ? 0.5 : -0.5;
+    if (i >= 480 && i <= 520) north = i >= 490 && i <= 510 ? 50 : 0;
+    points.push_back({At(1000 * i), 47.0 + north / 111195, 8.0 + i / 75853.0});
+  }
+  std::string encoded;
+  EncodeTrack(points, &encoded);
+  EXPECT_EQ(Decode(encoded, 0).size(), 1001);
+  size_t previous = 1001;
+  for (int level = 1; level < kNumTrackLevels; ++level) {
+    const size_t size = Decode(encoded, level).size();
+    EXPECT_LE(size, previous);
+    previous = size;
+  }
+  // Within 4 m only the ends and the corners of the detour are left, and
+  // past 64 m only the ends.
+  EXPECT_THAT(Decode(encoded, 2),
+              ElementsAre(Field(&TrackPoint::time, At(0)),
+                          Field(&TrackPoint::time, At(489000)),
+                          Field(&TrackPoint::time, At(490000)),
+                          Field(&TrackPoint::time, At(510000)),
+                          Field(&TrackPoint::time, At(511000)),
+                          Field(&TrackPoint::time, At(1000000))));
+  EXPECT_THAT(Decode(encoded, kNumTrackLevels - 1),
+              ElementsAre(Field(&TrackPoint::time, At(0)),
+                          Field(&TrackPoint::time, At(1000000))));
+}
+
+TEST(TrackEncodingTest, LevelForZoom) {
+  EXPECT_EQ(TrackLevelTolerance(0), 0);
+  EXPECT_EQ(TrackLevelTolerance(1), 1);
+  EXPECT_EQ(TrackLevelTolerance(3), 16);
+  // About 0.4 m per pixel at zoom 18 at 47 N, 6.5 m at zoom 14 and 1.7 km
+  // at zoom 6.
+  EXPECT_EQ(TrackLevelForZoom(18, 47), 0);
+  EXPECT_EQ(TrackLevelForZoom(14, 47), 1);
+  EXPECT_EQ(TrackLevelForZoom(6, 47), 5);
+  EXPECT_EQ(TrackLevelForZoom(0, 47), kNumTrackLevels - 1);
+}
+
+TEST(TrackEncodingTest, Corrupt) {
+  std::string encoded;
+  EncodeTrack(RandomRide(10), &encoded);
+  for (size_t size = 0; size < encoded.size(); ++size) {
+    TrackDecoder decoder(encoded.data(), size, 0);
+    TrackPoint point;
+    int n = 0;
+    while (decoder.Next(&point)) ++n;
+    EXPECT_FALSE(decoder.ok()) << size;
+    EXPECT_LT(n, 10);
+  }
+}
+
+}  // namespace
+}  // namespace cycling
@@ -0,0 +1,117 @@
+#include "w_prime_balance.h"
+
+#include <cassert>
+#include <cmath>
+
+#include <chrono>
+#include <memory>
+
+#include "measurement.h"
+#include "si_unit.h"
+
+namespace cycling {
+
+namespace {
+
+template <typename T, typename... Args>
+std::unique_ptr<T> make_unique(Args&&... args) {
+  return std::unique_ptr<T>(new T(std::forward<Args>(args)...));
+}
+
+double ToSeconds(const TimeSample::TimePoint::duration& d) {
+  return std::chrono::duration_cast<std::chrono::duration<double>>(d).count();
+}
+
+}  // namespace
+
+constexpr double WPrimeBalance::kMaxSampleSeconds;
+
+WPrimeBalance::WPrimeBalance(const SiVar& critical_power, const SiVar& w_prime,
+                             const Model model)
+    : model_(model),
+      critical_power_(critical_power.coef()),
+      w_prime_(w_prime.coef()),
+      balance_(w_prime.coef()) {
+  assert(critical_power.unit() == SiUnit::Watt());
+  assert(w_prime.unit() == SiUnit::Joule());
+  assert(w_prime_ > 0);
+}
+
+double WPrimeBalance::Add(const TimePoint& time, const double watts) {
+  if (has_last_time_) {
+    assert(time > last_time_);
+    const double seconds = ToSeconds(time - last_time_);
+    if (seconds > kMaxSampleSeconds) {
+      Apply(watts, kMaxSampleSeconds);
+      Apply(0, seconds - kMaxSampleSeconds);
+    } else {
+      Apply(watts, seconds);
+    }
+  }
+  has_last_time_ = true;
+  last_time_ = time;
+  return balance();
+}
+
+double WPrimeBalance::balance() const {
+  switch (model_) {
+    case DIFFERENTIAL:
+      return balance_;
+    case INTEGRAL:
+      return w_prime_ - expended_;
+  }
+  return 0;
+}
+
+void WPrimeBalance::Apply(const double watts, const double seconds) {
+  if (seconds <= 0) return;
+  switch (model_) {
+    case DIFFERENTIAL:
+      if (watts > critical_power_) {
+        balance_ -= (watts - critical_power_) * seconds;
+      } else {
+        // Closed form of dW/dt = (CP - P) * (W' - W) / W' over the interval,
+        // so the result does not depend on the sampling rate.
+        balance_ = w_prime_ - (w_prime_ - balance_) *
+                                  std::exp(-(critical_power_ - watts) *
+                                           seconds / w_prime_);
+      }
+      break;
+    case INTEGRAL: {
+      if (watts < critical_power_) {
+        recovery_joules_ += watts * seconds;
+        recovery_seconds_ += seconds;
+      }
+      const double recovery_watts =
+          recovery_seconds_ > 0 ? recovery_joules_ / recovery_seconds_ : 0;
+      const double tau =
+          546 * std::exp(-0.01 * (critical_power_ - recovery_watts)) + 316;
+      expended_ *= std::exp(-seconds / tau);
+      if (watts > critical_power_) {
+        expended_ += (watts - critical_power_) * seconds;
+      }
+      break;
+    }
+  }
+}
+
+std::unique_ptr<TimeSeries> ComputeWPrimeBalance(
+    const TimeSeries& series, const SiVar& critical_power,
+    const SiVar& w_prime, const WPrimeBalance::Model model) {
+  auto result = make_unique<TimeSeries>();
+  if (series.num_samples() == 0) return result;
+  WPrimeBalance balance(critical_power, w_prime, model);
+  const TimeSeries::TimePoint begin = series.BeginTime();
+  const TimeSeries::TimePoint end = series.EndTime();
+  series.PrepareVisit();
+  series.Visit(begin, end, Measurement::POWER,
+               [&](const TimeSeries::TimePoint& time, const double watts) {
+                 result->Add(TimeSample(
+                     time, Measurement(Measurement::W_PRIME_BALANCE,
+                                       balance.Add(time, watts))));
+               });
+  series.FinishVisit();
+  return result;
+}
+
+}  // namespace cycling
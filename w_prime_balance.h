@@ -0,0 +1,81 @@
+#ifndef __W_PRIME_BALANCE_H__
+#define __W_PRIME_BALANCE_H__
+
+#include <memory>
+
+#include "si_var.h"
+#include "time_sample.h"
+#include "time_series.h"
+
+namespace cycling {
+
+// Tracks the balance of an athlete's anaerobic work capacity (W') as power
+// samples arrive, using one of Skiba's models. Each call to Add() is O(1) and
+// the object holds a constant amount of state, so it can be fed from a parsed
+// file or from live sensor data alike.
+class WPrimeBalance {
+ public:
+  using TimePoint = TimeSample::TimePoint;
+
+  enum Model {
+    // Skiba et al. 2015: W' is depleted linearly above CP and recovers
+    // exponentially below it at a rate proportional to (CP - P) / W'.
+    DIFFERENTIAL,
+    // Skiba et al. 2012: W' balance is W' minus the sum of all prior
+    // expenditures, each decaying with time constant tau. Tau depends on the
+    // mean recovery power, which is tracked as a running mean so the model
+    // stays constant-memory.
+    INTEGRAL,
+  };
+
+  // Gaps between samples longer than this are treated as recovery at 0 W for
+  // everything beyond the first kMaxSampleSeconds.
+  static constexpr double kMaxSampleSeconds = 10.0;
+
+  // critical_power must be in watts and w_prime in joules.
+  WPrimeBalance(const SiVar& critical_power, const SiVar& w_prime,
+                const Model model);
+  WPrimeBalance(const WPrimeBalance&) = default;
+  WPrimeBalance& operator=(const WPrimeBalance&) = default;
+  ~WPrimeBalance() = default;
+
+  // Adds a power sample (in watts) recorded at time, which must come strictly
+  // after the previously added sample. The power is assumed to have been held
+  // since the previous sample. Returns the new balance in joules.
+  double Add(const TimePoint& time, const double watts);
+
+  // The current balance, in joules.
+  double balance() const;
+
+  Model model() const { return model_; }
+
+ private:
+  // Applies power held for the given number of seconds.
+  void Apply(const double watts, const double seconds);
+
+  Model model_;
+  double critical_power_;
+  double w_prime_;
+  bool has_last_time_ = false;
+  TimePoint last_time_;
+
+  // DIFFERENTIAL: the current balance.
+  double balance_;
+
+  // INTEGRAL: the decayed sum of all expenditures above CP, and the running
+  // totals used to derive the mean recovery power.
+  double expended_ = 0;
+  double recovery_joules_ = 0;
+  double recovery_seconds_ = 0;
+};
+
+// Runs the W' balance model over every POWER measurement in series and returns
+// a new series holding one W_PRIME_BALANCE measurement per power sample, at the
+// same times.
+std::unique_ptr<TimeSeries> ComputeWPrimeBalance(
+    const TimeSeries& series, const SiVar& critical_power,
+    const SiVar& w_prime, const WPrimeBalance::Model model);
+
+}  // namespace cycling
+
+#endif  // __W_PRIME_BALANCE_H__
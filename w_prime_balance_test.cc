@@ -0,0 +1,137 @@
+#include "w_prime_balance.h"
+
+#include <chrono>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "measurement.h"
+
+namespace cycling {
+namespace {
+
+using TimePoint = WPrimeBalance::TimePoint;
+
+const SiVar kCriticalPower = 250 * SiVar::Watt();
+const SiVar kWPrime = 20000 * SiVar::Joule();
+
+TimePoint Start() { return TimePoint() + std::chrono::hours(24 * 365 * 40); }
+
+TEST(WPrimeBalanceTest, DifferentialDepletesLinearly) {
+  WPrimeBalance balance(kCriticalPower, kWPrime, WPrimeBalance::DIFFERENTIAL);
+  EXPECT_DOUBLE_EQ(balance.Add(Start(), 350), 20000);
+  for (int i = 1; i <= 60; ++i) {
+    balance.Add(Start() + std::chrono::seconds(i), 350);
+  }
+  EXPECT_DOUBLE_EQ(balance.balance(), 14000);
+}
+
+TEST(WPrimeBalanceTest, DifferentialRecoversTowardsWPrime) {
+  WPrimeBalance balance(kCriticalPower, kWPrime, WPrimeBalance::DIFFERENTIAL);
+  int t = 0;
+  balance.Add(Start(), 450);
+  for (++t; t <= 50; ++t) balance.Add(Start() + std::chrono::seconds(t), 450);
+  EXPECT_DOUBLE_EQ(balance.balance(), 10000);
+  double last = balance.balance();
+  for (; t <= 3000; ++t) {
+    const double b = balance.Add(Start() + std::chrono::seconds(t), 100);
+    EXPECT_GT(b, last);
+    EXPECT_LT(b, 20000);
+    last = b;
+  }
+  EXPECT_NEAR(last, 20000, 1);
+}
+
+TEST(WPrimeBalanceTest, DifferentialIsIndependentOfSampleRate) {
+  WPrimeBalance one_hz(kCriticalPower, kWPrime, WPrimeBalance::DIFFERENTIAL);
+  WPrimeBalance five_hz(kCriticalPower, kWPrime, WPrimeBalance::DIFFERENTIAL);
+  for (int i = 0; i <= 100; ++i) {
+    one_hz.Add(Start() + std::chrono::seconds(i), i <= 40 ? 400 : 150);
+  }
+  for (int i = 0; i <= 500; ++i) {
+    five_hz.Add(Start() + std::chrono::milliseconds(200 * i),
+                i <= 200 ? 400 : 150);
+  }
+  EXPECT_NEAR(one_hz.balance(), five_hz.balance(), 1e-6);
+}
+
+TEST(WPrimeBalanceTest, IntegralBelowCriticalPowerIsFull) {
+  WPrimeBalance balance(kCriticalPower, kWPrime, WPrimeBalance::INTEGRAL);
+  for (int i = 0; i < 600; ++i) {
+    EXPECT_DOUBLE_EQ(balance.Add(Start() + std::chrono::seconds(i), 200),
+                     20000);
+  }
+}
+
+TEST(WPrimeBalanceTest, IntegralDepletesAndRecovers) {
+  WPrimeBalance balance(kCriticalPower, kWPrime, WPrimeBalance::INTEGRAL);
+  int t = 0;
+  balance.Add(Start(), 350);
+  for (++t; t <= 60; ++t) balance.Add(Start() + std::chrono::seconds(t), 350);
+  // Expenditure already decays while riding above CP, so the balance is a bit
+  // higher than the linear 14 kJ.
+  EXPECT_GT(balance.balance(), 14000);
+  EXPECT_LT(balance.balance(), 15000);
+  double last = balance.balance();
+  for (; t <= 3600; ++t) {
+    const double b = balance.Add(Start() + std::chrono::seconds(t), 0);
+    EXPECT_GT(b, last);
+    last = b;
+  }
+  EXPECT_NEAR(last, 20000, 10);
+}
+
+TEST(WPrimeBalanceTest, GapsAreTreatedAsRecovery) {
+  WPrimeBalance balance(kCriticalPower, kWPrime, WPrimeBalance::DIFFERENTIAL);
+  balance.Add(Start(), 350);
+  // A ten minute hole in the recording only counts the first ten seconds of
+  // the 350 W effort.
+  balance.Add(Start() + std::chrono::seconds(600), 350);
+  EXPECT_GT(balance.balance(), 19000);
+}
+
+TEST(WPrimeBalanceTest, ComputeOverTimeSeries) {
+  TimeSeries series;
+  std::vector<double> expected;
+  WPrimeBalance reference(kCriticalPower, kWPrime, WPrimeBalance::INTEGRAL);
+  for (int i = 0; i < 300; ++i) {
+    const TimePoint time = Start() + std::chrono::seconds(i);
+    TimeSample sample(time, Measurement(Measurement::HEART_RATE, 150));
+    // Every tenth sample has a power dropout.
+    if (i % 10 != 5) {
+      const double watts = (i / 30) % 2 == 0 ? 400 : 120;
+      sample.Add(Measurement(Measurement::POWER, watts));
+      expected.push_back(reference.Add(time, watts));
+    }
+    series.Add(sample);
+  }
+
+  std::unique_ptr<TimeSeries> result = ComputeWPrimeBalance(
+      series, kCriticalPower, kWPrime, WPrimeBalance::INTEGRAL);
+  ASSERT_NE(result, nullptr);
+  ASSERT_EQ(result->num_samples(), expected.size());
+  int index = 0;
+  const TimePoint begin = result->BeginTime();
+  const TimePoint end = result->EndTime();
+  result->PrepareVisit();
+  result->Visit(begin, end, Measurement::W_PRIME_BALANCE,
+                [&](const TimePoint& /*time*/, const double joules) {
+                  ASSERT_LT(index, expected.size());
+                  EXPECT_DOUBLE_EQ(joules, expected[index]);
+                  ++index;
+                });
+  result->FinishVisit();
+  EXPECT_EQ(index, expected.size());
+}
+
+TEST(WPrimeBalanceTest, ComputeOverEmptySeries) {
+  TimeSeries series;
+  std::unique_ptr<TimeSeries> result = ComputeWPrimeBalance(
+      series, kCriticalPower, kWPrime, WPrimeBalance::DIFFERENTIAL);
+  ASSERT_NE(result, nullptr);
+  EXPECT_EQ(result->num_samples(), 0);
+}
+
+}  // namespace
+}  // namespace cycling
@@ -0,0 +1,661 @@
+#include "xml_scanner.h"
+
+#include <zlib.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cpu_features.h"
+#include "mapped_file.h"
+#include "str_util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CYCLING_X86 1
+#endif
+
+namespace cycling {
+
+namespace {
+
+const char kByteOrderMark[] = "\xef\xbb\xbf";
+
+// Compressed files are decompressed into this many blocks of this size, which
+// bounds the memory a stream takes.
+const size_t kStreamBlockSize = 256 << 10;
+const int kNumStreamBlocks = 4;
+
+bool IsGzip(const char* data, const size_t size) {
+  return size >= 2 && data[0] == '\x1f' && data[1] == '\x8b';
+}
+
+bool IsSpace(const char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+bool IsNameStart(const char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+bool IsNameChar(const char c) {
+  return IsNameStart(c) || (c >= '0' && c <= '9') || c == '-' || c == '.' ||
+         c == ':';
+}
+
+// Returns the first '<' or '&' in [p, end), or end if there is none. These
+// are the only characters that end a run of text.
+const char* FindMarkupScalar(const char* p, const char* end) {
+  const char* lt = static_cast<const char*>(memchr(p, '<', end - p));
+  if (lt == nullptr) lt = end;
+  const char* amp = static_cast<const char*>(memchr(p, '&', lt - p));
+  return amp == nullptr ? lt : amp;
+}
+
+#ifdef CYCLING_X86
+
+// Same as FindMarkupScalar, looking for both characters in one pass.
+__attribute__((target("avx2"))) const char* FindMarkupAvx2(const char* p,
+                                                           const char* end) {
+  const __m256i lt = _mm256_set1_epi8('<');
+  const __m256i amp = _mm256_set1_epi8('&');
+  for (; end - p >= 32; p += 32) {
+    const __m256i bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    const uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(bytes, lt),
+                        _mm256_cmpeq_epi8(bytes, amp))));
+    if (mask != 0) return p + __builtin_ctz(mask);
+  }
+  for (; p < end; ++p) {
+    if (*p == '<' || *p == '&') return p;
+  }
+  return end;
+}
+
+#endif  // CYCLING_X86
+
+// Passed everything and ignores it.
+class IgnoringHandler : public XmlScanHandler {
+ public:
+  Status StartElement(const char*, const size_t, bool*) override {
+    return Status::OkStatus();
+  }
+  Status EndElement() override { return Status::OkStatus(); }
+  Status Text(const char*, const size_t) override {
+    return Status::OkStatus();
+  }
+};
+
+// What the blocks of a stream scanned so far leave open, carried from one
+// block to the next.
+struct StreamState {
+  bool first = true;
+  bool seen_root = false;
+  std::vector<std::string> open;
+  // The namespace prefixes in scope, with the depth of the element that
+  // declared them.
+  std::vector<std::pair<std::string, size_t>> prefixes;
+};
+
+class Scanner {
+ public:
+  Scanner(const char* data, const size_t size, XmlScanHandler* handler)
+      : data_(data), p_(data), end_(data + size), handler_(handler) {
+#ifdef CYCLING_X86
+    static const bool has_avx2 = HasAvx2();
+    has_avx2_ = has_avx2;
+#endif
+  }
+
+  // Makes Scan() scan a piece of a document, as ScanXmlPiece.
+  void SetPiece(const bool first, const std::vector<std::string>& prefixes,
+                XmlPieceEnds* ends) {
+    first_ = first;
+    ends_ = ends;
+    for (const std::string& prefix : prefixes) {
+      prefixes_.push_back({{prefix.data(), prefix.size()}, 0});
+    }
+  }
+
+  // Makes Scan() scan the next block of a stream, carrying on from where
+  // state says the last one left off, and updating it. Blocks are cut just
+  // before tags.
+  void SetStream(StreamState* state) {
+    stream_ = state;
+    first_ = state->first;
+    seen_root_ = state->seen_root;
+    outer_depth_ = state->open.size();
+    for (const auto& prefix : state->prefixes) {
+      prefixes_.push_back(
+          {{prefix.first.data(), prefix.first.size()}, prefix.second});
+    }
+  }
+
+  Status Scan();
+  Status ScanRootPrefixes(std::vector<std::string>* prefixes);
+
+ private:
+  struct Name {
+    const char* data;
+    size_t size;
+  };
+
+  struct Attribute {
+    Name name;
+    Name value;
+  };
+
+  // A namespace prefix, declared by an element at depth.
+  struct Prefix {
+    Name name;
+    size_t depth;
+  };
+
+  Status Failure(const char* what) const {
+    return Status::FailureStatus(
+        StrCat("XML scanner: ", what, " at byte ", p_ - data_, "."));
+  }
+
+  const char* FindMarkup() const {
+#ifdef CYCLING_X86
+    if (has_avx2_) return FindMarkupAvx2(p_, end_);
+#endif
+    return FindMarkupScalar(p_, end_);
+  }
+
+  bool LookingAt(const char* str, const size_t size) const {
+    return static_cast<size_t>(end_ - p_) >= size &&
+           memcmp(p_, str, size) == 0;
+  }
+
+  void SkipSpace() {
+    while (p_ < end_ && IsSpace(*p_)) ++p_;
+  }
+
+  // Reads a name at p_. Returns false if there isn't one.
+  bool ReadName(Name* name) {
+    if (p_ == end_ || !IsNameStart(*p_)) return false;
+    name->data = p_;
+    for (++p_; p_ < end_ && IsNameChar(*p_); ++p_) {
+    }
+    name->size = p_ - name->data;
+    return true;
+  }
+
+  bool IsDeclared(const char* prefix, const size_t size) const {
+    for (auto it = prefixes_.rbegin(); it != prefixes_.rend(); ++it) {
+      if (it->name.size == size && memcmp(it->name.data, prefix, size) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // The number of elements open at p_.
+  size_t depth() const { return outer_depth_ + open_.size(); }
+
+  Status Prolog();
+  Status Declaration();
+  Status StartTag();
+  bool SkipContent(const Name& name);
+  Status EndTag();
+  Status EndOuterTag(const Name& name);
+  Status Close();
+  void SaveStream();
+
+  const char* const data_;
+  const char* p_;
+  const char* const end_;
+  XmlScanHandler* const handler_;
+  bool has_avx2_ = false;
+  // Set when scanning a piece of a document.
+  XmlPieceEnds* ends_ = nullptr;
+  // Set when scanning a block of a stream. The first outer_depth_ elements
+  // of stream_->open were opened by earlier blocks, and are still open.
+  StreamState* stream_ = nullptr;
+  size_t outer_depth_ = 0;
+  bool first_ = true;
+  bool seen_root_ = false;
+  // The elements opened at p_ since data_.
+  std::vector<Name> open_;
+  std::vector<Prefix> prefixes_;
+  // The attributes of the tag being read.
+  std::vector<Attribute> attributes_;
+};
+
+Status Scanner::Prolog() {
+  if (LookingAt(kByteOrderMark, 3)) p_ += 3;
+  if (LookingAt("<?xml", 5) && p_ + 5 < end_ && IsSpace(p_[5])) {
+    RETURN_IF_ERROR(Declaration());
+  }
+  return Status::OkStatus();
+}
+
+Status Scanner::Scan() {
+  if (first_) RETURN_IF_ERROR(Prolog());
+  while (p_ < end_) {
+    const char* markup = FindMarkup();
+    if (markup > p_) {
+      if (depth() == 0 && ends_ == nullptr) {
+        for (; p_ < markup; ++p_) {
+          if (!IsSpace(*p_)) return Failure("text outside the root element");
+        }
+      } else {
+        RETURN_IF_ERROR(handler_->Text(p_, markup - p_));
+      }
+      p_ = markup;
+    }
+    if (p_ == end_) break;
+    if (*p_ == '&') return Failure("reference");
+    if (p_ + 1 == end_) return Failure("unterminated tag");
+    if (p_[1] == '/') {
+      RETURN_IF_ERROR(EndTag());
+    } else if (p_[1] == '!' || p_[1] == '?') {
+      return Failure("comment, CDATA, DOCTYPE or processing instruction");
+    } else {
+      if (seen_root_ && depth() == 0 && ends_ == nullptr) {
+        return Failure("second root element");
+      }
+      seen_root_ = true;
+      RETURN_IF_ERROR(StartTag());
+    }
+  }
+  if (ends_ != nullptr) {
+    for (const Name& name : open_) {
+      ends_->open.emplace_back(name.data, name.size);
+    }
+    return Status::OkStatus();
+  }
+  if (stream_ != nullptr) {
+    SaveStream();
+    return Status::OkStatus();
+  }
+  if (!seen_root_) return Failure("no root element");
+  if (!open_.empty()) return Failure("unclosed element");
+  return Status::OkStatus();
+}
+
+Status Scanner::ScanRootPrefixes(std::vector<std::string>* prefixes) {
+  RETURN_IF_ERROR(Prolog());
+  SkipSpace();
+  if (p_ + 1 >= end_ || *p_ != '<' || !IsNameStart(p_[1])) {
+    return Failure("expected the root element");
+  }
+  RETURN_IF_ERROR(StartTag());
+  for (const Prefix& prefix : prefixes_) {
+    prefixes->emplace_back(prefix.name.data, prefix.name.size);
+  }
+  return Status::OkStatus();
+}
+
+Status Scanner::Declaration() {
+  const char* start = p_;
+  const char* end = nullptr;
+  for (const char* q = p_; q + 1 < end_; ++q) {
+    if (q[0] == '?' && q[1] == '>') {
+      end = q;
+      break;
+    }
+  }
+  if (end == nullptr) return Failure("unterminated XML declaration");
+  // Anything but UTF-8 (or its subset ASCII) needs converting.
+  const std::string declaration(start, end);
+  const size_t encoding = declaration.find("encoding");
+  if (encoding != std::string::npos) {
+    const size_t quote = declaration.find_first_of("\"'", encoding);
+    if (quote == std::string::npos) return Failure("bad XML declaration");
+    const size_t close = declaration.find(declaration[quote], quote + 1);
+    if (close == std::string::npos) return Failure("bad XML declaration");
+    const std::string name =
+        ToLowercase(declaration.substr(quote + 1, close - quote - 1));
+    if (name != "utf-8" && name != "utf8" && name != "us-ascii") {
+      return Failure("encoding other than UTF-8");
+    }
+  }
+  p_ = end + 2;
+  return Status::OkStatus();
+}
+
+Status Scanner::StartTag() {
+  ++p_;
+  Name name;
+  if (!ReadName(&name)) return Failure("bad element name");
+  attributes_.clear();
+  bool empty = false;
+  while (true) {
+    const char* before = p_;
+    SkipSpace();
+    if (p_ == end_) return Failure("unterminated tag");
+    if (*p_ == '>') {
+      ++p_;
+      break;
+    }
+    if (*p_ == '/') {
+      if (p_ + 1 == end_ || p_[1] != '>') return Failure("bad tag");
+      p_ += 2;
+      empty = true;
+      break;
+    }
+    Name attribute;
+    if (p_ == before || !ReadName(&attribute)) {
+      return Failure("bad attribute");
+    }
+    SkipSpace();
+    if (p_ == end_ || *p_ != '=') return Failure("bad attribute");
+    ++p_;
+    SkipSpace();
+    if (p_ == end_ || (*p_ != '"' && *p_ != '\'')) {
+      return Failure("bad attribute");
+    }
+    const char* value = p_ + 1;
+    const char* close =
+        static_cast<const char*>(memchr(value, *p_, end_ - value));
+    if (close == nullptr) return Failure("unterminated attribute");
+    if (memchr(value, '<', close - value) != nullptr) {
+      return Failure("'<' in attribute");
+    }
+    if (memchr(value, '&', close - value) != nullptr) {
+      return Failure("reference");
+    }
+    p_ = close + 1;
+    if (attribute.size > 6 && memcmp(attribute.data, "xmlns:", 6) == 0) {
+      prefixes_.push_back(
+          {{attribute.data + 6, attribute.size - 6}, depth() + 1});
+    } else if (attribute.size != 5 ||
+               memcmp(attribute.data, "xmlns", 5) != 0) {
+      attributes_.push_back({attribute, {value, size_t(close - value)}});
+    }
+  }
+  open_.push_back(name);
+
+  const char* local = name.data;
+  size_t local_size = name.size;
+  const char* colon =
+      static_cast<const char*>(memchr(name.data, ':', name.size));
+  if (colon != nullptr) {
+    const size_t prefix_size = colon - name.data;
+    if (colon + 1 == name.data + name.size ||
+        memchr(colon + 1, ':', name.size - prefix_size - 1) != nullptr) {
+      return Failure("bad element name");
+    }
+    if (IsDeclared(name.data, prefix_size)) {
+      local = colon + 1;
+      local_size = name.size - prefix_size - 1;
+    }
+  }
+  bool skip = false;
+  RETURN_IF_ERROR(handler_->StartElement(local, local_size, &skip));
+  if (skip && (empty || SkipContent(name))) return Close();
+  for (const Attribute& attribute : attributes_) {
+    RETURN_IF_ERROR(handler_->Attribute(attribute.name.data,
+                                        attribute.name.size,
+                                        attribute.value.data,
+                                        attribute.value.size));
+  }
+  if (empty) RETURN_IF_ERROR(Close());
+  return Status::OkStatus();
+}
+
+// Moves p_, just after the start tag of name, past its end tag, without
+// reading what is in between but for the tags named the same, which may nest.
+// Returns false, leaving p_ where it was, if the end tag isn't in the data.
+bool Scanner::SkipContent(const Name& name) {
+  size_t nested = 0;
+  const char* q = p_;
+  while (true) {
+    q = static_cast<const char*>(memmem(q, end_ - q, name.data, name.size));
+    if (q == nullptr) return false;
+    const char* after = q + name.size;
+    if (after == end_) return false;
+    const bool start = q - p_ >= 1 && q[-1] == '<';
+    const bool end = q - p_ >= 2 && q[-2] == '<' && q[-1] == '/';
+    if ((!start && !end) || IsNameChar(*after)) {
+      q = after;
+      continue;
+    }
+    // The rest of the tag, where a '>' may be quoted in attribute values.
+    for (q = after; q < end_ && *q != '>'; ++q) {
+      if (*q == '"' || *q == '\'') {
+        q = static_cast<const char*>(memchr(q + 1, *q, end_ - q - 1));
+        if (q == nullptr) return false;
+      }
+    }
+    if (q == end_) return false;
+    ++q;
+    if (end) {
+      if (nested == 0) {
+        p_ = q;
+        return true;
+      }
+      --nested;
+    } else if (q[-2] != '/') {
+      ++nested;
+    }
+  }
+}
+
+Status Scanner::EndTag() {
+  p_ += 2;
+  Name name;
+  if (!ReadName(&name)) return Failure("bad end tag");
+  SkipSpace();
+  if (p_ == end_ || *p_ != '>') return Failure("bad end tag");
+  ++p_;
+  if (open_.empty() && ends_ != nullptr) {
+    // Opened before the piece.
+    ends_->closed.emplace_back(name.data, name.size);
+    return handler_->EndElement();
+  }
+  if (open_.empty() && outer_depth_ > 0) return EndOuterTag(name);
+  if (open_.empty() || open_.back().size != name.size ||
+      memcmp(open_.back().data, name.data, name.size) != 0) {
+    return Failure("mismatched end tag");
+  }
+  return Close();
+}
+
+// Closes an element opened by an earlier block of the stream.
+Status Scanner::EndOuterTag(const Name& name) {
+  if (stream_->open[outer_depth_ - 1] != std::string(name.data, name.size)) {
+    return Failure("mismatched end tag");
+  }
+  while (!prefixes_.empty() && prefixes_.back().depth == outer_depth_) {
+    prefixes_.pop_back();
+  }
+  --outer_depth_;
+  return handler_->EndElement();
+}
+
+Status Scanner::Close() {
+  while (!prefixes_.empty() && prefixes_.back().depth == depth()) {
+    prefixes_.pop_back();
+  }
+  open_.pop_back();
+  return handler_->EndElement();
+}
+
+// Copies what is left open into stream_, as the names point into the block.
+void Scanner::SaveStream() {
+  stream_->first = false;
+  stream_->seen_root = seen_root_;
+  stream_->open.resize(outer_depth_);
+  for (const Name& name : open_) {
+    stream_->open.emplace_back(name.data, name.size);
+  }
+  std::vector<std::pair<std::string, size_t>> prefixes;
+  for (const Prefix& prefix : prefixes_) {
+    prefixes.emplace_back(std::string(prefix.name.data, prefix.name.size),
+                          prefix.depth);
+  }
+  stream_->prefixes = std::move(prefixes);
+}
+
+// Decompresses a gzip file on a thread of its own, into a few blocks that it
+// hands to the thread scanning them, and gets back once they are scanned.
+class GzipReader {
+ public:
+  explicit GzipReader(gzFile file) : file_(file) {
+    free_.resize(kNumStreamBlocks);
+    thread_ = std::thread([this]() { Decompress(); });
+  }
+
+  ~GzipReader() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    changed_.notify_all();
+    thread_.join();
+    gzclose(file_);
+  }
+
+  // Swaps the next block into block, taking back the one the last call gave
+  // out. Leaves block empty at the end of the file.
+  Status Read(std::string* block) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this]() { return !full_.empty() || done_; });
+    if (full_.empty()) {
+      block->clear();
+      return status_;
+    }
+    if (lent_) free_.push_back(std::move(*block));
+    lent_ = true;
+    *block = std::move(full_.front());
+    full_.pop_front();
+    changed_.notify_all();
+    return Status::OkStatus();
+  }
+
+ private:
+  void Decompress() {
+    while (true) {
+      std::string block;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [this]() { return !free_.empty() || stop_; });
+        if (stop_) return;
+        block = std::move(free_.back());
+        free_.pop_back();
+      }
+      block.resize(kStreamBlockSize);
+      const int size = gzread(file_, &block[0], block.size());
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (size > 0) {
+        block.resize(size);
+        full_.push_back(std::move(block));
+      } else {
+        if (size < 0) {
+          int error;
+          status_ = Status::FailureStatus(
+              StrCat("Couldn't decompress: ", gzerror(file_, &error)));
+        }
+        done_ = true;
+      }
+      changed_.notify_all();
+      if (done_) return;
+    }
+  }
+
+  gzFile const file_;
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  // Blocks ready to scan, and ones ready to fill.
+  std::deque<std::string> full_;
+  std::vector<std::string> free_;
+  // Whether the caller holds a block from full_, which is only false before
+  // the first Read.
+  bool lent_ = false;
+  bool done_ = false;
+  bool stop_ = false;
+  Status status_;
+  std::thread thread_;
+};
+
+Status ScanGzipFile(const std::string& path, XmlScanHandler* handler) {
+  gzFile file = gzopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return Status::FailureStatus(StrCat("Couldn't open ", path));
+  }
+  gzbuffer(file, 128 << 10);
+  GzipReader reader(file);
+  StreamState state;
+  const auto scan = [handler, &state](const char* data, const size_t size) {
+    Scanner scanner(data, size, handler);
+    scanner.SetStream(&state);
+    return scanner.Scan();
+  };
+  // Each block is scanned in place up to its last '<'. What follows, the
+  // tail, is carried over and completed with the next block up to its first
+  // '<'. Only a tag or text longer than a block makes the tail grow further.
+  std::string tail;
+  std::string block;
+  while (true) {
+    RETURN_IF_ERROR(reader.Read(&block));
+    if (block.empty()) break;
+    size_t first = 0;
+    if (!tail.empty()) {
+      first = block.find('<');
+      if (first == std::string::npos) {
+        tail.append(block);
+        continue;
+      }
+      tail.append(block, 0, first);
+      RETURN_IF_ERROR(scan(tail.data(), tail.size()));
+      tail.clear();
+    }
+    const size_t last = block.rfind('<');
+    if (last != std::string::npos && last > first) {
+      RETURN_IF_ERROR(scan(block.data() + first, last - first));
+      first = last;
+    }
+    tail.assign(block, first, std::string::npos);
+  }
+  RETURN_IF_ERROR(scan(tail.data(), tail.size()));
+  if (!state.seen_root) {
+    return Status::FailureStatus("XML scanner: no root element.");
+  }
+  if (!state.open.empty()) {
+    return Status::FailureStatus("XML scanner: unclosed element.");
+  }
+  return Status::OkStatus();
+}
+
+}  // namespace
+
+Status ScanXml(const char* data, const size_t size, XmlScanHandler* handler) {
+  Scanner scanner(data, size, handler);
+  return scanner.Scan();
+}
+
+Status ScanXmlFile(const std::string& path, XmlScanHandler* handler) {
+  const std::unique_ptr<MappedFile> file = MappedFile::Open(path);
+  if (file == nullptr) {
+    return Status::FailureStatus(StrCat("Couldn't map ", path));
+  }
+  if (IsGzip(file->data(), file->size())) return ScanGzipFile(path, handler);
+  return ScanXml(file->data(), file->size(), handler);
+}
+
+Status ScanXmlPiece(const char* data, const size_t size, const bool first,
+                    const std::vector<std::string>& prefixes,
+                    XmlScanHandler* handler, XmlPieceEnds* ends) {
+  Scanner scanner(data, size, handler);
+  scanner.SetPiece(first, prefixes, ends);
+  return scanner.Scan();
+}
+
+Status ScanXmlRootPrefixes(const char* data, const size_t size,
+                           std::vector<std::string>* prefixes) {
+  IgnoringHandler handler;
+  Scanner scanner(data, size, &handler);
+  return scanner.ScanRootPrefixes(prefixes);
+}
+
+}  // namespace cycling
@@ -0,0 +1,91 @@
+#ifndef __XML_SCANNER_H__
+#define __XML_SCANNER_H__
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "status.h"
+
+namespace cycling {
+
+// Receives the elements and text of a document from ScanXml, in document
+// order. The pointers are only valid during the call.
+class XmlScanHandler {
+ public:
+  virtual ~XmlScanHandler() {}
+
+  // name is the local name of the element, without its namespace prefix.
+  // Like libxml, an element whose prefix isn't declared keeps it.
+  //
+  // Setting *skip, which starts out false, says that the handler ignores
+  // what the element holds. The scanner may then jump to its end tag,
+  // passing on neither its attributes nor its text and children, none of
+  // which are checked; only EndElement() follows. It may also pass them on
+  // anyway, as libxml and a stream whose block ends inside the element do.
+  virtual Status StartElement(const char* name, const size_t size,
+                              bool* skip) = 0;
+  // The attributes of the element just started, one call each, right after
+  // StartElement(). name is as written, prefix and all, and value is as
+  // written between the quotes. Namespace declarations aren't passed on.
+  virtual Status Attribute(const char* /*name*/, const size_t /*name_size*/,
+                           const char* /*value*/,
+                           const size_t /*value_size*/) {
+    return Status::OkStatus();
+  }
+  virtual Status EndElement() = 0;
+  // A run of text between two tags, as it is in the document, whitespace and
+  // all. Never empty.
+  virtual Status Text(const char* text, const size_t size) = 0;
+};
+
+// A tokenizer for the plain XML that devices and apps write, such as TCX, many
+// times faster than libxml. It finds the next tag with AVX2 when the CPU has
+// it, and hands out pointers into the document rather than copies.
+//
+// Scans the document in [data, data + size), failing at the first thing it
+// doesn't handle: comments, CDATA, DOCTYPEs, processing instructions,
+// character and entity references, names that aren't ASCII and encodings
+// other than UTF-8. It also fails if the document isn't well formed, and as
+// soon as the handler fails. It doesn't check the characters of text and
+// attribute values, or that attribute names are unique. Callers fall back to
+// libxml on failure, which handles the rest of XML and says what is wrong.
+Status ScanXml(const char* data, const size_t size, XmlScanHandler* handler);
+
+// Same as ScanXml, for the file at path, which is mapped into memory rather
+// than read. A gzip compressed file is decompressed on a second thread, a
+// fixed number of fixed-size blocks at a time, while the blocks before are
+// scanned, so that the document is never all in memory.
+Status ScanXmlFile(const std::string& path, XmlScanHandler* handler);
+
+// What a piece of a document leaves unbalanced: the elements it closes without
+// opening them, innermost first, and those it opens without closing them,
+// outermost first. Names are as written, prefix and all.
+struct XmlPieceEnds {
+  std::vector<std::string> closed;
+  std::vector<std::string> open;
+};
+
+// Scans [data, data + size), a piece of a larger document cut just before
+// tags, so that the pieces of a document can be scanned at once. The first
+// piece of a document, which holds its prolog, has first set. prefixes are the
+// namespace prefixes in scope at data.
+//
+// Like ScanXml, except that the piece needn't be balanced: elements closed but
+// not opened in it are passed to handler->EndElement() and added to
+// ends->closed, and elements left open are added to ends->open. Text outside
+// the piece's elements goes to the handler too, whitespace and all, and there
+// is no check for a single root element. It's up to the caller to check those,
+// and that consecutive pieces fit together.
+Status ScanXmlPiece(const char* data, const size_t size, const bool first,
+                    const std::vector<std::string>& prefixes,
+                    XmlScanHandler* handler, XmlPieceEnds* ends);
+
+// Reads the namespace prefixes that the root element of the document in
+// [data, data + size) declares, which are in scope all through it.
+Status ScanXmlRootPrefixes(const char* data, const size_t size,
+                           std::vector<std::string>* prefixes);
+
+}  // namespace cycling
+
+#endif  // __XML_SCANNER_H__
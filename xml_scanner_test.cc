@@ -0,0 +1,307 @@
+#include "xml_scanner.h"
+
+#include <zlib.h>
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "str_util.h"
+
+namespace cycling {
+namespace {
+
+using ::testing::ElementsAre;
+
+// Records what it is handed as "<name", ">" and "'text'".
+class Recorder : public XmlScanHandler {
+ public:
+  Status StartElement(const char* name, const size_t size,
+                      bool* /*skip*/) override {
+    events.push_back("<" + std::string(name, size));
+    return Status::OkStatus();
+  }
+  Status EndElement() override {
+    events.push_back(">");
+    return Status::OkStatus();
+  }
+  Status Text(const char* text, const size_t size) override {
+    events.push_back("'" + std::string(text, size) + "'");
+    if (events.size() == fail_at) return Status::FailureStatus("failed");
+    return Status::OkStatus();
+  }
+
+  std::vector<std::string> events;
+  size_t fail_at = 0;
+};
+
+Status Scan(const std::string& xml, Recorder* recorder) {
+  return ScanXml(xml.data(), xml.size(), recorder);
+}
+
+TEST(XmlScannerTest, Scan) {
+  Recorder recorder;
+  ASSERT_TRUE(Scan("\xef\xbb\xbf<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<a x=\"1\" y = '>'><b/>some text<c></c ></a>\n",
+                   &recorder)
+                  .ok());
+  EXPECT_THAT(recorder.events,
+              ElementsAre("<a", "<b", ">", "'some text'", "<c", ">", ">"));
+}
+
+// Also records attributes, as "@name=value".
+class AttributeRecorder : public Recorder {
+ public:
+  Status Attribute(const char* name, const size_t name_size,
+                   const char* value, const size_t value_size) override {
+    events.push_back("@" + std::string(name, name_size) + "=" +
+                     std::string(value, value_size));
+    return Status::OkStatus();
+  }
+};
+
+TEST(XmlScannerTest, Attributes) {
+  AttributeRecorder recorder;
+  const std::string xml =
+      "<a xmlns=\"urn:a\" xmlns:x=\"urn:x\" x:b=\"1\" c = '>'><d e=\"\"/>"
+      "</a>";
+  ASSERT_TRUE(ScanXml(xml.data(), xml.size(), &recorder).ok());
+  EXPECT_THAT(recorder.events,
+              ElementsAre("<a", "@x:b=1", "@c=>", "<d", "@e=", ">", ">"));
+}
+
+// Also skips the elements named s.
+class SkippingRecorder : public AttributeRecorder {
+ public:
+  Status StartElement(const char* name, const size_t size,
+                      bool* skip) override {
+    *skip = std::string(name, size) == "s";
+    return Recorder::StartElement(name, size, skip);
+  }
+};
+
+TEST(XmlScannerTest, Skip) {
+  SkippingRecorder recorder;
+  // Only tags named s count when looking for the end of one, and a '>' in
+  // their attribute values doesn't end them.
+  ASSERT_TRUE(Scan("<a><s x=\"1\"><s>in<sx></sx><x:s/></s><b/>'>'</s >"
+                   "<b c=\"2\">t</b><s/><s y='/>'>z</s></a>",
+                   &recorder)
+                  .ok());
+  EXPECT_EQ(recorder.events,
+            std::vector<std::string>({"<a", "<s", ">", "<b", "@c=2", "'t'",
+                                      ">", "<s", ">", "<s", ">", ">"}));
+
+  // Nor is what they hold checked.
+  recorder.events.clear();
+  ASSERT_TRUE(Scan("<a><s><!-- c --> &amp; <?p?></s></a>", &recorder).ok());
+  EXPECT_THAT(recorder.events, ElementsAre("<a", "<s", ">", ">"));
+
+  // Without its end tag, an element is scanned as if it weren't skipped.
+  recorder.events.clear();
+  XmlPieceEnds ends;
+  ASSERT_TRUE(ScanXmlPiece("<s><b/>", 7, false, {}, &recorder, &ends).ok());
+  EXPECT_THAT(recorder.events, ElementsAre("<s", "<b", ">"));
+  EXPECT_THAT(ends.open, ElementsAre("s"));
+  EXPECT_FALSE(Scan("<a><s></a>", &recorder).ok());
+}
+
+TEST(XmlScannerTest, Namespaces) {
+  Recorder recorder;
+  ASSERT_TRUE(Scan("<a xmlns=\"urn:a\" xmlns:x=\"urn:x\"><x:b><y:c/></x:b>"
+                   "<d xmlns:y=\"urn:y\"><y:e/></d><y:f/></a>",
+                   &recorder)
+                  .ok());
+  // Like libxml, undeclared prefixes stay in the name.
+  EXPECT_EQ(recorder.events,
+            std::vector<std::string>({"<a", "<b", "<y:c", ">", ">", "<d", "<e",
+                                      ">", ">", "<y:f", ">", ">"}));
+}
+
+TEST(XmlScannerTest, LongText) {
+  // Past the 32 bytes the AVX2 search looks at at once.
+  const std::string text(100, 'x');
+  Recorder recorder;
+  ASSERT_TRUE(Scan("<a>" + text + "<b/>" + text + "</a>", &recorder).ok());
+  EXPECT_THAT(recorder.events, ElementsAre("<a", "'" + text + "'", "<b", ">",
+                                           "'" + text + "'", ">"));
+  EXPECT_FALSE(Scan("<a>" + text + "&amp;" + text + "</a>", &recorder).ok());
+}
+
+TEST(XmlScannerTest, Unsupported) {
+  for (const char* xml : {
+           "",
+           "  ",
+           "<a><!-- comment --></a>",
+           "<a><![CDATA[text]]></a>",
+           "<!DOCTYPE a><a/>",
+           "<a><?pi?></a>",
+           "<a>&lt;</a>",
+           "<a>&#65;</a>",
+           "<a b=\"&lt;\"/>",
+           "<?xml version=\"1.0\" encoding=\"ISO-8859-1\"?><a/>",
+           "<\xc3\xa9/>",
+       }) {
+    Recorder recorder;
+    EXPECT_FALSE(Scan(xml, &recorder).ok()) << xml;
+  }
+}
+
+TEST(XmlScannerTest, Malformed) {
+  for (const char* xml : {
+           "<a>",
+           "<a></b>",
+           "<a/><b/>",
+           "text<a/>",
+           "<a/>text",
+           "<a b/>",
+           "<a b=c/>",
+           "<a b=\"c\"d=\"e\"/>",
+           "<a b=\"<\"/>",
+           "<a b=\"c/>",
+           "<a></a",
+           "<1/>",
+           "<a:/>",
+           "<a:b:c/>",
+           "<a",
+       }) {
+    Recorder recorder;
+    EXPECT_FALSE(Scan(xml, &recorder).ok()) << xml;
+  }
+}
+
+TEST(XmlScannerTest, HandlerFailureStops) {
+  Recorder recorder;
+  recorder.fail_at = 2;
+  EXPECT_FALSE(Scan("<a>one<b/>two</a>", &recorder).ok());
+  EXPECT_THAT(recorder.events, ElementsAre("<a", "'one'"));
+}
+
+TEST(XmlScannerTest, Pieces) {
+  const std::string xml =
+      "<?xml version=\"1.0\"?>\n"
+      "<a xmlns:x=\"urn:x\"><b><x:c>one</x:c></b><b>two</b></a>\n";
+  std::vector<std::string> prefixes;
+  ASSERT_TRUE(ScanXmlRootPrefixes(xml.data(), xml.size(), &prefixes).ok());
+  EXPECT_THAT(prefixes, ElementsAre("x"));
+
+  // Cut before the second b.
+  const size_t cut = xml.find("<b>", xml.find("</b>"));
+  Recorder recorder;
+  XmlPieceEnds first, second;
+  ASSERT_TRUE(
+      ScanXmlPiece(xml.data(), cut, true, {}, &recorder, &first).ok());
+  EXPECT_TRUE(first.closed.empty());
+  EXPECT_THAT(first.open, ElementsAre("a"));
+  ASSERT_TRUE(ScanXmlPiece(xml.data() + cut, xml.size() - cut, false,
+                           prefixes, &recorder, &second)
+                  .ok());
+  EXPECT_THAT(second.closed, ElementsAre("a"));
+  EXPECT_TRUE(second.open.empty());
+  // Text outside the root is passed on.
+  EXPECT_EQ(recorder.events,
+            std::vector<std::string>({"'\n'", "<a", "<b", "<c", "'one'", ">",
+                                      ">", "<b", "'two'", ">", ">", "'\n'"}));
+
+  // Only the prefixes in scope are taken off.
+  const std::string piece = "<x:c/></b><b>";
+  for (const auto& prefixes_and_name :
+       {std::make_pair(std::vector<std::string>(), std::string("<x:c")),
+        std::make_pair(prefixes, std::string("<c"))}) {
+    Recorder recorder;
+    XmlPieceEnds ends;
+    ASSERT_TRUE(ScanXmlPiece(piece.data(), piece.size(), false,
+                             prefixes_and_name.first, &recorder, &ends)
+                    .ok());
+    EXPECT_THAT(recorder.events,
+                ElementsAre(prefixes_and_name.second, ">", ">", "<b"));
+    EXPECT_THAT(ends.closed, ElementsAre("b"));
+    EXPECT_THAT(ends.open, ElementsAre("b"));
+  }
+
+  XmlPieceEnds ends;
+  EXPECT_FALSE(
+      ScanXmlPiece("<b></c>", 7, false, {}, &recorder, &ends).ok());
+  EXPECT_FALSE(ScanXmlRootPrefixes("<!-- a --><a/>", 14, &prefixes).ok());
+}
+
+TEST(XmlScannerTest, ScanFile) {
+  Recorder recorder;
+  ASSERT_TRUE(ScanXmlFile("xml_util_test_data.xml", &recorder).ok());
+  // 7 elements, and the whitespace between them.
+  EXPECT_EQ(recorder.events.size(), 23);
+  EXPECT_EQ(recorder.events[0], "<a");
+  EXPECT_FALSE(ScanXmlFile("no_such_file.xml", &recorder).ok());
+}
+
+// Writes contents, gzip compressed, to a temporary file.
+std::string WriteGzip(const std::string& contents) {
+  const std::string path =
+      ::testing::internal::TempDir() + "xml_scanner_test.xml.gz";
+  gzFile file = gzopen(path.c_str(), "wb");
+  gzwrite(file, contents.data(), contents.size());
+  gzclose(file);
+  return path;
+}
+
+TEST(XmlScannerTest, ScanGzipFile) {
+  std::ifstream in("xml_util_test_data.xml");
+  std::stringstream contents;
+  contents << in.rdbuf();
+  Recorder expected;
+  ASSERT_TRUE(Scan(contents.str(), &expected).ok());
+  Recorder recorder;
+  ASSERT_TRUE(ScanXmlFile(WriteGzip(contents.str()), &recorder).ok());
+  EXPECT_EQ(recorder.events, expected.events);
+}
+
+// Spans many of the blocks a compressed file is decompressed into, with
+// namespaces declared along the way, and text and a tag that are longer than
+// a block.
+std::string LongDocument(const std::string& middle) {
+  std::string xml = "<?xml version=\"1.0\"?>\n<r xmlns:x=\"urn:x\">\n";
+  for (int i = 0; i < 20000; ++i) {
+    if (i == 10000) xml += middle;
+    xml += StrCat("<b xmlns:y=\"urn:y\" n=\"", i, "\"><y:c>", i,
+                  "</y:c><x:d/><z:e/></b>\n");
+  }
+  xml += "<f>" + std::string(300 << 10, 'f') + "</f>\n";
+  xml += "<g a=\"" + std::string(300 << 10, 'g') + "\"/>\n";
+  return xml + "</r>\n";
+}
+
+TEST(XmlScannerTest, ScanLongGzipFile) {
+  const std::string xml = LongDocument("");
+  Recorder expected;
+  ASSERT_TRUE(Scan(xml, &expected).ok());
+  Recorder recorder;
+  ASSERT_TRUE(ScanXmlFile(WriteGzip(xml), &recorder).ok());
+  EXPECT_EQ(recorder.events, expected.events);
+
+  for (const std::string& bad : {
+           LongDocument("</b>"),
+           LongDocument("<unclosed>"),
+           LongDocument("</r><second/>"),
+           LongDocument("<!-- comment -->"),
+           xml + "text",
+       }) {
+    Recorder recorder;
+    EXPECT_FALSE(ScanXmlFile(WriteGzip(bad), &recorder).ok());
+  }
+
+  // Cut short.
+  const std::string path = WriteGzip(xml);
+  std::ifstream in(path, std::ios::binary);
+  std::stringstream compressed;
+  compressed << in.rdbuf();
+  std::ofstream(path, std::ios::binary)
+      << compressed.str().substr(0, compressed.str().size() / 2);
+  EXPECT_FALSE(ScanXmlFile(path, &recorder).ok());
+}
+
+}  // namespace
+}  // namespace cycling
@@ -0,0 +1,242 @@
+#include "xml_text.h"
+
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <system_error>
+
+#include "str_util.h"
+
+namespace cycling {
+
+namespace {
+
+template <typename T>
+bool ParseNumber(const char* str, const size_t size, T* value) {
+  const char* begin = str;
+  const char* end = str + size;
+  if (end - begin > 1 && *begin == '+' && begin[1] != '-') ++begin;
+  const std::from_chars_result result = std::from_chars(begin, end, *value);
+  return result.ec == std::errc() && result.ptr == end;
+}
+
+// The value of the digit c, or something over 9 if c isn't a digit.
+unsigned DigitValue(const char c) {
+  return static_cast<unsigned>(static_cast<unsigned char>(c)) - '0';
+}
+
+// Skips a leading sign of [*begin, end). Returns true if it was a '-'.
+bool ReadSign(const char** begin, const char* end) {
+  if (*begin == end || (**begin != '-' && **begin != '+')) return false;
+  return *(*begin)++ == '-';
+}
+
+// Parses all of [str, str + size) if it is a sign and at most 9 digits, which
+// can't overflow an int. Everything else is left to ParseNumber.
+bool ParseShortInt(const char* str, const size_t size, int* value) {
+  const char* p = str;
+  const char* const end = str + size;
+  const bool negative = ReadSign(&p, end);
+  if (p == end || end - p > 9) return false;
+  int i = 0;
+  for (; p < end; ++p) {
+    const unsigned digit = DigitValue(*p);
+    if (digit > 9) return false;
+    i = i * 10 + digit;
+  }
+  *value = negative ? -i : i;
+  return true;
+}
+
+// The powers of ten that are exact as doubles.
+constexpr double kPowersOfTen[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                   1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                   1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                   1e18, 1e19, 1e20, 1e21, 1e22};
+
+// Parses all of [str, str + size) if it is a plain decimal, a sign and at
+// most 19 digits with at most one point among them. Everything else, such as
+// exponents, is left to ParseNumber. The digits make an integer mantissa, to
+// be divided by a power of ten, and both are exact as doubles up to 2^53, so
+// the one rounding of the division gives the same double as from_chars
+// (Clinger's fast path).
+//
+// The 17 digit values some devices write need more bits, which x87 long
+// doubles have: the quotient is then rounded twice, to 64 bits and to 53.
+// That only goes wrong if the first rounding lands exactly half way between
+// two doubles, which is left to ParseNumber too.
+bool ParseShortDecimal(const char* str, const size_t size, double* value) {
+  const char* p = str;
+  const char* const end = str + size;
+  const bool negative = ReadSign(&p, end);
+  // Up to 19 digits, the mantissa can't overflow before it is checked.
+  if (end - p > 20) return false;
+  uint64_t mantissa = 0;
+  const char* const digits = p;
+  for (; p < end && DigitValue(*p) <= 9; ++p) {
+    mantissa = mantissa * 10 + DigitValue(*p);
+  }
+  int num_digits = p - digits;
+  int num_decimals = 0;
+  if (p < end && *p == '.') {
+    const char* const decimals = ++p;
+    for (; p < end && DigitValue(*p) <= 9; ++p) {
+      mantissa = mantissa * 10 + DigitValue(*p);
+    }
+    num_decimals = p - decimals;
+    num_digits += num_decimals;
+  }
+  if (p != end || num_digits == 0 || num_digits > 19) return false;
+  double d;
+  if (mantissa <= (uint64_t{1} << 53)) {
+    d = static_cast<double>(mantissa) / kPowersOfTen[num_decimals];
+  } else {
+    if (std::numeric_limits<long double>::digits != 64) return false;
+    const long double quotient = static_cast<long double>(mantissa) /
+                                 static_cast<long double>(
+                                     kPowersOfTen[num_decimals]);
+    // The low bits of the x87 format are its 64 bit significand.
+    uint64_t significand;
+    memcpy(&significand, &quotient, sizeof(significand));
+    if ((significand & 0x7ff) == 0x400) return false;
+    d = static_cast<double>(quotient);
+  }
+  *value = negative ? -d : d;
+  return true;
+}
+
+// Reads the n decimal digits at str. Returns false if they aren't all digits.
+bool ReadDigits(const char* str, const int n, int* value) {
+  *value = 0;
+  for (int i = 0; i < n; ++i) {
+    if (str[i] < '0' || str[i] > '9') return false;
+    *value = *value * 10 + (str[i] - '0');
+  }
+  return true;
+}
+
+bool IsLeapYear(const int year) {
+  return year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
+}
+
+int DaysInMonth(const int year, const int month) {
+  static const int kDays[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+  return month == 2 && IsLeapYear(year) ? 29 : kDays[month - 1];
+}
+
+// Days from 1970-01-01 to the given day of the proleptic Gregorian calendar,
+// using the days_from_civil algorithm of
+// http://howardhinnant.github.io/date_algorithms.html.
+int64_t DaysFromCivil(int year, const int month, const int day) {
+  year -= month <= 2;
+  const int64_t era = (year >= 0 ? year : year - 399) / 400;
+  const int64_t year_of_era = year - era * 400;
+  const int64_t day_of_year =
+      (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  const int64_t day_of_era =
+      year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+  return era * 146097 + day_of_era - 719468;
+}
+
+}  // namespace
+
+Status ExtractDouble(const char* str, const size_t size, double* d) {
+  if (!ParseShortDecimal(str, size, d) && !ParseNumber(str, size, d)) {
+    return Status::FailureStatus(
+        StrCat("Expected string to contain one float, got ",
+               std::string(str, size), " instead."));
+  }
+  return Status::OkStatus();
+}
+
+Status ExtractDouble(const std::string& str, double* d) {
+  return ExtractDouble(str.data(), str.size(), d);
+}
+
+Status ExtractInt(const char* str, const size_t size, int* i) {
+  if (!ParseShortInt(str, size, i) && !ParseNumber(str, size, i)) {
+    return Status::FailureStatus(
+        StrCat("Expected string to contain one int, got ",
+               std::string(str, size), " instead."));
+  }
+  return Status::OkStatus();
+}
+
+Status ExtractInt(const std::string& str, int* i) {
+  return ExtractInt(str.data(), str.size(), i);
+}
+
+Status TimeParser::Parse(const char* str, const size_t size,
+                         TimeSample::TimePoint* time) {
+  const auto failure = [str, size]() {
+    return Status::FailureStatus(StrCat("Expected a Time value, got '",
+                                        std::string(str, size), "' instead."));
+  };
+  // The shortest is YYYY-MM-DDThh:mm:ssZ.
+  if (size < 20 || str[10] != 'T') return failure();
+  if (memcmp(str, date_, sizeof(date_)) != 0) {
+    int year, month, day;
+    if (!ReadDigits(str, 4, &year) || str[4] != '-' ||
+        !ReadDigits(str + 5, 2, &month) || str[7] != '-' ||
+        !ReadDigits(str + 8, 2, &day) || month < 1 || month > 12 || day < 1 ||
+        day > DaysInMonth(year, month)) {
+      return failure();
+    }
+    days_ = DaysFromCivil(year, month, day);
+    memcpy(date_, str, sizeof(date_));
+  }
+  int hour, minute, second;
+  // A second of 60 is a leap second, which like mktime we take to be the
+  // first second of the next minute.
+  if (!ReadDigits(str + 11, 2, &hour) || str[13] != ':' ||
+      !ReadDigits(str + 14, 2, &minute) || str[16] != ':' ||
+      !ReadDigits(str + 17, 2, &second) || hour > 23 || minute > 59 ||
+      second > 60) {
+    return failure();
+  }
+  const char* p = str + 19;
+  const char* const end = str + size;
+  int64_t nanoseconds = 0;
+  if (*p == '.') {
+    const char* digits = ++p;
+    int64_t scale = 1000000000;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+      scale /= 10;
+      nanoseconds += (*p - '0') * scale;
+    }
+    if (p == digits) return failure();
+  }
+  int offset_minutes = 0;
+  if (p < end && *p == 'Z') {
+    ++p;
+  } else if (end - p == 6 && (*p == '+' || *p == '-') && p[3] == ':') {
+    int offset_hours;
+    if (!ReadDigits(p + 1, 2, &offset_hours) ||
+        !ReadDigits(p + 4, 2, &offset_minutes) || offset_hours > 23 ||
+        offset_minutes > 59) {
+      return failure();
+    }
+    offset_minutes += offset_hours * 60;
+    if (*p == '-') offset_minutes = -offset_minutes;
+    p += 6;
+  } else {
+    // The zone is required, also after a fraction.
+    return failure();
+  }
+  if (p != end) return failure();
+  const int64_t seconds = days_ * 86400 + hour * 3600 + minute * 60 + second -
+                          offset_minutes * 60;
+  *time = TimeSample::TimePoint(
+      std::chrono::duration_cast<TimeSample::TimePoint::duration>(
+          std::chrono::seconds(seconds) +
+          std::chrono::nanoseconds(nanoseconds)));
+  return Status::OkStatus();
+}
+
+Status ExtractTime(const std::string& str, TimeSample::TimePoint* time) {
+  TimeParser parser;
+  return parser.Parse(str.data(), str.size(), time);
+}
+
+}  // namespace cycling
@@ -0,0 +1,129 @@
+#ifndef __XML_TEXT_H__
+#define __XML_TEXT_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "status.h"
+#include "time_sample.h"
+
+namespace cycling {
+
+// What the streaming parsers of XML activity files, TCX and GPX, share on top
+// of ScanXml: element names interned as atoms, and the numbers and times in
+// their text.
+
+constexpr char ToLowerAscii(const char c) {
+  return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+// FNV-1a of the lowercase name, starting from seed.
+constexpr uint32_t HashXmlName(const char* name, const size_t size,
+                               const uint32_t seed) {
+  uint32_t hash = 2166136261u ^ seed;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ static_cast<unsigned char>(ToLowerAscii(name[i]))) *
+           16777619u;
+  }
+  return hash;
+}
+
+// Interns the element names a parser knows as atoms, the index of the name in
+// entries, so that parsers only ever compare atoms. Names are matched without
+// regard to case. The table is a perfect hash of the names: the seed for which
+// every name hashes to a slot of its own, and the atom in each slot. It is
+// found by the compiler, so looking up a name is one hash and one comparison.
+//
+// entries is a constexpr array of structs with a lowercase std::string_view
+// name. Entry 0 is the atom of names that aren't known, and entries whose
+// name is in parentheses, like "(unknown)", are never matched. Check ok() with
+// a static_assert.
+template <typename Entry, size_t kNumAtoms>
+class XmlAtomTable {
+ public:
+  constexpr explicit XmlAtomTable(const Entry (&entries)[kNumAtoms]) {
+    static_assert(kNumAtoms <= 256, "Atoms are kept in a byte");
+    for (size_t i = 0; i < kNumAtoms; ++i) names_[i] = entries[i].name;
+    for (seed_ = 0; seed_ < kNoSeed; ++seed_) {
+      if (Fill()) return;
+    }
+  }
+
+  // False if there is no perfect hash of the names; grow kSlots.
+  constexpr bool ok() const { return seed_ != kNoSeed; }
+
+  // Returns the atom of [name, name + size), or 0 if it isn't known.
+  int Find(const char* name, const size_t size) const {
+    const int atom = atoms_[Slot(HashXmlName(name, size, seed_))];
+    if (atom == 0 || names_[atom].size() != size) return 0;
+    for (size_t i = 0; i < size; ++i) {
+      if (ToLowerAscii(name[i]) != names_[atom][i]) return 0;
+    }
+    return atom;
+  }
+
+ private:
+  static constexpr int kSlots = 256;
+  static constexpr uint32_t kNoSeed = 1000;
+
+  static constexpr int Slot(const uint32_t hash) {
+    return (hash ^ (hash >> 16)) & (kSlots - 1);
+  }
+
+  // Fills in atoms_ for seed_. Returns false if two names share a slot.
+  constexpr bool Fill() {
+    for (int i = 0; i < kSlots; ++i) atoms_[i] = 0;
+    for (size_t i = 1; i < kNumAtoms; ++i) {
+      const std::string_view name = names_[i];
+      if (!name.empty() && name[0] == '(') continue;
+      const int slot = Slot(HashXmlName(name.data(), name.size(), seed_));
+      if (atoms_[slot] != 0) return false;
+      atoms_[slot] = static_cast<uint8_t>(i);
+    }
+    return true;
+  }
+
+  uint32_t seed_ = 0;
+  std::string_view names_[kNumAtoms] = {};
+  uint8_t atoms_[kSlots] = {};
+};
+
+// Trims the whitespace, and control characters, off both ends of
+// [*begin, *end), as TrimWhitespace does.
+inline void TrimXmlText(const char** begin, const char** end) {
+  while (*begin < *end && **begin <= ' ') ++*begin;
+  while (*end > *begin && (*end)[-1] <= ' ') --*end;
+}
+
+// Parses all of [str, str + size), or str, as one number, giving exactly what
+// std::from_chars does, without allocating or looking at the locale. Like
+// sscanf, a leading '+' is allowed. Plain decimals, which is what activity
+// files hold, are read by hand; anything else goes to std::from_chars.
+Status ExtractDouble(const char* str, const size_t size, double* d);
+Status ExtractDouble(const std::string& str, double* d);
+Status ExtractInt(const char* str, const size_t size, int* i);
+Status ExtractInt(const std::string& str, int* i);
+
+// Parses xsd:dateTime values, such as "2016-07-23T08:51:44Z" and
+// "2017-02-06T05:50:01.250+01:00", into UTC time points. Fractional seconds
+// are kept to the nanosecond, and the UTC offset, Z or [+-]hh:mm, can't be
+// left out. Consecutive trackpoints nearly always fall on the same day, so
+// the last date is remembered and only the time of day of the next ones is
+// parsed.
+class TimeParser {
+ public:
+  Status Parse(const char* str, const size_t size, TimeSample::TimePoint* time);
+
+ private:
+  // The last date parsed, as YYYY-MM-DD, and its days since the epoch.
+  char date_[10] = {};
+  int64_t days_ = 0;
+};
+
+Status ExtractTime(const std::string& str, TimeSample::TimePoint* time);
+
+}  // namespace cycling
+
+#endif  // __XML_TEXT_H__
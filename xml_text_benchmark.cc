@@ -0,0 +1,184 @@
+// Times ExtractInt, ExtractDouble and TimeParser on every value of those types
+// in the bundled TCX files, against the sscanf and mktime versions they
+// replaced, and checks that both give the same values. Each is meant to be at
+// least 10 times faster per field. Run from the directory of the files.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "str_util.h"
+#include "xml_text.h"
+
+namespace cycling {
+namespace {
+
+const int kNumRuns = 21;
+
+const char* const kFiles[] = {
+    "fenix3_indoor_intervals_run.tcx", "fenix3_indoor_ride.tcx",
+    "fenix3_outdoor_interval_run.tcx", "fenix3_outdoor_ride.tcx",
+    "trainerroad_ride.tcx",
+};
+
+// What ExtractDouble, ExtractInt and ExtractTime were before.
+Status OldExtractDouble(const std::string& str, double* d) {
+  int n;
+  if (sscanf(str.c_str(), "%lf%n", d, &n) != 1 ||
+      static_cast<size_t>(n) != str.size()) {
+    return Status::FailureStatus(
+        StrCat("Expected string to contain one float, got ", str, " instead."));
+  }
+  return Status::OkStatus();
+}
+
+Status OldExtractInt(const std::string& str, int* i) {
+  int n;
+  if (sscanf(str.c_str(), "%d%n", i, &n) != 1 ||
+      static_cast<size_t>(n) != str.size()) {
+    return Status::FailureStatus(
+        StrCat("Expected string to contain one int, got ", str, " instead."));
+  }
+  return Status::OkStatus();
+}
+
+Status OldExtractTime(const std::string& str, TimeSample::TimePoint* time) {
+  int y, m, d, h, min, s, ms, n;
+  if (sscanf(str.c_str(), "%4d-%2d-%2dT%2d:%2d:%2d.%dZ%n", &y, &m, &d, &h,
+             &min, &s, &ms, &n) != 7 ||
+      static_cast<size_t>(n) < str.size()) {
+    if (sscanf(str.c_str(), "%4d-%2d-%2dT%2d:%2d:%2dZ%n", &y, &m, &d, &h,
+               &min, &s, &n) != 6 ||
+        static_cast<size_t>(n) < str.size()) {
+      return Status::FailureStatus(
+          StrCat("Expected a Time value, got '", str, "' instead."));
+    }
+  }
+  struct tm c_time = {};
+  c_time.tm_isdst = -1;
+  c_time.tm_sec = s;
+  c_time.tm_min = min;
+  c_time.tm_hour = h;
+  c_time.tm_mday = d;
+  c_time.tm_mon = m - 1;
+  c_time.tm_year = y - 1900;
+  *time = std::chrono::system_clock::from_time_t(mktime(&c_time));
+  return Status::OkStatus();
+}
+
+// Appends the text of every element of document named one of names.
+void FindValues(const std::string& document,
+                const std::vector<std::string>& names,
+                std::vector<std::string>* values) {
+  for (const std::string& name : names) {
+    const std::string start = "<" + name + ">";
+    for (size_t at = document.find(start); at != std::string::npos;
+         at = document.find(start, at)) {
+      at += start.size();
+      values->push_back(document.substr(at, document.find('<', at) - at));
+    }
+  }
+}
+
+// Nanoseconds per value of parse, which is called on each of values in turn.
+template <typename Parse>
+double Time(const std::vector<std::string>& values, Parse parse) {
+  const auto start = std::chrono::steady_clock::now();
+  for (const std::string& value : values) parse(value);
+  const std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / values.size();
+}
+
+// Prints the best and median times of old_parse and new_parse, and the median
+// of how much faster new_parse was. They take turns, so that both see the
+// same load on the machine.
+template <typename OldParse, typename NewParse>
+void Compare(const char* what, const std::vector<std::string>& values,
+             OldParse old_parse, NewParse new_parse) {
+  std::vector<double> old_ns, new_ns, speedups;
+  for (int run = 0; run < kNumRuns; ++run) {
+    old_ns.push_back(Time(values, old_parse));
+    new_ns.push_back(Time(values, new_parse));
+    speedups.push_back(old_ns.back() / new_ns.back());
+  }
+  std::sort(old_ns.begin(), old_ns.end());
+  std::sort(new_ns.begin(), new_ns.end());
+  std::sort(speedups.begin(), speedups.end());
+  printf("%-6s %6zu values: best %6.1f -> %5.1f ns, "
+         "median %6.1f -> %5.1f ns, %5.1fx faster\n",
+         what, values.size(), old_ns.front(), new_ns.front(),
+         old_ns[kNumRuns / 2], new_ns[kNumRuns / 2], speedups[kNumRuns / 2]);
+}
+
+void Run() {
+  std::vector<std::string> ints, doubles, times;
+  for (const char* file : kFiles) {
+    std::ifstream in(file);
+    if (!in) {
+      fprintf(stderr, "Couldn't read %s\n", file);
+      exit(1);
+    }
+    const std::string document((std::istreambuf_iterator<char>(in)),
+                               std::istreambuf_iterator<char>());
+    FindValues(document, {"Value", "Cadence", "ns3:Watts", "ns3:RunCadence"},
+               &ints);
+    FindValues(document,
+               {"LatitudeDegrees", "LongitudeDegrees", "AltitudeMeters",
+                "DistanceMeters", "ns3:Speed"},
+               &doubles);
+    FindValues(document, {"Time"}, &times);
+  }
+
+  // The old ExtractTime read times as local time.
+  setenv("TZ", "UTC", 1);
+  tzset();
+  int mismatches = 0;
+  for (const std::string& value : ints) {
+    int expected, actual;
+    mismatches += !OldExtractInt(value, &expected).ok() ||
+                  !ExtractInt(value, &actual).ok() || expected != actual;
+  }
+  for (const std::string& value : doubles) {
+    double expected, actual;
+    mismatches += !OldExtractDouble(value, &expected).ok() ||
+                  !ExtractDouble(value, &actual).ok() || expected != actual;
+  }
+  TimeParser time_parser;
+  for (const std::string& value : times) {
+    TimeSample::TimePoint expected, actual;
+    mismatches +=
+        !OldExtractTime(value, &expected).ok() ||
+        !time_parser.Parse(value.data(), value.size(), &actual).ok() ||
+        expected != actual;
+  }
+  printf("%d values differ from the old functions\n", mismatches);
+
+  int i;
+  double d;
+  TimeSample::TimePoint time;
+  Compare("int", ints, [&](const std::string& s) { OldExtractInt(s, &i); },
+          [&](const std::string& s) { ExtractInt(s.data(), s.size(), &i); });
+  Compare("double", doubles,
+          [&](const std::string& s) { OldExtractDouble(s, &d); },
+          [&](const std::string& s) { ExtractDouble(s.data(), s.size(), &d); });
+  Compare("time", times,
+          [&](const std::string& s) { OldExtractTime(s, &time); },
+          [&](const std::string& s) {
+            time_parser.Parse(s.data(), s.size(), &time);
+          });
+}
+
+}  // namespace
+}  // namespace cycling
+
+int main() {
+  cycling::Run();
+  return 0;
+}
@@ -0,0 +1,77 @@
+#include "xml_text.h"
+
+#include <charconv>
+#include <cstring>
+#include <random>
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace cycling {
+namespace {
+
+// What from_chars makes of all of str, which ExtractDouble must match bit for
+// bit.
+bool FromChars(const std::string& str, double* d) {
+  const std::from_chars_result result =
+      std::from_chars(str.data(), str.data() + str.size(), *d);
+  return result.ec == std::errc() && result.ptr == str.data() + str.size();
+}
+
+void ExpectSameDouble(const std::string& str) {
+  double expected = 0, actual = 0;
+  ASSERT_TRUE(FromChars(str, &expected)) << str;
+  ASSERT_TRUE(ExtractDouble(str, &actual).ok()) << str;
+  EXPECT_EQ(0, memcmp(&expected, &actual, sizeof(double)))
+      << str << ": " << expected << " != " << actual;
+}
+
+TEST(XmlTextTest, ExtractInt) {
+  int i;
+  EXPECT_TRUE(ExtractInt("142", &i).ok());
+  EXPECT_EQ(142, i);
+  EXPECT_TRUE(ExtractInt("+7", &i).ok());
+  EXPECT_EQ(7, i);
+  EXPECT_TRUE(ExtractInt("-007", &i).ok());
+  EXPECT_EQ(-7, i);
+  EXPECT_TRUE(ExtractInt("2147483647", &i).ok());
+  EXPECT_EQ(2147483647, i);
+  EXPECT_TRUE(ExtractInt("-2147483648", &i).ok());
+  EXPECT_EQ(-2147483647 - 1, i);
+  for (const std::string bad :
+       {"", "+", "-", "+-1", "1.5", "1 ", "0x10", "2147483648", "12a"}) {
+    EXPECT_FALSE(ExtractInt(bad, &i).ok()) << bad;
+  }
+}
+
+TEST(XmlTextTest, ExtractDouble) {
+  for (const std::string str :
+       {"0", "-0", "1.5", "1.", ".5", "-.5", "45.1234567", "1e5", "2.5E-3",
+        "0.1", "0.30000000000000004", "123.40000152587891",
+        // 2^53 and 2^53 + 1, which is half way between two doubles.
+        "9007199254740992", "9007199254740993", "9007199254740993.0",
+        "1844674407370955161", "0.0000000000000000001"}) {
+    ExpectSameDouble(str);
+  }
+  double d;
+  EXPECT_TRUE(ExtractDouble("+1.5", &d).ok());
+  EXPECT_EQ(1.5, d);
+  for (const std::string bad : {"", "+", "-", ".", "+-1", "1.5.", "1 ", "e5"}) {
+    EXPECT_FALSE(ExtractDouble(bad, &d).ok()) << bad;
+  }
+}
+
+TEST(XmlTextTest, ExtractDoubleMatchesFromChars) {
+  std::mt19937_64 random(1);
+  for (int i = 0; i < 100000; ++i) {
+    const int num_digits = 1 + random() % 19;
+    std::string digits;
+    for (int j = 0; j < num_digits; ++j) digits += '0' + random() % 10;
+    const int point = random() % (num_digits + 1);
+    ExpectSameDouble((random() % 2 ? "-" : "") + digits.substr(0, point) +
+                     "." + digits.substr(point));
+  }
+}
+
+}  // namespace
+}  // namespace cycling
@@ -3,10 +3,15 @@
 #include <cstdio>
 
 #include <algorithm>
+#include <cstring>
+#include <new>
 #include <utility>
+#include <vector>
 
 #include "libxml/parser.h"
 #include "libxml/tree.h"
+#include "libxml/xmlreader.h"
+#include "str_util.h"
 
 namespace cycling {
 
@@ -30,6 +35,175 @@ std::ostream& operator<<(std::ostream& lhs, const XmlNode& rhs) {
   return lhs << "} num_kids=" << rhs.children.size();
 }
 
+namespace {
+
+// Documents grow their arena by this much at a time.
+const size_t kArenaBlockSize = 64 << 10;
+const size_t kArenaAlignment = alignof(XmlDocument::Node);
+
+std::string_view ToStringView(const xmlChar* str) {
+  return str ? std::string_view(reinterpret_cast<const char*>(str))
+             : std::string_view();
+}
+
+std::string_view TrimmedView(const std::string_view str) {
+  size_t begin = 0;
+  size_t end = str.size();
+  while (begin < end && str[begin] <= ' ') ++begin;
+  while (end > begin && str[end - 1] <= ' ') --end;
+  return str.substr(begin, end - begin);
+}
+
+}  // namespace
+
+const std::string_view* XmlDocument::Node::FindAttribute(
+    const std::string_view name) const {
+  for (int i = 0; i < num_attrs; ++i) {
+    if (attrs[i].name == name) return &attrs[i].value;
+  }
+  return nullptr;
+}
+
+void* XmlDocument::Allocate(const size_t size) {
+  const size_t aligned =
+      (size + kArenaAlignment - 1) / kArenaAlignment * kArenaAlignment;
+  if (aligned > left_) {
+    // Big requests get a block of their own, so the current block can still
+    // be used.
+    if (aligned > kArenaBlockSize / 4) {
+      blocks_.emplace_back(new char[aligned]);
+      return blocks_.back().get();
+    }
+    blocks_.emplace_back(new char[kArenaBlockSize]);
+    next_ = blocks_.back().get();
+    left_ = kArenaBlockSize;
+  }
+  void* result = next_;
+  next_ += aligned;
+  left_ -= aligned;
+  return result;
+}
+
+std::string_view XmlDocument::Copy(const std::string_view str) {
+  if (str.empty()) return std::string_view();
+  char* data = static_cast<char*>(Allocate(str.size()));
+  memcpy(data, str.data(), str.size());
+  return std::string_view(data, str.size());
+}
+
+std::string_view XmlDocument::Intern(const std::string_view name) {
+  auto it = names_.find(name);
+  if (it != names_.end()) return it->second;
+  const std::string_view copy = Copy(name);
+  names_.emplace(copy, copy);
+  return copy;
+}
+
+// Builds an XmlDocument from the nodes xmlTextReader walks through, in one
+// pass.
+class XmlDocumentBuilder {
+ public:
+  explicit XmlDocumentBuilder(xml_util::XmlReader reader)
+      : owned_reader_(std::move(reader)), reader_(owned_reader_.get()) {}
+
+  std::unique_ptr<XmlDocument> Build() {
+    if (reader_ == nullptr) return nullptr;
+    std::unique_ptr<XmlDocument> document(new XmlDocument);
+    document_ = document.get();
+    XmlDocument::Node* root = NewNode(XmlNode::ROOT);
+    document->root_ = root;
+    open_.push_back({root, nullptr});
+    int result;
+    while ((result = xmlTextReaderRead(reader_)) == 1) {
+      switch (xmlTextReaderNodeType(reader_)) {
+        case XML_READER_TYPE_ELEMENT:
+          StartElement();
+          break;
+        case XML_READER_TYPE_END_ELEMENT:
+          open_.pop_back();
+          break;
+        case XML_READER_TYPE_TEXT:
+        case XML_READER_TYPE_CDATA:
+          Text();
+          break;
+        default:
+          // Whitespace would be trimmed away, and comments, processing
+          // instructions and the like aren't part of the tree.
+          break;
+      }
+    }
+    if (result != 0 || root->first_child == nullptr) return nullptr;
+    return document;
+  }
+
+ private:
+  struct OpenNode {
+    XmlDocument::Node* node;
+    XmlDocument::Node* last_child;
+  };
+
+  XmlDocument::Node* NewNode(const XmlNode::Type type) {
+    XmlDocument::Node* node =
+        new (document_->Allocate(sizeof(XmlDocument::Node))) XmlDocument::Node;
+    node->type = type;
+    return node;
+  }
+
+  // Adds node as the last child of the innermost open node.
+  void Append(XmlDocument::Node* node) {
+    OpenNode& parent = open_.back();
+    node->parent = parent.node;
+    if (parent.last_child == nullptr) {
+      parent.node->first_child = node;
+    } else {
+      parent.last_child->next_sibling = node;
+    }
+    parent.last_child = node;
+    ++parent.node->num_children;
+  }
+
+  void StartElement() {
+    XmlDocument::Node* node = NewNode(XmlNode::TAG);
+    node->name =
+        document_->Intern(ToStringView(xmlTextReaderConstLocalName(reader_)));
+    const bool empty = xmlTextReaderIsEmptyElement(reader_);
+    attrs_.clear();
+    while (xmlTextReaderMoveToNextAttribute(reader_) == 1) {
+      if (xmlTextReaderIsNamespaceDecl(reader_)) continue;
+      attrs_.push_back(
+          {document_->Intern(
+               ToStringView(xmlTextReaderConstLocalName(reader_))),
+           document_->Copy(ToStringView(xmlTextReaderConstValue(reader_)))});
+    }
+    xmlTextReaderMoveToElement(reader_);
+    if (!attrs_.empty()) {
+      auto* attrs = static_cast<XmlDocument::Attribute*>(document_->Allocate(
+          attrs_.size() * sizeof(XmlDocument::Attribute)));
+      std::copy(attrs_.begin(), attrs_.end(), attrs);
+      node->attrs = attrs;
+      node->num_attrs = static_cast<int>(attrs_.size());
+    }
+    Append(node);
+    if (!empty) open_.push_back({node, nullptr});
+  }
+
+  void Text() {
+    const std::string_view text =
+        TrimmedView(ToStringView(xmlTextReaderConstValue(reader_)));
+    if (text.empty()) return;
+    XmlDocument::Node* node = NewNode(XmlNode::FREE_TEXT);
+    node->text = document_->Copy(text);
+    Append(node);
+  }
+
+  const xml_util::XmlReader owned_reader_;
+  xmlTextReaderPtr const reader_;
+  XmlDocument* document_ = nullptr;
+  std::vector<OpenNode> open_;
+  // Reused for the attributes of each element.
+  std::vector<XmlDocument::Attribute> attrs_;
+};
+
 namespace xml_util {
 
 namespace {
@@ -44,7 +218,65 @@ std::string ToString(const xmlChar* stupid_rep) {
                     : "";
 }
 
-std::map<xmlElementType, int> g_counts;
+const char* ToChars(const xmlChar* text) {
+  return text ? reinterpret_cast<const char*>(text) : "";
+}
+
+// Threads keep at most this many readers they are done with.
+const size_t kMaxPooledReaders = 4;
+
+// Sets up libxml's global state, once. It is never cleaned up, since
+// xmlCleanupParser() would pull it from under other threads.
+void InitLibxml() {
+  static const bool initialized = (xmlInitParser(), true);
+  (void)initialized;
+}
+
+// The parser context of the calling thread, for building libxml trees.
+xmlParserCtxtPtr ThreadParserContext() {
+  struct Holder {
+    ~Holder() {
+      if (context != nullptr) xmlFreeParserCtxt(context);
+    }
+    xmlParserCtxtPtr context = nullptr;
+  };
+  thread_local Holder holder;
+  if (holder.context == nullptr) holder.context = xmlNewParserCtxt();
+  return holder.context;
+}
+
+// The text readers a thread is done with.
+class ReaderPool {
+ public:
+  ~ReaderPool() {
+    for (xmlTextReaderPtr reader : readers_) xmlFreeTextReader(reader);
+  }
+
+  // Returns nullptr if the pool is empty.
+  xmlTextReaderPtr Take() {
+    if (readers_.empty()) return nullptr;
+    xmlTextReaderPtr reader = readers_.back();
+    readers_.pop_back();
+    return reader;
+  }
+
+  void Put(xmlTextReaderPtr reader) {
+    if (readers_.size() < kMaxPooledReaders) {
+      readers_.push_back(reader);
+    } else {
+      xmlFreeTextReader(reader);
+    }
+  }
+
+ private:
+  std::vector<xmlTextReaderPtr> readers_;
+};
+
+ReaderPool& ThreadReaders() {
+  thread_local ReaderPool pool;
+  return pool;
+}
+
 const std::map<xmlElementType, std::string> kTypes = {
     {XML_ELEMENT_NODE, "XML_ELEMENT_NODE"},
     {XML_ATTRIBUTE_NODE, "XML_ATTRIBUTE_NODE"},
@@ -82,7 +314,6 @@ std::string TrimWhitespace(const std::string str) {
 
 std::unique_ptr<XmlNode> ConvertToNode(xmlNode* cur_node) {
   auto node = make_unique<XmlNode>();
-  g_counts[cur_node->type]++;
   switch (cur_node->type) {
     case XML_ELEMENT_NODE:
       node->name = ToString(cur_node->name);
@@ -163,25 +394,104 @@ const XmlNode* FindNextNode(const std::string& name, const XmlNode* parent,
 
 }  // namespace
 
+void XmlReaderReleaser::operator()(xmlTextReader* reader) const {
+  // Lets go of the document, but keeps the reader's buffers and dictionary.
+  xmlTextReaderClose(reader);
+  ThreadReaders().Put(reader);
+}
+
+XmlReader XmlReaderForFile(const std::string& path) {
+  InitLibxml();
+  xmlTextReaderPtr reader = ThreadReaders().Take();
+  if (reader == nullptr) {
+    return XmlReader(xmlReaderForFile(path.c_str(), nullptr, 0));
+  }
+  XmlReader pooled(reader);
+  if (xmlReaderNewFile(reader, path.c_str(), nullptr, 0) != 0) return nullptr;
+  return pooled;
+}
+
+XmlReader XmlReaderForMemory(const char* data, const size_t size) {
+  InitLibxml();
+  xmlTextReaderPtr reader = ThreadReaders().Take();
+  if (reader == nullptr) {
+    return XmlReader(xmlReaderForMemory(data, static_cast<int>(size),
+                                        "noname.xml", nullptr, 0));
+  }
+  XmlReader pooled(reader);
+  if (xmlReaderNewMemory(reader, data, static_cast<int>(size), "noname.xml",
+                         nullptr, 0) != 0) {
+    return nullptr;
+  }
+  return pooled;
+}
+
+Status ReadXmlFile(const std::string& path, XmlScanHandler* handler) {
+  const XmlReader reader = XmlReaderForFile(path);
+  if (reader == nullptr) {
+    return Status::FailureStatus(StrCat("Couldn't open ", path));
+  }
+  int result;
+  while ((result = xmlTextReaderRead(reader.get())) == 1) {
+    switch (xmlTextReaderNodeType(reader.get())) {
+      case XML_READER_TYPE_ELEMENT: {
+        const char* name = ToChars(xmlTextReaderConstLocalName(reader.get()));
+        // Skipping is only a hint, which libxml's reader can't take.
+        bool skip = false;
+        RETURN_IF_ERROR(handler->StartElement(name, strlen(name), &skip));
+        while (xmlTextReaderMoveToNextAttribute(reader.get()) == 1) {
+          if (xmlTextReaderIsNamespaceDecl(reader.get()) == 1) continue;
+          const char* attribute = ToChars(xmlTextReaderConstName(reader.get()));
+          const char* value = ToChars(xmlTextReaderConstValue(reader.get()));
+          RETURN_IF_ERROR(handler->Attribute(attribute, strlen(attribute),
+                                             value, strlen(value)));
+        }
+        xmlTextReaderMoveToElement(reader.get());
+        if (xmlTextReaderIsEmptyElement(reader.get())) {
+          RETURN_IF_ERROR(handler->EndElement());
+        }
+        break;
+      }
+      case XML_READER_TYPE_END_ELEMENT:
+        RETURN_IF_ERROR(handler->EndElement());
+        break;
+      case XML_READER_TYPE_TEXT:
+      case XML_READER_TYPE_CDATA:
+      case XML_READER_TYPE_WHITESPACE:
+      case XML_READER_TYPE_SIGNIFICANT_WHITESPACE: {
+        const char* text = ToChars(xmlTextReaderConstValue(reader.get()));
+        RETURN_IF_ERROR(handler->Text(text, strlen(text)));
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  if (result != 0) return Status::FailureStatus("Malformed XML.");
+  return Status::OkStatus();
+}
+
 std::unique_ptr<XmlNode> ParseXmlContents(const std::string& contents) {
-  xmlDoc* doc =
-      xmlReadMemory(contents.data(), static_cast<int>(contents.size()), "noname.xml", nullptr, 0);
+  InitLibxml();
+  xmlDoc* doc = xmlCtxtReadMemory(ThreadParserContext(), contents.data(),
+                                  static_cast<int>(contents.size()),
+                                  "noname.xml", nullptr, 0);
   if (doc == nullptr) {
     fprintf(stderr, "Failed to parse document\n");
     return nullptr;
   }
   auto node = ConvertToXmlNodeTree(doc);
   xmlFreeDoc(doc);
-  xmlCleanupParser();
   return node;
 }
 
 std::unique_ptr<XmlNode> ParseXmlFile(const std::string& path) {
-  xmlDoc* doc = xmlReadFile(path.c_str(), NULL, 0);
+  InitLibxml();
+  xmlDoc* doc =
+      xmlCtxtReadFile(ThreadParserContext(), path.c_str(), nullptr, 0);
   if (doc == nullptr) return nullptr;
   auto node = ConvertToXmlNodeTree(doc);
   xmlFreeDoc(doc);
-  xmlCleanupParser();
   return node;
 }
 
@@ -205,5 +515,48 @@ const XmlNode* FindNextNode(const std::string& name, const XmlNode* hint) {
   return FindNextNode(name, hint->parent, hint);
 }
 
+std::unique_ptr<XmlDocument> ParseXmlDocument(const std::string& contents) {
+  XmlDocumentBuilder builder(
+      XmlReaderForMemory(contents.data(), contents.size()));
+  return builder.Build();
+}
+
+std::unique_ptr<XmlDocument> ParseXmlDocumentFile(const std::string& path) {
+  XmlDocumentBuilder builder(XmlReaderForFile(path));
+  return builder.Build();
+}
+
+const XmlDocument::Node* FindNode(const std::string_view name,
+                                  const XmlDocument::Node* root) {
+  if (root == nullptr || root->type == XmlNode::FREE_TEXT) return nullptr;
+  if (root->name == name) return root;
+  for (const XmlDocument::Node* kid = root->first_child; kid != nullptr;
+       kid = kid->next_sibling) {
+    const XmlDocument::Node* n = FindNode(name, kid);
+    if (n != nullptr) return n;
+  }
+  return nullptr;
+}
+
+const XmlDocument::Node* FindNextNode(const std::string_view name,
+                                      const XmlDocument::Node* hint) {
+  // Below hint, then after it, then after each of its ancestors.
+  if (hint == nullptr) return nullptr;
+  for (const XmlDocument::Node* kid = hint->first_child; kid != nullptr;
+       kid = kid->next_sibling) {
+    const XmlDocument::Node* n = FindNode(name, kid);
+    if (n != nullptr) return n;
+  }
+  for (const XmlDocument::Node* node = hint; node != nullptr;
+       node = node->parent) {
+    for (const XmlDocument::Node* sibling = node->next_sibling;
+         sibling != nullptr; sibling = sibling->next_sibling) {
+      const XmlDocument::Node* n = FindNode(name, sibling);
+      if (n != nullptr) return n;
+    }
+  }
+  return nullptr;
+}
+
 }  // namespace xml_util
 }  // namespace cycling
@@ -1,12 +1,19 @@
 #ifndef __XML_UTIL_H__
 #define __XML_UTIL_H__
 
+#include <cstddef>
 #include <iostream>
 #include <map>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
+#include "libxml/xmlreader.h"
+#include "status.h"
+#include "xml_scanner.h"
+
 namespace cycling {
 
 // Contains either free text in an XML document, or a tag complete with
@@ -35,8 +42,88 @@ struct XmlNode {
   friend std::ostream& operator<<(std::ostream& lhs, const XmlNode& rhs);
 };
 
+// The same tree as XmlNode, for large documents: every node, attribute and
+// piece of text lives in one arena owned by the document, which takes a
+// handful of allocations instead of several per node. Names are interned, so
+// all the <Trackpoint>s of a TCX file share one copy of the name, and equal
+// names have equal data() pointers. Text is trimmed, and whitespace dropped,
+// as the document is built.
+class XmlDocument {
+ public:
+  struct Attribute {
+    std::string_view name;
+    std::string_view value;
+  };
+
+  struct Node {
+    XmlNode::Type type;
+    // Null for the root.
+    const Node* parent = nullptr;
+    // Children in document order, linked through next_sibling.
+    const Node* first_child = nullptr;
+    const Node* next_sibling = nullptr;
+    int num_children = 0;
+
+    // Only set if this is a tag node.
+    std::string_view name;
+    // In document order, except namespace declarations.
+    const Attribute* attrs = nullptr;
+    int num_attrs = 0;
+
+    // Only set if this is a text node.
+    std::string_view text;
+
+    // Returns the value of the attribute called name, or nullptr.
+    const std::string_view* FindAttribute(const std::string_view name) const;
+  };
+
+  XmlDocument(const XmlDocument&) = delete;
+  XmlDocument& operator=(const XmlDocument&) = delete;
+
+  const Node* root() const { return root_; }
+
+ private:
+  friend class XmlDocumentBuilder;
+
+  XmlDocument() = default;
+
+  // Returns size bytes from the arena, aligned for any of the types in it.
+  void* Allocate(const size_t size);
+  std::string_view Copy(const std::string_view str);
+  std::string_view Intern(const std::string_view name);
+
+  std::vector<std::unique_ptr<char[]>> blocks_;
+  char* next_ = nullptr;
+  size_t left_ = 0;
+  std::unordered_map<std::string_view, std::string_view> names_;
+  const Node* root_ = nullptr;
+};
+
 namespace xml_util {
 
+// libxml is set up once, the first time any of these functions need it, and
+// never torn down, so documents can be parsed on several threads at once.
+// Each thread keeps the parser context and text readers it is done with, and
+// reuses them for its next documents.
+
+// Hands a text reader back to the pool of the thread that destroys it.
+struct XmlReaderReleaser {
+  void operator()(xmlTextReader* reader) const;
+};
+using XmlReader = std::unique_ptr<xmlTextReader, XmlReaderReleaser>;
+
+// Returns a libxml text reader for the file at path, or for the document in
+// [data, data + size), which must outlive it. Takes one from the calling
+// thread's pool if it can. Returns nullptr if the document can't be read.
+XmlReader XmlReaderForFile(const std::string& path);
+XmlReader XmlReaderForMemory(const char* data, const size_t size);
+
+// Same as ScanXmlFile, but reads the file with a libxml text reader, which
+// handles all of XML and says what is wrong with it. Element names are local
+// names, entities are replaced, and comments and processing instructions are
+// skipped. Several times slower than ScanXmlFile, which parsers try first.
+Status ReadXmlFile(const std::string& path, XmlScanHandler* handler);
+
 // Parses the XML contents in the string and converts it to a tree of XmlNodes.
 std::unique_ptr<XmlNode> ParseXmlContents(const std::string& contents);
 
@@ -52,6 +139,20 @@ const XmlNode* FindNode(const std::string& name, const XmlNode* root);
 // children. The same procedure is followed recursively up the tree.
 const XmlNode* FindNextNode(const std::string& name, const XmlNode* hint);
 
+// Parses the XML contents in the string, or the file at the given path, into
+// an XmlDocument with the same tree that ParseXmlContents and ParseXmlFile
+// give, except that comments and processing instructions are skipped rather
+// than fatal. Streams the document through libxml instead of building
+// libxml's own tree first. Returns nullptr if the XML is malformed.
+std::unique_ptr<XmlDocument> ParseXmlDocument(const std::string& contents);
+std::unique_ptr<XmlDocument> ParseXmlDocumentFile(const std::string& path);
+
+// The same as FindNode and FindNextNode, on an XmlDocument.
+const XmlDocument::Node* FindNode(const std::string_view name,
+                                  const XmlDocument::Node* root);
+const XmlDocument::Node* FindNextNode(const std::string_view name,
+                                      const XmlDocument::Node* hint);
+
 }  // namespace xml_util
 }  // namespace cycling
 
@@ -1,6 +1,14 @@
 #include "xml_util.h"
+
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "xml_scanner.h"
 
 namespace cycling {
 namespace xml_util {
@@ -142,6 +150,201 @@ TEST_F(XmlUtilTest, FindNextNodeInCousin) {
               AllOf(HasName("c"), HasAttribute("second", "")));
 }
 
+// Returns true if the document node has the same tree as the XmlNode,
+// attributes aside.
+bool DocumentMatches(const XmlNode* expected, const XmlDocument::Node* node) {
+  if (expected == nullptr || node == nullptr) return false;
+  if (expected->type != node->type) return false;
+  if (expected->type == XmlNode::FREE_TEXT) return expected->text == node->text;
+  if (expected->name != node->name) return false;
+  if (static_cast<int>(expected->children.size()) != node->num_children) {
+    return false;
+  }
+  const XmlDocument::Node* kid = node->first_child;
+  for (const auto& expected_kid : expected->children) {
+    if (kid->parent != node) return false;
+    if (!DocumentMatches(expected_kid.get(), kid)) return false;
+    kid = kid->next_sibling;
+  }
+  return kid == nullptr;
+}
+
+const char kRichTestData[] = R"(<?xml version="1.0"?>
+  <a xmlns="urn:a" xmlns:x="urn:x" x:one="1" two = 'a &amp; b'>
+    <!-- A comment -->
+    <x:b>  some text  </x:b>
+    <c/>
+    one &lt; two
+  </a>
+)";
+
+TEST_F(XmlUtilTest, Document) {
+  for (const char* contents : {kTestData, kRichTestData}) {
+    std::string xml = contents;
+    // XmlNode trees can't have comments.
+    const size_t comment = xml.find("<!--");
+    if (comment != std::string::npos) xml.erase(comment, 18);
+    const std::unique_ptr<XmlNode> expected = ParseXmlContents(xml);
+    const std::unique_ptr<XmlDocument> document = ParseXmlDocument(contents);
+    ASSERT_NE(document.get(), nullptr);
+    EXPECT_EQ(document->root()->parent, nullptr);
+    EXPECT_TRUE(DocumentMatches(expected.get(), document->root()));
+  }
+  const std::unique_ptr<XmlDocument> file =
+      ParseXmlDocumentFile(kTestFilePath);
+  ASSERT_NE(file.get(), nullptr);
+  EXPECT_TRUE(DocumentMatches(root_.get(), file->root()->first_child));
+
+  // Unlike XmlNode trees, documents can have CDATA.
+  const std::unique_ptr<XmlDocument> cdata =
+      ParseXmlDocument("<a> <![CDATA[ <b> ]]> </a>");
+  ASSERT_NE(cdata.get(), nullptr);
+  EXPECT_EQ(cdata->root()->first_child->first_child->text, "<b>");
+
+  EXPECT_EQ(ParseXmlDocument("<a><b></a>"), nullptr);
+  EXPECT_EQ(ParseXmlDocument(""), nullptr);
+  EXPECT_EQ(ParseXmlDocumentFile("no_such_file.xml"), nullptr);
+}
+
+TEST_F(XmlUtilTest, DocumentAttributes) {
+  const std::unique_ptr<XmlDocument> document = ParseXmlDocument(kRichTestData);
+  ASSERT_NE(document.get(), nullptr);
+  const XmlDocument::Node* a = document->root()->first_child;
+  ASSERT_EQ(a->num_attrs, 2);
+  EXPECT_EQ(a->attrs[0].name, "one");
+  EXPECT_EQ(a->attrs[0].value, "1");
+  ASSERT_NE(a->FindAttribute("two"), nullptr);
+  EXPECT_EQ(*a->FindAttribute("two"), "a & b");
+  EXPECT_EQ(a->FindAttribute("three"), nullptr);
+  EXPECT_EQ(a->first_child->num_attrs, 0);
+}
+
+TEST_F(XmlUtilTest, DocumentNamesAreInterned) {
+  const std::unique_ptr<XmlDocument> document = ParseXmlDocument(kTestData);
+  const XmlDocument::Node* first = FindNode("b", document->root());
+  const XmlDocument::Node* second = FindNextNode("b", first);
+  ASSERT_NE(second, nullptr);
+  ASSERT_NE(first, second);
+  EXPECT_EQ(first->name.data(), second->name.data());
+  EXPECT_EQ(first->attrs[0].name.data(),
+            first->first_child->attrs[0].name.data());
+}
+
+TEST_F(XmlUtilTest, DocumentFindNode) {
+  const std::unique_ptr<XmlDocument> document = ParseXmlDocument(kTestData);
+  const XmlDocument::Node* a = document->root()->first_child;
+  EXPECT_EQ(FindNode("a", a), a);
+  EXPECT_EQ(FindNode("e", a), nullptr);
+  EXPECT_EQ(FindNextNode("a", a), nullptr);
+
+  const XmlDocument::Node* b = FindNextNode("b", a);
+  ASSERT_NE(b, nullptr);
+  EXPECT_NE(b->FindAttribute("first"), nullptr);
+  // In a sibling.
+  const XmlDocument::Node* b2 = FindNextNode("b", b);
+  ASSERT_NE(b2, nullptr);
+  EXPECT_NE(b2->FindAttribute("second"), nullptr);
+  // In an uncle, and in a cousin.
+  const XmlDocument::Node* c = FindNode("c", a);
+  EXPECT_EQ(FindNextNode("b", c), b2);
+  const XmlDocument::Node* c2 = FindNextNode("c", c);
+  ASSERT_NE(c2, nullptr);
+  EXPECT_NE(c2->FindAttribute("second"), nullptr);
+}
+
+TEST_F(XmlUtilTest, ReadersAreReused) {
+  // A thread's readers are reused, whatever became of their last document.
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(ParseXmlDocument("<a><b></a>"), nullptr);
+    EXPECT_EQ(ParseXmlDocumentFile("no_such_file.xml"), nullptr);
+    const std::unique_ptr<XmlDocument> file =
+        ParseXmlDocumentFile(kTestFilePath);
+    ASSERT_NE(file.get(), nullptr);
+    EXPECT_TRUE(DocumentMatches(root_.get(), file->root()->first_child));
+    const std::unique_ptr<XmlDocument> document =
+        ParseXmlDocument(kRichTestData);
+    ASSERT_NE(document.get(), nullptr);
+    EXPECT_EQ(document->root()->first_child->num_attrs, 2);
+  }
+
+  // Several at once.
+  XmlReader first = XmlReaderForMemory(kTestData, strlen(kTestData));
+  XmlReader second = XmlReaderForFile(kTestFilePath);
+  ASSERT_NE(first, nullptr);
+  ASSERT_NE(second, nullptr);
+  EXPECT_NE(first.get(), second.get());
+  EXPECT_EQ(xmlTextReaderRead(first.get()), 1);
+  EXPECT_EQ(xmlTextReaderRead(second.get()), 1);
+  EXPECT_STREQ(reinterpret_cast<const char*>(
+                   xmlTextReaderConstLocalName(first.get())),
+               "a");
+  EXPECT_STREQ(reinterpret_cast<const char*>(
+                   xmlTextReaderConstLocalName(second.get())),
+               "a");
+}
+
+TEST_F(XmlUtilTest, ParseOnManyThreads) {
+  const std::unique_ptr<XmlNode> expected = ParseXmlFile(kTestFilePath);
+  std::atomic<int> num_mismatches(0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&]() {
+      for (int j = 0; j < 50; ++j) {
+        const std::unique_ptr<XmlNode> file = ParseXmlFile(kTestFilePath);
+        const std::unique_ptr<XmlNode> contents = ParseXmlContents(kTestData);
+        const std::unique_ptr<XmlDocument> document =
+            ParseXmlDocumentFile(kTestFilePath);
+        if (!XmlTreesAreEqual(expected.get(), file.get()) ||
+            !XmlTreesAreEqual(expected->children[0].get(),
+                              contents->children[0].get()) ||
+            document == nullptr ||
+            !DocumentMatches(expected.get(), document->root())) {
+          ++num_mismatches;
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  EXPECT_EQ(num_mismatches, 0);
+}
+
+// Records what it is handed as "<name", "@name=value", ">" and "'text'".
+class Recorder : public XmlScanHandler {
+ public:
+  Status StartElement(const char* name, const size_t size,
+                      bool* /*skip*/) override {
+    events.push_back("<" + std::string(name, size));
+    return Status::OkStatus();
+  }
+  Status Attribute(const char* name, const size_t name_size,
+                   const char* value, const size_t value_size) override {
+    events.push_back("@" + std::string(name, name_size) + "=" +
+                     std::string(value, value_size));
+    return Status::OkStatus();
+  }
+  Status EndElement() override {
+    events.push_back(">");
+    return Status::OkStatus();
+  }
+  Status Text(const char* text, const size_t size) override {
+    events.push_back("'" + std::string(text, size) + "'");
+    return Status::OkStatus();
+  }
+
+  std::vector<std::string> events;
+};
+
+TEST_F(XmlUtilTest, ReadXmlFile) {
+  // The same as the scanner.
+  Recorder scanned;
+  ASSERT_TRUE(ScanXmlFile(kTestFilePath, &scanned).ok());
+  Recorder read;
+  ASSERT_TRUE(ReadXmlFile(kTestFilePath, &read).ok());
+  EXPECT_EQ(read.events, scanned.events);
+  EXPECT_EQ(read.events[1], "@zeroth=");
+  EXPECT_FALSE(ReadXmlFile("no_such_file.xml", &read).ok());
+}
+
 }  // namespace
 }  // namespace xml_util
 }  // namespace cycling